@@ -0,0 +1,243 @@
+/*
+ * capture-replay.cc
+ * Analyse a capture of raw counter reads recorded with the -r option of
+ * msr-poll-gaps-nsec-and-power or papi-poll-timings, without the hardware.
+ *
+ * The counter updates are found the same way as in the poll loops: a read
+ * that returns a different value than the previous read of the register
+ * is an update. The gaps between the updates are measured both with
+ * CLOCK_MONOTONIC and with the TSC, and the counter deltas take the wrap
+ * around of the register into account.
+ *
+ * Usage: ./capture-replay [ -r <register> ] [ -o <gaps file> ] [ -t ] [ -d ] <capture file>
+ *   -r	Name or index of the register to analyse (defaults to the first one)
+ *   -o	Write the gaps in seconds and the counter deltas like gaps-msr-and-power.csv
+ *   -t	Print the CLOCK_MONOTONIC and TSC timestamps of every update
+ *   -d	Print every read as CSV instead of analysing the capture
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "read-capture.h"
+
+struct update {
+	uint64_t mono_ns;
+	uint64_t tsc;
+	uint64_t delta;
+};
+
+static double monotonic_double() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static int find_register(const struct capture_header *header, const char *name) {
+	char *end = NULL;
+	unsigned i;
+	
+	for (i = 0; i < header->num_registers; i++) {
+		if (strcmp(header->registers[i].name, name) == 0) {
+			return i;
+		}
+	}
+	long index = strtol(name, &end, 0);
+	if (*end == '\0' && index >= 0 && index < (long)header->num_registers) {
+		return index;
+	}
+	return -1;
+}
+
+static void print_header(const struct capture_header *header) {
+	time_t start = header->start_time / 1000000000LL;
+	char formatted_time[64];
+	unsigned i;
+	
+	strftime(formatted_time, sizeof(formatted_time), "%Y-%m-%d %H:%M:%S", localtime(&start));
+	printf("Captured by %s at %s", header->tool_name, formatted_time);
+	if (header->cpu >= 0) {
+		printf(" on CPU %d", header->cpu);
+	}
+	printf("\n");
+	for (i = 0; i < header->num_registers; i++) {
+		printf("Register %u: %s (0x%x, %u bits)\n", i, header->registers[i].name, header->registers[i].id, header->registers[i].bits);
+	}
+}
+
+static void dump_reads(struct capture_reader *reader) {
+	struct capture_record record;
+	
+	printf("register, tsc, monotonic, value\n");
+	while (capture_next(reader, &record)) {
+		printf("%u, %llu, %llu.%09llu, %llu\n", record.reg, (unsigned long long)record.tsc,
+			(unsigned long long)(record.mono_ns / 1000000000ULL), (unsigned long long)(record.mono_ns % 1000000000ULL),
+			(unsigned long long)record.value);
+	}
+}
+
+int main(int argc, char **argv) {
+	const char *reg_name = NULL, *gaps_file = NULL;
+	bool print_timings = false, dump = false;
+	int c = 0, reg = 0;
+	size_t i = 0;
+	
+	while ((c = getopt(argc, argv, "r:o:td")) != -1) {
+		switch (c) {
+			case 'r':
+				reg_name = optarg;
+				break;
+			case 'o':
+				gaps_file = optarg;
+				break;
+			case 't':
+				print_timings = true;
+				break;
+			case 'd':
+				dump = true;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [ -r <register> ] [ -o <gaps file> ] [ -t ] [ -d ] <capture file>\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [ -r <register> ] [ -o <gaps file> ] [ -t ] [ -d ] <capture file>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	
+	struct capture_reader *reader = capture_reader_open(argv[optind]);
+	if (!reader) {
+		return EXIT_FAILURE;
+	}
+	const struct capture_header *header = capture_reader_header(reader);
+	if (dump) {
+		dump_reads(reader);
+		capture_reader_close(reader);
+		return EXIT_SUCCESS;
+	}
+	print_header(header);
+	if (header->num_registers == 0) {
+		fprintf(stderr, "Error: The capture has no registers\n");
+		capture_reader_close(reader);
+		return EXIT_FAILURE;
+	}
+	if (reg_name && (reg = find_register(header, reg_name)) < 0) {
+		fprintf(stderr, "Error: No register '%s' in the capture\n", reg_name);
+		capture_reader_close(reader);
+		return EXIT_FAILURE;
+	}
+	const uint32_t bits = header->registers[reg].bits;
+	const uint64_t mask = bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+	
+	// Decode everything first so that the decoding speed can be reported
+	struct capture_record record, first, last, prev;
+	memset(&first, 0, sizeof(first));
+	last = prev = first;
+	std::vector<struct update> updates;
+	uint64_t num_reads = 0, num_reg_reads = 0;
+	bool have_prev = false;
+	double fstart = monotonic_double();
+	while (capture_next(reader, &record)) {
+		if (num_reads == 0) {
+			first = record;
+		}
+		last = record;
+		num_reads++;
+		if (record.reg != (unsigned)reg) {
+			continue;
+		}
+		num_reg_reads++;
+		if (have_prev && record.value != prev.value) {
+			struct update update = { record.mono_ns, record.tsc, (record.value - prev.value) & mask };
+			updates.push_back(update);
+		}
+		prev = record;
+		have_prev = true;
+	}
+	double decode_time = monotonic_double() - fstart;
+	uint64_t dropped = capture_reader_dropped(reader);
+	capture_reader_close(reader);
+	
+	printf("Decoded %llu reads in %f seconds (%.1f million reads per second)\n", (unsigned long long)num_reads, decode_time, num_reads / decode_time * 1e-6);
+	if (dropped > 0) {
+		printf("Warning: %llu reads were dropped while capturing, gaps over them are too long\n", (unsigned long long)dropped);
+	}
+	if (num_reads < 2) {
+		fprintf(stderr, "Error: The capture has too few reads\n");
+		return EXIT_FAILURE;
+	}
+	
+	double time_spent = (last.mono_ns - first.mono_ns) * 1e-9;
+	double tsc_hz = (last.tsc - first.tsc) / time_spent;
+	printf("%llu reads of %s in %f seconds.\n", (unsigned long long)num_reg_reads, header->registers[reg].name, time_spent);
+	printf("Polling rate of %f hz.\n", num_reg_reads / time_spent);
+	printf("Polling delay of %f microseconds.\n", time_spent / num_reg_reads * 1000000.0);
+	if (tsc_hz > 0.0) {
+		printf("TSC frequency of %f MHz.\n", tsc_hz * 1e-6);
+	}
+	
+	// The first update only ends the gap that started before the capture
+	size_t num_gaps = updates.size() > 0 ? updates.size() - 1 : 0;
+	if (num_gaps == 0) {
+		printf("The register was not updated twice.\n");
+		return EXIT_SUCCESS;
+	}
+	std::vector<double> gaps(num_gaps), tsc_gaps(num_gaps);
+	double sum_gaps = 0.0, sum_tsc_gaps = 0.0, biggest_gap = 0.0;
+	uint64_t sum_deltas = 0;
+	for (i = 0; i < num_gaps; i++) {
+		gaps[i] = (updates[i + 1].mono_ns - updates[i].mono_ns) * 1e-9;
+		tsc_gaps[i] = tsc_hz > 0.0 ? (updates[i + 1].tsc - updates[i].tsc) / tsc_hz : 0.0;
+		sum_gaps += gaps[i];
+		sum_tsc_gaps += tsc_gaps[i];
+		sum_deltas += updates[i + 1].delta;
+		if (gaps[i] > biggest_gap) {
+			biggest_gap = gaps[i];
+		}
+	}
+	double avg_gap = sum_gaps / num_gaps;
+	double avg_tsc_gap = sum_tsc_gaps / num_gaps;
+	printf("%lu updates.\n", (unsigned long)updates.size());
+	printf("Biggest gap was %f millisecond.\n", biggest_gap * 1000.0);
+	printf("Average gap of %f milliseconds (%f milliseconds by the TSC).\n", avg_gap * 1000.0, avg_tsc_gap * 1000.0);
+	
+	double sum_squares = 0.0, sum_tsc_squares = 0.0;
+	for (i = 0; i < num_gaps; i++) {
+		sum_squares += (gaps[i] - avg_gap) * (gaps[i] - avg_gap);
+		sum_tsc_squares += (tsc_gaps[i] - avg_tsc_gap) * (tsc_gaps[i] - avg_tsc_gap);
+	}
+	printf("Standard deviation of the gaps is %f microseconds (%f microseconds by the TSC).\n",
+		sqrt(sum_squares / num_gaps) * 1000000.0, sqrt(sum_tsc_squares / num_gaps) * 1000000.0);
+	printf("Average counter delta of %f per update.\n", (double)sum_deltas / num_gaps);
+	
+	if (print_timings) {
+		for (i = 0; i < updates.size(); i++) {
+			printf("%llu.%09llu\t%llu\n", (unsigned long long)(updates[i].mono_ns / 1000000000ULL),
+				(unsigned long long)(updates[i].mono_ns % 1000000000ULL), (unsigned long long)updates[i].tsc);
+		}
+	}
+	
+	if (gaps_file) {
+		FILE *fp = fopen(gaps_file, "w");
+		if (!fp) {
+			fprintf(stderr, "Failed to open %s!\n", gaps_file);
+			return EXIT_FAILURE;
+		}
+		printf("Dumping data to %s\n", gaps_file);
+		for (i = 0; i < num_gaps; i++) {
+			fprintf(fp, "%.9f, %ld\n", gaps[i], (long)updates[i + 1].delta);
+		}
+		fclose(fp);
+	}
+	
+	return EXIT_SUCCESS;
+}
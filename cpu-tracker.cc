@@ -0,0 +1,799 @@
+/*
+ * CPU time of a process tree or a cgroup
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+#include "cpu-tracker.h"
+#include "util.h"
+
+// How long to wait for the proc connector to confirm that we are listening
+#define CONNECTOR_ACK_TIMEOUT_MS 100
+
+// Number of exited processes remembered while handling one batch of fork events
+#define MAX_EXITED_PARENTS 256
+
+struct tracked_process {
+	pid_t pid;
+	// Open /proc/<pid>/stat, it stops being readable when the process is reaped
+	int fd;
+};
+
+struct cpu_tracker {
+	// Process tree
+	struct tracked_process *processes;
+	int num_processes;
+	int max_processes;
+	uint64_t tracked_ns;
+	// Processes of the tree reaped by the caller, may be added from another thread
+	uint64_t reaped_ns;
+	int64_t next_rescan_ns;
+	// Next tree in the list that the fork events are dispatched to
+	struct cpu_tracker *next;
+	
+	// Cgroup, -1 when tracking a process tree
+	int cgroup_fd;
+	bool cgroup_v2;
+	uint64_t cgroup_start_ns;
+	// Directory of the cgroup created for a process tree, NULL for the other trackers
+	char *tree_cgroup;
+	
+	uint64_t system_start_ticks;
+};
+
+// Shared by all trackers
+static int s_num_trackers = 0;
+static int s_proc_stat_fd = -1;
+static double s_ns_per_tick = 0.0;
+
+// All process trees share one proc connector socket, -1 when /proc is scanned instead
+static struct cpu_tracker *s_trees = NULL;
+static int s_num_trees = 0;
+static int s_connector_fd = -1;
+static bool s_connector_failed = false;
+
+// Cgroup v2 directory of the caller that the trees are created under, empty when the trees are scanned
+static char s_cgroup_dir[PATH_MAX];
+static pid_t s_cgroup_owner = 0;
+static bool s_trees_prepared = false;
+static int64_t s_rescan_ns = CPU_TRACKER_RESCAN_NS;
+
+static int64_t monotonic_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Read a whole proc file that fits in the buffer, returns the length or -1
+static ssize_t read_proc_file(int fd, char *buf, size_t size) {
+	ssize_t len = pread(fd, buf, size - 1, 0);
+	if (len < 0) {
+		return -1;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+// The command name may contain spaces and parentheses, so parsing starts after the last ')'
+bool cpu_tracker_parse_stat(const char *buf, uint64_t *ticks) {
+	const char *p = strrchr(buf, ')');
+	if (!p) {
+		return false;
+	}
+	// Stop at the space before field 14, skipping the state and fields 4 to 13
+	for (int field = 3; field <= 14; field++) {
+		p = strchr(p + 1, ' ');
+		if (!p) {
+			return false;
+		}
+	}
+	unsigned long long utime = 0, stime = 0, cutime = 0, cstime = 0;
+	if (sscanf(p + 1, "%llu %llu %llu %llu", &utime, &stime, &cutime, &cstime) != 4) {
+		return false;
+	}
+	*ticks = utime + stime + cutime + cstime;
+	return true;
+}
+
+static uint64_t timeval_to_ns(const struct timeval *tv) {
+	return tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+}
+
+// Busy time of all CPUs from the first line of /proc/stat, steal time is spent by other guests
+static uint64_t read_system_ticks() {
+	char buf[512];
+	unsigned long long user = 0, nice = 0, system = 0, idle = 0, iowait = 0, irq = 0, softirq = 0;
+	
+	if (read_proc_file(s_proc_stat_fd, buf, sizeof(buf)) < 0) {
+		return 0;
+	}
+	if (sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu", &user, &nice, &system, &idle, &iowait, &irq, &softirq) < 7) {
+		return 0;
+	}
+	return user + nice + system + irq + softirq;
+}
+
+static struct cpu_tracker *tracker_alloc() {
+	struct cpu_tracker *tracker = (struct cpu_tracker *)calloc(1, sizeof(*tracker));
+	if (!tracker) {
+		return NULL;
+	}
+	tracker->cgroup_fd = -1;
+	if (s_num_trackers == 0) {
+		s_ns_per_tick = 1e9 / sysconf(_SC_CLK_TCK);
+		s_proc_stat_fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+		if (s_proc_stat_fd < 0) {
+			perror("open /proc/stat");
+			free(tracker);
+			return NULL;
+		}
+	}
+	s_num_trackers++;
+	tracker->system_start_ticks = read_system_ticks();
+	return tracker;
+}
+
+static bool is_tracked(const struct cpu_tracker *tracker, pid_t pid) {
+	for (int i = 0; i < tracker->num_processes; i++) {
+		if (tracker->processes[i].pid == pid) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Returns false if the process has already been reaped
+static bool add_process(struct cpu_tracker *tracker, pid_t pid) {
+	char filename[64];
+	
+	if (is_tracked(tracker, pid)) {
+		return true;
+	}
+	if (tracker->num_processes == tracker->max_processes) {
+		int max_processes = tracker->max_processes ? 2 * tracker->max_processes : 16;
+		struct tracked_process *processes = (struct tracked_process *)realloc(tracker->processes, max_processes * sizeof(*processes));
+		if (!processes) {
+			return true;
+		}
+		tracker->processes = processes;
+		tracker->max_processes = max_processes;
+	}
+	snprintf(filename, sizeof(filename), "/proc/%d/stat", (int)pid);
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		// Already gone, its time is counted by whoever reaped it
+		return false;
+	}
+	struct tracked_process *process = &tracker->processes[tracker->num_processes++];
+	process->pid = pid;
+	process->fd = fd;
+	return true;
+}
+
+// Add the children of every thread of a process
+static void scan_children(struct cpu_tracker *tracker, pid_t pid) {
+	char path[64], filename[PATH_MAX], buf[4096];
+	struct dirent *entry;
+	
+	snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+	DIR *dir = opendir(path);
+	if (!dir) {
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+			continue;
+		}
+		snprintf(filename, sizeof(filename), "%s/%s/children", path, entry->d_name);
+		int fd = open(filename, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		if (read_proc_file(fd, buf, sizeof(buf)) > 0) {
+			char *p = buf, *end = NULL;
+			long child;
+			while ((child = strtol(p, &end, 10)) > 0 && end != p) {
+				add_process(tracker, (pid_t)child);
+				p = end;
+			}
+		}
+		close(fd);
+	}
+	closedir(dir);
+}
+
+/*
+ * Processes added during the scan are scanned as well. Orphans are children
+ * of the caller, but with several trees it cannot be told which one they
+ * belong to.
+ */
+static void rescan_tree(struct cpu_tracker *tracker) {
+	if (s_num_trees == 1) {
+		scan_children(tracker, getpid());
+	}
+	for (int i = 0; i < tracker->num_processes; i++) {
+		scan_children(tracker, tracker->processes[i].pid);
+	}
+	// The fork events keep the tree up to date after the first scan
+	tracker->next_rescan_ns = s_connector_fd >= 0 ? INT64_MAX : monotonic_ns() + s_rescan_ns;
+}
+
+static bool send_connector_op(int fd, enum proc_cn_mcast_op op) {
+	char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))] __attribute__((aligned(NLMSG_ALIGNTO)));
+	memset(buf, 0, sizeof(buf));
+	struct nlmsghdr *hdr = (struct nlmsghdr *)buf;
+	hdr->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(op));
+	hdr->nlmsg_type = NLMSG_DONE;
+	hdr->nlmsg_pid = getpid();
+	struct cn_msg *msg = (struct cn_msg *)NLMSG_DATA(hdr);
+	msg->id.idx = CN_IDX_PROC;
+	msg->id.val = CN_VAL_PROC;
+	msg->len = sizeof(op);
+	memcpy(msg->data, &op, sizeof(op));
+	return send(fd, buf, hdr->nlmsg_len, 0) == (ssize_t)hdr->nlmsg_len;
+}
+
+// Returns the process event in a netlink message or NULL if it is something else
+static const struct proc_event *get_proc_event(const struct nlmsghdr *hdr) {
+	if (hdr->nlmsg_type == NLMSG_ERROR || hdr->nlmsg_type == NLMSG_NOOP || hdr->nlmsg_len < NLMSG_LENGTH(sizeof(struct cn_msg))) {
+		return NULL;
+	}
+	const struct cn_msg *msg = (const struct cn_msg *)NLMSG_DATA(hdr);
+	if (msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC || msg->len < sizeof(struct proc_event)) {
+		return NULL;
+	}
+	return (const struct proc_event *)msg->data;
+}
+
+// Returns the socket or -1 if the process events are not available to us
+static int open_connector() {
+	char buf[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct sockaddr_nl addr;
+	
+	int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (fd < 0) {
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = CN_IDX_PROC;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || !send_connector_op(fd, PROC_CN_MCAST_LISTEN)) {
+		close(fd);
+		return -1;
+	}
+	
+	// The kernel acknowledges the request, with an error if we are not privileged
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	int64_t deadline = monotonic_ns() + CONNECTOR_ACK_TIMEOUT_MS * 1000000LL;
+	while (true) {
+		int timeout_ms = (int)((deadline - monotonic_ns()) / 1000000);
+		if (timeout_ms <= 0 || poll(&pfd, 1, timeout_ms) <= 0) {
+			break;
+		}
+		ssize_t len = recv(fd, buf, sizeof(buf), 0);
+		if (len <= 0) {
+			continue;
+		}
+		for (struct nlmsghdr *hdr = (struct nlmsghdr *)buf; NLMSG_OK(hdr, (size_t)len); hdr = NLMSG_NEXT(hdr, len)) {
+			const struct proc_event *ev = get_proc_event(hdr);
+			if (ev && ev->what == proc_event::PROC_EVENT_NONE) {
+				if (ev->event_data.ack.err == 0) {
+					return fd;
+				}
+				close(fd);
+				return -1;
+			}
+		}
+	}
+	close(fd);
+	return -1;
+}
+
+// The cgroup v2 directory of the calling process, if we can create cgroups in it and move processes out of it
+static bool find_own_cgroup(char *dir, size_t size) {
+	char line[PATH_MAX + 256], mount_point[PATH_MAX] = "", path[PATH_MAX] = "", filename[PATH_MAX];
+	
+	FILE *fp = fopen("/proc/self/mountinfo", "r");
+	if (!fp) {
+		return false;
+	}
+	// The fields are ID, parent ID, device, root and mount point, the file system type follows the separator
+	while (fgets(line, sizeof(line), fp)) {
+		const char *type = strstr(line, " - cgroup2 ");
+		if (type && sscanf(line, "%*s %*s %*s %*s %4095s", mount_point) == 1) {
+			break;
+		}
+		mount_point[0] = '\0';
+	}
+	fclose(fp);
+	
+	fp = fopen("/proc/self/cgroup", "r");
+	if (!fp) {
+		return false;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "0::", 3) == 0) {
+			sscanf(line + 3, "%4095s", path);
+			break;
+		}
+	}
+	fclose(fp);
+	
+	// A path outside of our cgroup namespace starts with /..
+	if (mount_point[0] == '\0' || path[0] != '/' || strncmp(path, "/..", 3) == 0) {
+		return false;
+	}
+	if (snprintf(dir, size, "%s%s", mount_point, strcmp(path, "/") == 0 ? "" : path) >= (int)size ||
+		snprintf(filename, sizeof(filename), "%s/cgroup.procs", dir) >= (int)sizeof(filename)) {
+		return false;
+	}
+	return access(dir, W_OK) == 0 && access(filename, W_OK) == 0;
+}
+
+// Directory of the cgroup of the tree with the given root, returns false if it does not fit
+static bool tree_cgroup_path(char *path, size_t size, pid_t root) {
+	return snprintf(path, size, "%s/cpu-tracker-%d-%d", s_cgroup_dir, (int)s_cgroup_owner, (int)root) < (int)size;
+}
+
+// Move a process into a cgroup, 0 moves the calling process
+static bool move_to_cgroup(const char *dir, pid_t pid) {
+	char filename[PATH_MAX], buf[32];
+	
+	if (snprintf(filename, sizeof(filename), "%s/cgroup.procs", dir) >= (int)sizeof(filename)) {
+		return false;
+	}
+	int fd = open(filename, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	int len = snprintf(buf, sizeof(buf), "%d", (int)pid);
+	bool moved = write(fd, buf, len) == len;
+	close(fd);
+	return moved;
+}
+
+// Whether any process is left in a cgroup, from its cgroup.events file
+static bool cgroup_populated(const char *dir) {
+	char filename[PATH_MAX], buf[256];
+	
+	if (snprintf(filename, sizeof(filename), "%s/cgroup.events", dir) >= (int)sizeof(filename)) {
+		return false;
+	}
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	ssize_t len = read_proc_file(fd, buf, sizeof(buf));
+	close(fd);
+	return len > 0 && strstr(buf, "populated 1") != NULL;
+}
+
+// The processes in the cgroup.procs file of a cgroup, returns their number and a malloc'd array in *pids
+static int read_cgroup_pids(const char *dir, pid_t **pids) {
+	char filename[PATH_MAX], buf[4096];
+	int num_pids = 0, max_pids = 0;
+	size_t pending = 0;
+	
+	*pids = NULL;
+	if (snprintf(filename, sizeof(filename), "%s/cgroup.procs", dir) >= (int)sizeof(filename)) {
+		return 0;
+	}
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 0;
+	}
+	// One process per line, a line may be split between two reads
+	while (true) {
+		ssize_t len = read(fd, buf + pending, sizeof(buf) - 1 - pending);
+		if (len <= 0) {
+			break;
+		}
+		buf[pending + len] = '\0';
+		char *p = buf, *newline = NULL;
+		while ((newline = strchr(p, '\n')) != NULL) {
+			if (num_pids == max_pids) {
+				max_pids = max_pids ? 2 * max_pids : 16;
+				pid_t *grown = (pid_t *)realloc(*pids, max_pids * sizeof(pid_t));
+				if (!grown) {
+					close(fd);
+					return num_pids;
+				}
+				*pids = grown;
+			}
+			(*pids)[num_pids++] = (pid_t)strtol(p, NULL, 10);
+			p = newline + 1;
+		}
+		pending = strlen(p);
+		memmove(buf, p, pending);
+	}
+	close(fd);
+	return num_pids;
+}
+
+// Processes that exited before they could join a tree
+struct exited_parent {
+	pid_t pid;
+	struct cpu_tracker *tree;
+};
+
+// Returns the tree that a process belongs to or NULL
+static struct cpu_tracker *find_tree(pid_t pid, const struct exited_parent *exited, int num_exited) {
+	for (struct cpu_tracker *tree = s_trees; tree; tree = tree->next) {
+		if (is_tracked(tree, pid)) {
+			return tree;
+		}
+	}
+	for (int i = 0; i < num_exited; i++) {
+		if (exited[i].pid == pid) {
+			return exited[i].tree;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * A new process whose parent is in a tree joins the tree, new threads are
+ * already counted by their process. The events are handled some time after
+ * the forks, so a process may have exited before it could join. It is still
+ * remembered for the rest of the batch, so that its children can join.
+ * Events are dispatched to all trees, whichever tree is read.
+ */
+static void handle_events() {
+	char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct exited_parent exited[MAX_EXITED_PARENTS];
+	int num_exited = 0;
+	
+	while (true) {
+		ssize_t len = recv(s_connector_fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == ENOBUFS) {
+				// Events were lost, scan /proc once to catch up
+				for (struct cpu_tracker *tree = s_trees; tree; tree = tree->next) {
+					tree->next_rescan_ns = 0;
+				}
+				continue;
+			}
+			break;
+		}
+		for (struct nlmsghdr *hdr = (struct nlmsghdr *)buf; NLMSG_OK(hdr, (size_t)len); hdr = NLMSG_NEXT(hdr, len)) {
+			const struct proc_event *ev = get_proc_event(hdr);
+			if (!ev || ev->what != proc_event::PROC_EVENT_FORK) {
+				continue;
+			}
+			const pid_t parent = ev->event_data.fork.parent_tgid, child = ev->event_data.fork.child_tgid;
+			if (ev->event_data.fork.child_pid != child) {
+				continue;
+			}
+			struct cpu_tracker *tree = find_tree(parent, exited, num_exited);
+			if (tree && !add_process(tree, child) && num_exited < MAX_EXITED_PARENTS) {
+				exited[num_exited].pid = child;
+				exited[num_exited].tree = tree;
+				num_exited++;
+			}
+		}
+	}
+}
+
+bool cpu_tracker_become_subreaper() {
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0) < 0) {
+		perror("prctl(PR_SET_CHILD_SUBREAPER)");
+		return false;
+	}
+	return true;
+}
+
+bool cpu_tracker_prepare_trees() {
+	// Listen before the first scan, so that no fork falls between the two
+	if (s_connector_fd < 0 && !s_connector_failed) {
+		s_connector_fd = open_connector();
+		s_connector_failed = s_connector_fd < 0;
+	}
+	if (s_connector_fd < 0 && !s_trees_prepared) {
+		if (find_own_cgroup(s_cgroup_dir, sizeof(s_cgroup_dir))) {
+			s_cgroup_owner = getpid();
+		} else {
+			s_cgroup_dir[0] = '\0';
+		}
+	}
+	s_trees_prepared = true;
+	return s_connector_fd >= 0 || s_cgroup_dir[0] != '\0';
+}
+
+void cpu_tracker_enter_tree() {
+	char path[PATH_MAX];
+	
+	if (s_connector_fd >= 0 || s_cgroup_dir[0] == '\0') {
+		return;
+	}
+	// The tracker creates the cgroup too, whichever comes first
+	if (tree_cgroup_path(path, sizeof(path), getpid()) && (mkdir(path, 0755) == 0 || errno == EEXIST)) {
+		move_to_cgroup(path, 0);
+	}
+}
+
+static void remove_tree_cgroup(const char *dir) {
+	pid_t *pids = NULL;
+	
+	if (cgroup_populated(dir)) {
+		int num_pids = read_cgroup_pids(dir, &pids);
+		for (int i = 0; i < num_pids; i++) {
+			move_to_cgroup(s_cgroup_dir, pids[i]);
+		}
+		free(pids);
+	}
+	if (rmdir(dir) < 0) {
+		fprintf(stderr, "Warning: Could not remove the cgroup '%s': %s\n", dir, strerror(errno));
+	}
+}
+
+// Put the tree in a cgroup of its own, returns false if the tree has to be scanned instead
+static bool open_tree_cgroup(struct cpu_tracker *tracker, pid_t root) {
+	char path[PATH_MAX], filename[PATH_MAX];
+	
+	if (!tree_cgroup_path(path, sizeof(path), root) || (mkdir(path, 0755) < 0 && errno != EEXIST)) {
+		return false;
+	}
+	if (snprintf(filename, sizeof(filename), "%s/cpu.stat", path) >= (int)sizeof(filename)) {
+		rmdir(path);
+		return false;
+	}
+	tracker->cgroup_fd = open(filename, O_RDONLY | O_CLOEXEC);
+	tracker->cgroup_v2 = true;
+	// The root may have moved itself already, the cgroup is new so its time starts from zero
+	if (tracker->cgroup_fd < 0 || !move_to_cgroup(path, root)) {
+		if (tracker->cgroup_fd >= 0) {
+			close(tracker->cgroup_fd);
+			tracker->cgroup_fd = -1;
+		}
+		rmdir(path);
+		return false;
+	}
+	tracker->tree_cgroup = strdup(path);
+	return tracker->tree_cgroup != NULL;
+}
+
+struct cpu_tracker *cpu_tracker_open_tree(pid_t root) {
+	struct cpu_tracker *tracker = tracker_alloc();
+	if (!tracker) {
+		return NULL;
+	}
+	cpu_tracker_prepare_trees();
+	if (s_connector_fd < 0 && s_cgroup_dir[0] != '\0' && open_tree_cgroup(tracker, root)) {
+		return tracker;
+	}
+	tracker->next = s_trees;
+	s_trees = tracker;
+	s_num_trees++;
+	add_process(tracker, root);
+	if (tracker->num_processes == 0) {
+		fprintf(stderr, "Error: Could not track process %d: %s\n", (int)root, strerror(errno));
+		cpu_tracker_close(tracker);
+		return NULL;
+	}
+	rescan_tree(tracker);
+	return tracker;
+}
+
+static bool read_cgroup_ns(struct cpu_tracker *tracker, uint64_t *ns) {
+	char buf[1024];
+	
+	if (read_proc_file(tracker->cgroup_fd, buf, sizeof(buf)) < 0) {
+		return false;
+	}
+	if (!tracker->cgroup_v2) {
+		*ns = strtoull(buf, NULL, 10);
+		return true;
+	}
+	const char *usage = strstr(buf, "usage_usec ");
+	if (!usage) {
+		return false;
+	}
+	*ns = strtoull(usage + strlen("usage_usec "), NULL, 10) * 1000;
+	return true;
+}
+
+struct cpu_tracker *cpu_tracker_open_cgroup(const char *path) {
+	char filename[PATH_MAX];
+	
+	struct cpu_tracker *tracker = tracker_alloc();
+	if (!tracker) {
+		return NULL;
+	}
+	snprintf(filename, sizeof(filename), "%s/cpu.stat", path);
+	tracker->cgroup_fd = open(filename, O_RDONLY | O_CLOEXEC);
+	tracker->cgroup_v2 = true;
+	if (tracker->cgroup_fd < 0) {
+		snprintf(filename, sizeof(filename), "%s/cpuacct.usage", path);
+		tracker->cgroup_fd = open(filename, O_RDONLY | O_CLOEXEC);
+		tracker->cgroup_v2 = false;
+	}
+	if (tracker->cgroup_fd < 0 || !read_cgroup_ns(tracker, &tracker->cgroup_start_ns)) {
+		fprintf(stderr, "Error: Could not read the CPU usage of the cgroup '%s'\n", path);
+		cpu_tracker_close(tracker);
+		return NULL;
+	}
+	return tracker;
+}
+
+void cpu_tracker_close(struct cpu_tracker *tracker) {
+	for (int i = 0; i < tracker->num_processes; i++) {
+		close(tracker->processes[i].fd);
+	}
+	free(tracker->processes);
+	if (tracker->cgroup_fd >= 0) {
+		close(tracker->cgroup_fd);
+		if (tracker->tree_cgroup) {
+			remove_tree_cgroup(tracker->tree_cgroup);
+			free(tracker->tree_cgroup);
+		}
+	} else {
+		for (struct cpu_tracker **link = &s_trees; *link; link = &(*link)->next) {
+			if (*link == tracker) {
+				*link = tracker->next;
+				s_num_trees--;
+				break;
+			}
+		}
+		if (s_num_trees == 0 && s_connector_fd >= 0) {
+			send_connector_op(s_connector_fd, PROC_CN_MCAST_IGNORE);
+			close(s_connector_fd);
+			s_connector_fd = -1;
+		}
+	}
+	if (--s_num_trackers == 0) {
+		close(s_proc_stat_fd);
+		s_proc_stat_fd = -1;
+	}
+	free(tracker);
+}
+
+static void read_tree(struct cpu_tracker *tracker) {
+	char buf[1024];
+	uint64_t ticks = 0, total_ticks = 0;
+	int i = 0;
+	
+	if (s_connector_fd >= 0) {
+		handle_events();
+	}
+	if (unlikely(monotonic_ns() >= tracker->next_rescan_ns)) {
+		rescan_tree(tracker);
+	}
+	while (i < tracker->num_processes) {
+		struct tracked_process *process = &tracker->processes[i];
+		if (unlikely(read_proc_file(process->fd, buf, sizeof(buf)) <= 0)) {
+			// Reaped, its time has moved to the process that waited for it
+			close(process->fd);
+			*process = tracker->processes[--tracker->num_processes];
+			continue;
+		}
+		if (likely(cpu_tracker_parse_stat(buf, &ticks))) {
+			total_ticks += ticks;
+		}
+		i++;
+	}
+	
+	uint64_t total_ns = total_ticks * s_ns_per_tick + __atomic_load_n(&tracker->reaped_ns, __ATOMIC_RELAXED);
+	// A process that is reaped while the tree is being read can be missed or counted twice for one read
+	if (total_ns > tracker->tracked_ns) {
+		tracker->tracked_ns = total_ns;
+	}
+}
+
+void cpu_tracker_read(struct cpu_tracker *tracker, uint64_t *tracked_ns, uint64_t *system_ns) {
+	if (tracker->cgroup_fd >= 0) {
+		uint64_t ns = tracker->cgroup_start_ns;
+		read_cgroup_ns(tracker, &ns);
+		*tracked_ns = ns - tracker->cgroup_start_ns;
+	} else {
+		read_tree(tracker);
+		*tracked_ns = tracker->tracked_ns;
+	}
+	if (system_ns) {
+		uint64_t system_ticks = read_system_ticks();
+		*system_ns = system_ticks > tracker->system_start_ticks ? (system_ticks - tracker->system_start_ticks) * s_ns_per_tick : 0;
+	}
+}
+
+void cpu_tracker_add_reaped(struct cpu_tracker *tracker, const struct rusage *usage) {
+	uint64_t ns = timeval_to_ns(&usage->ru_utime) + timeval_to_ns(&usage->ru_stime);
+	__atomic_fetch_add(&tracker->reaped_ns, ns, __ATOMIC_RELAXED);
+}
+
+bool cpu_tracker_contains(const struct cpu_tracker *tracker, pid_t pid) {
+	if (tracker->tree_cgroup) {
+		pid_t *pids = NULL;
+		bool found = false;
+		int num_pids = read_cgroup_pids(tracker->tree_cgroup, &pids);
+		for (int i = 0; i < num_pids && !found; i++) {
+			found = pids[i] == pid;
+		}
+		free(pids);
+		return found;
+	}
+	return is_tracked(tracker, pid);
+}
+
+int cpu_tracker_num_processes(const struct cpu_tracker *tracker) {
+	if (tracker->tree_cgroup) {
+		pid_t *pids = NULL;
+		int num_pids = cgroup_populated(tracker->tree_cgroup) ? read_cgroup_pids(tracker->tree_cgroup, &pids) : 0;
+		free(pids);
+		return num_pids;
+	}
+	return tracker->num_processes;
+}
+
+bool cpu_tracker_has_events(const struct cpu_tracker *tracker) {
+	return tracker->cgroup_fd < 0 && s_connector_fd >= 0;
+}
+
+bool cpu_tracker_has_cgroup(const struct cpu_tracker *tracker) {
+	return tracker->tree_cgroup != NULL;
+}
+
+void cpu_tracker_set_rescan_interval(int64_t ns) {
+	s_rescan_ns = ns;
+}
+
+int cpu_tracker_kill(struct cpu_tracker *tracker, int sig) {
+	int signaled = 0;
+	if (tracker->tree_cgroup) {
+		pid_t *pids = NULL;
+		int num_pids = read_cgroup_pids(tracker->tree_cgroup, &pids);
+		for (int i = 0; i < num_pids; i++) {
+			if (kill(pids[i], sig) == 0) {
+				signaled++;
+			}
+		}
+		free(pids);
+		return signaled;
+	}
+	for (int i = 0; i < tracker->num_processes; i++) {
+		if (kill(tracker->processes[i].pid, sig) == 0) {
+			signaled++;
+		}
+	}
+	return signaled;
+}
+
+void cpu_split_energy(struct cpu_split *split, uint64_t tracked_delta_ns, uint64_t system_delta_ns, double *joules, int n) {
+	int i;
+	
+	split->tracked_ns += tracked_delta_ns;
+	split->system_ns += system_delta_ns;
+	for (i = 0; i < n && i < CPU_SPLIT_MAX_VALUES; i++) {
+		split->pending[i] += joules[i];
+		joules[i] = 0.0;
+	}
+	if (split->system_ns == 0) {
+		return;
+	}
+	
+	uint64_t used_ns = split->tracked_ns < split->system_ns ? split->tracked_ns : split->system_ns;
+	const double share = (double)used_ns / split->system_ns;
+	for (i = 0; i < n && i < CPU_SPLIT_MAX_VALUES; i++) {
+		joules[i] = split->pending[i] * share;
+		split->pending[i] = 0.0;
+	}
+	split->tracked_ns -= used_ns;
+	split->system_ns = 0;
+}
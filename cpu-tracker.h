@@ -0,0 +1,138 @@
+/*
+ * CPU time of a process tree or a cgroup, for splitting the energy of the
+ * packages between the tracked tasks and everything else, and for watching
+ * that a process tree makes progress
+ *
+ * The tracker keeps the proc files of the live processes of the tree open
+ * and every read is a single pread() per process. /proc/<pid>/stat already
+ * includes the time of all threads of a process, also the threads that have
+ * exited, and the time of the children it has waited for. The caller passes
+ * the resource usage of the processes of the tree that it reaps itself to
+ * cpu_tracker_add_reaped(), so the time of processes that have exited is not
+ * lost, even if the tracker never saw them.
+ *
+ * The set of live descendants is kept up to date with fork events from the
+ * proc connector, one socket is shared by all trees. Before Linux 6.6,
+ * listening to it needs CAP_NET_ADMIN. Without it, each tree is put in a
+ * cgroup of its own under the cgroup v2 directory of the caller, if that is
+ * writable to us, for example when it has been delegated with
+ * systemd-run --user. The cgroup counts the time of every descendant, also
+ * the ones that were orphaned or have exited, and the live processes are
+ * listed in its cgroup.procs file, so nothing is scanned. The cgroup is
+ * removed when the tracker is closed and descendants that are still running
+ * are moved back to the cgroup of the caller.
+ *
+ * Otherwise the children files in /proc/<pid>/task/<tid>/ are scanned every
+ * CPU_TRACKER_RESCAN_NS or the interval set with
+ * cpu_tracker_set_rescan_interval(). A scan opens and reads one file per
+ * thread of the tree, and processes that live shorter than the interval are
+ * only counted when their parent in the tree reaps them. Descendants that are
+ * orphaned are found among the children of the caller, if it tracks a single
+ * tree and has made itself a subreaper with cpu_tracker_become_subreaper().
+ *
+ * A cgroup is read from its cpu.stat (cgroup v2) or cpuacct.usage (cgroup v1)
+ * file. The CPU time of the whole system is read from /proc/stat. All times
+ * are cumulative since the tracker was opened.
+ *
+ * The trackers are not thread-safe, all calls must come from the same thread
+ * except for cpu_tracker_add_reaped().
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef CPU_TRACKER_H
+#define CPU_TRACKER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+// How often the process tree is scanned for new descendants without the proc connector
+#define CPU_TRACKER_RESCAN_NS	100000000
+
+struct cpu_tracker;
+
+/*
+ * Orphaned descendants are reparented to the calling process instead of init,
+ * so that it can track and reap them. Call before forking the root.
+ */
+bool cpu_tracker_become_subreaper();
+
+/*
+ * Choose how the trees are tracked, call before forking the roots. Returns
+ * false if the trees will be found by scanning /proc.
+ */
+bool cpu_tracker_prepare_trees();
+
+/*
+ * Call in the child after fork and before exec, moves it into the cgroup of
+ * its tree so that none of its descendants can be missed. Does not allocate
+ * memory, so it is safe after forking a multithreaded process.
+ */
+void cpu_tracker_enter_tree();
+
+// Track a child process and all of its descendants, returns NULL on failure
+struct cpu_tracker *cpu_tracker_open_tree(pid_t root);
+
+// Track the tasks of a cgroup given as a directory, returns NULL on failure
+struct cpu_tracker *cpu_tracker_open_cgroup(const char *path);
+
+void cpu_tracker_close(struct cpu_tracker *tracker);
+
+/*
+ * Read the CPU time in nanoseconds that the tracked tasks and all tasks of
+ * the system have used since the tracker was opened. system_ns may be NULL.
+ */
+void cpu_tracker_read(struct cpu_tracker *tracker, uint64_t *tracked_ns, uint64_t *system_ns);
+
+// Add the time of a process of the tree that the caller has reaped with wait4()
+void cpu_tracker_add_reaped(struct cpu_tracker *tracker, const struct rusage *usage);
+
+// Whether a live process belongs to the tree
+bool cpu_tracker_contains(const struct cpu_tracker *tracker, pid_t pid);
+
+// Number of live processes in the tree, 0 for a cgroup given to cpu_tracker_open_cgroup()
+int cpu_tracker_num_processes(const struct cpu_tracker *tracker);
+
+// Whether fork events come from the proc connector instead of scanning /proc
+bool cpu_tracker_has_events(const struct cpu_tracker *tracker);
+
+// Whether the tree is in a cgroup of its own instead of being found by scanning /proc
+bool cpu_tracker_has_cgroup(const struct cpu_tracker *tracker);
+
+// Set the interval of the /proc scans, for trees that have neither events nor a cgroup
+void cpu_tracker_set_rescan_interval(int64_t ns);
+
+// Send a signal to every live process of the tree, returns the number of processes signaled
+int cpu_tracker_kill(struct cpu_tracker *tracker, int sig);
+
+/*
+ * Parse utime + stime + cutime + cstime in clock ticks (fields 14 to 17) from
+ * the contents of a /proc/<pid>/stat file. Returns false if the line is cut short.
+ */
+bool cpu_tracker_parse_stat(const char *buf, uint64_t *ticks);
+
+// Upper limit for the number of energy values split at once
+#define CPU_SPLIT_MAX_VALUES	8
+
+/*
+ * Splits energy by CPU time. The tracked tasks get the share of the energy
+ * that their CPU time is of the busy time of the whole system, so idle power
+ * is shared in the same proportion. The CPU times count in clock ticks, which
+ * can be longer than the sampling period. The energy of intervals where the
+ * system time did not advance is held back until it does, and tracked time
+ * that is ahead of the system time is carried over to the next interval.
+ */
+struct cpu_split {
+	uint64_t tracked_ns;
+	uint64_t system_ns;
+	double pending[CPU_SPLIT_MAX_VALUES];
+};
+
+/*
+ * Split the energy of an interval in place, each of the n values in joules is
+ * replaced with the part that belongs to the tracked tasks.
+ */
+void cpu_split_energy(struct cpu_split *split, uint64_t tracked_delta_ns, uint64_t system_delta_ns, double *joules, int n);
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * Writing the gaps to a CSV file outside of the poll loop
+ *
+ * The gap tools find gaps in a tight poll loop, so the CSV file is written by
+ * a separate thread. The poll loop only pushes the gap into a ring from
+ * spsc-ring.h, which never blocks or allocates, and the writer thread wakes
+ * up every millisecond to format and write the gaps that are waiting. If the
+ * writer falls behind, gaps are dropped from the file and counted, the
+ * statistics of the tool still include them.
+ *
+ * On a machine with a single CPU the writer thread still shares the CPU with
+ * the poll loop.
+ *
+ * Link with -pthread.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef GAP_WRITER_H
+#define GAP_WRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "spsc-ring.h"
+
+// Number of gaps that can wait for the writer, 512 kB
+#define GAP_WRITER_CAPACITY	(1 << 16)
+#define GAP_WRITER_POLL_INTERVAL_NS	1000000
+
+struct gap_writer {
+	struct spsc_ring ring;
+	FILE *fp;
+	const char *filename;
+	// printf format of one gap, for example "%f\n"
+	const char *format;
+	pthread_t thread;
+	int done;
+	uint64_t dropped;
+};
+
+static inline void *gap_writer_thread(void *arg) {
+	struct gap_writer *writer = (struct gap_writer *)arg;
+	const struct timespec poll_interval = { 0, GAP_WRITER_POLL_INTERVAL_NS };
+	double gap = 0.0;
+	
+	while (true) {
+		// Checked before taking a gap so that the last gaps are not lost
+		bool done = __atomic_load_n(&writer->done, __ATOMIC_ACQUIRE);
+		if (!spsc_ring_pop(&writer->ring, &gap)) {
+			if (done) {
+				break;
+			}
+			nanosleep(&poll_interval, NULL);
+			continue;
+		}
+		fprintf(writer->fp, writer->format, gap);
+	}
+	
+	return NULL;
+}
+
+// Create the file and start the writer thread, prints an error and returns false on failure
+static inline bool gap_writer_open(struct gap_writer *writer, const char *filename, const char *format) {
+	sigset_t all_signals, old_signals;
+	
+	memset(writer, 0, sizeof(*writer));
+	writer->filename = filename;
+	writer->format = format;
+	writer->fp = fopen(filename, "w");
+	if (!writer->fp) {
+		fprintf(stderr, "Failed to open %s!\n", filename);
+		return false;
+	}
+	if (!spsc_ring_init(&writer->ring, sizeof(double), GAP_WRITER_CAPACITY)) {
+		fprintf(stderr, "Could not allocate memory for the gaps.\n");
+		fclose(writer->fp);
+		return false;
+	}
+	
+	// The writer thread must not take the signals of the poll loop
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+	int err = pthread_create(&writer->thread, NULL, gap_writer_thread, writer);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (err != 0) {
+		fprintf(stderr, "Could not create the writer thread: %s\n", strerror(err));
+		spsc_ring_destroy(&writer->ring);
+		fclose(writer->fp);
+		return false;
+	}
+	
+	return true;
+}
+
+// Called from the poll loop
+static inline void gap_writer_add(struct gap_writer *writer, double gap) {
+	if (!spsc_ring_push(&writer->ring, &gap)) {
+		writer->dropped++;
+	}
+}
+
+// Write the remaining gaps and close the file
+static inline void gap_writer_close(struct gap_writer *writer) {
+	__atomic_store_n(&writer->done, 1, __ATOMIC_RELEASE);
+	pthread_join(writer->thread, NULL);
+	fclose(writer->fp);
+	spsc_ring_destroy(&writer->ring);
+	printf("Dumped data to %s\n", writer->filename);
+	if (writer->dropped > 0) {
+		fprintf(stderr, "Warning: %llu gaps were left out of %s because the writer could not keep up\n",
+			(unsigned long long)writer->dropped, writer->filename);
+	}
+}
+
+#endif
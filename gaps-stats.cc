@@ -1,8 +1,18 @@
+/*
+ * gaps-stats.cc
+ * Print statistics of a file of numbers, such as the gaps dumped by the poll tools.
+ * The file is read in one pass, so its size is not limited by memory.
+ *
+ * Usage: ./gaps-stats <file>
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 
-#include <vector>
+#include "stream-stats.h"
 
 int main(int argc, char **argv) {
 	if (argc < 2) {
@@ -16,27 +26,20 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 	
+	// The percentiles assume values in seconds, like the gaps
+	static struct gap_stats gaps;
+	gap_stats_init(&gaps);
 	double value = 0.0;
-	std::vector<double> values;
-	double sum = 0.0;
-	long num = 0;
 	while (fscanf(fp, "%lf", &value) > 0) {
-		sum += value;
-		values.push_back(value);
-		num++;
+		gap_stats_add(&gaps, value);
 	}
-	double avg = sum / num;
-	printf("Average is %.9f\n", avg);
+	fclose(fp);
 	
-	// Calculate standard deviation
-	double sum_squares = 0.0;
-	int i = 0;
-	for (i = 0; i < num; i++) {
-		double diff = values[i] - avg;
-		sum_squares += diff * diff;
-	}
-	double std_dev = sqrt(sum_squares / num);
-	printf("Standard deviation is %.9f\n", std_dev);
+	printf("Average is %.9f\n", gaps.stats.mean);
+	printf("Standard deviation is %.9f\n", stream_stats_stddev(&gaps.stats));
+	printf("Minimum is %.9f and maximum is %.9f\n", gaps.stats.min, gaps.stats.max);
+	printf("Skewness is %f and excess kurtosis is %f\n", stream_stats_skewness(&gaps.stats), stream_stats_kurtosis(&gaps.stats));
+	stream_hist_print_percentiles(stdout, "Percentiles in milliseconds", &gaps.hist, 1e-6);
 	
 	return 0;
 }
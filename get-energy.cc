@@ -2,9 +2,15 @@
  * Measure the energy of executing another program.
  * Code based on IgProf energy profiling module by Filip Nybäck.
  * 
+ * The RAPL backend can be selected with the RAPL_BACKEND environment variable
+ * (papi, msr, perf, powercap or sim). By default the first working backend is used.
+ * On multi-socket systems the energy of every package is reported separately.
+ * 
+ * Counters that wrap around (MSR, powercap) are polled from a background
+ * thread often enough that no wraparound is missed.
+ * 
  * TODO:
  * Use waitpid() instead of wait().
- * Account for RAPL overflows.
  *
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
@@ -19,26 +25,24 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include <vector>
 
-#include <papi.h>
+#include "rapl.h"
 
-#define READ_ENERGY(a) PAPI_read(s_event_set, a)
+static struct rapl_source *s_rapl = NULL;
+static struct rapl_accum s_accum;
 
-static int s_event_set = 0;
-static int s_num_events = 0;
-static long long *s_begin_values = NULL;
-static long long *s_end_values = NULL;
+// Poll at least four times per wrap period assuming this much power per package
+#define MAX_PACKAGE_POWER 500.0
 
-static int idx_pkg_energy = -1;
-static int idx_pp0_energy = -1;
-static int idx_pp1_energy = -1;
-static int idx_dram_energy = -1;
-
-// Set the scale factor for the RAPL energy readings:
-// one integer step is 15.3 microjoules, scale everything to joules.
-static const double scaleFactor = 1e-9;
+static pthread_t poll_thread;
+static pthread_mutex_t poll_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poll_cond = PTHREAD_COND_INITIALIZER;
+static bool poll_running = false;
+static bool poll_stop = false;
+static double poll_interval = 0.0;
 
 static pid_t child_pid = -1;
 
@@ -48,6 +52,69 @@ static double gettimeofday_double() {
 	return now.tv_sec + now.tv_usec * 1e-6;
 }
 
+// Read the counters and add them to the accumulator
+static void update_energy() {
+	uint64_t values[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS] = { 0 };
+	pthread_mutex_lock(&poll_mutex);
+	if (rapl_read(s_rapl, values)) {
+		rapl_accum_update(&s_accum, values);
+	}
+	pthread_mutex_unlock(&poll_mutex);
+}
+
+static void *poll_main(void *arg) {
+	(void)arg;
+	
+	pthread_mutex_lock(&poll_mutex);
+	while (!poll_stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		double wakeup = deadline.tv_sec + deadline.tv_nsec * 1e-9 + poll_interval;
+		deadline.tv_sec = (time_t)wakeup;
+		deadline.tv_nsec = (long)((wakeup - deadline.tv_sec) * 1e9);
+		if (pthread_cond_timedwait(&poll_cond, &poll_mutex, &deadline) == ETIMEDOUT) {
+			pthread_mutex_unlock(&poll_mutex);
+			update_energy();
+			pthread_mutex_lock(&poll_mutex);
+		}
+	}
+	pthread_mutex_unlock(&poll_mutex);
+	
+	return NULL;
+}
+
+static void start_polling() {
+	double wrap_seconds = rapl_wrap_seconds(s_rapl, MAX_PACKAGE_POWER);
+	if (wrap_seconds == 0.0) {
+		return; // The counters never wrap
+	}
+	poll_interval = wrap_seconds / 4;
+	
+	// Signals are handled by the main thread
+	sigset_t all_signals, old_signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+	int err = pthread_create(&poll_thread, NULL, poll_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (err != 0) {
+		fprintf(stderr, "Warning: Could not create the polling thread, runs longer than %.0f seconds may be wrong: %s\n", wrap_seconds, strerror(err));
+		return;
+	}
+	poll_running = true;
+}
+
+static void stop_polling() {
+	if (!poll_running) {
+		return;
+	}
+	pthread_mutex_lock(&poll_mutex);
+	poll_stop = true;
+	pthread_cond_signal(&poll_cond);
+	pthread_mutex_unlock(&poll_mutex);
+	pthread_join(poll_thread, NULL);
+	poll_running = false;
+}
+
 static void sighandler(int signum) {
 	printf("Received signal %d\n", signum);
 	if (child_pid > 0) {
@@ -63,93 +130,6 @@ static void do_signals() {
 	signal(SIGINT, sighandler);
 }
 
-static bool init_rapl() {
-	if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
-		fprintf(stderr, "PAPI library initialisation failed.\n");
-		return false;
-	}
-	
-	// Find the RAPL component of PAPI.
-	int num_components = PAPI_num_components();
-	int component_id;
-	const PAPI_component_info_t *component_info = 0;
-	for (component_id = 0; component_id < num_components; ++component_id)
-	{
-		component_info = PAPI_get_component_info(component_id);
-		if (component_info && strstr(component_info->name, "rapl")) {
-			break;
-		}
-	}
-	if (component_id == num_components) {
-		fprintf(stderr, "No RAPL component found in PAPI library.\n");
-		return false;
-	}
-	
-	if (component_info->disabled) {
-		fprintf(stderr, "RAPL component of PAPI disabled: %s.\n",
-			component_info->disabled_reason);
-		return false;
-	}
-	
-	// Create an event set.
-	s_event_set = PAPI_NULL;
-	if (PAPI_create_eventset(&s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not create PAPI event set.\n");
-		return false;
-	}
-	
-	int code = PAPI_NATIVE_MASK;
-	for (int retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_FIRST, component_id); retval == PAPI_OK; retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_EVENTS, component_id)) {
-		char event_name[PAPI_MAX_STR_LEN];
-		if (PAPI_event_code_to_name(code, event_name) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event name.\n");
-			return false;
-		}
-		
-		PAPI_event_info_t event_info;
-		if (PAPI_get_event_info(code, &event_info) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event info.\n");
-			return false;
-		}
-		if (event_info.data_type != PAPI_DATATYPE_UINT64) {
-			continue;
-		}
-		
-		if (strstr(event_name, "PACKAGE_ENERGY:")) {
-			idx_pkg_energy = s_num_events;
-		} else if (strstr(event_name, "PP0_ENERGY:")) {
-			idx_pp0_energy = s_num_events;
-		} else if (strstr(event_name, "PP1_ENERGY:")) {
-			idx_pp1_energy = s_num_events;
-		} else if (strstr(event_name, "DRAM_ENERGY:")) {
-			idx_dram_energy = s_num_events;
-		} else {
-			continue; // Skip other counters
-		}
-		
-		//printf("Adding %s to event set.\n", event_name);
-		if (PAPI_add_event(s_event_set, code) != PAPI_OK)
-			break;
-		++s_num_events;
-	}
-	if (s_num_events == 0) {
-		fprintf(stderr, "Could not find any RAPL events.\n");
-		return false;
-	}
-	
-	// Allocate memory for reading the counters
-	s_begin_values = (long long *)calloc(s_num_events, sizeof(long long));
-	s_end_values = (long long *)calloc(s_num_events, sizeof(long long));
-	
-	// Activate the event set.
-	if (PAPI_start(s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not activate the event set.\n");
-		return false;
-	}
-	
-	return true;
-}
-
 static void do_fork_and_exec(int argc, char **argv) {
 	if (argc > 1) {
 		child_pid = fork();
@@ -178,36 +158,42 @@ static void do_fork_and_exec(int argc, char **argv) {
 	}
 }
 
+static void print_energy(const char *prefix, int package, double time_elapsed) {
+	static const char *domain_labels[RAPL_NUM_DOMAINS] = { "Package", "PP0", "PP1", "DRAM" };
+	int domain;
+	
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		if (rapl_has_domain(s_rapl, domain)) {
+			double energy = rapl_accum_joules(&s_accum, s_rapl, package, domain);
+			printf("%s%s energy consumed: %f J\n", prefix, domain_labels[domain], energy);
+			printf("%s%s average power: %f W\n", prefix, domain_labels[domain], energy / time_elapsed);
+		}
+	}
+}
+
 int main(int argc, char **argv) {
 	do_signals();
-	if (init_rapl()) {
+	s_rapl = rapl_open_all(getenv("RAPL_BACKEND"));
+	if (s_rapl) {
+		rapl_accum_init(&s_accum, s_rapl);
 		double begin_time = gettimeofday_double();
-		READ_ENERGY(s_begin_values);
+		update_energy();
+		start_polling();
 		do_fork_and_exec(argc, argv);
-		READ_ENERGY(s_end_values);
+		stop_polling();
+		update_energy();
 		double end_time = gettimeofday_double();
 		
 		double time_elapsed = end_time - begin_time;
 		printf("Real time elapsed: %f seconds\n", time_elapsed);
-		if (idx_pkg_energy != -1) {
-			double pkg_energy = scaleFactor * (s_end_values[idx_pkg_energy] - s_begin_values[idx_pkg_energy]);
-			printf("Package energy consumed: %f J\n", pkg_energy);
-			printf("Package average power: %f W\n", pkg_energy / time_elapsed);
-		}
-		if (idx_pp0_energy != -1) {
-			double pp0_energy = scaleFactor * (s_end_values[idx_pp0_energy] - s_begin_values[idx_pp0_energy]);
-			printf("PP0 energy consumed: %f J\n", pp0_energy);
-			printf("PP0 average power: %f W\n", pp0_energy / time_elapsed);
-		}
-		if (idx_pp1_energy != -1) {
-			double pp1_energy = scaleFactor * (s_end_values[idx_pp1_energy] - s_begin_values[idx_pp1_energy]);
-			printf("PP1 energy consumed: %f J\n", pp1_energy);
-			printf("PP1 average power: %f W\n", pp1_energy / time_elapsed);
-		}
-		if (idx_dram_energy != -1) {
-			double dram_energy = scaleFactor * (s_end_values[idx_dram_energy] - s_begin_values[idx_dram_energy]);
-			printf("DRAM energy consumed: %f J\n", dram_energy);
-			printf("DRAM average power: %f W\n", dram_energy / time_elapsed);
+		if (s_rapl->num_packages == 1) {
+			print_energy("", 0, time_elapsed);
+		} else {
+			for (int package = 0; package < s_rapl->num_packages; package++) {
+				char prefix[32];
+				snprintf(prefix, sizeof(prefix), "Socket %d: ", package);
+				print_energy(prefix, package, time_elapsed);
+			}
 		}
 	}
 	return 0;
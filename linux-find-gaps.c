@@ -3,16 +3,53 @@
  * Find any gaps in the execution of a busy loop program.
  * Goal is to potentially find signs of System Management Mode (SMM).
  *
+ * Usage: ./linux-find-gaps [ -n <iterations> ]
+ *        ./linux-find-gaps -a [ -d <seconds> ] [ -t <threshold> ] [ -m <events> ] [ -o <file> ]
+ *   -n	Number of iterations of the single busy loop (defaults to 8000000)
+ *   -a	Spin on every CPU the process may run on and correlate the gaps
+ *   -d	Duration of the all-CPU mode in seconds (defaults to 10)
+ *   -t	Gaps longer than this many microseconds are recorded (defaults to 10)
+ *   -m	Number of gaps recorded per CPU, the rest are only counted (defaults to 16384)
+ *   -o	Write the recorded gaps as CSV
+ *
+ * SMM stalls every core at the same time, while preemption and interrupts
+ * stop one core at a time. The all-CPU mode runs one pinned spinning thread
+ * per CPU. Each thread records the gaps above the threshold with their TSC
+ * timestamps into a buffer of its own, so nothing is shared while spinning.
+ * Afterwards the gaps are merged into clusters of overlapping gaps, and a
+ * cluster that covers every CPU with a common overlap is reported as an
+ * all-core stall. This assumes that the TSC is synchronised across the CPUs.
+ *
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "stream-stats.h"
+#include "tsc-latency.h"
 
+/* The default number of iterations */
 #define NUM_ITERATIONS 8000000ULL
 
+/* Defaults of the all-CPU mode */
+#define DEFAULT_DURATION	10.0
+#define DEFAULT_THRESHOLD_US	10.0
+#define DEFAULT_MAX_EVENTS	16384
+
+/* How many all-core stalls are printed, the output file has all of them */
+#define MAX_PRINTED_STALLS	20
+
+#define CACHE_LINE	64
+
 #if __x86_64__ || __i386__
 #define HAVE_RDTSC
 #define RDTSC(v)							\
@@ -22,41 +59,331 @@
   } while (0)
 #endif
 
-int main() {
 #ifdef HAVE_RDTSC
-	uint32_t *gaps = calloc(NUM_ITERATIONS, sizeof(uint32_t));
+
+struct gap_event {
+	uint64_t start;
+	uint64_t length;
+};
+
+/*
+ * One spinning thread. The thread keeps its counters in registers while
+ * spinning and stores them here when done. Each struct has cache lines of
+ * its own, and the event buffer is allocated and touched by the thread
+ * itself, so that it is local to the CPU and does not page fault while
+ * spinning.
+ */
+struct spinner {
+	int cpu;
+	pthread_t thread;
+	struct gap_event *events;
+	uint64_t capacity;
+	uint64_t start_tsc;
+	uint64_t iterations;
+	// Gaps over the threshold, also the ones that did not fit in the buffer
+	uint64_t num_events;
+	uint64_t longest_gap;
+	uint64_t stalled_cycles;
+} __attribute__((aligned(CACHE_LINE)));
+
+// A recorded gap of any CPU, for merging
+struct merged_event {
+	uint64_t start;
+	uint64_t end;
+	int cpu;
+};
+
+enum cluster_kind {
+	CLUSTER_SINGLE,
+	CLUSTER_PARTIAL,
+	CLUSTER_ALL,
+};
+
+static const char *cluster_kind_names[] = { "single", "partial", "all" };
+
+// Read-only while the threads spin
+static uint64_t threshold_cycles = 0;
+static uint64_t duration_cycles = 0;
+static uint64_t max_events = DEFAULT_MAX_EVENTS;
+static pthread_barrier_t start_barrier;
+
+static void *spin_thread(void *arg) {
+	struct spinner *spinner = (struct spinner *)arg;
+	struct gap_event *events = NULL;
+	uint64_t capacity = max_events;
+	
+	if (capacity > 0 && posix_memalign((void **)&events, CACHE_LINE, capacity * sizeof(*events)) == 0) {
+		memset(events, 0, capacity * sizeof(*events));
+	} else {
+		events = NULL;
+		capacity = 0;
+	}
+	
+	pthread_barrier_wait(&start_barrier);
+	
+	uint64_t tsc = 0, prev_tsc = 0, end_tsc = 0;
+	uint64_t iterations = 0, num_events = 0, longest_gap = 0, stalled_cycles = 0;
+	RDTSC(prev_tsc);
+	spinner->start_tsc = prev_tsc;
+	end_tsc = prev_tsc + duration_cycles;
+	do {
+		RDTSC(tsc);
+		uint64_t gap = tsc - prev_tsc;
+		if (__builtin_expect(gap > threshold_cycles, 0)) {
+			if (num_events < capacity) {
+				events[num_events].start = prev_tsc;
+				events[num_events].length = gap;
+			}
+			num_events++;
+			stalled_cycles += gap;
+			if (gap > longest_gap) {
+				longest_gap = gap;
+			}
+		}
+		prev_tsc = tsc;
+		iterations++;
+	} while (tsc < end_tsc);
+	
+	spinner->events = events;
+	spinner->capacity = capacity;
+	spinner->iterations = iterations;
+	spinner->num_events = num_events;
+	spinner->longest_gap = longest_gap;
+	spinner->stalled_cycles = stalled_cycles;
+	return NULL;
+}
+
+static int compare_events(const void *a, const void *b) {
+	const struct merged_event *ea = (const struct merged_event *)a;
+	const struct merged_event *eb = (const struct merged_event *)b;
+	if (ea->start != eb->start) {
+		return ea->start < eb->start ? -1 : 1;
+	}
+	return ea->cpu - eb->cpu;
+}
+
+static int find_gaps_all_cpus(double duration, double threshold_us, const char *output_file) {
+	cpu_set_t allowed;
+	int num_spinners = 0, cpu = 0, i = 0;
+	
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		perror("sched_getaffinity");
+		return EXIT_FAILURE;
+	}
+	int num_cpus = CPU_COUNT(&allowed);
+	struct spinner *spinners = NULL;
+	if (posix_memalign((void **)&spinners, CACHE_LINE, num_cpus * sizeof(*spinners)) != 0) {
+		fprintf(stderr, "Error: Failed to allocate the thread state\n");
+		return EXIT_FAILURE;
+	}
+	memset(spinners, 0, num_cpus * sizeof(*spinners));
+	
+	double cycles_per_ns = tsc_latency_calibrate();
+	threshold_cycles = (uint64_t)(threshold_us * 1000.0 * cycles_per_ns);
+	duration_cycles = (uint64_t)(duration * 1e9 * cycles_per_ns);
+	printf("Spinning on %d CPUs for %f seconds, recording gaps over %f microseconds (%llu TSC cycles at %f GHz)\n",
+		num_cpus, duration, threshold_us, (unsigned long long)threshold_cycles, cycles_per_ns);
+	
+	// The threads are pinned before they start, so that they never run on the wrong CPU
+	pthread_barrier_init(&start_barrier, NULL, num_cpus);
+	for (cpu = 0; cpu < CPU_SETSIZE && num_spinners < num_cpus; cpu++) {
+		if (!CPU_ISSET(cpu, &allowed)) {
+			continue;
+		}
+		cpu_set_t mask;
+		CPU_ZERO(&mask);
+		CPU_SET(cpu, &mask);
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setaffinity_np(&attr, sizeof(mask), &mask);
+		spinners[num_spinners].cpu = cpu;
+		int ret = pthread_create(&spinners[num_spinners].thread, &attr, spin_thread, &spinners[num_spinners]);
+		pthread_attr_destroy(&attr);
+		if (ret != 0) {
+			fprintf(stderr, "Error: Failed to start the thread of CPU %d: %s\n", cpu, strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+		num_spinners++;
+	}
+	for (i = 0; i < num_spinners; i++) {
+		pthread_join(spinners[i].thread, NULL);
+	}
+	pthread_barrier_destroy(&start_barrier);
+	
+	// Merge the recorded gaps of all CPUs in time order
+	uint64_t num_recorded = 0, first_tsc = spinners[0].start_tsc;
+	for (i = 0; i < num_spinners; i++) {
+		struct spinner *spinner = &spinners[i];
+		uint64_t recorded = spinner->num_events < spinner->capacity ? spinner->num_events : spinner->capacity;
+		uint64_t dropped = spinner->num_events - recorded;
+		num_recorded += recorded;
+		if (spinner->start_tsc < first_tsc) {
+			first_tsc = spinner->start_tsc;
+		}
+		printf("CPU %d: %llu iterations, %llu gaps over the threshold", spinner->cpu,
+			(unsigned long long)spinner->iterations, (unsigned long long)spinner->num_events);
+		if (dropped > 0) {
+			printf(" (%llu not recorded)", (unsigned long long)dropped);
+		}
+		if (spinner->num_events > 0) {
+			printf(", longest %f microseconds, %f milliseconds stalled", spinner->longest_gap / cycles_per_ns * 1e-3,
+				spinner->stalled_cycles / cycles_per_ns * 1e-6);
+		}
+		printf("\n");
+	}
+	struct merged_event *events = (struct merged_event *)calloc(num_recorded > 0 ? num_recorded : 1, sizeof(*events));
+	int *cluster_stamp = (int *)malloc(CPU_SETSIZE * sizeof(int));
+	if (!events || !cluster_stamp) {
+		fprintf(stderr, "Error: Failed to allocate memory for merging the gaps\n");
+		return EXIT_FAILURE;
+	}
+	uint64_t n = 0, j = 0;
+	for (i = 0; i < num_spinners; i++) {
+		uint64_t recorded = spinners[i].num_events < spinners[i].capacity ? spinners[i].num_events : spinners[i].capacity;
+		for (j = 0; j < recorded; j++) {
+			events[n].start = spinners[i].events[j].start;
+			events[n].end = spinners[i].events[j].start + spinners[i].events[j].length;
+			events[n].cpu = spinners[i].cpu;
+			n++;
+		}
+		free(spinners[i].events);
+	}
+	qsort(events, num_recorded, sizeof(*events), compare_events);
+	
+	/*
+	 * A cluster is a run of gaps that overlap each other, directly or through
+	 * other gaps. It is an all-core stall if every CPU has a gap in it and all
+	 * of the gaps share a common interval.
+	 */
+	FILE *fp = NULL;
+	if (output_file) {
+		fp = fopen(output_file, "w");
+		if (!fp) {
+			fprintf(stderr, "Failed to open %s!\n", output_file);
+		} else {
+			fprintf(fp, "time, cpu, length, cluster, cluster_cpus, kind\n");
+		}
+	}
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		cluster_stamp[i] = -1;
+	}
+	uint64_t num_clusters[3] = { 0, 0, 0 }, printed = 0, k = 0;
+	int cluster = 0;
+	for (j = 0; j < num_recorded; j = k, cluster++) {
+		uint64_t cluster_end = events[j].end, common_start = events[j].start, common_end = events[j].end;
+		int cluster_cpus = 0;
+		for (k = j; k < num_recorded && (k == j || events[k].start < cluster_end); k++) {
+			if (events[k].end > cluster_end) cluster_end = events[k].end;
+			if (events[k].start > common_start) common_start = events[k].start;
+			if (events[k].end < common_end) common_end = events[k].end;
+			if (cluster_stamp[events[k].cpu] != cluster) {
+				cluster_stamp[events[k].cpu] = cluster;
+				cluster_cpus++;
+			}
+		}
+		enum cluster_kind kind = CLUSTER_PARTIAL;
+		if (cluster_cpus == 1) {
+			kind = CLUSTER_SINGLE;
+		} else if (cluster_cpus == num_spinners && common_start < common_end) {
+			kind = CLUSTER_ALL;
+		}
+		num_clusters[kind]++;
+		double time = (events[j].start - first_tsc) / cycles_per_ns * 1e-9;
+		if (kind == CLUSTER_ALL && printed++ < MAX_PRINTED_STALLS) {
+			printf("All-core stall at %f seconds: %f microseconds on every CPU, %f microseconds from the first to the last CPU\n",
+				time, (common_end - common_start) / cycles_per_ns * 1e-3, (cluster_end - events[j].start) / cycles_per_ns * 1e-3);
+		}
+		if (fp) {
+			uint64_t e = 0;
+			for (e = j; e < k; e++) {
+				fprintf(fp, "%.9f, %d, %f, %d, %d, %s\n", (events[e].start - first_tsc) / cycles_per_ns * 1e-9, events[e].cpu,
+					(events[e].end - events[e].start) / cycles_per_ns * 1e-3, cluster, cluster_cpus, cluster_kind_names[kind]);
+			}
+		}
+	}
+	if (printed > MAX_PRINTED_STALLS) {
+		printf("... and %llu more all-core stalls\n", (unsigned long long)(printed - MAX_PRINTED_STALLS));
+	}
+	printf("%llu all-core stalls, %llu stalls on some of the CPUs, %llu stalls on a single CPU\n",
+		(unsigned long long)num_clusters[CLUSTER_ALL], (unsigned long long)num_clusters[CLUSTER_PARTIAL], (unsigned long long)num_clusters[CLUSTER_SINGLE]);
+	if (num_spinners == 1) {
+		printf("Only one CPU, all-core stalls cannot be told apart from preemption\n");
+	}
+	if (fp) {
+		printf("Dumped the gaps to %s\n", output_file);
+		fclose(fp);
+	}
+	
+	free(cluster_stamp);
+	free(events);
+	free(spinners);
+	return EXIT_SUCCESS;
+}
+
+#endif
+
+int main(int argc, char **argv) {
+#ifdef HAVE_RDTSC
+	unsigned long long num_iterations = NUM_ITERATIONS;
+	double duration = DEFAULT_DURATION, threshold_us = DEFAULT_THRESHOLD_US;
+	const char *output_file = NULL;
+	int all_cpus = 0;
+	int c = 0;
+	while ((c = getopt(argc, argv, "n:ad:t:m:o:")) != -1) {
+		switch (c) {
+			case 'n':
+				num_iterations = strtoull(optarg, NULL, 0);
+				break;
+			case 'a':
+				all_cpus = 1;
+				break;
+			case 'd':
+				duration = atof(optarg);
+				break;
+			case 't':
+				threshold_us = atof(optarg);
+				break;
+			case 'm':
+				max_events = strtoull(optarg, NULL, 0);
+				break;
+			case 'o':
+				output_file = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [ -n <iterations> ]\n", argv[0]);
+				fprintf(stderr, "       %s -a [ -d <seconds> ] [ -t <threshold in microseconds> ] [ -m <events per CPU> ] [ -o <file> ]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	
+	if (all_cpus) {
+		return find_gaps_all_cpus(duration, threshold_us, output_file);
+	}
+	
+	// The statistics are updated in the loop, so the memory use does not depend on the number of iterations
+	static struct stream_stats stats;
+	static struct stream_hist hist;
+	stream_stats_init(&stats);
+	stream_hist_init(&hist);
 	uint64_t tsc = 0, prev_tsc = 0;
 	unsigned long long i = 0;
 	RDTSC(tsc);
 	prev_tsc = tsc;
-	for (i = 0; i < NUM_ITERATIONS; i++) {
+	for (i = 0; i < num_iterations; i++) {
 		RDTSC(tsc);
-		gaps[i] = tsc - prev_tsc;
+		uint64_t gap = tsc - prev_tsc;
+		stream_stats_add(&stats, gap);
+		stream_hist_add(&hist, gap);
 		prev_tsc = tsc;
 	}
 	
-	// Run some statistics
-	double gaps_sum = 0;
-	uint64_t min_gap = -1LL;
-	uint64_t max_gap = 0;
-	for (i = 0; i < NUM_ITERATIONS; i++) {
-		uint64_t gap = gaps[i];
-		gaps_sum += gap;
-		if (gap < min_gap) min_gap = gap;
-		if (gap > max_gap) max_gap = gap;
-		//printf("%llu\n", (unsigned long long)gap);
-	}
-	double avg_gap = gaps_sum / NUM_ITERATIONS;
-	// Standard deviation
-	double sum_squares = 0;
-	for (i = 0; i < NUM_ITERATIONS; i++) {
-		uint64_t gap = gaps[i];
-		double delta = (gap - avg_gap);
-		sum_squares += delta * delta;
-	}
-	double std_dev = sqrt(sum_squares / NUM_ITERATIONS);
-	printf("Avg gap = %f cycles, std dev = %f cycles, min gap = %llu cycles, max gap = %llu cycles\n", avg_gap, std_dev, (unsigned long long)min_gap, (unsigned long long)max_gap);
+	printf("Avg gap = %f cycles, std dev = %f cycles, min gap = %llu cycles, max gap = %llu cycles\n",
+		stats.mean, stream_stats_stddev(&stats), (unsigned long long)hist.min, (unsigned long long)hist.max);
+	printf("Skewness = %f, excess kurtosis = %f\n", stream_stats_skewness(&stats), stream_stats_kurtosis(&stats));
+	stream_hist_print_percentiles(stdout, "Gap percentiles in cycles", &hist, 1.0);
 #else
+	(void)argc;
+	(void)argv;
 	printf("RDTSC only works on x86 platforms!\n");
 #endif
 	return 0;
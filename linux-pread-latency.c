@@ -1,5 +1,9 @@
 /*
- * Measure the average latency of calling pread.
+ * Measure the latency of calling pread.
+ * Each call is timed with the TSC, see tsc-latency.h.
+ *
+ * Usage: ./linux-pread-latency [ -n <iterations> ] [ -H <histogram file> ]
+ *   -H	Write the latency histogram in nanoseconds as CSV
  *
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
@@ -7,31 +11,60 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <sys/time.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+#include "tsc-latency.h"
 
 int do_read(int fd) {
 	char buf[8];
 	return pread(fd, buf, 8, 0);
 }
 
-static double gettimeofday_double() {
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	return tv.tv_sec + tv.tv_usec * 1e-6;
-}
-
-int main() {
-	double start = gettimeofday_double();
+int main(int argc, char **argv) {
+	const char *histogram_file = NULL;
 	int i = 0, iterations = 1000000;
+	int c = 0;
+	
+	while ((c = getopt(argc, argv, "n:H:")) != -1) {
+		switch (c) {
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			case 'H':
+				histogram_file = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [ -n <iterations> ] [ -H <histogram file> ]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	
+	static struct tsc_latency lat;
+	tsc_latency_init(&lat);
 	int fd = open("/dev/zero", O_RDONLY);
+	uint64_t start = tsc_latency_monotonic_ns();
 	for (i = 0; i < iterations; i++) {
+		uint64_t begin = tsc_latency_begin();
 		do_read(fd);
+		tsc_latency_add(&lat, begin, tsc_latency_end());
 	}
-	double end = gettimeofday_double();
+	uint64_t end = tsc_latency_monotonic_ns();
 	close(fd);
-	printf("%d iterations in %f seconds\n", iterations, (end - start));
-	printf("pread latency: %f nanoseconds\n", (end - start) / iterations * 1e9);
+	printf("%d iterations in %f seconds\n", iterations, (end - start) * 1e-9);
+	printf("pread latency: %f nanoseconds\n", tsc_latency_mean_ns(&lat));
+	tsc_latency_print(stdout, "pread", &lat);
+	tsc_latency_print_overhead(stdout, &lat);
+	
+	if (histogram_file) {
+		FILE *fp = fopen(histogram_file, "w");
+		if (!fp) {
+			fprintf(stderr, "Failed to open %s!\n", histogram_file);
+			return EXIT_FAILURE;
+		}
+		tsc_latency_dump(fp, "pread", &lat);
+		fclose(fp);
+	}
 	return 0;
 }
@@ -1,14 +1,22 @@
 /*
  * linux-test-clocks.c
  * Test various clock sources available through clock_gettime().
+ * The polling latency of every call is measured with the TSC, see tsc-latency.h.
+ *
+ * Usage: ./linux-test-clocks [ -H <histogram file> ]
+ *   -H	Write the latency histograms in nanoseconds as CSV
  *
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
+
+#include "tsc-latency.h"
 
 #if __x86_64__ || __i386__
 #define HAVE_RDTSC
@@ -48,12 +56,6 @@ const char *clk_names[] = {
 const int num_clocks = sizeof(clk_ids) / sizeof(*clk_ids);
 const int num_iterations = 10000000;
 
-static double gettimeofday_double() {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	return now.tv_sec + now.tv_usec * 0.000001;
-}
-
 static void gettimeofday_getres(struct timespec *res) {
 	struct timeval begin, now;
 	gettimeofday(&begin, NULL);
@@ -69,10 +71,37 @@ static void gettimeofday_getres(struct timespec *res) {
 	res->tv_nsec = delta * 1000;
 }
 
-int main() {
-	int i = 0, j = 0;
+// Print the latencies of one clock and add them to the histogram file
+static void report_latency(const char *name, const struct tsc_latency *lat, FILE *histogram_fp) {
+	printf("%s : %f nanoseconds\n", name, tsc_latency_mean_ns(lat));
+	tsc_latency_print(stdout, name, lat);
+	if (histogram_fp) {
+		tsc_latency_dump(histogram_fp, name, lat);
+	}
+}
+
+int main(int argc, char **argv) {
+	int i = 0, j = 0, c = 0;
 	struct timespec res = {0, 0};
 	struct timeval now = {0, 0};
+	static struct tsc_latency lat;
+	FILE *histogram_fp = NULL;
+	
+	while ((c = getopt(argc, argv, "H:")) != -1) {
+		switch (c) {
+			case 'H':
+				histogram_fp = fopen(optarg, "w");
+				if (!histogram_fp) {
+					fprintf(stderr, "Failed to open %s!\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [ -H <histogram file> ]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	
 	printf("Clock time resolutions\n");
 	printf("======================\n\n");
 	
@@ -84,11 +113,11 @@ int main() {
 	// Special case: gettimeofday
 	gettimeofday_getres(&res);
 	printf("gettimeofday : %lld.%09lld\n", (long long)res.tv_sec, (long long)res.tv_nsec);
-	
+
 #ifdef HAVE_RDTSC
 	printf("RDTSC : ?\n");
 #endif
-	
+
 	printf("\n");
 	printf("Current values\n");
 	printf("==============\n\n");
@@ -101,45 +130,50 @@ int main() {
 	// Special case: gettimeofday
 	gettimeofday(&now, NULL);
 	printf("gettimeofday : %lld.%09lld\n", (long long)now.tv_sec, ((long long)now.tv_usec) * 1000);
-	
+
 #ifdef HAVE_RDTSC
 	uint64_t tsc = 0;
 	RDTSC(tsc);
 	printf("RDTSC : %llu\n", (long long unsigned)tsc);
 #endif
-	
+
 	printf("\n");
 	printf("Polling latencies\n");
 	printf("=================\n\n");
 	
 	for (i = 0; i < num_clocks; i++) {
-		double time_start = gettimeofday_double();
+		tsc_latency_init(&lat);
 		for (j = 0; j < num_iterations; j++) {
+			uint64_t begin = tsc_latency_begin();
 			clock_gettime(clk_ids[i], &res);
+			tsc_latency_add(&lat, begin, tsc_latency_end());
 		}
-		double time_end = gettimeofday_double();
-		printf("%s : %f nanoseconds\n", clk_names[i], (time_end - time_start) * 1000000000.0 / num_iterations);
+		report_latency(clk_names[i], &lat, histogram_fp);
 	}
 	
 	// Special case: gettimeofday
-	{
-		double time_start = gettimeofday_double();
-		for (j = 0; j < num_iterations; j++) {
-			gettimeofday(&now, NULL);
-		}
-		double time_end = gettimeofday_double();
-		printf("gettimeofday : %f nanoseconds\n", (time_end - time_start) * 1000000000.0 / num_iterations);
+	tsc_latency_init(&lat);
+	for (j = 0; j < num_iterations; j++) {
+		uint64_t begin = tsc_latency_begin();
+		gettimeofday(&now, NULL);
+		tsc_latency_add(&lat, begin, tsc_latency_end());
 	}
-	
+	report_latency("gettimeofday", &lat, histogram_fp);
+
 #ifdef HAVE_RDTSC
-	{
-		double time_start = gettimeofday_double();
-		for (j = 0; j < num_iterations; j++) {
-			RDTSC(tsc);
-		}
-		double time_end = gettimeofday_double();
-		printf("RDTSC : %f nanoseconds\n", (time_end - time_start) * 1000000000.0 / num_iterations);
+	tsc_latency_init(&lat);
+	for (j = 0; j < num_iterations; j++) {
+		uint64_t begin = tsc_latency_begin();
+		RDTSC(tsc);
+		tsc_latency_add(&lat, begin, tsc_latency_end());
 	}
+	report_latency("RDTSC", &lat, histogram_fp);
 #endif
+
+	printf("\n");
+	tsc_latency_print_overhead(stdout, &lat);
+	if (histogram_fp) {
+		fclose(histogram_fp);
+	}
 	return 0;
 }
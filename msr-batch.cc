@@ -0,0 +1,258 @@
+/*
+ * Batched MSR reads
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "msr-batch.h"
+#include "uring-read.h"
+#include "rapl.h"
+
+#define MSR_BATCH_DEVICE "/dev/cpu/msr_batch"
+
+// Size of the submission queue, larger batches are submitted in several chunks
+#define MSR_BATCH_URING_ENTRIES 256
+
+/* Interface of the msr-safe batch device, the layout matches msr_batch.h of msr-safe */
+struct msr_batch_op {
+	uint16_t cpu;
+	uint16_t isrdmsr;
+	int32_t err;
+	uint32_t msr;
+	uint64_t msrdata;
+	uint64_t wmask;
+};
+
+struct msr_batch_array {
+	uint32_t numops;
+	struct msr_batch_op *ops;
+};
+
+#define X86_IOC_MSR_BATCH	_IOWR('c', 0xA2, struct msr_batch_array)
+
+struct msr_cpu_file {
+	int cpu;
+	int fd;
+};
+
+struct msr_batch {
+	int method;
+	// The batch device of msr-safe
+	int batch_fd;
+	int num_ops;
+	int max_ops;
+	// The reads in the format of the batch ioctl, also used by the pread method
+	struct msr_batch_op *ops;
+	// MSR file of each read for the pread and io_uring methods
+	int *op_fds;
+	// Requests and results of the io_uring method
+	struct uring_reader *ring;
+	struct uring_read *reads;
+	int *results;
+	// Open MSR files, one per CPU
+	int num_files;
+	int max_files;
+	struct msr_cpu_file *files;
+};
+
+struct msr_batch *msr_batch_create(int method) {
+	struct msr_batch *batch = (struct msr_batch *)calloc(1, sizeof(*batch));
+	batch->method = method;
+	batch->batch_fd = -1;
+	
+	if (method == MSR_BATCH_URING || (method == MSR_BATCH_AUTO && uring_requested())) {
+		batch->ring = uring_reader_create(MSR_BATCH_URING_ENTRIES);
+		if (batch->ring) {
+			batch->method = MSR_BATCH_URING;
+			return batch;
+		} else if (method == MSR_BATCH_URING) {
+			free(batch);
+			return NULL;
+		}
+		fprintf(stderr, "Warning: io_uring is not available, reading the MSRs synchronously\n");
+	}
+	if (method == MSR_BATCH_AUTO || method == MSR_BATCH_IOCTL) {
+		batch->batch_fd = open(MSR_BATCH_DEVICE, O_RDWR);
+		if (batch->batch_fd >= 0) {
+			batch->method = MSR_BATCH_IOCTL;
+		} else if (method == MSR_BATCH_IOCTL) {
+			perror("open");
+			fprintf(stderr, "Trying to open %s, is the msr-safe module loaded?\n", MSR_BATCH_DEVICE);
+			free(batch);
+			return NULL;
+		} else {
+			batch->method = MSR_BATCH_PREAD;
+		}
+	}
+	
+	return batch;
+}
+
+void msr_batch_destroy(struct msr_batch *batch) {
+	int i;
+	for (i = 0; i < batch->num_files; i++) {
+		close(batch->files[i].fd);
+	}
+	if (batch->batch_fd >= 0) {
+		close(batch->batch_fd);
+	}
+	if (batch->ring) {
+		uring_reader_destroy(batch->ring);
+	}
+	free(batch->results);
+	free(batch->reads);
+	free(batch->files);
+	free(batch->op_fds);
+	free(batch->ops);
+	free(batch);
+}
+
+const char *msr_batch_method(const struct msr_batch *batch) {
+	switch (batch->method) {
+		case MSR_BATCH_IOCTL:
+			return "msr-safe";
+		case MSR_BATCH_URING:
+			return "io_uring";
+		default:
+			return "pread";
+	}
+}
+
+// Returns the MSR file of the CPU, opening it on first use
+static int cpu_file(struct msr_batch *batch, int cpu) {
+	int i;
+	for (i = 0; i < batch->num_files; i++) {
+		if (batch->files[i].cpu == cpu) {
+			return batch->files[i].fd;
+		}
+	}
+	
+	int fd = rapl_msr_open(cpu);
+	if (fd < 0) {
+		return -1;
+	}
+	if (batch->num_files == batch->max_files) {
+		batch->max_files = batch->max_files ? 2 * batch->max_files : 16;
+		batch->files = (struct msr_cpu_file *)realloc(batch->files, batch->max_files * sizeof(struct msr_cpu_file));
+	}
+	batch->files[batch->num_files].cpu = cpu;
+	batch->files[batch->num_files].fd = fd;
+	batch->num_files++;
+	return fd;
+}
+
+int msr_batch_add(struct msr_batch *batch, int cpu, unsigned msr) {
+	int fd = -1;
+	
+	if (batch->method == MSR_BATCH_IOCTL) {
+		if (cpu < 0 || cpu > UINT16_MAX) {
+			fprintf(stderr, "CPU %d cannot be read through %s\n", cpu, MSR_BATCH_DEVICE);
+			return -1;
+		}
+	} else if ((fd = cpu_file(batch, cpu)) < 0) {
+		return -1;
+	}
+	
+	if (batch->num_ops == batch->max_ops) {
+		batch->max_ops = batch->max_ops ? 2 * batch->max_ops : 16;
+		batch->ops = (struct msr_batch_op *)realloc(batch->ops, batch->max_ops * sizeof(struct msr_batch_op));
+		batch->op_fds = (int *)realloc(batch->op_fds, batch->max_ops * sizeof(int));
+		if (batch->method == MSR_BATCH_URING) {
+			batch->reads = (struct uring_read *)realloc(batch->reads, batch->max_ops * sizeof(struct uring_read));
+			batch->results = (int *)realloc(batch->results, batch->max_ops * sizeof(int));
+		}
+	}
+	struct msr_batch_op *op = &batch->ops[batch->num_ops];
+	memset(op, 0, sizeof(*op));
+	op->cpu = cpu;
+	op->isrdmsr = 1;
+	op->msr = msr;
+	batch->op_fds[batch->num_ops] = fd;
+	return batch->num_ops++;
+}
+
+void msr_batch_clear(struct msr_batch *batch) {
+	batch->num_ops = 0;
+}
+
+int msr_batch_size(const struct msr_batch *batch) {
+	return batch->num_ops;
+}
+
+bool msr_batch_read(struct msr_batch *batch) {
+	int i;
+	
+	if (batch->num_ops == 0) {
+		return true;
+	}
+	if (batch->method == MSR_BATCH_IOCTL) {
+		struct msr_batch_array array;
+		array.numops = batch->num_ops;
+		array.ops = batch->ops;
+		for (i = 0; i < batch->num_ops; i++) {
+			batch->ops[i].err = 0;
+		}
+		if (ioctl(batch->batch_fd, X86_IOC_MSR_BATCH, &array) < 0) {
+			// A failed read is reported in its err field, anything else means the whole batch failed
+			int err = errno;
+			for (i = 0; i < batch->num_ops; i++) {
+				if (batch->ops[i].err != 0) {
+					return true;
+				}
+			}
+			errno = err;
+			perror("ioctl(X86_IOC_MSR_BATCH)");
+			for (i = 0; i < batch->num_ops; i++) {
+				batch->ops[i].err = -err;
+			}
+			return false;
+		}
+		return true;
+	}
+	
+	if (batch->method == MSR_BATCH_URING) {
+		for (i = 0; i < batch->num_ops; i++) {
+			batch->reads[i].fd = batch->op_fds[i];
+			batch->reads[i].buf = &batch->ops[i].msrdata;
+			batch->reads[i].len = sizeof(batch->ops[i].msrdata);
+			batch->reads[i].offset = batch->ops[i].msr;
+		}
+		if (!uring_read_batch(batch->ring, batch->reads, batch->num_ops, batch->results)) {
+			for (i = 0; i < batch->num_ops; i++) {
+				batch->ops[i].err = -EIO;
+			}
+			return false;
+		}
+		for (i = 0; i < batch->num_ops; i++) {
+			batch->ops[i].err = batch->results[i] == sizeof(batch->ops[i].msrdata) ? 0 : (batch->results[i] < 0 ? batch->results[i] : -EIO);
+		}
+		return true;
+	}
+	
+	for (i = 0; i < batch->num_ops; i++) {
+		struct msr_batch_op *op = &batch->ops[i];
+		ssize_t len = pread(batch->op_fds[i], &op->msrdata, sizeof(op->msrdata), op->msr);
+		if (len == sizeof(op->msrdata)) {
+			op->err = 0;
+		} else {
+			op->err = len < 0 ? -errno : -EIO;
+		}
+	}
+	return true;
+}
+
+bool msr_batch_ok(const struct msr_batch *batch, int index) {
+	return batch->ops[index].err == 0;
+}
+
+uint64_t msr_batch_value(const struct msr_batch *batch, int index) {
+	return batch->ops[index].msrdata;
+}
@@ -0,0 +1,52 @@
+/*
+ * Batched MSR reads
+ *
+ * Collects many (CPU, register) reads and performs them together. With the
+ * msr-safe driver the whole batch is a single ioctl on /dev/cpu/msr_batch.
+ * Otherwise each register is read with pread() from /dev/cpu/N/msr. The stock
+ * msr driver selects the register with the file offset, so readv() cannot
+ * read more than one register per call. Setting RAPL_IO_ENGINE=uring submits
+ * the preads of a batch through io_uring instead (see uring-read.h).
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef MSR_BATCH_H
+#define MSR_BATCH_H
+
+#include <stdint.h>
+
+/* How the reads of a batch are performed */
+#define MSR_BATCH_AUTO		0	/* io_uring if requested, then msr-safe if it is available, pread otherwise */
+#define MSR_BATCH_IOCTL		1	/* msr-safe batch ioctl */
+#define MSR_BATCH_PREAD		2	/* one pread() per register */
+#define MSR_BATCH_URING		3	/* all preads submitted at once through io_uring */
+
+struct msr_batch;
+
+// Returns NULL if the requested method is not available
+struct msr_batch *msr_batch_create(int method);
+void msr_batch_destroy(struct msr_batch *batch);
+
+// Name of the method used by the batch
+const char *msr_batch_method(const struct msr_batch *batch);
+
+// Add a read of the register on the CPU, returns the index of the read or -1 on failure
+int msr_batch_add(struct msr_batch *batch, int cpu, unsigned msr);
+
+// Remove all reads, the MSR files of the CPUs are kept open
+void msr_batch_clear(struct msr_batch *batch);
+
+int msr_batch_size(const struct msr_batch *batch);
+
+/*
+ * Perform all reads of the batch. Returns false if the batch could not be
+ * performed at all, in which case every read is marked as failed.
+ * Individual reads are checked with msr_batch_ok().
+ */
+bool msr_batch_read(struct msr_batch *batch);
+
+bool msr_batch_ok(const struct msr_batch *batch, int index);
+uint64_t msr_batch_value(const struct msr_batch *batch, int index);
+
+#endif
@@ -29,6 +29,9 @@
 #include <string.h>
 #include <sched.h>
 
+#include "rapl.h"
+#include "util.h"
+
 #define MSR_RAPL_POWER_UNIT		0x606
 
 /*
@@ -72,137 +75,6 @@
 #define TIME_UNIT_OFFSET	0x10
 #define TIME_UNIT_MASK		0xF000
 
-static int open_msr(int core) {
-	
-	char msr_filename[BUFSIZ];
-	int fd;
-	
-	sprintf(msr_filename, "/dev/cpu/%d/msr", core);
-	fd = open(msr_filename, O_RDONLY);
-	if ( fd < 0 ) {
-		if ( errno == ENXIO ) {
-			fprintf(stderr, "rdmsr: No CPU %d\n", core);
-			exit(2);
-		} else if ( errno == EIO ) {
-			fprintf(stderr, "rdmsr: CPU %d doesn't support MSRs\n", core);
-			exit(3);
-		} else {
-			perror("rdmsr:open");
-			fprintf(stderr,"Trying to open %s\n",msr_filename);
-			exit(127);
-		}
-	}
-	
-	return fd;
-}
-
-#if 1
-static uint64_t read_msr(int fd, int which) {
-	uint64_t data;
-	
-	if (pread(fd, &data, sizeof(data), which) != sizeof(data)) {
-		perror("rdmsr:pread");
-		exit(127);
-	}
-	
-	return data;
-}
-#else
-static uint64_t read_msr(int fd, int which) {
-	uint64_t data;
-	
-	if (lseek(fd, which, SEEK_SET) == -1) {
-		perror("lseek");
-		exit(127);
-	}
-	
-	if (read(fd, &data, sizeof(data)) != sizeof(data)) {
-		perror("read");
-		exit(127);
-	}
-	
-	return data;
-}
-#endif
-
-#define CPU_SANDYBRIDGE		42
-#define CPU_SANDYBRIDGE_EP	45
-#define CPU_IVYBRIDGE		58
-#define CPU_IVYBRIDGE_EP	62
-#define CPU_HASWELL		60
-
-static int detect_cpu(void) {
-	
-	FILE *fff;
-	
-	int family,model=-1;
-	char buffer[BUFSIZ],*result;
-	char vendor[BUFSIZ];
-	
-	fff=fopen("/proc/cpuinfo","r");
-	if (fff==NULL) return -1;
-	
-	while(1) {
-		result=fgets(buffer,BUFSIZ,fff);
-		if (result==NULL) break;
-		
-		if (!strncmp(result,"vendor_id",8)) {
-			sscanf(result,"%*s%*s%s",vendor);
-			
-			if (strncmp(vendor,"GenuineIntel",12)) {
-				printf("%s not an Intel chip\n",vendor);
-				return -1;
-			}
-		}
-		
-		if (!strncmp(result,"cpu family",10)) {
-			sscanf(result,"%*s%*s%*s%d",&family);
-			if (family!=6) {
-				printf("Wrong CPU family %d\n",family);
-				return -1;
-			}
-		}
-		
-		if (!strncmp(result,"model",5)) {
-			sscanf(result,"%*s%*s%d",&model);
-		}
-		
-	}
-	
-	fclose(fff);
-	
-	switch(model) {
-		case CPU_SANDYBRIDGE:
-			printf("Found Sandybridge CPU\n");
-			break;
-		case CPU_SANDYBRIDGE_EP:
-			printf("Found Sandybridge-EP CPU\n");
-			break;
-		case CPU_IVYBRIDGE:
-			printf("Found Ivybridge CPU\n");
-			break;
-		case CPU_IVYBRIDGE_EP:
-			printf("Found Ivybridge-EP CPU\n");
-			break;
-		case CPU_HASWELL:
-			printf("Found Haswell CPU\n");
-			break;
-		default:	printf("Unsupported model %d\n",model);
-		model=-1;
-		break;
-	}
-	
-	return model;
-}
-
-static int do_affinity(int core) {
-	cpu_set_t mask;
-	CPU_ZERO(&mask);
-	CPU_SET(core, &mask);
-	int result = sched_setaffinity(0, sizeof(mask), &mask);
-	return result >= 0;
-}
-
 int main(int argc, char **argv) {
 	
 	int fd = -1;
@@ -210,7 +82,6 @@ int main(int argc, char **argv) {
 	int c = 0;
 	uint64_t result = 0;
 	int cpu_model = -1;
-	unsigned capab = 0;
 	
 	opterr=0;
 	
@@ -227,17 +98,22 @@ int main(int argc, char **argv) {
 	
 	do_affinity(core);
 	
-	cpu_model=detect_cpu();
+	cpu_model=rapl_detect_cpu();
 	if (cpu_model<0) {
 		printf("Unsupported CPU type\n");
 		return -1;
 	}
 	
-	fd=open_msr(core);
+	fd=rapl_msr_open(core);
+	if (fd<0) {
+		exit(127);
+	}
 	
 	// Read MSR_PERF_STATUS
 	const double voltage_units = 0.0001220703125; // From Intel's manual: 1.0 / (2^13)
-	result = read_msr(fd, MSR_PERF_STATUS);
+	if (!rapl_msr_read(fd, MSR_PERF_STATUS, &result)) {
+		exit(127);
+	}
 	printf("MSR_PERF_STATUS reads %016llx\n", (unsigned long long)result);
 	// Shift by 32 bits and take 16 bits
 	unsigned voltage = (result >> 32) & 0xFFFF;
@@ -246,7 +122,6 @@ int main(int argc, char **argv) {
 	// Kill compiler warnings
 	(void)argc;
 	(void)argv;
-	(void)capab;
 	(void)result;
 	
 	return 0;
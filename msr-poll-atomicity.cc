@@ -42,6 +42,9 @@
 #include <string.h>
 #include <sched.h>
 
+#include "rapl.h"
+#include "util.h"
+
 #define MSR_RAPL_POWER_UNIT		0x606
 
 /*
@@ -82,49 +85,6 @@
 #define TIME_UNIT_OFFSET	0x10
 #define TIME_UNIT_MASK		0xF000
 
-static int open_msr(int core) {
-	
-	char msr_filename[BUFSIZ];
-	int fd;
-	
-	sprintf(msr_filename, "/dev/cpu/%d/msr", core);
-	fd = open(msr_filename, O_RDONLY);
-	if ( fd < 0 ) {
-		if ( errno == ENXIO ) {
-			fprintf(stderr, "rdmsr: No CPU %d\n", core);
-			exit(2);
-		} else if ( errno == EIO ) {
-			fprintf(stderr, "rdmsr: CPU %d doesn't support MSRs\n", core);
-			exit(3);
-		} else {
-			perror("rdmsr:open");
-			fprintf(stderr,"Trying to open %s\n",msr_filename);
-			exit(127);
-		}
-	}
-	
-	return fd;
-}
-
-static uint64_t read_msr(int fd, int which) {
-	uint64_t data;
-	
-	if (pread(fd, &data, sizeof(data), which) != sizeof(data)) {
-		perror("rdmsr:pread");
-		exit(127);
-	}
-	
-	return data;
-}
-
-static int do_affinity(int core) {
-	cpu_set_t mask;
-	CPU_ZERO(&mask);
-	CPU_SET(core, &mask);
-	int result = sched_setaffinity(0, sizeof(mask), &mask);
-	return result >= 0;
-}
-
 static void timedelta(struct timespec *result, struct timespec *a, struct timespec *b) {
 	time_t sec_delta = a->tv_sec - b->tv_sec;
 	long nsec_delta = a->tv_nsec - b->tv_nsec;
@@ -160,7 +120,10 @@ int main(int argc, char **argv) {
 	
 	do_affinity(core);
 	
-	fd=open_msr(core);
+	fd=rapl_msr_open(core);
+	if (fd<0) {
+		exit(127);
+	}
 	
 	// Order for checking RAPL registers
 	//const int first_register = MSR_PKG_ENERGY_STATUS; const int second_register = MSR_DRAM_ENERGY_STATUS;
@@ -175,8 +138,14 @@ int main(int argc, char **argv) {
 	std::vector<double> second_update_times;
 	first_update_times.reserve(MAX_UPDATES);
 	second_update_times.reserve(MAX_UPDATES);
-	uint64_t prev_energy_first = read_msr(fd, first_register);
-	uint64_t prev_energy_second = read_msr(fd, second_register);
+	uint64_t prev_energy_first = 0;
+	if (!rapl_msr_read(fd, first_register, &prev_energy_first)) {
+		exit(127);
+	}
+	uint64_t prev_energy_second = 0;
+	if (!rapl_msr_read(fd, second_register, &prev_energy_second)) {
+		exit(127);
+	}
 	struct timespec tstart = {0, 0};
 	clock_gettime(CLOCK_REALTIME, &tstart);
 	struct timespec tnow = {0, 0};
@@ -186,7 +155,9 @@ int main(int argc, char **argv) {
 	long num_updates = 0;
 	long i;
 	for (i = 0; num_updates < MAX_UPDATES; i++) {
-		first_energy = read_msr(fd, first_register);
+		if (!rapl_msr_read(fd, first_register, &first_energy)) {
+			exit(127);
+		}
 		if (first_energy != prev_energy_first) {
 			clock_gettime(CLOCK_REALTIME, &tnow);
 			timedelta(&tdelta, &tnow, &tstart);
@@ -194,7 +165,9 @@ int main(int argc, char **argv) {
 			prev_energy_first = first_energy;
 			num_updates = std::min(first_update_times.size(), second_update_times.size());
 		}
-		second_energy = read_msr(fd, second_register);
+		if (!rapl_msr_read(fd, second_register, &second_energy)) {
+			exit(127);
+		}
 		if (second_energy != prev_energy_second) {
 			clock_gettime(CLOCK_REALTIME, &tnow);
 			timedelta(&tdelta, &tnow, &tstart);
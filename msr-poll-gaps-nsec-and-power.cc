@@ -2,6 +2,9 @@
  * msr-poll-gaps.cc
  * Find the average gap between RAPL updates by polling via MSR driver.
  *
+ * Usage: ./msr-poll-gaps-nsec-and-power [ -c <core> ] [ -t <duration> ] [ -r <capture file> ]
+ * With -r every read is also written to a capture file for capture-replay.
+ *
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
 
@@ -42,6 +45,10 @@
 #include <string.h>
 #include <sched.h>
 
+#include "rapl.h"
+#include "util.h"
+#include "read-capture.h"
+
 #define MSR_RAPL_POWER_UNIT		0x606
 
 /*
@@ -82,49 +89,6 @@
 #define TIME_UNIT_OFFSET	0x10
 #define TIME_UNIT_MASK		0xF000
 
-static int open_msr(int core) {
-	
-	char msr_filename[BUFSIZ];
-	int fd;
-	
-	sprintf(msr_filename, "/dev/cpu/%d/msr", core);
-	fd = open(msr_filename, O_RDONLY);
-	if ( fd < 0 ) {
-		if ( errno == ENXIO ) {
-			fprintf(stderr, "rdmsr: No CPU %d\n", core);
-			exit(2);
-		} else if ( errno == EIO ) {
-			fprintf(stderr, "rdmsr: CPU %d doesn't support MSRs\n", core);
-			exit(3);
-		} else {
-			perror("rdmsr:open");
-			fprintf(stderr,"Trying to open %s\n",msr_filename);
-			exit(127);
-		}
-	}
-	
-	return fd;
-}
-
-static uint64_t read_msr(int fd, int which) {
-	uint64_t data;
-	
-	if (pread(fd, &data, sizeof(data), which) != sizeof(data)) {
-		perror("rdmsr:pread");
-		exit(127);
-	}
-	
-	return data;
-}
-
-static int do_affinity(int core) {
-	cpu_set_t mask;
-	CPU_ZERO(&mask);
-	CPU_SET(core, &mask);
-	int result = sched_setaffinity(0, sizeof(mask), &mask);
-	return result >= 0;
-}
-
 static void timedelta(struct timespec *result, struct timespec *a, struct timespec *b) {
 	time_t sec_delta = a->tv_sec - b->tv_sec;
 	long nsec_delta = a->tv_nsec - b->tv_nsec;
@@ -146,10 +110,12 @@ int main(int argc, char **argv) {
 	int c = 0;
 	uint64_t result = 0;
 	int i = 0, iteration = 0, duration = 1;
+	const char *capture_file = NULL;
+	struct capture *capture = NULL;
 	
 	opterr=0;
 	
-	while ((c = getopt (argc, argv, "c:t:")) != -1) {
+	while ((c = getopt (argc, argv, "c:t:r:")) != -1) {
 		switch (c)
 		{
 			case 'c':
@@ -158,6 +124,9 @@ int main(int argc, char **argv) {
 			case 't':
 				duration = atoi(optarg);
 				break;
+			case 'r':
+				capture_file = optarg;
+				break;
 			default:
 				exit(-1);
 		}
@@ -165,10 +134,26 @@ int main(int argc, char **argv) {
 	
 	do_affinity(core);
 	
-	fd=open_msr(core);
+	fd=rapl_msr_open(core);
+	if (fd<0) {
+		exit(127);
+	}
+	
+	if (capture_file) {
+		if (!(capture = capture_open(capture_file, "msr-poll-gaps-nsec-and-power", core))) {
+			exit(EXIT_FAILURE);
+		}
+		capture_add_register(capture, "PKG_ENERGY_STATUS", MSR_PKG_ENERGY_STATUS, 32);
+	}
 	
 	// Benchmark MSR register reads
-	uint64_t prev_energy = read_msr(fd, MSR_PKG_ENERGY_STATUS);
+	uint64_t prev_energy = 0;
+	if (!rapl_msr_read(fd, MSR_PKG_ENERGY_STATUS, &prev_energy)) {
+		exit(127);
+	}
+	if (capture) {
+		capture_read(capture, 0, prev_energy);
+	}
 	struct timespec tstart = {0, 0};
 	clock_gettime(CLOCK_REALTIME, &tstart);
 	struct timespec tprev = {0, 0};
@@ -182,7 +167,12 @@ int main(int argc, char **argv) {
 	double biggest_gap = 0.0;
 	int num_gaps = -1;
 	for (iteration = 0; num_gaps < duration * MAX_GAPS; iteration++) {
-		result = read_msr(fd, MSR_PKG_ENERGY_STATUS);
+		if (!rapl_msr_read(fd, MSR_PKG_ENERGY_STATUS, &result)) {
+			exit(127);
+		}
+		if (capture) {
+			capture_read(capture, 0, result);
+		}
 		if (result != prev_energy) {
 			power_delta = (uint32_t)result - (uint32_t)prev_energy;
 			prev_energy = result;
@@ -203,6 +193,10 @@ int main(int argc, char **argv) {
 	}
 	
 	clock_gettime(CLOCK_REALTIME, &tnow);
+	if (capture) {
+		capture_close(capture);
+		printf("Wrote the reads to %s\n", capture_file);
+	}
 	struct timespec ttotal = {0, 0};
 	timedelta(&ttotal, &tnow, &tstart);
 	double time_spent = timespec_to_double(&ttotal);
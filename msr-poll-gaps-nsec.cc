@@ -5,7 +5,6 @@
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
 
-#include <vector>
 #include <time.h>
 
 /* The number of gaps to be observed */
@@ -42,6 +41,11 @@
 #include <string.h>
 #include <sched.h>
 
+#include "rapl.h"
+#include "util.h"
+#include "stream-stats.h"
+#include "gap-writer.h"
+
 #define MSR_RAPL_POWER_UNIT		0x606
 
 /*
@@ -82,49 +86,6 @@
 #define TIME_UNIT_OFFSET	0x10
 #define TIME_UNIT_MASK		0xF000
 
-static int open_msr(int core) {
-	
-	char msr_filename[BUFSIZ];
-	int fd;
-	
-	sprintf(msr_filename, "/dev/cpu/%d/msr", core);
-	fd = open(msr_filename, O_RDONLY);
-	if ( fd < 0 ) {
-		if ( errno == ENXIO ) {
-			fprintf(stderr, "rdmsr: No CPU %d\n", core);
-			exit(2);
-		} else if ( errno == EIO ) {
-			fprintf(stderr, "rdmsr: CPU %d doesn't support MSRs\n", core);
-			exit(3);
-		} else {
-			perror("rdmsr:open");
-			fprintf(stderr,"Trying to open %s\n",msr_filename);
-			exit(127);
-		}
-	}
-	
-	return fd;
-}
-
-static uint64_t read_msr(int fd, int which) {
-	uint64_t data;
-	
-	if (pread(fd, &data, sizeof(data), which) != sizeof(data)) {
-		perror("rdmsr:pread");
-		exit(127);
-	}
-	
-	return data;
-}
-
-static int do_affinity(int core) {
-	cpu_set_t mask;
-	CPU_ZERO(&mask);
-	CPU_SET(core, &mask);
-	int result = sched_setaffinity(0, sizeof(mask), &mask);
-	return result >= 0;
-}
-
 static void timedelta(struct timespec *result, struct timespec *a, struct timespec *b) {
 	time_t sec_delta = a->tv_sec - b->tv_sec;
 	long nsec_delta = a->tv_nsec - b->tv_nsec;
@@ -145,7 +106,8 @@ int main(int argc, char **argv) {
 	int core = 0;
 	int c = 0;
 	uint64_t result = 0;
-	int i = 0, iteration = 0, duration = 1;
+	unsigned long long iteration = 0;
+	int duration = 1;
 	
 	opterr=0;
 	
@@ -165,23 +127,33 @@ int main(int argc, char **argv) {
 	
 	do_affinity(core);
 	
-	fd=open_msr(core);
+	fd=rapl_msr_open(core);
+	if (fd<0) {
+		exit(127);
+	}
+	
+	// The gaps are written out by a separate thread, so that the run length is not limited by memory
+	static struct gap_writer writer;
+	bool write_gaps = gap_writer_open(&writer, "gaps-msr.csv", "%.9f\n");
+	static struct gap_stats gaps;
+	gap_stats_init(&gaps);
 	
 	// Benchmark MSR register reads
-	uint64_t prev_energy = read_msr(fd, MSR_PKG_ENERGY_STATUS);
+	uint64_t prev_energy = 0;
+	if (!rapl_msr_read(fd, MSR_PKG_ENERGY_STATUS, &prev_energy)) {
+		exit(127);
+	}
 	struct timespec tstart = {0, 0};
 	clock_gettime(CLOCK_REALTIME, &tstart);
 	struct timespec tprev = {0, 0};
 	struct timespec tnow = {0, 0};
 	struct timespec tgap = {0, 0};
 	double fgap = 0.0;
-	std::vector<double> gaps;
-	gaps.reserve(duration * MAX_GAPS);
-	double sum_gaps = 0.0;
-	double biggest_gap = 0.0;
-	int num_gaps = -1;
-	for (iteration = 0; num_gaps < duration * MAX_GAPS; iteration++) {
-		result = read_msr(fd, MSR_PKG_ENERGY_STATUS);
+	long long num_gaps = -1;
+	for (iteration = 0; num_gaps < (long long)duration * MAX_GAPS; iteration++) {
+		if (!rapl_msr_read(fd, MSR_PKG_ENERGY_STATUS, &result)) {
+			exit(127);
+		}
 		if (result != prev_energy) {
 			prev_energy = result;
 			clock_gettime(CLOCK_REALTIME, &tnow);
@@ -190,11 +162,10 @@ int main(int argc, char **argv) {
 			num_gaps++;
 			// Ignore the first gap
 			if (num_gaps > 0) {
-				sum_gaps += fgap;
-				if (fgap > biggest_gap) {
-					biggest_gap = fgap;
+				gap_stats_add(&gaps, fgap);
+				if (write_gaps) {
+					gap_writer_add(&writer, fgap);
 				}
-				gaps.push_back(fgap);
 			}
 			memcpy(&tprev, &tnow, sizeof(tprev));
 		}
@@ -204,44 +175,13 @@ int main(int argc, char **argv) {
 	struct timespec ttotal = {0, 0};
 	timedelta(&ttotal, &tnow, &tstart);
 	double time_spent = timespec_to_double(&ttotal);
-	printf("%d iterations in %f seconds.\n", iteration, time_spent);
+	printf("%llu iterations in %f seconds.\n", iteration, time_spent);
 	printf("Polling rate of %f hz.\n", iteration / time_spent);
 	printf("MSR polling delay of %f microseconds.\n", time_spent / iteration * 1000000.0);
-	printf("Biggest gap was %f millisecond.\n", biggest_gap * 1000.0);
-	double avg_gap = sum_gaps / num_gaps;
-	printf("Average gap of %f milliseconds.\n", avg_gap * 1000.0);
-	
-	// Calculate standard deviation
-	double sum_squares = 0.0;
-	for (i = 0; i < num_gaps; i++) {
-		double diff = gaps[i] - avg_gap;
-		sum_squares += diff * diff;
-	}
-	double std_dev = sqrt(sum_squares / num_gaps);
-	printf("Standard deviation of the gaps is %f microseconds.\n", std_dev * 1000000.0);
+	gap_stats_print(stdout, &gaps);
 	
-#if 0
-	// Calculate skewnewss
-	double sum_cubes = 0.0;
-	for (i = 0; i < num_gaps; i++) {
-		double diff = gaps[i] - avg_gap;
-		sum_cubes += diff * diff * diff;
-	}
-	double third_moment = sum_cubes / num_gaps;
-	double skewness = third_moment / pow(std_dev, 3.0);
-	printf("Skewness is %f microseconds.\n", skewness * 1000000.0);
-#endif
-	
-	// Dump the gaps to a file
-	FILE *fp = fopen("gaps-msr.csv", "w");
-	if (!fp) {
-		fprintf(stderr, "Failed to open gaps-msr.csv!\n");
-	} else {
-		printf("Dumping data to gaps-msr.csv\n");
-		for (i = 0; i < num_gaps; i++) {
-			fprintf(fp, "%.9f\n", gaps[i]);
-		}
-		fclose(fp);
+	if (write_gaps) {
+		gap_writer_close(&writer);
 	}
 	
 	// Kill compiler warnings
@@ -5,9 +5,7 @@
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
 
-#include <vector>
-
-/* The number of gaps to be observed */
+/* The default number of gaps to be observed */
 #define MAX_GAPS 1000
 
 /* Read the RAPL registers on a sandybridge-ep machine                */
@@ -41,6 +39,11 @@
 #include <string.h>
 #include <sched.h>
 
+#include "rapl.h"
+#include "util.h"
+#include "stream-stats.h"
+#include "gap-writer.h"
+
 #define MSR_RAPL_POWER_UNIT		0x606
 
 /*
@@ -81,168 +84,6 @@
 #define TIME_UNIT_OFFSET	0x10
 #define TIME_UNIT_MASK		0xF000
 
-static int open_msr(int core) {
-	
-	char msr_filename[BUFSIZ];
-	int fd;
-	
-	sprintf(msr_filename, "/dev/cpu/%d/msr", core);
-	fd = open(msr_filename, O_RDONLY);
-	if ( fd < 0 ) {
-		if ( errno == ENXIO ) {
-			fprintf(stderr, "rdmsr: No CPU %d\n", core);
-			exit(2);
-		} else if ( errno == EIO ) {
-			fprintf(stderr, "rdmsr: CPU %d doesn't support MSRs\n", core);
-			exit(3);
-		} else {
-			perror("rdmsr:open");
-			fprintf(stderr,"Trying to open %s\n",msr_filename);
-			exit(127);
-		}
-	}
-	
-	return fd;
-}
-
-#if 1
-static uint64_t read_msr(int fd, int which) {
-	uint64_t data;
-	
-	if (pread(fd, &data, sizeof(data), which) != sizeof(data)) {
-		perror("rdmsr:pread");
-		exit(127);
-	}
-	
-	return data;
-}
-#else
-static uint64_t read_msr(int fd, int which) {
-	uint64_t data;
-	
-	if (lseek(fd, which, SEEK_SET) == -1) {
-		perror("lseek");
-		exit(127);
-	}
-	
-	if (read(fd, &data, sizeof(data)) != sizeof(data)) {
-		perror("read");
-		exit(127);
-	}
-	
-	return data;
-}
-#endif
-
-#define CPU_SANDYBRIDGE		42
-#define CPU_SANDYBRIDGE_EP	45
-#define CPU_IVYBRIDGE		58
-#define CPU_IVYBRIDGE_EP	62
-#define CPU_HASWELL		60
-
-static int detect_cpu(void) {
-	
-	FILE *fff;
-	
-	int family,model=-1;
-	char buffer[BUFSIZ],*result;
-	char vendor[BUFSIZ];
-	
-	fff=fopen("/proc/cpuinfo","r");
-	if (fff==NULL) return -1;
-	
-	while(1) {
-		result=fgets(buffer,BUFSIZ,fff);
-		if (result==NULL) break;
-		
-		if (!strncmp(result,"vendor_id",8)) {
-			sscanf(result,"%*s%*s%s",vendor);
-			
-			if (strncmp(vendor,"GenuineIntel",12)) {
-				printf("%s not an Intel chip\n",vendor);
-				return -1;
-			}
-		}
-		
-		if (!strncmp(result,"cpu family",10)) {
-			sscanf(result,"%*s%*s%*s%d",&family);
-			if (family!=6) {
-				printf("Wrong CPU family %d\n",family);
-				return -1;
-			}
-		}
-		
-		if (!strncmp(result,"model",5)) {
-			sscanf(result,"%*s%*s%d",&model);
-		}
-		
-	}
-	
-	fclose(fff);
-	
-	switch(model) {
-		case CPU_SANDYBRIDGE:
-			printf("Found Sandybridge CPU\n");
-			break;
-		case CPU_SANDYBRIDGE_EP:
-			printf("Found Sandybridge-EP CPU\n");
-			break;
-		case CPU_IVYBRIDGE:
-			printf("Found Ivybridge CPU\n");
-			break;
-		case CPU_IVYBRIDGE_EP:
-			printf("Found Ivybridge-EP CPU\n");
-			break;
-		case CPU_HASWELL:
-			printf("Found Haswell CPU\n");
-			break;
-		default:	printf("Unsupported model %d\n",model);
-		model=-1;
-		break;
-	}
-	
-	return model;
-}
-
-#define RAPL_HAVE_PKG_ENERGY_STATUS		0x0001
-#define RAPL_HAVE_PP0_ENERGY_STATUS		0x0002
-#define RAPL_HAVE_PP1_ENERGY_STATUS		0x0004
-#define RAPL_HAVE_DRAM_ENERGY_STATUS		0x0008
-#define RAPL_HAVE_PKG_PERF_STATUS		0x0010
-#define RAPL_HAVE_PP0_PERF_STATUS		0x0020
-#define RAPL_HAVE_PP1_PERF_STATUS		0x0040
-#define RAPL_HAVE_DRAM_PERF_STATUS		0x0080
-
-static unsigned detect_rapl(int cpu_model) {
-	unsigned capab = (RAPL_HAVE_PKG_ENERGY_STATUS | RAPL_HAVE_PP0_ENERGY_STATUS);
-	
-	/* only available on *Bridge-EP */
-	if ((cpu_model==CPU_SANDYBRIDGE_EP) || (cpu_model==CPU_IVYBRIDGE_EP)) {
-		capab |= (RAPL_HAVE_PKG_PERF_STATUS | RAPL_HAVE_PP0_PERF_STATUS);
-	}
-	
-	/* not available on *Bridge-EP */
-	if ((cpu_model==CPU_SANDYBRIDGE) || (cpu_model==CPU_IVYBRIDGE) || (cpu_model==CPU_HASWELL)) {
-		capab |= RAPL_HAVE_PP1_ENERGY_STATUS;
-	}
-	
-	/* Despite documentation saying otherwise, it looks like */
-	/* You can get DRAM readings on regular Haswell          */
-	if ((cpu_model==CPU_SANDYBRIDGE_EP) || (cpu_model==CPU_IVYBRIDGE_EP) || (cpu_model==CPU_HASWELL)) {
-		capab |= RAPL_HAVE_DRAM_ENERGY_STATUS;
-	}
-	
-	return capab;
-}
-
-static int do_affinity(int core) {
-	cpu_set_t mask;
-	CPU_ZERO(&mask);
-	CPU_SET(core, &mask);
-	int result = sched_setaffinity(0, sizeof(mask), &mask);
-	return result >= 0;
-}
-
 static double gettimeofday_double() {
 	struct timeval now;
 	gettimeofday(&now, NULL);
@@ -256,17 +97,20 @@ int main(int argc, char **argv) {
 	int c = 0;
 	uint64_t result = 0;
 	int cpu_model = -1;
-	unsigned capab = 0;
-	int i = 0, iteration = 0;
+	unsigned long long iteration = 0;
+	long long max_gaps = MAX_GAPS;
 	
 	opterr=0;
 	
-	while ((c = getopt (argc, argv, "c:")) != -1) {
+	while ((c = getopt (argc, argv, "c:n:")) != -1) {
 		switch (c)
 		{
 			case 'c':
 				core = atoi(optarg);
 				break;
+			case 'n':
+				max_gaps = atoll(optarg);
+				break;
 			default:
 				exit(-1);
 		}
@@ -274,29 +118,37 @@ int main(int argc, char **argv) {
 	
 	do_affinity(core);
 	
-	cpu_model=detect_cpu();
+	cpu_model=rapl_detect_cpu();
 	if (cpu_model<0) {
 		printf("Unsupported CPU type\n");
 		return -1;
 	}
 	
-	capab = detect_rapl(cpu_model);
+	fd=rapl_msr_open(core);
+	if (fd<0) {
+		exit(127);
+	}
 	
-	fd=open_msr(core);
+	// The gaps are written out by a separate thread, so that the run length is not limited by memory
+	static struct gap_writer writer;
+	bool write_gaps = gap_writer_open(&writer, "gaps-msr.csv", "%f\n");
+	static struct gap_stats gaps;
+	gap_stats_init(&gaps);
 	
 	// Benchmark MSR register reads
-	uint64_t prev_energy = read_msr(fd, MSR_PKG_ENERGY_STATUS);
+	uint64_t prev_energy = 0;
+	if (!rapl_msr_read(fd, MSR_PKG_ENERGY_STATUS, &prev_energy)) {
+		exit(127);
+	}
 	double fstart = gettimeofday_double();
 	double fprev = fstart;
 	double fnow = fstart;
 	double gap = 0.0;
-	std::vector<double> gaps;
-	gaps.reserve(MAX_GAPS);
-	double sum_gaps = 0.0;
-	double biggest_gap = 0.0;
-	int num_gaps = -1;
-	for (iteration = 0; num_gaps < MAX_GAPS; iteration++) {
-		result = read_msr(fd, MSR_PKG_ENERGY_STATUS);
+	long long num_gaps = -1;
+	for (iteration = 0; num_gaps < max_gaps; iteration++) {
+		if (!rapl_msr_read(fd, MSR_PKG_ENERGY_STATUS, &result)) {
+			exit(127);
+		}
 		if (result != prev_energy) {
 			prev_energy = result;
 			fnow = gettimeofday_double();
@@ -304,10 +156,10 @@ int main(int argc, char **argv) {
 			num_gaps++;
 			// Ignore the first gap
 			if (num_gaps > 0) {
-				sum_gaps += gap;
-				if (gap > biggest_gap)
-					biggest_gap = gap;
-				gaps.push_back(gap);
+				gap_stats_add(&gaps, gap);
+				if (write_gaps) {
+					gap_writer_add(&writer, gap);
+				}
 			}
 			//printf("%lld at %f seconds, %f second gap since previous\n", prev_energy, fnow - fstart, gap);
 			fprev = fnow;
@@ -315,37 +167,18 @@ int main(int argc, char **argv) {
 	}
 	
 	fnow = gettimeofday_double();
-	printf("%d iterations in %f seconds.\n", iteration, fnow - fstart);
+	printf("%llu iterations in %f seconds.\n", iteration, fnow - fstart);
 	printf("Polling rate of %f hz.\n", iteration / (fnow - fstart));
 	printf("PAPI polling delay of %f microseconds.\n", (fnow - fstart) / iteration * 1000000.0);
-	printf("Biggest gap was %f millisecond.\n", biggest_gap * 1000.0);
-	double avg_gap = sum_gaps / num_gaps;
-	printf("Average gap of %f milliseconds.\n", avg_gap * 1000.0);
+	gap_stats_print(stdout, &gaps);
 	
-	// Calculate standard deviation
-	double sum_squares = 0.0;
-	for (i = 0; i < num_gaps; i++) {
-		double diff = gaps[i] - avg_gap;
-		sum_squares += diff * diff;
-	}
-	printf("Standard deviation of the gaps is %f microseconds.\n", sqrt(sum_squares / num_gaps) * 1000000.0);
-	
-	// Dump the gaps to a file
-	FILE *fp = fopen("gaps-msr.csv", "w");
-	if (!fp) {
-		fprintf(stderr, "Failed to open gaps-msr.csv!\n");
-	} else {
-		printf("Dumping data to gaps-msr.csv\n");
-		for (i = 0; i < num_gaps; i++) {
-			fprintf(fp, "%f\n", gaps[i]);
-		}
-		fclose(fp);
+	if (write_gaps) {
+		gap_writer_close(&writer);
 	}
 	
 	// Kill compiler warnings
 	(void)argc;
 	(void)argv;
-	(void)capab;
 	(void)result;
 	
 	return 0;
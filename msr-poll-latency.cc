@@ -15,6 +15,17 @@
 /*                                                                    */
 /* Latency polling modification by:                                   */
 /*   Mikael Hirki <mikael.hirki@aalto.fi>                             */
+/*                                                                    */
+/* Usage: ./msr-poll-latency [ -c <core> ] [ -n <iterations> ]        */
+/*                           [ -b <maximum batch size> ]              */
+/*                           [ -H <histogram file> ]                  */
+/* Also measures the tick duration and the CPU time of reading MSR   */
+/* batches of 1, 4, 16, ... registers spread over the online CPUs,    */
+/* through pread(), io_uring and msr-safe when it is loaded. The      */
+/* energy_uj files of the powercap zones are swept the same way with  */
+/* pread() and io_uring, also when the MSRs cannot be read.           */
+/* Every read is timed with the TSC, see tsc-latency.h, and -H writes */
+/* the latency histograms in nanoseconds as CSV.                      */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +39,13 @@
 #include <math.h>
 #include <string.h>
 #include <sched.h>
+#include <time.h>
+
+#include "rapl.h"
+#include "util.h"
+#include "msr-batch.h"
+#include "uring-read.h"
+#include "tsc-latency.h"
 
 #define MSR_RAPL_POWER_UNIT		0x606
 
@@ -69,193 +87,234 @@
 #define TIME_UNIT_OFFSET	0x10
 #define TIME_UNIT_MASK		0xF000
 
-static int open_msr(int core) {
-	
-	char msr_filename[BUFSIZ];
-	int fd;
+#define POWERCAP_PATH "/sys/class/powercap"
+
+// Upper limit for the number of zones and subzones probed under the powercap directory
+#define POWERCAP_MAX_ZONES	64
+
+// Upper limit for the number of energy_uj files read in the powercap batches
+#define POWERCAP_MAX_FILES	64
+
+// Same queue size as the io_uring method of the MSR batches
+#define POWERCAP_URING_ENTRIES	256
+
+// Longest value of an energy_uj file
+#define POWERCAP_VALUE_SIZE	32
+
+static double thread_cpu_time() {
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void do_batch_latency(int method, int max_batch_size, int num_iterations, FILE *histogram_fp) {
+	int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int batch_size = 0, i = 0;
 	
-	sprintf(msr_filename, "/dev/cpu/%d/msr", core);
-	fd = open(msr_filename, O_RDONLY);
-	if ( fd < 0 ) {
-		if ( errno == ENXIO ) {
-			fprintf(stderr, "rdmsr: No CPU %d\n", core);
-			exit(2);
-		} else if ( errno == EIO ) {
-			fprintf(stderr, "rdmsr: CPU %d doesn't support MSRs\n", core);
-			exit(3);
-		} else {
-			perror("rdmsr:open");
-			fprintf(stderr,"Trying to open %s\n",msr_filename);
-			exit(127);
+	for (batch_size = 1; batch_size <= max_batch_size; batch_size *= 4) {
+		struct msr_batch *batch = msr_batch_create(method);
+		if (!batch) {
+			return;
+		}
+		for (i = 0; i < batch_size; i++) {
+			if (msr_batch_add(batch, i % num_cpus, MSR_PKG_ENERGY_STATUS) < 0) {
+				msr_batch_destroy(batch);
+				return;
+			}
+		}
+		
+		// The same number of registers is read for every batch size
+		int num_batches = num_iterations / batch_size > 0 ? num_iterations / batch_size : 1;
+		static struct tsc_latency lat;
+		tsc_latency_init(&lat);
+		double cpu_begin = thread_cpu_time();
+		for (i = 0; i < num_batches; i++) {
+			uint64_t begin = tsc_latency_begin();
+			msr_batch_read(batch);
+			tsc_latency_add(&lat, begin, tsc_latency_end());
 		}
+		double cpu_end = thread_cpu_time();
+		
+		char name[64];
+		snprintf(name, sizeof(name), "MSR batch (%s) of %d registers", msr_batch_method(batch), batch_size);
+		double batch_latency = tsc_latency_mean_ns(&lat);
+		double batch_cpu_time = (cpu_end - cpu_begin) * 1000000000.0 / num_batches;
+		printf("%s: %f nanoseconds per batch, %f nanoseconds per register, %f nanoseconds of CPU time per batch\n", name, batch_latency, batch_latency / batch_size, batch_cpu_time);
+		tsc_latency_print(stdout, name, &lat);
+		if (histogram_fp) {
+			tsc_latency_dump(histogram_fp, name, &lat);
+		}
+		msr_batch_destroy(batch);
 	}
-	
-	return fd;
 }
 
-#if 1
-static uint64_t read_msr(int fd, int which) {
-	uint64_t data;
+// Open the energy_uj files of the powercap zones and their subzones, returns the number of files
+static int open_powercap_counters(int *fds, int max_fds) {
+	char zone[128], subzone[192], path[256];
+	int num_fds = 0;
 	
-	if (pread(fd, &data, sizeof(data), which) != sizeof(data)) {
-		perror("rdmsr:pread");
-		exit(127);
+	for (int i = 0; i < POWERCAP_MAX_ZONES && num_fds < max_fds; i++) {
+		snprintf(zone, sizeof(zone), POWERCAP_PATH "/intel-rapl:%d", i);
+		snprintf(path, sizeof(path), "%s/energy_uj", zone);
+		if ((fds[num_fds] = open(path, O_RDONLY)) >= 0) {
+			num_fds++;
+		} else if (errno == EACCES) {
+			fprintf(stderr, "Recent kernels only let root read %s\n", path);
+		}
+		for (int j = 0; j < POWERCAP_MAX_ZONES && num_fds < max_fds; j++) {
+			snprintf(subzone, sizeof(subzone), "%s/intel-rapl:%d:%d", zone, i, j);
+			if (access(subzone, F_OK) != 0) {
+				break;
+			}
+			snprintf(path, sizeof(path), "%s/energy_uj", subzone);
+			if ((fds[num_fds] = open(path, O_RDONLY)) >= 0) {
+				num_fds++;
+			}
+		}
 	}
-	
-	return data;
+	return num_fds;
 }
-#else
-static uint64_t read_msr(int fd, int which) {
-	uint64_t data;
-	
-	if (lseek(fd, which, SEEK_SET) == -1) {
-		perror("lseek");
-		exit(127);
-	}
-	
-	if (read(fd, &data, sizeof(data)) != sizeof(data)) {
-		perror("read");
-		exit(127);
+
+static void close_powercap_counters(int *fds, int num_fds) {
+	for (int i = 0; i < num_fds; i++) {
+		close(fds[i]);
 	}
-	
-	return data;
 }
-#endif
-
-#define CPU_SANDYBRIDGE		42
-#define CPU_SANDYBRIDGE_EP	45
-#define CPU_IVYBRIDGE		58
-#define CPU_IVYBRIDGE_EP	62
-#define CPU_HASWELL		60
 
-static int detect_cpu(void) {
-	
-	FILE *fff;
-	
-	int family,model=-1;
-	char buffer[BUFSIZ],*result;
-	char vendor[BUFSIZ];
+/*
+ * Read batches of 1, 4, 16, ... energy_uj files, the files are repeated when
+ * there are fewer of them than reads in a batch. Without io_uring every file
+ * is read with pread() in turn, like the powercap backend does by default.
+ */
+static void do_powercap_latency(bool use_uring, int max_batch_size, int num_iterations, FILE *histogram_fp) {
+	int fds[POWERCAP_MAX_FILES];
+	int batch_size = 0, i = 0, j = 0;
+	struct uring_reader *ring = NULL;
 	
-	fff=fopen("/proc/cpuinfo","r");
-	if (fff==NULL) return -1;
+	int num_files = open_powercap_counters(fds, POWERCAP_MAX_FILES);
+	if (num_files == 0) {
+		printf("Powercap batch (%s): No readable energy_uj files under " POWERCAP_PATH "\n", use_uring ? "io_uring" : "pread");
+		return;
+	}
+	if (use_uring && (ring = uring_reader_create(POWERCAP_URING_ENTRIES)) == NULL) {
+		printf("Powercap batch (io_uring): io_uring is not available\n");
+		close_powercap_counters(fds, num_files);
+		return;
+	}
 	
-	while(1) {
-		result=fgets(buffer,BUFSIZ,fff);
-		if (result==NULL) break;
-		
-		if (!strncmp(result,"vendor_id",8)) {
-			sscanf(result,"%*s%*s%s",vendor);
-			
-			if (strncmp(vendor,"GenuineIntel",12)) {
-				printf("%s not an Intel chip\n",vendor);
-				return -1;
-			}
+	for (batch_size = 1; batch_size <= max_batch_size; batch_size *= 4) {
+		struct uring_read *reads = (struct uring_read *)calloc(batch_size, sizeof(*reads));
+		int *results = (int *)calloc(batch_size, sizeof(*results));
+		char *values = (char *)calloc(batch_size, POWERCAP_VALUE_SIZE);
+		for (i = 0; i < batch_size; i++) {
+			reads[i].fd = fds[i % num_files];
+			reads[i].buf = values + i * POWERCAP_VALUE_SIZE;
+			reads[i].len = POWERCAP_VALUE_SIZE;
+			reads[i].offset = 0;
 		}
 		
-		if (!strncmp(result,"cpu family",10)) {
-			sscanf(result,"%*s%*s%*s%d",&family);
-			if (family!=6) {
-				printf("Wrong CPU family %d\n",family);
-				return -1;
+		// The same number of files is read for every batch size
+		int num_batches = num_iterations / batch_size > 0 ? num_iterations / batch_size : 1;
+		static struct tsc_latency lat;
+		tsc_latency_init(&lat);
+		bool failed = false;
+		double cpu_begin = thread_cpu_time();
+		for (i = 0; i < num_batches; i++) {
+			uint64_t begin = tsc_latency_begin();
+			if (ring) {
+				failed |= !uring_read_batch(ring, reads, batch_size, results);
+			} else {
+				for (j = 0; j < batch_size; j++) {
+					results[j] = (int)pread(reads[j].fd, reads[j].buf, reads[j].len, reads[j].offset);
+				}
 			}
+			tsc_latency_add(&lat, begin, tsc_latency_end());
 		}
-		
-		if (!strncmp(result,"model",5)) {
-			sscanf(result,"%*s%*s%d",&model);
+		double cpu_end = thread_cpu_time();
+		for (j = 0; j < batch_size; j++) {
+			failed |= results[j] <= 0;
 		}
+		free(reads);
+		free(results);
+		free(values);
 		
-	}
-	
-	fclose(fff);
-	
-	switch(model) {
-		case CPU_SANDYBRIDGE:
-			printf("Found Sandybridge CPU\n");
-			break;
-		case CPU_SANDYBRIDGE_EP:
-			printf("Found Sandybridge-EP CPU\n");
-			break;
-		case CPU_IVYBRIDGE:
-			printf("Found Ivybridge CPU\n");
-			break;
-		case CPU_IVYBRIDGE_EP:
-			printf("Found Ivybridge-EP CPU\n");
-			break;
-		case CPU_HASWELL:
-			printf("Found Haswell CPU\n");
+		char name[64];
+		snprintf(name, sizeof(name), "Powercap batch (%s) of %d files", ring ? "io_uring" : "pread", batch_size);
+		if (failed) {
+			printf("%s: Reading the energy_uj files failed\n", name);
 			break;
-		default:	printf("Unsupported model %d\n",model);
-		model=-1;
-		break;
+		}
+		double batch_latency = tsc_latency_mean_ns(&lat);
+		double batch_cpu_time = (cpu_end - cpu_begin) * 1000000000.0 / num_batches;
+		printf("%s: %f nanoseconds per batch, %f nanoseconds per file, %f nanoseconds of CPU time per batch\n", name, batch_latency, batch_latency / batch_size, batch_cpu_time);
+		tsc_latency_print(stdout, name, &lat);
+		if (histogram_fp) {
+			tsc_latency_dump(histogram_fp, name, &lat);
+		}
 	}
 	
-	return model;
+	if (ring) {
+		uring_reader_destroy(ring);
+	}
+	close_powercap_counters(fds, num_files);
 }
 
-#define RAPL_HAVE_PKG_ENERGY_STATUS		0x0001
-#define RAPL_HAVE_PP0_ENERGY_STATUS		0x0002
-#define RAPL_HAVE_PP1_ENERGY_STATUS		0x0004
-#define RAPL_HAVE_DRAM_ENERGY_STATUS		0x0008
-#define RAPL_HAVE_PKG_PERF_STATUS		0x0010
-#define RAPL_HAVE_PP0_PERF_STATUS		0x0020
-#define RAPL_HAVE_PP1_PERF_STATUS		0x0040
-#define RAPL_HAVE_DRAM_PERF_STATUS		0x0080
-
-static unsigned detect_rapl(int cpu_model) {
-	unsigned capab = (RAPL_HAVE_PKG_ENERGY_STATUS | RAPL_HAVE_PP0_ENERGY_STATUS);
+static void do_msr_latency(int fd, int max_batch_size, int num_iterations, FILE *histogram_fp) {
+	uint64_t result = 0;
+	int i = 0;
 	
-	/* only available on *Bridge-EP */
-	if ((cpu_model==CPU_SANDYBRIDGE_EP) || (cpu_model==CPU_IVYBRIDGE_EP)) {
-		capab |= (RAPL_HAVE_PKG_PERF_STATUS | RAPL_HAVE_PP0_PERF_STATUS);
+	// Benchmark MSR register reads
+	static struct tsc_latency lat;
+	tsc_latency_init(&lat);
+	for (i = 0; i < num_iterations; i++) {
+		uint64_t begin = tsc_latency_begin();
+		rapl_msr_read(fd, MSR_PKG_ENERGY_STATUS, &result);
+		tsc_latency_add(&lat, begin, tsc_latency_end());
 	}
 	
-	/* not available on *Bridge-EP */
-	if ((cpu_model==CPU_SANDYBRIDGE) || (cpu_model==CPU_IVYBRIDGE) || (cpu_model==CPU_HASWELL)) {
-		capab |= RAPL_HAVE_PP1_ENERGY_STATUS;
+	printf("MSR read latency: %f nanosecond\n", tsc_latency_mean_ns(&lat));
+	tsc_latency_print(stdout, "MSR read", &lat);
+	tsc_latency_print_overhead(stdout, &lat);
+	if (histogram_fp) {
+		tsc_latency_dump(histogram_fp, "MSR read", &lat);
 	}
 	
-	/* Despite documentation saying otherwise, it looks like */
-	/* You can get DRAM readings on regular Haswell          */
-	if ((cpu_model==CPU_SANDYBRIDGE_EP) || (cpu_model==CPU_IVYBRIDGE_EP) || (cpu_model==CPU_HASWELL)) {
-		capab |= RAPL_HAVE_DRAM_ENERGY_STATUS;
+	// Benchmark batched reads
+	if (access("/dev/cpu/msr_batch", F_OK) == 0) {
+		do_batch_latency(MSR_BATCH_IOCTL, max_batch_size, num_iterations, histogram_fp);
 	}
-	
-	return capab;
-}
-
-static int do_affinity(int core) {
-	cpu_set_t mask;
-	CPU_ZERO(&mask);
-	CPU_SET(core, &mask);
-	int result = sched_setaffinity(0, sizeof(mask), &mask);
-	return result >= 0;
-}
-
-static double gettimeofday_double() {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	return now.tv_sec + now.tv_usec * 0.000001;
+	do_batch_latency(MSR_BATCH_PREAD, max_batch_size, num_iterations, histogram_fp);
+	do_batch_latency(MSR_BATCH_URING, max_batch_size, num_iterations, histogram_fp);
 }
 
 int main(int argc, char **argv) {
-	
+
 	int fd = -1;
 	int core = 0;
 	int c = 0;
-	uint64_t result = 0;
 	int cpu_model = -1;
-	unsigned capab = 0;
-	int i = 0;
 	int num_iterations = 1000000;
+	int max_batch_size = 256;
+	const char *histogram_file = NULL;
+	FILE *histogram_fp = NULL;
 	
 	opterr=0;
 	
-	while ((c = getopt (argc, argv, "c:")) != -1) {
+	while ((c = getopt (argc, argv, "c:n:b:H:")) != -1) {
 		switch (c)
 		{
 			case 'c':
 				core = atoi(optarg);
 				break;
+			case 'n':
+				num_iterations = atoi(optarg);
+				break;
+			case 'b':
+				max_batch_size = atoi(optarg);
+				break;
+			case 'H':
+				histogram_file = optarg;
+				break;
 			default:
 				exit(-1);
 		}
@@ -263,30 +322,37 @@ int main(int argc, char **argv) {
 	
 	do_affinity(core);
 	
-	cpu_model=detect_cpu();
+	if (histogram_file) {
+		histogram_fp = fopen(histogram_file, "w");
+		if (!histogram_fp) {
+			fprintf(stderr, "Failed to open %s!\n", histogram_file);
+			return -1;
+		}
+	}
+	
+	// Without the MSRs only the powercap files are measured
+	cpu_model=rapl_detect_cpu();
 	if (cpu_model<0) {
 		printf("Unsupported CPU type\n");
-		return -1;
+	} else {
+		fd=rapl_msr_open(core);
 	}
 	
-	capab = detect_rapl(cpu_model);
+	if (fd >= 0) {
+		do_msr_latency(fd, max_batch_size, num_iterations, histogram_fp);
+	}
 	
-	fd=open_msr(core);
+	// The powercap files do not need the MSR driver
+	do_powercap_latency(false, max_batch_size, num_iterations, histogram_fp);
+	do_powercap_latency(true, max_batch_size, num_iterations, histogram_fp);
 	
-	// Benchmark MSR register reads
-	double tbegin = gettimeofday_double();
-	for (i = 0; i < num_iterations; i++) {
-		result = read_msr(fd, MSR_PKG_ENERGY_STATUS);
+	if (histogram_fp) {
+		fclose(histogram_fp);
 	}
-	double tend = gettimeofday_double();
-	
-	printf("MSR read latency: %f nanosecond\n", (tend - tbegin) * 1000000000.0 / num_iterations);
 	
 	// Kill compiler warnings
 	(void)argc;
 	(void)argv;
-	(void)capab;
-	(void)result;
 	
-	return 0;
+	return fd >= 0 ? 0 : -1;
 }
@@ -0,0 +1,270 @@
+/*
+ * Per-core temperature reading through the MSR driver
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "msr-temp.h"
+#include "msr-batch.h"
+#include "rapl.h"
+
+struct core_temp_reader;
+
+struct core_temp_worker {
+	struct core_temp_reader *reader;
+	pthread_t thread;
+	// Slice of the CPU list read by this worker, the whole slice is one MSR batch
+	int first;
+	int count;
+	struct msr_batch *batch;
+};
+
+struct core_temp_reader {
+	int num_cpus;
+	short *tjmax;
+	// Slices without a worker thread are read by the calling thread
+	int num_slices;
+	int num_threads;
+	struct core_temp_worker *workers;
+	// Held while the workers are created, the barriers are set up once the thread count is known
+	pthread_mutex_t init_lock;
+	// All threads meet at start before a read and at done after it
+	pthread_barrier_t start;
+	pthread_barrier_t done;
+	// Destination of the current read
+	short *temps;
+	bool stop;
+};
+
+int parse_cpu_list(const char *list, int *cpus, int max_cpus) {
+	const char *p = list;
+	int n = 0;
+	
+	while (*p) {
+		char *end = NULL;
+		long first = strtol(p, &end, 10), last = 0;
+		if (end == p || first < 0) {
+			return -1;
+		}
+		last = first;
+		p = end;
+		if (*p == '-') {
+			p++;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first) {
+				return -1;
+			}
+			p = end;
+		}
+		for (long cpu = first; cpu <= last; cpu++) {
+			if (n == max_cpus) {
+				return -1;
+			}
+			cpus[n++] = cpu;
+		}
+		if (*p == ',') {
+			p++;
+		} else if (*p) {
+			return -1;
+		}
+	}
+	
+	return n;
+}
+
+int online_cpu_list(int *cpus, int max_cpus) {
+	int n = 0, cpu;
+	int num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	
+	for (cpu = 0; cpu < num_cpus && n < max_cpus; cpu++) {
+		char path[64];
+		// cpu0 usually has no online file because it cannot be taken offline
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/online", cpu);
+		FILE *fp = fopen(path, "r");
+		if (fp) {
+			int online = 1;
+			if (fscanf(fp, "%d", &online) != 1) {
+				online = 1;
+			}
+			fclose(fp);
+			if (!online) {
+				continue;
+			}
+		}
+		cpus[n++] = cpu;
+	}
+	
+	return n;
+}
+
+int read_tjmax(int fd) {
+	uint64_t msr_temp_target = 0;
+	if (!rapl_msr_read(fd, MSR_IA32_TEMPERATURE_TARGET, &msr_temp_target)) {
+		return -1;
+	}
+	return temperature_target_to_tjmax(msr_temp_target);
+}
+
+static void read_slice(struct core_temp_reader *reader, struct core_temp_worker *slice) {
+	bool ok = msr_batch_read(slice->batch);
+	int i;
+	for (i = 0; i < slice->count; i++) {
+		const int cpu = slice->first + i;
+		if (ok && msr_batch_ok(slice->batch, i)) {
+			reader->temps[cpu] = therm_status_to_temp(msr_batch_value(slice->batch, i), reader->tjmax[cpu]);
+		} else {
+			reader->temps[cpu] = -1;
+		}
+	}
+}
+
+// Set up the MSR batch of a slice and read TjMax of its CPUs
+static bool open_slice(struct core_temp_reader *reader, struct core_temp_worker *slice, const int *cpus, short default_tjmax) {
+	int i;
+	
+	slice->batch = msr_batch_create(MSR_BATCH_AUTO);
+	for (i = 0; i < slice->count; i++) {
+		if (msr_batch_add(slice->batch, cpus[slice->first + i], MSR_IA32_TEMPERATURE_TARGET) < 0) {
+			return false;
+		}
+	}
+	bool ok = msr_batch_read(slice->batch);
+	for (i = 0; i < slice->count; i++) {
+		int tjmax = -1;
+		if (ok && msr_batch_ok(slice->batch, i)) {
+			tjmax = temperature_target_to_tjmax(msr_batch_value(slice->batch, i));
+		}
+		reader->tjmax[slice->first + i] = tjmax > 0 ? tjmax : default_tjmax;
+	}
+	
+	// The MSR files stay open, the same CPUs are read again in the same order
+	msr_batch_clear(slice->batch);
+	for (i = 0; i < slice->count; i++) {
+		if (msr_batch_add(slice->batch, cpus[slice->first + i], MSR_IA32_THERM_STATUS) < 0) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+static void *core_temp_worker_main(void *arg) {
+	struct core_temp_worker *worker = (struct core_temp_worker *)arg;
+	struct core_temp_reader *reader = worker->reader;
+	
+	pthread_mutex_lock(&reader->init_lock);
+	pthread_mutex_unlock(&reader->init_lock);
+	
+	while (true) {
+		pthread_barrier_wait(&reader->start);
+		if (reader->stop) {
+			break;
+		}
+		read_slice(reader, worker);
+		pthread_barrier_wait(&reader->done);
+	}
+	
+	return NULL;
+}
+
+struct core_temp_reader *core_temp_open(const int *cpus, int num_cpus, int num_threads, short default_tjmax) {
+	int i;
+	
+	if (num_cpus <= 0) {
+		fprintf(stderr, "No CPUs to read the temperature from.\n");
+		return NULL;
+	}
+	if (num_threads < 1) num_threads = 1;
+	if (num_threads > num_cpus) num_threads = num_cpus;
+	
+	// Every slice gets at least one CPU
+	int slice = (num_cpus + num_threads - 1) / num_threads;
+	struct core_temp_reader *reader = (struct core_temp_reader *)calloc(1, sizeof(*reader));
+	reader->num_cpus = num_cpus;
+	reader->tjmax = (short *)calloc(num_cpus, sizeof(short));
+	reader->num_slices = (num_cpus + slice - 1) / slice;
+	reader->num_threads = 1;
+	reader->workers = (struct core_temp_worker *)calloc(reader->num_slices, sizeof(struct core_temp_worker));
+	pthread_mutex_init(&reader->init_lock, NULL);
+	for (i = 0; i < reader->num_slices; i++) {
+		reader->workers[i].reader = reader;
+		reader->workers[i].first = i * slice;
+		reader->workers[i].count = num_cpus - i * slice < slice ? num_cpus - i * slice : slice;
+		if (!open_slice(reader, &reader->workers[i], cpus, default_tjmax)) {
+			core_temp_close(reader);
+			return NULL;
+		}
+	}
+	
+	// Slice 0 belongs to the calling thread
+	if (reader->num_slices > 1) {
+		// The workers must not receive the signals meant for the main thread
+		sigset_t all_signals, old_signals;
+		sigfillset(&all_signals);
+		pthread_mutex_lock(&reader->init_lock);
+		pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+		for (i = 1; i < reader->num_slices; i++) {
+			int err = pthread_create(&reader->workers[i].thread, NULL, core_temp_worker_main, &reader->workers[i]);
+			if (err != 0) {
+				fprintf(stderr, "Warning: Could not create a temperature reader thread: %s\n", strerror(err));
+				break;
+			}
+			reader->num_threads++;
+		}
+		pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+		if (reader->num_threads > 1) {
+			pthread_barrier_init(&reader->start, NULL, reader->num_threads);
+			pthread_barrier_init(&reader->done, NULL, reader->num_threads);
+		}
+		pthread_mutex_unlock(&reader->init_lock);
+	}
+	
+	return reader;
+}
+
+void core_temp_read(struct core_temp_reader *reader, short *temps) {
+	int i;
+	
+	reader->temps = temps;
+	if (reader->num_threads > 1) {
+		pthread_barrier_wait(&reader->start);
+	}
+	read_slice(reader, &reader->workers[0]);
+	// Slices whose worker thread could not be created
+	for (i = reader->num_threads; i < reader->num_slices; i++) {
+		read_slice(reader, &reader->workers[i]);
+	}
+	if (reader->num_threads > 1) {
+		pthread_barrier_wait(&reader->done);
+	}
+}
+
+void core_temp_close(struct core_temp_reader *reader) {
+	int i;
+	
+	if (reader->num_threads > 1) {
+		reader->stop = true;
+		pthread_barrier_wait(&reader->start);
+		for (i = 1; i < reader->num_threads; i++) {
+			pthread_join(reader->workers[i].thread, NULL);
+		}
+		pthread_barrier_destroy(&reader->start);
+		pthread_barrier_destroy(&reader->done);
+	}
+	pthread_mutex_destroy(&reader->init_lock);
+	for (i = 0; i < reader->num_slices; i++) {
+		if (reader->workers[i].batch) {
+			msr_batch_destroy(reader->workers[i].batch);
+		}
+	}
+	free(reader->workers);
+	free(reader->tjmax);
+	free(reader);
+}
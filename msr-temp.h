@@ -0,0 +1,64 @@
+/*
+ * Per-core temperature reading through the MSR driver
+ *
+ * Reading IA32_THERM_STATUS of another CPU sends an IPI to that CPU, so
+ * reading many cores one after another adds up quickly. The reader splits
+ * the CPUs into slices and reads the slices in parallel from worker threads.
+ * Each slice is read as one MSR batch (see msr-batch.h).
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef MSR_TEMP_H
+#define MSR_TEMP_H
+
+#include <stdint.h>
+
+#define MSR_IA32_THERM_STATUS		0x0000019c
+#define MSR_IA32_TEMPERATURE_TARGET	0x000001a2
+#define MSR_IA32_PACKAGE_THERM_STATUS		0x000001b1
+
+// Upper limit for the number of CPUs in a CPU list
+#define MSR_TEMP_MAX_CPUS	1024
+
+/*
+ * Parse a CPU list such as "0-3,8,10-11".
+ * Returns the number of CPUs or -1 if the list is malformed.
+ */
+int parse_cpu_list(const char *list, int *cpus, int max_cpus);
+
+// Fill cpus with all online CPUs, returns the number of CPUs
+int online_cpu_list(int *cpus, int max_cpus);
+
+// Returns TjMax of the CPU or -1 if it could not be read
+int read_tjmax(int fd);
+
+// TjMax in degrees C from the IA32_TEMPERATURE_TARGET register
+static inline int temperature_target_to_tjmax(uint64_t temperature_target) {
+	return (temperature_target >> 16) & 0xff;
+}
+
+// Convert a THERM_STATUS register to degrees C
+static inline short therm_status_to_temp(uint64_t therm_status, short tjmax) {
+	return tjmax - ((therm_status >> 16) & 0x7f);
+}
+
+struct core_temp_reader;
+
+/*
+ * Open the MSR files of the given CPUs and start num_threads - 1 worker threads,
+ * the calling thread reads the first slice itself. Returns NULL on failure.
+ */
+struct core_temp_reader *core_temp_open(const int *cpus, int num_cpus, int num_threads, short default_tjmax);
+
+// Read the core temperatures in degrees C into temps, -1 marks a failed read
+void core_temp_read(struct core_temp_reader *reader, short *temps);
+
+void core_temp_close(struct core_temp_reader *reader);
+
+// Suggested number of threads, one per 16 CPUs
+static inline int core_temp_default_threads(int num_cpus) {
+	return (num_cpus + 15) / 16;
+}
+
+#endif
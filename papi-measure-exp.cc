@@ -19,8 +19,8 @@
 #include <papi.h>
 
 #include "util.h"
+#include "rapl.h"
 
-#define READ_ENERGY(a) PAPI_read(s_event_set, a)
 #define READ_PERF_EVENTS(a) PAPI_read(s_perf_event_set, a)
 
 #if __x86_64__ || __i386__
@@ -37,58 +37,26 @@ static double timeval_to_double(struct timeval *tv) {
 }
 
 bool do_rapl(double input) {
-	int s_event_set = 0;
 	int s_perf_event_set = 0;
-	int s_num_events = 0;
 	int s_perf_events = 0;
-	long long *s_values_before = NULL;
-	long long *s_values_after = NULL;
+	uint64_t s_values_before[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS] = { 0 };
+	uint64_t s_values_after[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS] = { 0 };
 	long long *s_perf_values_before = NULL;
 	long long *s_perf_values_after = NULL;
 	int i = 0;
-	int idx_pkg_energy = -1;
-	int idx_pp0_energy = -1;
-	int idx_pp1_energy = -1;
-	int idx_dram_energy = -1;
 	int num_iterations = 100000000;
 	uint64_t tsc_before = 0;
 	uint64_t tsc_after = 0;
 	struct timeval now;
 	
-	// Set the scale factor for the RAPL energy readings:
-	// one integer step is 15.3 microjoules, scale everything to joules.
-	double scaleFactor = 1e-9;
-	
 	if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
 		fprintf(stderr, "PAPI library initialisation failed.\n");
 		return false;
 	}
 	
-	// Find the RAPL component of PAPI.
-	int num_components = PAPI_num_components();
-	int component_id;
-	const PAPI_component_info_t *component_info = 0;
-	for (component_id = 0; component_id < num_components; ++component_id) {
-		component_info = PAPI_get_component_info(component_id);
-		if (component_info && strstr(component_info->name, "rapl")) {
-			break;
-		}
-	}
-	if (component_id == num_components) {
-		fprintf(stderr, "No RAPL component found in PAPI library.\n");
-		return false;
-	}
-	
-	if (component_info->disabled) {
-		fprintf(stderr, "RAPL component of PAPI disabled: %s.\n",
-			component_info->disabled_reason);
-		return false;
-	}
-	
-	// Create an event set.
-	s_event_set = PAPI_NULL;
-	if (PAPI_create_eventset(&s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not create PAPI event set.\n");
+	// The energy counters are read through librapl, the backend can be selected with RAPL_BACKEND
+	struct rapl_source *rapl = rapl_open(getenv("RAPL_BACKEND"), 0);
+	if (!rapl) {
 		return false;
 	}
 	
@@ -99,45 +67,6 @@ bool do_rapl(double input) {
 	}
 	
 	int code = PAPI_NATIVE_MASK;
-	for (int retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_FIRST, component_id); retval == PAPI_OK; retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_EVENTS, component_id)) {
-		char event_name[PAPI_MAX_STR_LEN];
-		if (PAPI_event_code_to_name(code, event_name) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event name.\n");
-			return false;
-		}
-		
-		PAPI_event_info_t event_info;
-		if (PAPI_get_event_info(code, &event_info) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event info.\n");
-			return false;
-		}
-		if (event_info.data_type != PAPI_DATATYPE_UINT64) {
-			continue;
-		}
-		
-		if (strstr(event_name, "PACKAGE_ENERGY:")) {
-			idx_pkg_energy = s_num_events;
-		} else if (strstr(event_name, "PP0_ENERGY:")) {
-			idx_pp0_energy = s_num_events;
-		} else if (strstr(event_name, "PP1_ENERGY:")) {
-			idx_pp1_energy = s_num_events;
-		} else if (strstr(event_name, "DRAM_ENERGY:")) {
-			idx_dram_energy = s_num_events;
-		} else {
-			continue; // Skip other counters
-		}
-		
-		printf("Adding %s to event set.\n", event_name);
-		if (PAPI_add_event(s_event_set, code) != PAPI_OK) {
-			break;
-		}
-		++s_num_events;
-	}
-	if (s_num_events == 0) {
-		fprintf(stderr, "Could not find any RAPL events.\n");
-		return false;
-	}
-	
 	if (PAPI_event_name_to_code(strdup("INSTRUCTIONS_RETIRED"), &code) != PAPI_OK) {
 		fprintf(stderr, "No event found INSTRUCTIONS_RETIRED!\n");
 	} else {
@@ -149,22 +78,16 @@ bool do_rapl(double input) {
 	}
 	
 	// Allocate memory for reading the counters
-	s_values_before = (long long *)calloc(s_num_events, sizeof(long long));
-	s_values_after = (long long *)calloc(s_num_events, sizeof(long long));
 	s_perf_values_before = (long long *)calloc(s_perf_events, sizeof(long long));
 	s_perf_values_after = (long long *)calloc(s_perf_events, sizeof(long long));
 	
 	// Activate the event set.
-	if (PAPI_start(s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not activate the event set.\n");
-		return false;
-	}
 	if (PAPI_start(s_perf_event_set) != PAPI_OK) {
 		fprintf(stderr, "Could not activate the perf event set.\n");
 		return false;
 	}
 	
-	READ_ENERGY(s_values_before);
+	rapl_read(rapl, s_values_before);
 	READ_PERF_EVENTS(s_perf_values_before);
 	gettimeofday(&now, NULL);
 	double tstart = timeval_to_double(&now);
@@ -180,17 +103,17 @@ bool do_rapl(double input) {
 	gettimeofday(&now, NULL);
 	double tend = timeval_to_double(&now);
 	READ_PERF_EVENTS(s_perf_values_after);
-	READ_ENERGY(s_values_after);
+	rapl_read(rapl, s_values_after);
 	
 	long long cycles = tsc_after - tsc_before;
-	double pkg_energy = scaleFactor * (s_values_after[idx_pkg_energy] - s_values_before[idx_pkg_energy]);
-	double pp0_energy = scaleFactor * (s_values_after[idx_pp0_energy] - s_values_before[idx_pp0_energy]);
-	double pp1_energy = 0;
-	if (idx_pp1_energy != -1)
-		pp1_energy = scaleFactor * (s_values_after[idx_pp1_energy] - s_values_before[idx_pp1_energy]);
-	double dram_energy = 0;
-	if (idx_dram_energy != -1)
-		dram_energy = scaleFactor * (s_values_after[idx_dram_energy] - s_values_before[idx_dram_energy]);
+	struct rapl_accum accum;
+	rapl_accum_init(&accum, rapl);
+	rapl_accum_update(&accum, s_values_before);
+	rapl_accum_update(&accum, s_values_after);
+	double pkg_energy = rapl_accum_joules(&accum, rapl, 0, RAPL_DOMAIN_PKG);
+	double pp0_energy = rapl_accum_joules(&accum, rapl, 0, RAPL_DOMAIN_PP0);
+	double pp1_energy = rapl_accum_joules(&accum, rapl, 0, RAPL_DOMAIN_PP1);
+	double dram_energy = rapl_accum_joules(&accum, rapl, 0, RAPL_DOMAIN_DRAM);
 	long long instructions_retired = s_perf_values_after[0] - s_perf_values_before[0];
 	
 	printf("Final result: %f\n", result);
@@ -3,126 +3,91 @@
  * Benchmark the latency of calling PAPI_read().
  * Code based on IgProf energy profiling module by Filip Nybäck.
  *
+ * Usage: ./papi-poll-latency [ -n <iterations> ] [ -H <histogram file> ]
+ *   -H	Write the latency histogram in nanoseconds as CSV
+ *
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
 #include <papi.h>
 #include <math.h>
-#include <vector>
+#include <unistd.h>
 
 #include "util.h"
+#include "rapl.h"
+#include "tsc-latency.h"
 
 #define READ_ENERGY(a) PAPI_read(s_event_set, a)
 
-static double gettimeofday_double() {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	return now.tv_sec + now.tv_usec * 1e-6;
-}
-
-bool do_rapl() {
+bool do_rapl(int num_iterations, const char *histogram_file) {
 	int s_event_set = 0;
 	int s_num_events = 0;
 	long long *s_values = NULL;
-	int i = 0, num_iterations = 1000000;
+	int i = 0;
 	int idx_pkg_energy = -1;
 	
-	if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
-		fprintf(stderr, "PAPI library initialisation failed.\n");
-		return false;
-	}
-	
-	// Find the RAPL component of PAPI.
-	int num_components = PAPI_num_components();
-	int component_id;
-	const PAPI_component_info_t *component_info = 0;
-	for (component_id = 0; component_id < num_components; ++component_id) {
-		component_info = PAPI_get_component_info(component_id);
-		if (component_info && strstr(component_info->name, "rapl")) {
-			break;
-		}
-	}
-	if (component_id == num_components) {
-		fprintf(stderr, "No RAPL component found in PAPI library.\n");
-		return false;
-	}
-	
-	if (component_info->disabled) {
-		fprintf(stderr, "RAPL component of PAPI disabled: %s.\n",
-			component_info->disabled_reason);
-		return false;
-	}
-	
-	// Create an event set.
-	s_event_set = PAPI_NULL;
-	if (PAPI_create_eventset(&s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not create PAPI event set.\n");
-		return false;
-	}
-	
-	int code = PAPI_NATIVE_MASK;
-	for (int retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_FIRST, component_id); retval == PAPI_OK; retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_EVENTS, component_id)) {
-		char event_name[PAPI_MAX_STR_LEN];
-		if (PAPI_event_code_to_name(code, event_name) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event name.\n");
-			return false;
-		}
-		
-		PAPI_event_info_t event_info;
-		if (PAPI_get_event_info(code, &event_info) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event info.\n");
-			return false;
-		}
-		if (event_info.data_type != PAPI_DATATYPE_UINT64) {
-			continue;
-		}
-		
-		if (strstr(event_name, "PACKAGE_ENERGY_CNT:")) {
-			idx_pkg_energy = s_num_events;
-		} else {
-			continue; // Skip other counters
-		}
-		
-		printf("Adding %s to event set.\n", event_name);
-		if (PAPI_add_event(s_event_set, code) != PAPI_OK) {
-			break;
-		}
-		++s_num_events;
-	}
+	static const char *const patterns[] = { "PACKAGE_ENERGY_CNT:" };
+	int indices[1];
+	s_num_events = rapl_papi_start(patterns, 1, indices, &s_event_set);
 	if (s_num_events == 0) {
-		fprintf(stderr, "Could not find any RAPL events.\n");
 		return false;
 	}
+	idx_pkg_energy = indices[0];
 	
 	// Allocate memory for reading the counters
 	s_values = (long long *)calloc(s_num_events, sizeof(long long));
 	
-	// Activate the event set.
-	if (PAPI_start(s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not activate the event set.\n");
-		return false;
-	}
-	
 	// Get rid of compiler warning
 	(void)idx_pkg_energy;
 	
-	double fstart = gettimeofday_double();
+	static struct tsc_latency lat;
+	tsc_latency_init(&lat);
 	for (i = 0; i < num_iterations; i++) {
+		uint64_t begin = tsc_latency_begin();
 		READ_ENERGY(s_values);
+		tsc_latency_add(&lat, begin, tsc_latency_end());
 	}
-	double fend = gettimeofday_double();
 	
-	printf("Average PAPI_read() latency: %f nanoseconds\n", (fend - fstart) * 1000000000.0 / num_iterations);
+	printf("Average PAPI_read() latency: %f nanoseconds\n", tsc_latency_mean_ns(&lat));
+	tsc_latency_print(stdout, "PAPI_read()", &lat);
+	tsc_latency_print_overhead(stdout, &lat);
+	
+	if (histogram_file) {
+		FILE *fp = fopen(histogram_file, "w");
+		if (!fp) {
+			fprintf(stderr, "Failed to open %s!\n", histogram_file);
+			return false;
+		}
+		tsc_latency_dump(fp, "PAPI_read()", &lat);
+		fclose(fp);
+	}
 	
 	return true;
 }
 
-int main() {
+int main(int argc, char **argv) {
+	const char *histogram_file = NULL;
+	int num_iterations = 1000000;
+	int c = 0;
+	
+	while ((c = getopt(argc, argv, "n:H:")) != -1) {
+		switch (c) {
+			case 'n':
+				num_iterations = atoi(optarg);
+				break;
+			case 'H':
+				histogram_file = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [ -n <iterations> ] [ -H <histogram file> ]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	
 	do_affinity(0);
-	do_rapl();
+	do_rapl(num_iterations, histogram_file);
 	return 0;
 }
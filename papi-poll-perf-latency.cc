@@ -3,30 +3,28 @@
  * Benchmark the latency of calling PAPI_read() to read performance counters.
  * Code based on IgProf energy profiling module by Filip Nybäck.
  *
+ * Usage: ./papi-poll-perf-latency [ -n <iterations> ] [ -H <histogram file> ]
+ *   -H	Write the latency histogram in nanoseconds as CSV
+ *
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
 #include <papi.h>
 #include <math.h>
 #include <vector>
+#include <unistd.h>
 
 #include "util.h"
+#include "tsc-latency.h"
 
-static double gettimeofday_double() {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	return now.tv_sec + now.tv_usec * 1e-6;
-}
-
-bool do_rapl() {
+bool do_rapl(int num_iterations, const char *histogram_file) {
 	int s_perf_event_set = 0;
 	int s_perf_events = 0;
 	long long *s_values = NULL;
-	int i = 0, num_iterations = 1000000;
+	int i = 0;
 	
 	if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
 		fprintf(stderr, "PAPI library initialisation failed.\n");
@@ -66,19 +64,51 @@ bool do_rapl() {
 		return false;
 	}
 	
-	double fstart = gettimeofday_double();
+	static struct tsc_latency lat;
+	tsc_latency_init(&lat);
 	for (i = 0; i < num_iterations; i++) {
+		uint64_t begin = tsc_latency_begin();
 		PAPI_read(s_perf_event_set, s_values);
+		tsc_latency_add(&lat, begin, tsc_latency_end());
 	}
-	double fend = gettimeofday_double();
 	
-	printf("Average PAPI_read() latency: %f nanoseconds\n", (fend - fstart) * 1000000000.0 / num_iterations);
+	printf("Average PAPI_read() latency: %f nanoseconds\n", tsc_latency_mean_ns(&lat));
+	tsc_latency_print(stdout, "PAPI_read()", &lat);
+	tsc_latency_print_overhead(stdout, &lat);
+	
+	if (histogram_file) {
+		FILE *fp = fopen(histogram_file, "w");
+		if (!fp) {
+			fprintf(stderr, "Failed to open %s!\n", histogram_file);
+			return false;
+		}
+		tsc_latency_dump(fp, "PAPI_read()", &lat);
+		fclose(fp);
+	}
 	
 	return true;
 }
 
-int main() {
+int main(int argc, char **argv) {
+	const char *histogram_file = NULL;
+	int num_iterations = 1000000;
+	int c = 0;
+	
+	while ((c = getopt(argc, argv, "n:H:")) != -1) {
+		switch (c) {
+			case 'n':
+				num_iterations = atoi(optarg);
+				break;
+			case 'H':
+				histogram_file = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [ -n <iterations> ] [ -H <histogram file> ]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	
 	do_affinity(0);
-	do_rapl();
+	do_rapl(num_iterations, histogram_file);
 	return 0;
 }
@@ -21,6 +21,7 @@
 #include <vector>
 
 #include "util.h"
+#include "rapl.h"
 
 #define READ_ENERGY(a) PAPI_read(s_event_set, a)
 
@@ -34,84 +35,18 @@ bool do_rapl() {
 	
 	struct timespec one_ms = { 0, 1000000 };
 	
-	if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
-		fprintf(stderr, "PAPI library initialisation failed.\n");
-		return false;
-	}
-	
-	// Find the RAPL component of PAPI.
-	int num_components = PAPI_num_components();
-	int component_id;
-	const PAPI_component_info_t *component_info = 0;
-	for (component_id = 0; component_id < num_components; ++component_id) {
-		component_info = PAPI_get_component_info(component_id);
-		if (component_info && strstr(component_info->name, "rapl")) {
-			break;
-		}
-	}
-	if (component_id == num_components) {
-		fprintf(stderr, "No RAPL component found in PAPI library.\n");
-		return false;
-	}
-	
-	if (component_info->disabled) {
-		fprintf(stderr, "RAPL component of PAPI disabled: %s.\n",
-			component_info->disabled_reason);
-		return false;
-	}
-	
-	// Create an event set.
-	s_event_set = PAPI_NULL;
-	if (PAPI_create_eventset(&s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not create PAPI event set.\n");
-		return false;
-	}
-	
-	int code = PAPI_NATIVE_MASK;
-	for (int retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_FIRST, component_id); retval == PAPI_OK; retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_EVENTS, component_id)) {
-		char event_name[PAPI_MAX_STR_LEN];
-		if (PAPI_event_code_to_name(code, event_name) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event name.\n");
-			return false;
-		}
-		
-		PAPI_event_info_t event_info;
-		if (PAPI_get_event_info(code, &event_info) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event info.\n");
-			return false;
-		}
-		if (event_info.data_type != PAPI_DATATYPE_UINT64) {
-			continue;
-		}
-		
-		if (strstr(event_name, "PACKAGE_ENERGY_CNT:")) {
-			idx_pkg_energy_cnt = s_num_events;
-		} else if (strstr(event_name, "PACKAGE_ENERGY:")) {
-			idx_pkg_energy = s_num_events;
-		} else {
-			continue; // Skip other counters
-		}
-		
-		printf("Adding %s to event set.\n", event_name);
-		if (PAPI_add_event(s_event_set, code) != PAPI_OK) {
-			break;
-		}
-		++s_num_events;
-	}
+	static const char *const patterns[] = { "PACKAGE_ENERGY_CNT:", "PACKAGE_ENERGY:" };
+	int indices[2];
+	s_num_events = rapl_papi_start(patterns, 2, indices, &s_event_set);
 	if (s_num_events == 0) {
-		fprintf(stderr, "Could not find any RAPL events.\n");
 		return false;
 	}
+	idx_pkg_energy_cnt = indices[0];
+	idx_pkg_energy = indices[1];
 	
 	// Allocate memory for reading the counters
 	s_values = (long long *)calloc(s_num_events, sizeof(long long));
 	
-	// Activate the event set.
-	if (PAPI_start(s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not activate the event set.\n");
-		return false;
-	}
-	
 	int num_iterations = 1000;
 	for (i = 0; i < num_iterations; i++) {
 		READ_ENERGY(s_values);
@@ -3,6 +3,9 @@
  * Attempt to correlate RAPL updates with various timing sources.
  * Code based on IgProf energy profiling module by Filip Nybäck.
  *
+ * Usage: ./papi-poll-timings [ -r <capture file> ]
+ * With -r every read is also written to a capture file for capture-replay.
+ *
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
 
@@ -14,9 +17,12 @@
 #include <papi.h>
 #include <math.h>
 #include <stdint.h>
+#include <unistd.h>
 #include <vector>
 
 #include "util.h"
+#include "rapl.h"
+#include "read-capture.h"
 
 #define READ_ENERGY(a) PAPI_read(s_event_set, a)
 
@@ -51,89 +57,24 @@ const char *clk_names[] = {
 
 const int num_clocks = sizeof(clk_ids) / sizeof(*clk_ids);
 
-bool do_rapl() {
+bool do_rapl(struct capture *capture) {
 	int s_event_set = 0;
 	int s_num_events = 0;
 	long long *s_values = NULL;
 	int i = 0;
 	int idx_pkg_energy = -1;
 	
-	if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
-		fprintf(stderr, "PAPI library initialisation failed.\n");
-		return false;
-	}
-	
-	// Find the RAPL component of PAPI.
-	int num_components = PAPI_num_components();
-	int component_id;
-	const PAPI_component_info_t *component_info = 0;
-	for (component_id = 0; component_id < num_components; ++component_id) {
-		component_info = PAPI_get_component_info(component_id);
-		if (component_info && strstr(component_info->name, "rapl")) {
-			break;
-		}
-	}
-	if (component_id == num_components) {
-		fprintf(stderr, "No RAPL component found in PAPI library.\n");
-		return false;
-	}
-	
-	if (component_info->disabled) {
-		fprintf(stderr, "RAPL component of PAPI disabled: %s.\n",
-			component_info->disabled_reason);
-		return false;
-	}
-	
-	// Create an event set.
-	s_event_set = PAPI_NULL;
-	if (PAPI_create_eventset(&s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not create PAPI event set.\n");
-		return false;
-	}
-	
-	int code = PAPI_NATIVE_MASK;
-	for (int retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_FIRST, component_id); retval == PAPI_OK; retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_EVENTS, component_id)) {
-		char event_name[PAPI_MAX_STR_LEN];
-		if (PAPI_event_code_to_name(code, event_name) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event name.\n");
-			return false;
-		}
-		
-		PAPI_event_info_t event_info;
-		if (PAPI_get_event_info(code, &event_info) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event info.\n");
-			return false;
-		}
-		if (event_info.data_type != PAPI_DATATYPE_UINT64) {
-			continue;
-		}
-		
-		if (strstr(event_name, "PACKAGE_ENERGY_CNT:")) {
-			idx_pkg_energy = s_num_events;
-		} else {
-			continue; // Skip other counters
-		}
-		
-		printf("Adding %s to event set.\n", event_name);
-		if (PAPI_add_event(s_event_set, code) != PAPI_OK) {
-			break;
-		}
-		++s_num_events;
-	}
+	static const char *const patterns[] = { "PACKAGE_ENERGY_CNT:" };
+	int indices[1];
+	s_num_events = rapl_papi_start(patterns, 1, indices, &s_event_set);
 	if (s_num_events == 0) {
-		fprintf(stderr, "Could not find any RAPL events.\n");
 		return false;
 	}
+	idx_pkg_energy = indices[0];
 	
 	// Allocate memory for reading the counters
 	s_values = (long long *)calloc(s_num_events, sizeof(long long));
 	
-	// Activate the event set.
-	if (PAPI_start(s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not activate the event set.\n");
-		return false;
-	}
-	
 	long long prev_energy = 0;
 	const int num_iterations = 100000;
 	std::vector<timespec> realtime_times;
@@ -148,6 +89,9 @@ bool do_rapl() {
 	uint64_t tsc = 0;
 	for (i = 0; i < num_iterations; i++) {
 		READ_ENERGY(s_values);
+		if (capture) {
+			capture_read(capture, 0, s_values[idx_pkg_energy]);
+		}
 		if (s_values[idx_pkg_energy] != prev_energy) {
 			prev_energy = s_values[idx_pkg_energy];
 			clock_gettime(CLOCK_REALTIME, &now);
@@ -175,8 +119,27 @@ bool do_rapl() {
 	return true;
 }
 
-int main() {
+int main(int argc, char **argv) {
+	struct capture *capture = NULL;
+	int c = 0;
+	
+	while ((c = getopt(argc, argv, "r:")) != -1) {
+		switch (c) {
+			case 'r':
+				if (!(capture = capture_open(optarg, "papi-poll-timings", 0))) {
+					return EXIT_FAILURE;
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [ -r <capture file> ]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	
 	do_affinity(0);
-	do_rapl();
+	do_rapl(capture);
+	if (capture) {
+		capture_close(capture);
+	}
 	return 0;
 }
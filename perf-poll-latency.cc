@@ -0,0 +1,159 @@
+/*
+ * perf-poll-latency.cc
+ * Benchmark the latency of reading the RAPL counters through the perf_event power PMU.
+ * Compares a single read() of an event group against reading each domain separately.
+ * Use rapl-read-latency for comparing against the PAPI and MSR backends.
+ *
+ * Each read is timed with the TSC, see tsc-latency.h.
+ *
+ * Usage: ./perf-poll-latency [ -c <core> ] [ -n <iterations> ] [ -H <histogram file> ]
+ *   -H	Write the latency histograms in nanoseconds as CSV
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "rapl.h"
+#include "util.h"
+#include "tsc-latency.h"
+
+static const char *event_names[] = { "energy-pkg", "energy-cores", "energy-gpu", "energy-ram", "energy-psys" };
+#define NUM_EVENTS	((int)(sizeof(event_names) / sizeof(event_names[0])))
+
+static void close_all(int *fds, int num_fds) {
+	int i;
+	for (i = num_fds - 1; i >= 0; i--) {
+		close(fds[i]);
+	}
+}
+
+// Open the available events, either as one group or as separate events
+static int open_events(int core, bool group, int *fds) {
+	int i, num_fds = 0;
+	for (i = 0; i < NUM_EVENTS; i++) {
+		struct rapl_perf_event event;
+		if (!rapl_perf_event(event_names[i], &event)) {
+			continue;
+		}
+		int fd = rapl_perf_open(&event, core, group && num_fds > 0 ? fds[0] : -1);
+		if (fd >= 0) {
+			fds[num_fds++] = fd;
+		}
+	}
+	return num_fds;
+}
+
+static void report_latency(const char *name, const struct tsc_latency *lat, FILE *histogram_fp) {
+	tsc_latency_print(stdout, name, lat);
+	if (histogram_fp) {
+		tsc_latency_dump(histogram_fp, name, lat);
+	}
+}
+
+static void do_group(int core, int num_iterations, FILE *histogram_fp) {
+	int fds[NUM_EVENTS];
+	uint64_t buf[1 + NUM_EVENTS];
+	int i = 0;
+	
+	int num_fds = open_events(core, true, fds);
+	if (num_fds == 0) {
+		fprintf(stderr, "Could not open any power PMU events.\n");
+		return;
+	}
+	
+	static struct tsc_latency lat;
+	tsc_latency_init(&lat);
+	for (i = 0; i < num_iterations; i++) {
+		uint64_t begin = tsc_latency_begin();
+		if (read(fds[0], buf, sizeof(buf)) < 0) {
+			perror("read");
+			break;
+		}
+		tsc_latency_add(&lat, begin, tsc_latency_end());
+	}
+	
+	printf("Average grouped read() latency for %d events: %f nanoseconds\n", num_fds, tsc_latency_mean_ns(&lat));
+	report_latency("Grouped read()", &lat, histogram_fp);
+	tsc_latency_print_overhead(stdout, &lat);
+	close_all(fds, num_fds);
+}
+
+static void do_separate(int core, int num_iterations, FILE *histogram_fp) {
+	int fds[NUM_EVENTS];
+	// An event that is not in a group reads as a group of one
+	uint64_t buf[2];
+	int i = 0, j = 0;
+	
+	int num_fds = open_events(core, false, fds);
+	if (num_fds == 0) {
+		return;
+	}
+	
+	// One sample covers the reads of all the events
+	static struct tsc_latency lat;
+	tsc_latency_init(&lat);
+	for (i = 0; i < num_iterations; i++) {
+		uint64_t begin = tsc_latency_begin();
+		for (j = 0; j < num_fds; j++) {
+			if (read(fds[j], buf, sizeof(buf)) < 0) {
+				perror("read");
+				break;
+			}
+		}
+		tsc_latency_add(&lat, begin, tsc_latency_end());
+	}
+	
+	printf("Average latency of %d separate read() calls: %f nanoseconds\n", num_fds, tsc_latency_mean_ns(&lat));
+	report_latency("Separate read() calls", &lat, histogram_fp);
+	close_all(fds, num_fds);
+}
+
+int main(int argc, char **argv) {
+	int core = 0, num_iterations = 1000000;
+	const char *histogram_file = NULL;
+	FILE *histogram_fp = NULL;
+	int c = 0;
+	
+	while ((c = getopt(argc, argv, "c:n:H:")) != -1) {
+		switch (c) {
+			case 'c':
+				core = atoi(optarg);
+				break;
+			case 'n':
+				num_iterations = atoi(optarg);
+				break;
+			case 'H':
+				histogram_file = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [ -c <core> ] [ -n <iterations> ] [ -H <histogram file> ]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (num_iterations <= 0) {
+		fprintf(stderr, "Error: The number of iterations must be greater than zero\n");
+		return EXIT_FAILURE;
+	}
+	
+	if (histogram_file) {
+		histogram_fp = fopen(histogram_file, "w");
+		if (!histogram_fp) {
+			fprintf(stderr, "Failed to open %s!\n", histogram_file);
+			return EXIT_FAILURE;
+		}
+	}
+	
+	do_affinity(core);
+	
+	do_group(core, num_iterations, histogram_fp);
+	do_separate(core, num_iterations, histogram_fp);
+	
+	if (histogram_fp) {
+		fclose(histogram_fp);
+	}
+	return 0;
+}
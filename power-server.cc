@@ -0,0 +1,435 @@
+/*
+ * Serves a live power stream to local subscribers
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+
+#include "power-stream.h"
+#include "power-server.h"
+
+#define POWER_SERVER_MAX_CLIENTS 64
+
+// Size of the shared frame ring in bytes, must be a power of two
+#define POWER_SERVER_RING_SIZE (1 << 20)
+
+// The rolling averages are published this often
+#define POWER_SERVER_AVERAGE_INTERVAL_NS 1000000000LL
+
+// One energy snapshot is kept per averaging interval, enough for the longest window
+#define POWER_SERVER_HISTORY 61
+
+// epoll user data of the listening socket, the clients use their slot index
+#define LISTEN_TAG UINT64_MAX
+
+static const uint32_t average_windows_ms[] = { 1000, 10000, 60000 };
+#define NUM_WINDOWS (int)(sizeof(average_windows_ms) / sizeof(average_windows_ms[0]))
+
+struct power_client {
+	int fd;
+	// The HELLO frame of this client and how much of it has been sent
+	unsigned char *hello;
+	size_t hello_len;
+	size_t hello_sent;
+	// Offset in the ring of the next byte to send
+	uint64_t offset;
+	bool want_write;
+};
+
+struct power_server {
+	int listen_fd;
+	int epoll_fd;
+	struct sockaddr_un addr;
+	int num_columns;
+	char names[PSTREAM_MAX_COLUMNS][PSTREAM_NAME_SIZE];
+	
+	// Shared ring of encoded frames, head is the total number of bytes written
+	unsigned char *ring;
+	uint64_t head;
+	uint64_t seq;
+	// Scratch space for encoding one frame
+	unsigned char *frame;
+	
+	struct power_client clients[POWER_SERVER_MAX_CLIENTS];
+	int num_clients;
+	
+	// Previous sample
+	double prev_joules[PSTREAM_MAX_COLUMNS];
+	int64_t prev_ns;
+	bool have_prev;
+	
+	// Energy snapshots for the rolling averages, history_next is the next slot to fill
+	double history[POWER_SERVER_HISTORY][PSTREAM_MAX_COLUMNS];
+	int64_t history_ns[POWER_SERVER_HISTORY];
+	int history_count;
+	int history_next;
+};
+
+// Returns true if another server is accepting connections on the socket
+static bool socket_in_use(const struct sockaddr_un *addr) {
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return false;
+	}
+	bool in_use = connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0;
+	close(fd);
+	return in_use;
+}
+
+struct power_server *power_server_create(const char *path, int num_columns, const char *const *names) {
+	struct sockaddr_un addr;
+	
+	if (num_columns < 1 || num_columns > PSTREAM_MAX_COLUMNS) {
+		fprintf(stderr, "power_server_create: Too many columns (%d)\n", num_columns);
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "power_server_create: Socket path is too long: %s\n", path);
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+	
+	if (socket_in_use(&addr)) {
+		fprintf(stderr, "power_server_create: Another server is already listening on %s\n", path);
+		return NULL;
+	}
+	// Remove a stale socket
+	if (unlink(path) < 0 && errno != ENOENT) {
+		perror("unlink");
+		return NULL;
+	}
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return NULL;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		close(fd);
+		return NULL;
+	}
+	if (listen(fd, 16) < 0) {
+		perror("listen");
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = LISTEN_TAG;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	
+	struct power_server *server = (struct power_server *)calloc(1, sizeof(*server));
+	server->listen_fd = fd;
+	server->epoll_fd = epoll_fd;
+	server->addr = addr;
+	server->num_columns = num_columns;
+	for (int i = 0; i < num_columns; i++) {
+		strncpy(server->names[i], names[i], PSTREAM_NAME_SIZE - 1);
+	}
+	server->ring = (unsigned char *)malloc(POWER_SERVER_RING_SIZE);
+	server->frame = (unsigned char *)malloc(PSTREAM_AVERAGE_SIZE(PSTREAM_MAX_COLUMNS, PSTREAM_MAX_WINDOWS));
+	for (int i = 0; i < POWER_SERVER_MAX_CLIENTS; i++) {
+		server->clients[i].fd = -1;
+	}
+	return server;
+}
+
+static void disconnect_client(struct power_server *server, struct power_client *client) {
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	free(client->hello);
+	client->hello = NULL;
+	client->fd = -1;
+	server->num_clients--;
+}
+
+void power_server_destroy(struct power_server *server) {
+	for (int i = 0; i < POWER_SERVER_MAX_CLIENTS; i++) {
+		if (server->clients[i].fd >= 0) {
+			disconnect_client(server, &server->clients[i]);
+		}
+	}
+	close(server->epoll_fd);
+	close(server->listen_fd);
+	unlink(server->addr.sun_path);
+	free(server->frame);
+	free(server->ring);
+	free(server);
+}
+
+int power_server_num_clients(const struct power_server *server) {
+	return server->num_clients;
+}
+
+static void set_want_write(struct power_server *server, int slot, bool want_write) {
+	struct power_client *client = &server->clients[slot];
+	if (client->want_write == want_write) {
+		return;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = want_write ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	ev.data.u64 = slot;
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+	client->want_write = want_write;
+}
+
+// Send everything the client has not received yet straight from the ring
+static void flush_client(struct power_server *server, int slot) {
+	struct power_client *client = &server->clients[slot];
+	
+	if (server->head - client->offset > POWER_SERVER_RING_SIZE) {
+		fprintf(stderr, "power_server: Disconnecting a subscriber that fell behind by more than %d bytes\n", POWER_SERVER_RING_SIZE);
+		disconnect_client(server, client);
+		return;
+	}
+	
+	while (true) {
+		struct iovec iov[3];
+		int n = 0;
+		if (client->hello_sent < client->hello_len) {
+			iov[n].iov_base = client->hello + client->hello_sent;
+			iov[n].iov_len = client->hello_len - client->hello_sent;
+			n++;
+		}
+		uint64_t pending = server->head - client->offset;
+		if (pending > 0) {
+			// The pending bytes wrap around the end of the ring at most once
+			size_t pos = client->offset & (POWER_SERVER_RING_SIZE - 1);
+			size_t first = pending < POWER_SERVER_RING_SIZE - pos ? pending : POWER_SERVER_RING_SIZE - pos;
+			iov[n].iov_base = server->ring + pos;
+			iov[n].iov_len = first;
+			n++;
+			if (pending > first) {
+				iov[n].iov_base = server->ring;
+				iov[n].iov_len = pending - first;
+				n++;
+			}
+		}
+		if (n == 0) {
+			break;
+		}
+		
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		ssize_t sent = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// Wait for the socket to drain
+				set_want_write(server, slot, true);
+				return;
+			}
+			disconnect_client(server, client);
+			return;
+		}
+		size_t hello_part = client->hello_len - client->hello_sent;
+		if (hello_part > (size_t)sent) {
+			hello_part = sent;
+		}
+		client->hello_sent += hello_part;
+		client->offset += sent - hello_part;
+	}
+	set_want_write(server, slot, false);
+}
+
+// The HELLO frame tells the client which sequence number comes next
+static void build_hello(struct power_server *server, struct power_client *client) {
+	struct pstream_header hdr;
+	uint32_t version = PSTREAM_VERSION, num_columns = server->num_columns, num_windows = NUM_WINDOWS;
+	
+	client->hello_len = PSTREAM_HELLO_SIZE(server->num_columns, NUM_WINDOWS);
+	client->hello = (unsigned char *)malloc(client->hello_len);
+	hdr.magic = PSTREAM_MAGIC;
+	hdr.type = PSTREAM_FRAME_HELLO;
+	hdr.length = client->hello_len;
+	hdr.seq = server->seq;
+	size_t offset = pstream_put(client->hello, 0, &hdr, sizeof(hdr));
+	offset = pstream_put(client->hello, offset, &version, sizeof(version));
+	offset = pstream_put(client->hello, offset, &num_columns, sizeof(num_columns));
+	offset = pstream_put(client->hello, offset, &num_windows, sizeof(num_windows));
+	offset = pstream_put(client->hello, offset, average_windows_ms, sizeof(average_windows_ms));
+	pstream_put(client->hello, offset, server->names, server->num_columns * PSTREAM_NAME_SIZE);
+	client->hello_sent = 0;
+}
+
+static void accept_clients(struct power_server *server) {
+	while (true) {
+		int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				perror("accept4");
+			}
+			return;
+		}
+		int slot;
+		for (slot = 0; slot < POWER_SERVER_MAX_CLIENTS; slot++) {
+			if (server->clients[slot].fd < 0) {
+				break;
+			}
+		}
+		if (slot == POWER_SERVER_MAX_CLIENTS) {
+			fprintf(stderr, "power_server: Too many subscribers, refusing a connection\n");
+			close(fd);
+			continue;
+		}
+		
+		struct power_client *client = &server->clients[slot];
+		client->fd = fd;
+		client->offset = server->head;
+		client->want_write = false;
+		build_hello(server, client);
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = slot;
+		epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+		server->num_clients++;
+	}
+}
+
+// Subscribers do not send anything, the input is only read to notice when they hang up
+static void handle_input(struct power_server *server, int slot) {
+	struct power_client *client = &server->clients[slot];
+	char discard[256];
+	
+	while (true) {
+		ssize_t len = read(client->fd, discard, sizeof(discard));
+		if (len > 0) {
+			continue;
+		}
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		disconnect_client(server, client);
+		return;
+	}
+}
+
+void power_server_poll(struct power_server *server, int timeout_ms) {
+	struct epoll_event events[16];
+	
+	int n = epoll_wait(server->epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout_ms);
+	for (int i = 0; i < n; i++) {
+		if (events[i].data.u64 == LISTEN_TAG) {
+			accept_clients(server);
+			continue;
+		}
+		int slot = (int)events[i].data.u64;
+		if (server->clients[slot].fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+			handle_input(server, slot);
+		}
+	}
+	
+	for (int slot = 0; slot < POWER_SERVER_MAX_CLIENTS; slot++) {
+		if (server->clients[slot].fd >= 0) {
+			flush_client(server, slot);
+		}
+	}
+}
+
+// Append the frame in the scratch buffer to the ring, it is encoded only once for all clients
+static void publish_frame(struct power_server *server, uint16_t type, size_t length) {
+	struct pstream_header hdr;
+	hdr.magic = PSTREAM_MAGIC;
+	hdr.type = type;
+	hdr.length = length;
+	hdr.seq = server->seq++;
+	pstream_put(server->frame, 0, &hdr, sizeof(hdr));
+	
+	size_t pos = server->head & (POWER_SERVER_RING_SIZE - 1);
+	size_t first = length < POWER_SERVER_RING_SIZE - pos ? length : POWER_SERVER_RING_SIZE - pos;
+	memcpy(server->ring + pos, server->frame, first);
+	memcpy(server->ring, server->frame + first, length - first);
+	server->head += length;
+}
+
+static void publish_average(struct power_server *server, int64_t now_ns) {
+	const int latest = (server->history_next + POWER_SERVER_HISTORY - 1) % POWER_SERVER_HISTORY;
+	uint32_t window_ms[NUM_WINDOWS];
+	int oldest[NUM_WINDOWS];
+	
+	size_t offset = pstream_put(server->frame, PSTREAM_HEADER_SIZE, &now_ns, sizeof(now_ns));
+	for (int w = 0; w < NUM_WINDOWS; w++) {
+		// Use the full history until the window has filled up
+		int steps = average_windows_ms[w] * 1000000LL / POWER_SERVER_AVERAGE_INTERVAL_NS;
+		if (steps > server->history_count - 1) {
+			steps = server->history_count - 1;
+		}
+		oldest[w] = (latest + POWER_SERVER_HISTORY - steps) % POWER_SERVER_HISTORY;
+		window_ms[w] = (server->history_ns[latest] - server->history_ns[oldest[w]]) / 1000000;
+		offset = pstream_put(server->frame, offset, &window_ms[w], sizeof(window_ms[w]));
+	}
+	for (int w = 0; w < NUM_WINDOWS; w++) {
+		double seconds = (server->history_ns[latest] - server->history_ns[oldest[w]]) * 1e-9;
+		for (int i = 0; i < server->num_columns; i++) {
+			float watts = (server->history[latest][i] - server->history[oldest[w]][i]) / seconds;
+			offset = pstream_put(server->frame, offset, &watts, sizeof(watts));
+		}
+	}
+	publish_frame(server, PSTREAM_FRAME_AVERAGE, offset);
+}
+
+void power_server_add_sample(struct power_server *server, const struct timespec *timestamp, const double *joules) {
+	const int64_t now_ns = timestamp->tv_sec * 1000000000LL + timestamp->tv_nsec;
+	
+	if (server->have_prev && now_ns > server->prev_ns) {
+		int64_t interval_ns = now_ns - server->prev_ns;
+		size_t offset = pstream_put(server->frame, PSTREAM_HEADER_SIZE, &now_ns, sizeof(now_ns));
+		offset = pstream_put(server->frame, offset, &interval_ns, sizeof(interval_ns));
+		for (int i = 0; i < server->num_columns; i++) {
+			float watts = (joules[i] - server->prev_joules[i]) / (interval_ns * 1e-9);
+			offset = pstream_put(server->frame, offset, &watts, sizeof(watts));
+		}
+		publish_frame(server, PSTREAM_FRAME_SAMPLE, offset);
+	}
+	memcpy(server->prev_joules, joules, server->num_columns * sizeof(double));
+	server->prev_ns = now_ns;
+	server->have_prev = true;
+	
+	// Take a snapshot once per averaging interval
+	if (server->history_count > 0) {
+		int latest = (server->history_next + POWER_SERVER_HISTORY - 1) % POWER_SERVER_HISTORY;
+		if (now_ns - server->history_ns[latest] < POWER_SERVER_AVERAGE_INTERVAL_NS) {
+			return;
+		}
+	}
+	memcpy(server->history[server->history_next], joules, server->num_columns * sizeof(double));
+	server->history_ns[server->history_next] = now_ns;
+	server->history_next = (server->history_next + 1) % POWER_SERVER_HISTORY;
+	if (server->history_count < POWER_SERVER_HISTORY) {
+		server->history_count++;
+	}
+	if (server->history_count > 1) {
+		publish_average(server, now_ns);
+	}
+}
@@ -0,0 +1,46 @@
+/*
+ * Serves a live power stream to local subscribers (see power-stream.h)
+ *
+ * Every frame is encoded once into a shared byte ring. Each subscriber only
+ * has a read offset into the ring and the frames are sent to it straight
+ * from the ring with sendmsg(), so the cost of a frame does not depend on
+ * the number of subscribers. A subscriber that falls behind by more than
+ * the size of the ring is disconnected.
+ *
+ * The server is not thread-safe, all calls must come from the same thread.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef POWER_SERVER_H
+#define POWER_SERVER_H
+
+#include <time.h>
+
+struct power_server;
+
+/*
+ * Listen on the UNIX socket at path. A stale socket left behind by a previous
+ * server is replaced. Returns NULL on failure.
+ */
+struct power_server *power_server_create(const char *path, int num_columns, const char *const *names);
+
+// Closes all connections and removes the socket
+void power_server_destroy(struct power_server *server);
+
+/*
+ * Add a sample with the accumulated energy of each column in joules.
+ * Publishes the power since the previous sample and, once per second, the
+ * rolling averages. The frames are sent by the next power_server_poll().
+ */
+void power_server_add_sample(struct power_server *server, const struct timespec *timestamp, const double *joules);
+
+/*
+ * Accept new subscribers and send pending frames, waiting up to timeout_ms
+ * milliseconds for the sockets to become ready.
+ */
+void power_server_poll(struct power_server *server, int timeout_ms);
+
+int power_server_num_clients(const struct power_server *server);
+
+#endif
@@ -0,0 +1,264 @@
+/*
+ * power-stream-client.cc: Test client for the live power stream of trace-energy-v2 -S.
+ *
+ * Connects to the socket, checks the framing and the sequence numbers of the
+ * frames and prints the samples and the rolling averages. With -q only a
+ * summary is printed, which is handy for running many subscribers at once.
+ *
+ * Usage: ./power-stream-client [ -n <frames> ] [ -q ] <socket path>
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "power-stream.h"
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void sigint_handler(int sig) {
+	(void)sig;
+	interrupted = 1;
+}
+
+static uint32_t num_columns = 0;
+static uint32_t num_windows = 0;
+static char names[PSTREAM_MAX_COLUMNS][PSTREAM_NAME_SIZE];
+
+static bool quiet = false;
+static unsigned long num_samples = 0;
+static unsigned long num_averages = 0;
+static unsigned long num_missed = 0;
+static uint64_t expected_seq = 0;
+
+static int connect_socket(const char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Error: Socket path is too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool handle_hello(const unsigned char *frame, const struct pstream_header *hdr) {
+	uint32_t version = 0, window_ms[PSTREAM_MAX_WINDOWS];
+	size_t offset = PSTREAM_HEADER_SIZE;
+	
+	offset = pstream_get(frame, offset, &version, sizeof(version));
+	offset = pstream_get(frame, offset, &num_columns, sizeof(num_columns));
+	offset = pstream_get(frame, offset, &num_windows, sizeof(num_windows));
+	if (version != PSTREAM_VERSION || num_columns > PSTREAM_MAX_COLUMNS || num_windows > PSTREAM_MAX_WINDOWS ||
+		hdr->length != PSTREAM_HELLO_SIZE(num_columns, num_windows)) {
+		fprintf(stderr, "Error: Unsupported HELLO frame (version %u, %u columns, %u windows)\n", version, num_columns, num_windows);
+		return false;
+	}
+	offset = pstream_get(frame, offset, window_ms, num_windows * sizeof(uint32_t));
+	pstream_get(frame, offset, names, num_columns * PSTREAM_NAME_SIZE);
+	expected_seq = hdr->seq;
+	
+	if (!quiet) {
+		printf("# Columns:");
+		for (uint32_t i = 0; i < num_columns; i++) {
+			names[i][PSTREAM_NAME_SIZE - 1] = '\0';
+			printf(" %s", names[i]);
+		}
+		printf("\n# Averaging windows:");
+		for (uint32_t w = 0; w < num_windows; w++) {
+			printf(" %.1f s", window_ms[w] * 1e-3);
+		}
+		printf("\n");
+	}
+	return true;
+}
+
+static void handle_sample(const unsigned char *frame) {
+	int64_t timestamp_ns = 0, interval_ns = 0;
+	size_t offset = PSTREAM_HEADER_SIZE;
+	
+	offset = pstream_get(frame, offset, &timestamp_ns, sizeof(timestamp_ns));
+	offset = pstream_get(frame, offset, &interval_ns, sizeof(interval_ns));
+	num_samples++;
+	if (quiet) {
+		return;
+	}
+	printf("%.6f", timestamp_ns * 1e-9);
+	for (uint32_t i = 0; i < num_columns; i++) {
+		float watts = 0.0f;
+		offset = pstream_get(frame, offset, &watts, sizeof(watts));
+		printf(", %.3f", watts);
+	}
+	printf("\n");
+}
+
+static void handle_average(const unsigned char *frame) {
+	int64_t timestamp_ns = 0;
+	uint32_t window_ms[PSTREAM_MAX_WINDOWS];
+	size_t offset = PSTREAM_HEADER_SIZE;
+	
+	offset = pstream_get(frame, offset, &timestamp_ns, sizeof(timestamp_ns));
+	offset = pstream_get(frame, offset, window_ms, num_windows * sizeof(uint32_t));
+	num_averages++;
+	if (quiet) {
+		return;
+	}
+	for (uint32_t w = 0; w < num_windows; w++) {
+		printf("# Average over %.3f s:", window_ms[w] * 1e-3);
+		for (uint32_t i = 0; i < num_columns; i++) {
+			float watts = 0.0f;
+			offset = pstream_get(frame, offset, &watts, sizeof(watts));
+			printf(" %s %.3f W", names[i], watts);
+		}
+		printf("\n");
+	}
+}
+
+// Returns false if the frame is malformed
+static bool handle_frame(const unsigned char *frame, const struct pstream_header *hdr, bool have_hello) {
+	if (hdr->type == PSTREAM_FRAME_HELLO) {
+		return handle_hello(frame, hdr);
+	}
+	if (!have_hello) {
+		fprintf(stderr, "Error: The first frame is not a HELLO frame\n");
+		return false;
+	}
+	if (hdr->seq != expected_seq) {
+		num_missed += hdr->seq - expected_seq;
+		if (!quiet) {
+			printf("# Missed %lu frames\n", (unsigned long)(hdr->seq - expected_seq));
+		}
+	}
+	expected_seq = hdr->seq + 1;
+	
+	switch (hdr->type) {
+		case PSTREAM_FRAME_SAMPLE:
+			if (hdr->length != PSTREAM_SAMPLE_SIZE(num_columns)) {
+				break;
+			}
+			handle_sample(frame);
+			return true;
+		case PSTREAM_FRAME_AVERAGE:
+			if (hdr->length != PSTREAM_AVERAGE_SIZE(num_columns, num_windows)) {
+				break;
+			}
+			handle_average(frame);
+			return true;
+		default:
+			// Unknown frame types are skipped
+			return true;
+	}
+	fprintf(stderr, "Error: Frame of type %u has the wrong length %u\n", hdr->type, hdr->length);
+	return false;
+}
+
+int main(int argc, char **argv) {
+	unsigned long max_frames = 0;
+	int c = 0;
+	
+	while ((c = getopt(argc, argv, "n:q")) != -1) {
+		switch (c) {
+			case 'n':
+				max_frames = strtoul(optarg, NULL, 10);
+				break;
+			case 'q':
+				quiet = true;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [ -n <frames> ] [ -q ] <socket path>\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Usage: %s [ -n <frames> ] [ -q ] <socket path>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	
+	// Interrupt read() so that the summary is printed on Ctrl-C
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigint_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	
+	int fd = connect_socket(argv[optind]);
+	if (fd < 0) {
+		return EXIT_FAILURE;
+	}
+	
+	static unsigned char buf[1 << 16];
+	size_t filled = 0;
+	bool have_hello = false, ok = true;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	while (ok && !interrupted && (max_frames == 0 || num_samples + num_averages < max_frames)) {
+		ssize_t len = read(fd, buf + filled, sizeof(buf) - filled);
+		if (len < 0) {
+			if (errno != EINTR) {
+				perror("read");
+			}
+			break;
+		}
+		if (len == 0) {
+			if (!quiet) {
+				printf("# The server closed the connection\n");
+			}
+			break;
+		}
+		filled += len;
+		
+		// Handle all complete frames in the buffer
+		size_t pos = 0;
+		while (filled - pos >= PSTREAM_HEADER_SIZE) {
+			struct pstream_header hdr;
+			pstream_get(buf, pos, &hdr, sizeof(hdr));
+			if (hdr.magic != PSTREAM_MAGIC || hdr.length < PSTREAM_HEADER_SIZE || hdr.length > sizeof(buf)) {
+				fprintf(stderr, "Error: Invalid frame header at offset %lu\n", (unsigned long)pos);
+				ok = false;
+				break;
+			}
+			if (filled - pos < hdr.length) {
+				break;
+			}
+			if (!handle_frame(buf + pos, &hdr, have_hello)) {
+				ok = false;
+				break;
+			}
+			have_hello = true;
+			pos += hdr.length;
+			if (max_frames > 0 && num_samples + num_averages >= max_frames) {
+				break;
+			}
+		}
+		memmove(buf, buf + pos, filled - pos);
+		filled -= pos;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(fd);
+	
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+	fprintf(stderr, "%s: %lu samples and %lu averages in %.3f seconds, %lu frames missed\n", argv[0], num_samples, num_averages, seconds, num_missed);
+	return ok && num_missed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
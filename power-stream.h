@@ -0,0 +1,81 @@
+/*
+ * Live power stream protocol
+ *
+ * trace-energy-v2 -S <socket> serves the samples it takes over a local
+ * AF_UNIX stream socket. Every frame starts with a struct pstream_header,
+ * the payload follows it and the length covers the whole frame. A client
+ * first receives a HELLO frame describing the columns, then SAMPLE frames
+ * with the power of each column since the previous sample and, once per
+ * second, AVERAGE frames with the rolling averages over longer windows.
+ *
+ * Frame sequence numbers increase by one for every SAMPLE and AVERAGE frame.
+ * The HELLO frame carries the sequence number of the first frame the client
+ * will receive, so the client can check that it has not missed any frames.
+ * All values are stored in host byte order, since the socket is local.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef POWER_STREAM_H
+#define POWER_STREAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PSTREAM_MAGIC		0x5053	/* "PS" */
+#define PSTREAM_VERSION		1
+
+/* Frame types */
+#define PSTREAM_FRAME_HELLO	1
+#define PSTREAM_FRAME_SAMPLE	2
+#define PSTREAM_FRAME_AVERAGE	3
+
+// Upper limits, frames larger than this are invalid
+#define PSTREAM_MAX_COLUMNS	64
+#define PSTREAM_MAX_WINDOWS	4
+#define PSTREAM_NAME_SIZE	16
+
+struct pstream_header {
+	uint16_t magic;
+	uint16_t type;
+	// Size of the whole frame including this header
+	uint32_t length;
+	uint64_t seq;
+};
+
+/*
+ * HELLO payload:
+ *   uint32_t version
+ *   uint32_t num_columns
+ *   uint32_t num_windows
+ *   uint32_t window_ms[num_windows]	Nominal length of each averaging window
+ *   char name[num_columns][PSTREAM_NAME_SIZE]
+ *
+ * SAMPLE payload:
+ *   int64_t timestamp_ns		CLOCK_REALTIME
+ *   int64_t interval_ns		Time since the previous sample
+ *   float watts[num_columns]
+ *
+ * AVERAGE payload:
+ *   int64_t timestamp_ns
+ *   uint32_t window_ms[num_windows]	Actual length of each window, shorter at startup
+ *   float watts[num_windows][num_columns]
+ */
+
+#define PSTREAM_HEADER_SIZE	sizeof(struct pstream_header)
+#define PSTREAM_HELLO_SIZE(columns, windows)	(PSTREAM_HEADER_SIZE + 3 * sizeof(uint32_t) + (windows) * sizeof(uint32_t) + (columns) * PSTREAM_NAME_SIZE)
+#define PSTREAM_SAMPLE_SIZE(columns)		(PSTREAM_HEADER_SIZE + 2 * sizeof(int64_t) + (columns) * sizeof(float))
+#define PSTREAM_AVERAGE_SIZE(columns, windows)	(PSTREAM_HEADER_SIZE + sizeof(int64_t) + (windows) * sizeof(uint32_t) + (windows) * (columns) * sizeof(float))
+
+/* Helpers for packing and unpacking frames, the put helpers return the offset of the next value */
+static inline size_t pstream_put(unsigned char *frame, size_t offset, const void *value, size_t size) {
+	memcpy(frame + offset, value, size);
+	return offset + size;
+}
+
+static inline size_t pstream_get(const unsigned char *frame, size_t offset, void *value, size_t size) {
+	memcpy(value, frame + offset, size);
+	return offset + size;
+}
+
+#endif
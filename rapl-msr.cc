@@ -0,0 +1,118 @@
+/*
+ * librapl: MSR driver backend
+ *
+ * Reads the energy status registers through /dev/cpu/N/msr.
+ * Requires the msr kernel module and read access to the device file.
+ * All domains are read as one MSR batch, a single ioctl when msr-safe is loaded.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "rapl.h"
+#include "msr-batch.h"
+#include "msr-index.h"
+
+static const unsigned msr_energy_status[RAPL_NUM_DOMAINS] = {
+	MSR_PKG_ENERGY_STATUS,
+	MSR_PP0_ENERGY_STATUS,
+	MSR_PP1_ENERGY_STATUS,
+	MSR_DRAM_ENERGY_STATUS,
+};
+
+struct rapl_msr_priv {
+	struct msr_batch *batch;
+	// Index of each domain in the batch
+	int index[RAPL_NUM_DOMAINS];
+};
+
+static bool rapl_msr_read_all(struct rapl_source *source, uint64_t *values) {
+	struct rapl_msr_priv *priv = (struct rapl_msr_priv *)source->priv;
+	int domain;
+	
+	if (!msr_batch_read(priv->batch)) {
+		return false;
+	}
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		if (!(source->domains & RAPL_HAVE_DOMAIN(domain))) {
+			continue;
+		}
+		if (!msr_batch_ok(priv->batch, priv->index[domain])) {
+			fprintf(stderr, "rdmsr: Failed to read MSR offset 0x%04x\n", msr_energy_status[domain]);
+			return false;
+		}
+		// The energy counters are 32 bits wide
+		values[domain] = msr_batch_value(priv->batch, priv->index[domain]) & 0xffffffff;
+	}
+	
+	return true;
+}
+
+static void rapl_msr_close(struct rapl_source *source) {
+	struct rapl_msr_priv *priv = (struct rapl_msr_priv *)source->priv;
+	if (priv->batch) {
+		msr_batch_destroy(priv->batch);
+	}
+	free(priv);
+	free(source);
+}
+
+static const struct rapl_source_ops rapl_msr_ops = {
+	"msr",
+	rapl_msr_read_all,
+	rapl_msr_close,
+};
+
+struct rapl_source *rapl_open_msr(int cpu) {
+	double energy_unit = 0.0;
+	int fd = -1, domain;
+	
+	if ((fd = rapl_msr_open(cpu)) < 0) {
+		return NULL;
+	}
+	
+	if (!rapl_msr_energy_unit(fd, &energy_unit)) {
+		fprintf(stderr, "Could not read MSR_RAPL_POWER_UNIT, RAPL is not supported on CPU %d.\n", cpu);
+		close(fd);
+		return NULL;
+	}
+	
+	struct rapl_source *source = (struct rapl_source *)calloc(1, sizeof(*source));
+	struct rapl_msr_priv *priv = (struct rapl_msr_priv *)calloc(1, sizeof(*priv));
+	source->ops = &rapl_msr_ops;
+	source->num_packages = 1;
+	source->priv = priv;
+	
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		uint64_t data = 0;
+		// Probe the domain, unsupported registers fail with EIO
+		if (pread(fd, &data, sizeof(data), msr_energy_status[domain]) == sizeof(data)) {
+			source->domains |= RAPL_HAVE_DOMAIN(domain);
+		}
+		source->energy_unit[domain] = energy_unit;
+		source->counter_range[domain] = RAPL_MSR_COUNTER_RANGE;
+	}
+	close(fd);
+	
+	if (!(source->domains & RAPL_HAVE_DOMAIN(RAPL_DOMAIN_PKG))) {
+		fprintf(stderr, "Could not read MSR_PKG_ENERGY_STATUS on CPU %d.\n", cpu);
+		rapl_msr_close(source);
+		return NULL;
+	}
+	
+	priv->batch = msr_batch_create(MSR_BATCH_AUTO);
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		if (!(source->domains & RAPL_HAVE_DOMAIN(domain))) {
+			continue;
+		}
+		if ((priv->index[domain] = msr_batch_add(priv->batch, cpu, msr_energy_status[domain])) < 0) {
+			rapl_msr_close(source);
+			return NULL;
+		}
+	}
+	
+	return source;
+}
@@ -0,0 +1,173 @@
+/*
+ * librapl: Backend selection
+ *
+ * Kept separate from rapl.cc so that tools which only use the MSR helpers
+ * do not pull in the other backends when linking against librapl.a.
+ *
+ * The PAPI backend is not part of librapl.a, so that librapl builds on
+ * machines without PAPI. Tools that want it link rapl-papi.o next to the
+ * archive. Without it rapl_open_papi() is a null weak reference, the
+ * automatic selection skips PAPI and asking for it is an error.
+ *
+ * For rapl_open_all() the MSR, perf and powercap backends get one source per
+ * package, combined behind a single source by rapl_open_packages().
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rapl.h"
+
+// Defined in rapl-papi.o, which is only linked into the tools that use PAPI
+struct rapl_source *rapl_open_papi(int num_packages) __attribute__((weak));
+
+static struct rapl_source *open_papi(int num_packages, bool quiet) {
+	if (!rapl_open_papi) {
+		if (!quiet) {
+			fprintf(stderr, "This program was built without the PAPI backend.\n");
+		}
+		return NULL;
+	}
+	return rapl_open_papi(num_packages);
+}
+
+// "sim" or "sim:<options>", returns the options or NULL if they come from the environment
+static bool is_sim_backend(const char *backend, const char **options) {
+	if (strncmp(backend, "sim", 3) != 0 || (backend[3] != '\0' && backend[3] != ':')) {
+		return false;
+	}
+	*options = backend[3] ? backend + 4 : NULL;
+	return true;
+}
+
+struct rapl_source *rapl_open(const char *backend, int cpu) {
+	struct rapl_source *source = NULL;
+	const char *sim_options = NULL;
+	
+	if (backend == NULL || strcmp(backend, "auto") == 0) {
+		if ((source = open_papi(1, true)) != NULL) return source;
+		if ((source = rapl_open_msr(cpu)) != NULL) return source;
+		if ((source = rapl_open_perf(cpu)) != NULL) return source;
+		if ((source = rapl_open_powercap(cpu)) != NULL) return source;
+		fprintf(stderr, "No working RAPL backend found.\n");
+		return NULL;
+	} else if (strcmp(backend, "papi") == 0) {
+		return open_papi(1, false);
+	} else if (strcmp(backend, "msr") == 0) {
+		return rapl_open_msr(cpu);
+	} else if (strcmp(backend, "perf") == 0) {
+		return rapl_open_perf(cpu);
+	} else if (strcmp(backend, "powercap") == 0) {
+		return rapl_open_powercap(cpu);
+	} else if (is_sim_backend(backend, &sim_options)) {
+		return rapl_open_sim(sim_options, 1);
+	}
+	
+	fprintf(stderr, "Unknown RAPL backend '%s'.\n", backend);
+	return NULL;
+}
+
+struct rapl_multi_priv {
+	struct rapl_source *packages[RAPL_MAX_PACKAGES];
+};
+
+static bool rapl_multi_read(struct rapl_source *source, uint64_t *values) {
+	struct rapl_multi_priv *priv = (struct rapl_multi_priv *)source->priv;
+	int package;
+	
+	for (package = 0; package < source->num_packages; package++) {
+		if (!rapl_read(priv->packages[package], values + RAPL_VALUE_INDEX(package, 0))) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+static void rapl_multi_close(struct rapl_source *source) {
+	struct rapl_multi_priv *priv = (struct rapl_multi_priv *)source->priv;
+	int package;
+	for (package = 0; package < source->num_packages; package++) {
+		rapl_close(priv->packages[package]);
+	}
+	free(priv);
+	free(source);
+}
+
+static const struct rapl_source_ops rapl_multi_ops = {
+	"multi",
+	rapl_multi_read,
+	rapl_multi_close,
+};
+
+// Open the named single package backend for every package and combine them
+static struct rapl_source *rapl_open_packages(const char *backend, const struct rapl_package *packages, int num_packages) {
+	struct rapl_source *sources[RAPL_MAX_PACKAGES] = { NULL };
+	int i, domain;
+	
+	for (i = 0; i < num_packages; i++) {
+		if (strcmp(backend, "msr") == 0) {
+			sources[i] = rapl_open_msr(packages[i].cpu);
+		} else if (strcmp(backend, "perf") == 0) {
+			sources[i] = rapl_open_perf(packages[i].cpu);
+		} else {
+			sources[i] = rapl_open_powercap(packages[i].id);
+		}
+		if (!sources[i]) {
+			while (i-- > 0) {
+				rapl_close(sources[i]);
+			}
+			return NULL;
+		}
+	}
+	if (num_packages <= 1) {
+		return sources[0];
+	}
+	
+	struct rapl_source *source = (struct rapl_source *)calloc(1, sizeof(*source));
+	struct rapl_multi_priv *priv = (struct rapl_multi_priv *)calloc(1, sizeof(*priv));
+	source->ops = &rapl_multi_ops;
+	source->num_packages = num_packages;
+	source->priv = priv;
+	// The packages are identical, so the domains and units of the first one are used
+	source->domains = sources[0]->domains;
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		source->energy_unit[domain] = sources[0]->energy_unit[domain];
+		source->counter_range[domain] = sources[0]->counter_range[domain];
+	}
+	for (i = 0; i < num_packages; i++) {
+		priv->packages[i] = sources[i];
+		source->domains &= sources[i]->domains;
+	}
+	
+	return source;
+}
+
+struct rapl_source *rapl_open_all(const char *backend) {
+	struct rapl_package packages[RAPL_MAX_PACKAGES];
+	struct rapl_source *source = NULL;
+	const char *sim_options = NULL;
+	int num_packages = rapl_discover_packages(packages, RAPL_MAX_PACKAGES);
+	
+	if (backend == NULL || strcmp(backend, "auto") == 0) {
+		if ((source = open_papi(num_packages, true)) != NULL) return source;
+		if ((source = rapl_open_packages("msr", packages, num_packages)) != NULL) return source;
+		if ((source = rapl_open_packages("perf", packages, num_packages)) != NULL) return source;
+		if ((source = rapl_open_packages("powercap", packages, num_packages)) != NULL) return source;
+		fprintf(stderr, "No working RAPL backend found.\n");
+		return NULL;
+	} else if (strcmp(backend, "papi") == 0) {
+		return open_papi(num_packages, false);
+	} else if (strcmp(backend, "msr") == 0 || strcmp(backend, "perf") == 0 || strcmp(backend, "powercap") == 0) {
+		return rapl_open_packages(backend, packages, num_packages);
+	} else if (is_sim_backend(backend, &sim_options)) {
+		// The simulated packages do not depend on the topology of the machine
+		return rapl_open_sim(sim_options, RAPL_MAX_PACKAGES);
+	}
+	
+	fprintf(stderr, "Unknown RAPL backend '%s'.\n", backend);
+	return NULL;
+}
@@ -0,0 +1,259 @@
+/*
+ * librapl: PAPI backend
+ *
+ * Based on Filip Nybäck's energy profiling module in IgProf
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <papi.h>
+
+#include "rapl.h"
+
+// The PAPI energy events are reported in nanojoules
+static const double papi_energy_unit = 1e-9;
+
+#define PAPI_MAX_EVENTS (RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS)
+
+struct rapl_papi_priv {
+	int event_set;
+	int num_events;
+	// Maps PAPI event index to RAPL_VALUE_INDEX()
+	int index_of_event[PAPI_MAX_EVENTS];
+	long long values[PAPI_MAX_EVENTS];
+};
+
+static const char *papi_event_prefix[RAPL_NUM_DOMAINS] = {
+	"PACKAGE_ENERGY:PACKAGE",
+	"PP0_ENERGY:PACKAGE",
+	"PP1_ENERGY:PACKAGE",
+	"DRAM_ENERGY:PACKAGE",
+};
+
+// Find the domain and package of an energy event, returns -1 for other events
+static int papi_event_index(const char *event_name, int num_packages, int *domain_out) {
+	int domain;
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		const char *match = strstr(event_name, papi_event_prefix[domain]);
+		if (match) {
+			int package = atoi(match + strlen(papi_event_prefix[domain]));
+			if (package < 0 || package >= num_packages) {
+				return -1;
+			}
+			*domain_out = domain;
+			return RAPL_VALUE_INDEX(package, domain);
+		}
+	}
+	return -1;
+}
+
+static bool rapl_papi_read(struct rapl_source *source, uint64_t *values) {
+	struct rapl_papi_priv *priv = (struct rapl_papi_priv *)source->priv;
+	int i;
+	
+	if (PAPI_read(priv->event_set, priv->values) != PAPI_OK) {
+		return false;
+	}
+	for (i = 0; i < priv->num_events; i++) {
+		values[priv->index_of_event[i]] = priv->values[i];
+	}
+	
+	return true;
+}
+
+static void rapl_papi_close(struct rapl_source *source) {
+	struct rapl_papi_priv *priv = (struct rapl_papi_priv *)source->priv;
+	long long values[PAPI_MAX_EVENTS];
+	PAPI_stop(priv->event_set, values);
+	PAPI_cleanup_eventset(priv->event_set);
+	PAPI_destroy_eventset(&priv->event_set);
+	free(priv);
+	free(source);
+}
+
+static const struct rapl_source_ops rapl_papi_ops = {
+	"papi",
+	rapl_papi_read,
+	rapl_papi_close,
+};
+
+int rapl_papi_component() {
+	int retval = PAPI_library_init(PAPI_VER_CURRENT);
+	if (retval != PAPI_VER_CURRENT && retval != PAPI_OK) {
+		fprintf(stderr, "PAPI library initialisation failed.\n");
+		return -1;
+	}
+	
+	// Find the RAPL component of PAPI.
+	int num_components = PAPI_num_components();
+	int component_id;
+	const PAPI_component_info_t *component_info = 0;
+	for (component_id = 0; component_id < num_components; ++component_id) {
+		component_info = PAPI_get_component_info(component_id);
+		if (component_info && strstr(component_info->name, "rapl")) {
+			break;
+		}
+	}
+	if (component_id == num_components) {
+		fprintf(stderr, "No RAPL component found in PAPI library.\n");
+		return -1;
+	}
+	
+	if (component_info->disabled) {
+		fprintf(stderr, "RAPL component of PAPI disabled: %s.\n",
+			component_info->disabled_reason);
+		return -1;
+	}
+	
+	return component_id;
+}
+
+int rapl_papi_start(const char *const *patterns, int num_patterns, int *indices, int *event_set) {
+	int component_id = rapl_papi_component();
+	int num_events = 0;
+	int i;
+	
+	for (i = 0; i < num_patterns; i++) {
+		indices[i] = -1;
+	}
+	if (component_id < 0) {
+		return 0;
+	}
+	
+	// Create an event set.
+	*event_set = PAPI_NULL;
+	if (PAPI_create_eventset(event_set) != PAPI_OK) {
+		fprintf(stderr, "Could not create PAPI event set.\n");
+		return 0;
+	}
+	
+	int code = PAPI_NATIVE_MASK;
+	for (int retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_FIRST, component_id); retval == PAPI_OK; retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_EVENTS, component_id)) {
+		char event_name[PAPI_MAX_STR_LEN];
+		if (PAPI_event_code_to_name(code, event_name) != PAPI_OK) {
+			fprintf(stderr, "Could not get PAPI event name.\n");
+			return 0;
+		}
+		
+		PAPI_event_info_t event_info;
+		if (PAPI_get_event_info(code, &event_info) != PAPI_OK) {
+			fprintf(stderr, "Could not get PAPI event info.\n");
+			return 0;
+		}
+		if (event_info.data_type != PAPI_DATATYPE_UINT64) {
+			continue;
+		}
+		
+		for (i = 0; i < num_patterns; i++) {
+			if (strstr(event_name, patterns[i])) {
+				break;
+			}
+		}
+		if (i == num_patterns) {
+			continue; // Skip other counters
+		}
+		
+		printf("Adding %s to event set.\n", event_name);
+		if (PAPI_add_event(*event_set, code) != PAPI_OK) {
+			break;
+		}
+		indices[i] = num_events++;
+	}
+	if (num_events == 0) {
+		fprintf(stderr, "Could not find any RAPL events.\n");
+		return 0;
+	}
+	
+	// Activate the event set.
+	if (PAPI_start(*event_set) != PAPI_OK) {
+		fprintf(stderr, "Could not activate the event set.\n");
+		return 0;
+	}
+	
+	return num_events;
+}
+
+struct rapl_source *rapl_open_papi(int num_packages) {
+	bool have_event[PAPI_MAX_EVENTS] = { false };
+	int component_id = rapl_papi_component();
+	int retval = PAPI_OK;
+	if (component_id < 0) {
+		return NULL;
+	}
+	
+	if (num_packages < 1 || num_packages > RAPL_MAX_PACKAGES) {
+		fprintf(stderr, "Unsupported number of packages: %d.\n", num_packages);
+		return NULL;
+	}
+	
+	struct rapl_papi_priv *priv = (struct rapl_papi_priv *)calloc(1, sizeof(*priv));
+	
+	// Create an event set.
+	priv->event_set = PAPI_NULL;
+	if (PAPI_create_eventset(&priv->event_set) != PAPI_OK) {
+		fprintf(stderr, "Could not create PAPI event set.\n");
+		free(priv);
+		return NULL;
+	}
+	
+	struct rapl_source *source = (struct rapl_source *)calloc(1, sizeof(*source));
+	source->ops = &rapl_papi_ops;
+	source->num_packages = num_packages;
+	// PAPI returns 64-bit counts that do not wrap, counter_range stays 0
+	source->priv = priv;
+	
+	int code = PAPI_NATIVE_MASK;
+	for (retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_FIRST, component_id); retval == PAPI_OK; retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_EVENTS, component_id)) {
+		char event_name[PAPI_MAX_STR_LEN];
+		int domain = -1, index = -1;
+		if (PAPI_event_code_to_name(code, event_name) != PAPI_OK) {
+			fprintf(stderr, "Could not get PAPI event name.\n");
+			break;
+		}
+		
+		PAPI_event_info_t event_info;
+		if (PAPI_get_event_info(code, &event_info) != PAPI_OK) {
+			fprintf(stderr, "Could not get PAPI event info.\n");
+			break;
+		}
+		if (event_info.data_type != PAPI_DATATYPE_UINT64) {
+			continue;
+		}
+		
+		// All packages go into the same event set so that one PAPI_read() covers them
+		index = papi_event_index(event_name, num_packages, &domain);
+		if (index < 0 || have_event[index]) {
+			continue; // Skip other counters
+		}
+		
+		if (PAPI_add_event(priv->event_set, code) != PAPI_OK)
+			break;
+		have_event[index] = true;
+		priv->index_of_event[priv->num_events++] = index;
+		source->domains |= RAPL_HAVE_DOMAIN(domain);
+		source->energy_unit[domain] = papi_energy_unit;
+	}
+	if (priv->num_events == 0) {
+		fprintf(stderr, "Could not find any RAPL events.\n");
+		PAPI_destroy_eventset(&priv->event_set);
+		free(priv);
+		free(source);
+		return NULL;
+	}
+	
+	// Activate the event set.
+	if (PAPI_start(priv->event_set) != PAPI_OK) {
+		fprintf(stderr, "Could not activate the event set.\n");
+		PAPI_cleanup_eventset(priv->event_set);
+		PAPI_destroy_eventset(&priv->event_set);
+		free(priv);
+		free(source);
+		return NULL;
+	}
+	
+	return source;
+}
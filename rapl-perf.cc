@@ -0,0 +1,168 @@
+/*
+ * librapl: perf_event backend
+ *
+ * Reads the energy counters through the "power" PMU of the kernel
+ * (energy-pkg, energy-cores, energy-gpu and energy-ram). All domains of a
+ * package are opened as one event group with PERF_FORMAT_GROUP, so a single
+ * read() returns every counter at once. The kernel extends the counters to
+ * 64 bits, so they do not wrap around.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "rapl.h"
+
+#define PERF_POWER_PATH "/sys/bus/event_source/devices/power"
+
+// Names of the power PMU events in domain order
+static const char *perf_event_names[RAPL_NUM_DOMAINS] = {
+	"energy-pkg",
+	"energy-cores",
+	"energy-gpu",
+	"energy-ram",
+};
+
+struct rapl_perf_priv {
+	int num_events;
+	// Group members in the order they were opened, the first one is the leader
+	int fd[RAPL_NUM_DOMAINS];
+	int domain[RAPL_NUM_DOMAINS];
+};
+
+// Read the first line of a sysfs file
+static bool read_sysfs_line(const char *path, char *buf, size_t size) {
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		return false;
+	}
+	bool ok = fgets(buf, size, fp) != NULL;
+	fclose(fp);
+	return ok;
+}
+
+bool rapl_perf_event(const char *name, struct rapl_perf_event *event) {
+	char path[256], buf[64];
+	
+	if (!read_sysfs_line(PERF_POWER_PATH "/type", buf, sizeof(buf))) {
+		return false;
+	}
+	event->type = strtoul(buf, NULL, 10);
+	
+	snprintf(path, sizeof(path), PERF_POWER_PATH "/events/%s", name);
+	if (!read_sysfs_line(path, buf, sizeof(buf)) || sscanf(buf, "event=%" SCNx64, &event->config) != 1) {
+		return false;
+	}
+	
+	// The counters count in units of 2^-32 J unless the PMU says otherwise
+	event->scale = 1.0 / (1ULL << 32);
+	snprintf(path, sizeof(path), PERF_POWER_PATH "/events/%s.scale", name);
+	if (read_sysfs_line(path, buf, sizeof(buf))) {
+		event->scale = strtod(buf, NULL);
+	}
+	
+	return true;
+}
+
+int rapl_perf_open(const struct rapl_perf_event *event, int cpu, int group_fd) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = event->type;
+	attr.config = event->config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	
+	// The power PMU only supports system-wide counting on one CPU of each package
+	int fd = syscall(__NR_perf_event_open, &attr, -1, cpu, group_fd, 0);
+	if (fd < 0) {
+		int err = errno;
+		perror("perf_event_open");
+		if (err == EACCES || err == EPERM) {
+			fprintf(stderr, "System-wide perf events need CAP_PERFMON or kernel.perf_event_paranoid set to 0 or less.\n");
+		}
+		errno = err;
+	}
+	return fd;
+}
+
+static bool rapl_perf_read(struct rapl_source *source, uint64_t *values) {
+	struct rapl_perf_priv *priv = (struct rapl_perf_priv *)source->priv;
+	// Layout of PERF_FORMAT_GROUP: the number of events followed by their values
+	uint64_t buf[1 + RAPL_NUM_DOMAINS];
+	int i;
+	
+	ssize_t len = read(priv->fd[0], buf, sizeof(buf));
+	if (len < (ssize_t)((1 + priv->num_events) * sizeof(uint64_t))) {
+		perror("perf:read");
+		return false;
+	}
+	for (i = 0; i < priv->num_events; i++) {
+		values[priv->domain[i]] = buf[1 + i];
+	}
+	
+	return true;
+}
+
+static void rapl_perf_close(struct rapl_source *source) {
+	struct rapl_perf_priv *priv = (struct rapl_perf_priv *)source->priv;
+	int i;
+	// Close the members before the group leader
+	for (i = priv->num_events - 1; i >= 0; i--) {
+		close(priv->fd[i]);
+	}
+	free(priv);
+	free(source);
+}
+
+static const struct rapl_source_ops rapl_perf_ops = {
+	"perf",
+	rapl_perf_read,
+	rapl_perf_close,
+};
+
+struct rapl_source *rapl_open_perf(int cpu) {
+	struct rapl_perf_event event;
+	int domain;
+	
+	if (!rapl_perf_event(perf_event_names[RAPL_DOMAIN_PKG], &event)) {
+		fprintf(stderr, "The kernel has no perf event %s.\n", perf_event_names[RAPL_DOMAIN_PKG]);
+		return NULL;
+	}
+	
+	struct rapl_source *source = (struct rapl_source *)calloc(1, sizeof(*source));
+	struct rapl_perf_priv *priv = (struct rapl_perf_priv *)calloc(1, sizeof(*priv));
+	source->ops = &rapl_perf_ops;
+	source->num_packages = 1;
+	source->priv = priv;
+	
+	// The package domain leads the group, the others are optional
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		if (domain != RAPL_DOMAIN_PKG && !rapl_perf_event(perf_event_names[domain], &event)) {
+			continue;
+		}
+		int fd = rapl_perf_open(&event, cpu, priv->num_events > 0 ? priv->fd[0] : -1);
+		if (fd < 0) {
+			if (priv->num_events == 0) {
+				free(priv);
+				free(source);
+				return NULL;
+			}
+			continue;
+		}
+		priv->fd[priv->num_events] = fd;
+		priv->domain[priv->num_events] = domain;
+		priv->num_events++;
+		source->domains |= RAPL_HAVE_DOMAIN(domain);
+		source->energy_unit[domain] = event.scale;
+	}
+	
+	return source;
+}
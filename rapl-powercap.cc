@@ -0,0 +1,237 @@
+/*
+ * librapl: powercap sysfs backend
+ *
+ * Reads the energy counters exported by the intel_rapl driver under
+ * /sys/class/powercap. The files are kept open and read with pread().
+ * Needs neither PAPI nor the MSR driver. The counters wrap around at
+ * max_energy_range_uj of their zone. With RAPL_IO_ENGINE=uring all counters
+ * are read with a single io_uring submission.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "rapl.h"
+#include "uring-read.h"
+
+#define POWERCAP_PATH "/sys/class/powercap"
+
+// Upper limit for the number of zones probed under the powercap directory
+#define POWERCAP_MAX_ZONES 64
+
+// The powercap energy counters are reported in microjoules
+static const double powercap_energy_unit = 1e-6;
+
+struct rapl_powercap_priv {
+	int fd[RAPL_NUM_DOMAINS];
+	// Optional io_uring engine
+	struct uring_reader *ring;
+};
+
+// Read a sysfs file containing a single line into buf, strips the newline
+static bool read_sysfs_string(const char *path, char *buf, size_t size) {
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		return false;
+	}
+	if (!fgets(buf, size, fp)) {
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+	char *newline = strchr(buf, '\n');
+	if (newline) *newline = '\0';
+	return true;
+}
+
+#define COUNTER_BUF_SIZE 32
+
+static bool read_counter(int fd, uint64_t *value) {
+	char buf[COUNTER_BUF_SIZE];
+	ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0) {
+		return false;
+	}
+	buf[len] = '\0';
+	*value = strtoull(buf, NULL, 10);
+	return true;
+}
+
+static bool read_counters_uring(struct rapl_powercap_priv *priv, uint64_t *values) {
+	struct uring_read reads[RAPL_NUM_DOMAINS];
+	char bufs[RAPL_NUM_DOMAINS][COUNTER_BUF_SIZE];
+	int domains[RAPL_NUM_DOMAINS], results[RAPL_NUM_DOMAINS];
+	int domain, i, num_reads = 0;
+	
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		if (priv->fd[domain] < 0) {
+			continue;
+		}
+		reads[num_reads].fd = priv->fd[domain];
+		reads[num_reads].buf = bufs[num_reads];
+		reads[num_reads].len = COUNTER_BUF_SIZE - 1;
+		reads[num_reads].offset = 0;
+		domains[num_reads++] = domain;
+	}
+	if (!uring_read_batch(priv->ring, reads, num_reads, results)) {
+		return false;
+	}
+	for (i = 0; i < num_reads; i++) {
+		if (results[i] <= 0) {
+			fprintf(stderr, "powercap: Failed to read the %s counter: %s\n", rapl_domain_name(domains[i]), strerror(-results[i]));
+			return false;
+		}
+		bufs[i][results[i]] = '\0';
+		values[domains[i]] = strtoull(bufs[i], NULL, 10);
+	}
+	
+	return true;
+}
+
+static bool rapl_powercap_read(struct rapl_source *source, uint64_t *values) {
+	struct rapl_powercap_priv *priv = (struct rapl_powercap_priv *)source->priv;
+	int domain;
+	
+	if (priv->ring) {
+		return read_counters_uring(priv, values);
+	}
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		if (priv->fd[domain] < 0) {
+			continue;
+		}
+		if (!read_counter(priv->fd[domain], &values[domain])) {
+			perror("powercap:pread");
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+static void rapl_powercap_close(struct rapl_source *source) {
+	struct rapl_powercap_priv *priv = (struct rapl_powercap_priv *)source->priv;
+	int domain;
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		if (priv->fd[domain] >= 0) {
+			close(priv->fd[domain]);
+		}
+	}
+	if (priv->ring) {
+		uring_reader_destroy(priv->ring);
+	}
+	free(priv);
+	free(source);
+}
+
+static const struct rapl_source_ops rapl_powercap_ops = {
+	"powercap",
+	rapl_powercap_read,
+	rapl_powercap_close,
+};
+
+static int zone_domain(const char *name) {
+	if (strncmp(name, "package-", strlen("package-")) == 0) {
+		return RAPL_DOMAIN_PKG;
+	} else if (strcmp(name, "core") == 0) {
+		return RAPL_DOMAIN_PP0;
+	} else if (strcmp(name, "uncore") == 0) {
+		return RAPL_DOMAIN_PP1;
+	} else if (strcmp(name, "dram") == 0) {
+		return RAPL_DOMAIN_DRAM;
+	}
+	return -1;
+}
+
+// Open the energy counter of the zone if it belongs to one of our domains
+static void open_zone(struct rapl_source *source, const char *zone) {
+	struct rapl_powercap_priv *priv = (struct rapl_powercap_priv *)source->priv;
+	char path[256], name[64];
+	
+	snprintf(path, sizeof(path), "%s/name", zone);
+	if (!read_sysfs_string(path, name, sizeof(name))) {
+		return;
+	}
+	int domain = zone_domain(name);
+	if (domain < 0 || priv->fd[domain] >= 0) {
+		return;
+	}
+	
+	// The counter wraps to zero after reaching max_energy_range_uj
+	char range[32];
+	snprintf(path, sizeof(path), "%s/max_energy_range_uj", zone);
+	if (!read_sysfs_string(path, range, sizeof(range))) {
+		fprintf(stderr, "Could not read %s\n", path);
+		return;
+	}
+	
+	snprintf(path, sizeof(path), "%s/energy_uj", zone);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		fprintf(stderr, "Trying to open %s\n", path);
+		if (errno == EACCES) {
+			fprintf(stderr, "Recent kernels only let root read energy_uj, ask the administrator to grant read access to it.\n");
+		}
+		return;
+	}
+	priv->fd[domain] = fd;
+	source->domains |= RAPL_HAVE_DOMAIN(domain);
+	source->energy_unit[domain] = powercap_energy_unit;
+	source->counter_range[domain] = strtoull(range, NULL, 10) + 1;
+}
+
+struct rapl_source *rapl_open_powercap(int package) {
+	char zone[128], path[256], name[64], expected_name[64];
+	int i;
+	
+	// The zone index does not always match the package number, so match by name
+	snprintf(expected_name, sizeof(expected_name), "package-%d", package);
+	for (i = 0; i < POWERCAP_MAX_ZONES; i++) {
+		snprintf(zone, sizeof(zone), POWERCAP_PATH "/intel-rapl:%d", i);
+		snprintf(path, sizeof(path), "%s/name", zone);
+		if (read_sysfs_string(path, name, sizeof(name)) && strcmp(name, expected_name) == 0) {
+			break;
+		}
+	}
+	if (i == POWERCAP_MAX_ZONES) {
+		fprintf(stderr, "No powercap zone found for package %d.\n", package);
+		return NULL;
+	}
+	
+	struct rapl_source *source = (struct rapl_source *)calloc(1, sizeof(*source));
+	struct rapl_powercap_priv *priv = (struct rapl_powercap_priv *)calloc(1, sizeof(*priv));
+	for (int domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		priv->fd[domain] = -1;
+	}
+	source->ops = &rapl_powercap_ops;
+	source->num_packages = 1;
+	source->priv = priv;
+	
+	open_zone(source, zone);
+	for (int j = 0; j < POWERCAP_MAX_ZONES; j++) {
+		char subzone[192];
+		snprintf(subzone, sizeof(subzone), "%s/intel-rapl:%d:%d", zone, i, j);
+		if (access(subzone, F_OK) != 0) {
+			break;
+		}
+		open_zone(source, subzone);
+	}
+	
+	if (!(source->domains & RAPL_HAVE_DOMAIN(RAPL_DOMAIN_PKG))) {
+		fprintf(stderr, "Could not open the powercap energy counter of package %d.\n", package);
+		rapl_powercap_close(source);
+		return NULL;
+	}
+	
+	if (uring_requested() && (priv->ring = uring_reader_create(RAPL_NUM_DOMAINS)) == NULL) {
+		fprintf(stderr, "Warning: io_uring is not available, reading the powercap counters synchronously\n");
+	}
+	
+	return source;
+}
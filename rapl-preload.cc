@@ -0,0 +1,376 @@
+/*
+ * rapl-preload.cc: Statistical energy profiler loaded with LD_PRELOAD
+ *
+ * Samples the call stack of the running threads on a CPU time timer and
+ * splits the energy measured through librapl between the samples, so that
+ * unmodified binaries can be profiled:
+ *
+ *	LD_PRELOAD=./librapl-preload.so ./program
+ *	flamegraph.pl energy-profile.<pid>.folded > energy.svg
+ *
+ * A SIGPROF timer on CLOCK_PROCESS_CPUTIME_ID interrupts whichever thread is
+ * running, and the signal handler only captures the stack into a bounded
+ * lock-free queue. A background thread reads the energy counters every
+ * PROFILE_DRAIN_INTERVAL_NS and divides the energy consumed since the
+ * previous read evenly between the samples taken in between. Energy with no
+ * samples, for example while the program sleeps, is charged to [no samples].
+ * RAPL measures the whole package, so other programs running at the same
+ * time are charged to the profiled program as well.
+ *
+ * At exit the stacks are written in the folded format of the flamegraph
+ * tools with the energy in microjoules as the value, and the functions that
+ * consumed the most energy are printed to stderr. Symbols are resolved with
+ * dladdr(), link the program with -rdynamic to see its static functions.
+ *
+ * Environment variables:
+ *   RAPL_PROFILE_FREQ		Samples per second of CPU time (defaults to 100, at most 10000)
+ *   RAPL_PROFILE_OUTPUT	Output file (defaults to energy-profile.<pid>.folded)
+ *   RAPL_PROFILE_DOMAIN	RAPL domain to attribute: PKG, PP0, PP1 or DRAM (defaults to PKG)
+ *   RAPL_BACKEND		librapl backend (defaults to auto)
+ *
+ * The profiled program must not use SIGPROF itself. A child created with
+ * fork() is not profiled unless it calls exec().
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <cxxabi.h>
+
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "rapl.h"
+#include "util.h"
+
+#define PROFILE_DEFAULT_FREQ	100.0
+#define PROFILE_MAX_FREQ	10000.0
+
+// Deepest stack recorded, deeper stacks are cut at the root
+#define PROFILE_MAX_DEPTH	64
+
+// Number of samples the queue can hold, must be a power of two
+#define PROFILE_QUEUE_SIZE	1024
+
+// How often the energy is read and the queue is drained
+#define PROFILE_DRAIN_INTERVAL_NS	10000000
+
+// Number of functions printed at exit
+#define PROFILE_TOP_FUNCTIONS	10
+
+struct profile_sample {
+	int depth;
+	void *frames[PROFILE_MAX_DEPTH];
+};
+
+/*
+ * Bounded queue with many producers (the signal handlers of all threads)
+ * and one consumer. A producer reserves a slot with compare-and-swap and
+ * marks it ready when the stack has been copied.
+ */
+static struct profile_sample s_queue[PROFILE_QUEUE_SIZE];
+static int s_queue_ready[PROFILE_QUEUE_SIZE];
+static uint64_t s_queue_reserve = 0;
+static uint64_t s_queue_tail = 0;
+static unsigned long s_dropped = 0;
+
+static bool s_active = false;
+static struct rapl_source *s_rapl = NULL;
+static struct rapl_accum s_accum;
+static int s_domain = RAPL_DOMAIN_PKG;
+static double s_frequency = PROFILE_DEFAULT_FREQ;
+static char s_output[PATH_MAX];
+static timer_t s_timer;
+static pthread_t s_thread;
+static volatile int s_stop = 0;
+
+// Stacks are stored root first, energy in joules
+// Allocated by the constructor, which may run before the static constructors of this file
+static std::map<std::vector<void *>, double> *s_stacks = NULL;
+static unsigned long s_num_samples = 0;
+static double s_total_joules = 0.0;
+static double s_last_joules = 0.0;
+
+static void sigprof_handler(int sig, siginfo_t *info, void *context) {
+	void *frames[PROFILE_MAX_DEPTH + 2];
+	int saved_errno = errno;
+	uint64_t slot;
+	(void)sig;
+	(void)info;
+	(void)context;
+	
+	do {
+		slot = __atomic_load_n(&s_queue_reserve, __ATOMIC_RELAXED);
+		if (slot - __atomic_load_n(&s_queue_tail, __ATOMIC_ACQUIRE) >= PROFILE_QUEUE_SIZE) {
+			__atomic_fetch_add(&s_dropped, 1, __ATOMIC_RELAXED);
+			errno = saved_errno;
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&s_queue_reserve, &slot, slot + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	
+	// The first two frames are this handler and the signal trampoline
+	int depth = backtrace(frames, PROFILE_MAX_DEPTH + 2) - 2;
+	struct profile_sample *sample = &s_queue[slot & (PROFILE_QUEUE_SIZE - 1)];
+	sample->depth = depth > 0 ? depth : 0;
+	memcpy(sample->frames, frames + 2, sample->depth * sizeof(void *));
+	__atomic_store_n(&s_queue_ready[slot & (PROFILE_QUEUE_SIZE - 1)], 1, __ATOMIC_RELEASE);
+	errno = saved_errno;
+}
+
+static double read_joules() {
+	uint64_t values[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS] = { 0 };
+	double joules = 0.0;
+	rapl_read(s_rapl, values);
+	rapl_accum_update(&s_accum, values);
+	for (int package = 0; package < s_rapl->num_packages; package++) {
+		joules += rapl_accum_joules(&s_accum, s_rapl, package, s_domain);
+	}
+	return joules;
+}
+
+// Split the energy since the previous call between the samples in the queue
+static void drain_queue() {
+	std::vector<std::vector<void *> > stacks;
+	uint64_t tail = s_queue_tail;
+	
+	while (__atomic_load_n(&s_queue_ready[tail & (PROFILE_QUEUE_SIZE - 1)], __ATOMIC_ACQUIRE)) {
+		const struct profile_sample *sample = &s_queue[tail & (PROFILE_QUEUE_SIZE - 1)];
+		// Root first like the folded format
+		stacks.push_back(std::vector<void *>(sample->frames, sample->frames + sample->depth));
+		std::reverse(stacks.back().begin(), stacks.back().end());
+		s_queue_ready[tail & (PROFILE_QUEUE_SIZE - 1)] = 0;
+		tail++;
+		__atomic_store_n(&s_queue_tail, tail, __ATOMIC_RELEASE);
+	}
+	
+	double joules = read_joules();
+	double delta = joules - s_last_joules;
+	s_last_joules = joules;
+	s_total_joules += delta;
+	s_num_samples += stacks.size();
+	if (stacks.empty()) {
+		(*s_stacks)[std::vector<void *>()] += delta;
+		return;
+	}
+	for (size_t i = 0; i < stacks.size(); i++) {
+		(*s_stacks)[stacks[i]] += delta / stacks.size();
+	}
+}
+
+static void *drain_thread(void *arg) {
+	const struct timespec interval = { 0, PROFILE_DRAIN_INTERVAL_NS };
+	(void)arg;
+	while (!s_stop) {
+		nanosleep(&interval, NULL);
+		drain_queue();
+	}
+	return NULL;
+}
+
+static std::string symbol_name(void *ip, bool leaf) {
+	Dl_info info;
+	// Return addresses point past the call instruction
+	void *lookup = leaf ? ip : (void *)((uintptr_t)ip - 1);
+	char buf[PATH_MAX + 2];
+	
+	if (dladdr(lookup, &info) && info.dli_sname) {
+		int status = 0;
+		char *demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+		std::string name = status == 0 && demangled ? demangled : info.dli_sname;
+		free(demangled);
+		return name;
+	}
+	// Functions without a dynamic symbol are merged by the object they belong to
+	if (dladdr(lookup, &info) && info.dli_fname) {
+		const char *base = strrchr(info.dli_fname, '/');
+		snprintf(buf, sizeof(buf), "[%s]", base ? base + 1 : info.dli_fname);
+		return buf;
+	}
+	return "[unknown]";
+}
+
+static void write_profile() {
+	std::map<void *, std::string> names;
+	std::map<std::string, double> folded_joules;
+	std::map<std::string, double> self_joules;
+	
+	// Different addresses in the same functions give the same folded stack
+	for (std::map<std::vector<void *>, double>::const_iterator it = s_stacks->begin(); it != s_stacks->end(); ++it) {
+		const std::vector<void *> &stack = it->first;
+		std::string folded;
+		if (stack.empty()) {
+			folded = "[no samples]";
+		}
+		for (size_t i = 0; i < stack.size(); i++) {
+			bool leaf = i + 1 == stack.size();
+			std::map<void *, std::string>::iterator name = names.find(stack[i]);
+			if (name == names.end()) {
+				name = names.insert(std::make_pair(stack[i], symbol_name(stack[i], leaf))).first;
+			}
+			if (i > 0) {
+				folded += ';';
+			}
+			folded += name->second;
+		}
+		folded_joules[folded] += it->second;
+		self_joules[stack.empty() ? folded : names[stack.back()]] += it->second;
+	}
+	
+	FILE *fp = fopen(s_output, "w");
+	if (!fp) {
+		fprintf(stderr, "rapl-preload: Could not open '%s' for writing!\n", s_output);
+		return;
+	}
+	for (std::map<std::string, double>::const_iterator it = folded_joules.begin(); it != folded_joules.end(); ++it) {
+		// The flamegraph tools expect integer values
+		long long microjoules = llround(it->second * 1e6);
+		if (microjoules > 0) {
+			fprintf(fp, "%s %lld\n", it->first.c_str(), microjoules);
+		}
+	}
+	fclose(fp);
+	
+	fprintf(stderr, "rapl-preload: %lu samples, %.3f J of %s energy, %lu samples dropped, profile written to %s\n",
+		s_num_samples, s_total_joules, rapl_domain_name(s_domain), s_dropped, s_output);
+	std::vector<std::pair<double, std::string> > top;
+	for (std::map<std::string, double>::const_iterator it = self_joules.begin(); it != self_joules.end(); ++it) {
+		top.push_back(std::make_pair(it->second, it->first));
+	}
+	std::sort(top.rbegin(), top.rend());
+	for (size_t i = 0; i < top.size() && i < PROFILE_TOP_FUNCTIONS; i++) {
+		fprintf(stderr, "rapl-preload: %10.3f J %5.1f%%  %s\n", top[i].first,
+			s_total_joules > 0.0 ? top[i].first * 100.0 / s_total_joules : 0.0, top[i].second.c_str());
+	}
+}
+
+// A forked child has no drain thread and no timer
+static void atfork_child() {
+	s_active = false;
+}
+
+static bool parse_environment() {
+	const char *value = getenv("RAPL_PROFILE_FREQ");
+	if (value && value[0]) {
+		double freq = atof(value);
+		if (freq <= 0) {
+			fprintf(stderr, "rapl-preload: Invalid RAPL_PROFILE_FREQ '%s'\n", value);
+			return false;
+		}
+		s_frequency = freq < PROFILE_MAX_FREQ ? freq : PROFILE_MAX_FREQ;
+	}
+	value = getenv("RAPL_PROFILE_DOMAIN");
+	if (value && value[0]) {
+		for (s_domain = 0; s_domain < RAPL_NUM_DOMAINS; s_domain++) {
+			if (strcasecmp(value, rapl_domain_name(s_domain)) == 0) {
+				break;
+			}
+		}
+		if (s_domain == RAPL_NUM_DOMAINS) {
+			fprintf(stderr, "rapl-preload: Unknown RAPL_PROFILE_DOMAIN '%s'\n", value);
+			return false;
+		}
+	}
+	value = getenv("RAPL_PROFILE_OUTPUT");
+	if (value && value[0]) {
+		snprintf(s_output, sizeof(s_output), "%s", value);
+	} else {
+		snprintf(s_output, sizeof(s_output), "energy-profile.%d.folded", (int)getpid());
+	}
+	return true;
+}
+
+__attribute__((constructor))
+static void profile_start() {
+	sigset_t all_signals, old_signals;
+	void *warmup[4];
+	
+	if (!parse_environment()) {
+		return;
+	}
+	const char *backend = getenv("RAPL_BACKEND");
+	s_rapl = rapl_open_all(backend && backend[0] ? backend : "auto");
+	if (!s_rapl) {
+		fprintf(stderr, "rapl-preload: Could not open RAPL, profiling is disabled\n");
+		return;
+	}
+	if (!rapl_has_domain(s_rapl, s_domain)) {
+		fprintf(stderr, "rapl-preload: The %s domain is not available, profiling is disabled\n", rapl_domain_name(s_domain));
+		rapl_close(s_rapl);
+		return;
+	}
+	rapl_accum_init(&s_accum, s_rapl);
+	s_last_joules = read_joules();
+	s_stacks = new std::map<std::vector<void *>, double>();
+	
+	// The first call of backtrace() loads libgcc, which must not happen in the signal handler
+	backtrace(warmup, 4);
+	
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = sigprof_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, NULL) < 0) {
+		perror("rapl-preload: sigaction");
+		rapl_close(s_rapl);
+		return;
+	}
+	
+	// The drain thread must never be sampled
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+	int err = pthread_create(&s_thread, NULL, drain_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (err != 0) {
+		fprintf(stderr, "rapl-preload: Could not create the drain thread: %s\n", strerror(err));
+		rapl_close(s_rapl);
+		return;
+	}
+	
+	struct sigevent ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.sigev_notify = SIGEV_SIGNAL;
+	ev.sigev_signo = SIGPROF;
+	const long period_ns = llround(1e9 / s_frequency);
+	struct itimerspec timer_value = { { period_ns / 1000000000, period_ns % 1000000000 }, { period_ns / 1000000000, period_ns % 1000000000 } };
+	if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &ev, &s_timer) < 0 || timer_settime(s_timer, 0, &timer_value, NULL) < 0) {
+		perror("rapl-preload: timer");
+		s_stop = 1;
+		pthread_join(s_thread, NULL);
+		rapl_close(s_rapl);
+		return;
+	}
+	pthread_atfork(NULL, NULL, atfork_child);
+	s_active = true;
+}
+
+__attribute__((destructor))
+static void profile_stop() {
+	if (!s_active) {
+		return;
+	}
+	s_active = false;
+	timer_delete(s_timer);
+	s_stop = 1;
+	pthread_join(s_thread, NULL);
+	drain_queue();
+	write_profile();
+	delete s_stacks;
+	s_stacks = NULL;
+	rapl_close(s_rapl);
+}
@@ -0,0 +1,119 @@
+/*
+ * rapl-read-latency.cc
+ * Benchmark the latency of reading all RAPL domains through each librapl backend.
+ *
+ * Usage: ./rapl-read-latency [ -c <core> ] [ -n <iterations> ] [ -H <histogram file> ] [ backend ... ]
+ * The backends default to papi, msr, perf and powercap. Also prints how often the
+ * counters of each backend wrap around at the given package power. The simulated
+ * backend (sim or sim:<options>) measures the cost of the sampling code alone.
+ * Each read is timed with the TSC, see tsc-latency.h.
+ *   -H	Write the latency histograms in nanoseconds as CSV, one per backend
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rapl.h"
+#include "util.h"
+#include "tsc-latency.h"
+
+// Package power used for estimating the wrap-around period
+#define WRAP_POWER	100.0
+
+static bool do_backend(const char *backend, int core, int num_iterations, FILE *histogram_fp) {
+	uint64_t values[RAPL_NUM_DOMAINS] = { 0 };
+	int i = 0, domain = 0, num_domains = 0;
+	
+	struct rapl_source *source = rapl_open(backend, core);
+	if (!source) {
+		printf("%s: not available\n", backend);
+		return false;
+	}
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		if (rapl_has_domain(source, domain)) {
+			num_domains++;
+		}
+	}
+	
+	static struct tsc_latency lat;
+	tsc_latency_init(&lat);
+	for (i = 0; i < num_iterations; i++) {
+		uint64_t begin = tsc_latency_begin();
+		rapl_read(source, values);
+		tsc_latency_add(&lat, begin, tsc_latency_end());
+	}
+	
+	printf("%s: Average read latency for %d domains: %f nanoseconds\n", backend, num_domains, tsc_latency_mean_ns(&lat));
+	tsc_latency_print(stdout, backend, &lat);
+	tsc_latency_print_overhead(stdout, &lat);
+	if (histogram_fp) {
+		tsc_latency_dump(histogram_fp, backend, &lat);
+	}
+	double wrap_seconds = rapl_wrap_seconds(source, WRAP_POWER);
+	if (wrap_seconds > 0.0) {
+		printf("%s: Counters wrap around every %.0f seconds at %.0f W\n", backend, wrap_seconds, WRAP_POWER);
+	} else {
+		printf("%s: Counters do not wrap around\n", backend);
+	}
+	
+	rapl_close(source);
+	return true;
+}
+
+int main(int argc, char **argv) {
+	static const char *default_backends[] = { "papi", "msr", "perf", "powercap" };
+	int core = 0, num_iterations = 1000000;
+	const char *histogram_file = NULL;
+	FILE *histogram_fp = NULL;
+	int c = 0, i = 0;
+	
+	while ((c = getopt(argc, argv, "c:n:H:")) != -1) {
+		switch (c) {
+			case 'c':
+				core = atoi(optarg);
+				break;
+			case 'n':
+				num_iterations = atoi(optarg);
+				break;
+			case 'H':
+				histogram_file = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [ -c <core> ] [ -n <iterations> ] [ -H <histogram file> ] [ backend ... ]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (num_iterations <= 0) {
+		fprintf(stderr, "Error: The number of iterations must be greater than zero\n");
+		return EXIT_FAILURE;
+	}
+	
+	if (histogram_file) {
+		histogram_fp = fopen(histogram_file, "w");
+		if (!histogram_fp) {
+			fprintf(stderr, "Failed to open %s!\n", histogram_file);
+			return EXIT_FAILURE;
+		}
+	}
+	
+	do_affinity(core);
+	
+	if (optind < argc) {
+		for (i = optind; i < argc; i++) {
+			do_backend(argv[i], core, num_iterations, histogram_fp);
+		}
+	} else {
+		for (i = 0; i < (int)(sizeof(default_backends) / sizeof(default_backends[0])); i++) {
+			do_backend(default_backends[i], core, num_iterations, histogram_fp);
+		}
+	}
+	
+	if (histogram_fp) {
+		fclose(histogram_fp);
+	}
+	return 0;
+}
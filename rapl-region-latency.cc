@@ -0,0 +1,107 @@
+/*
+ * rapl-region-latency.cc
+ * Benchmark the overhead of rapl_region_begin() and rapl_region_end() and
+ * attribute the energy of an exp() loop running on several threads.
+ *
+ * Start the publisher first to get energy numbers: ./trace-energy-v2 -M /rapl-energy
+ * The region report is printed when the program exits.
+ *
+ * Each begin/end pair is timed with the TSC, see tsc-latency.h.
+ *
+ * Usage: ./rapl-region-latency [ -n <iterations> ] [ -t <threads> ] [ -H <histogram file> ]
+ *   -H	Write the latency histogram in nanoseconds as CSV
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "rapl-region.h"
+#include "tsc-latency.h"
+
+// Number of exp() calls in one region
+#define EXP_CALLS_PER_REGION 1000
+
+static int num_iterations = 1000000;
+
+static void *exp_thread(void *arg) {
+	volatile double sum = 0.0;
+	double input = 1.0 + (long)arg * 1e-3;
+	
+	for (int i = 0; i < num_iterations / EXP_CALLS_PER_REGION; i++) {
+		rapl_region_scope scope("exp");
+		for (int j = 0; j < EXP_CALLS_PER_REGION; j++) {
+			sum = sum + exp(input + j * 1e-9);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	const char *histogram_file = NULL;
+	int num_threads = 1, i = 0, c = 0;
+	
+	while ((c = getopt(argc, argv, "n:t:H:")) != -1) {
+		switch (c) {
+			case 'n':
+				num_iterations = atoi(optarg);
+				break;
+			case 't':
+				num_threads = atoi(optarg);
+				break;
+			case 'H':
+				histogram_file = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [ -n <iterations> ] [ -t <threads> ] [ -H <histogram file> ]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (num_iterations <= 0 || num_threads <= 0) {
+		fprintf(stderr, "Error: The number of iterations and threads must be greater than zero\n");
+		return EXIT_FAILURE;
+	}
+	
+	// The first call initializes the regions, keep it out of the measurement
+	rapl_region_begin("empty");
+	rapl_region_end();
+	
+	static struct tsc_latency lat;
+	tsc_latency_init(&lat);
+	for (i = 0; i < num_iterations; i++) {
+		uint64_t begin = tsc_latency_begin();
+		rapl_region_begin("empty");
+		rapl_region_end();
+		tsc_latency_add(&lat, begin, tsc_latency_end());
+	}
+	printf("Average rapl_region_begin() + rapl_region_end() latency: %f nanoseconds\n", tsc_latency_mean_ns(&lat));
+	tsc_latency_print(stdout, "rapl_region_begin() + rapl_region_end()", &lat);
+	tsc_latency_print_overhead(stdout, &lat);
+	if (histogram_file) {
+		FILE *fp = fopen(histogram_file, "w");
+		if (!fp) {
+			fprintf(stderr, "Failed to open %s!\n", histogram_file);
+			return EXIT_FAILURE;
+		}
+		tsc_latency_dump(fp, "rapl_region_begin() + rapl_region_end()", &lat);
+		fclose(fp);
+	}
+	
+	pthread_t *threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+	uint64_t start = tsc_latency_monotonic_ns();
+	for (i = 0; i < num_threads; i++) {
+		pthread_create(&threads[i], NULL, exp_thread, (void *)(long)i);
+	}
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	uint64_t end = tsc_latency_monotonic_ns();
+	printf("%d threads called exp() %d times each in %f seconds\n", num_threads, num_iterations / EXP_CALLS_PER_REGION * EXP_CALLS_PER_REGION, (end - start) * 1e-9);
+	free(threads);
+	
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,322 @@
+/*
+ * Energy regions: attribute energy and cycles to parts of a program
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rapl-region.h"
+#include "rapl-shm.h"
+#include "util.h"
+
+#if __x86_64__ || __i386__
+#define RDTSC(v)							\
+  do { unsigned lo, hi;							\
+    __asm__ volatile("rdtsc" : "=a" (lo), "=d" (hi));			\
+    (v) = ((uint64_t) lo) | ((uint64_t) hi << 32);			\
+  } while (0)
+#else
+// Nanoseconds stand in for cycles where there is no TSC
+#define RDTSC(v)							\
+  do { struct timespec ts;						\
+    clock_gettime(CLOCK_MONOTONIC, &ts);				\
+    (v) = ts.tv_sec * 1000000000ULL + ts.tv_nsec;			\
+  } while (0)
+#endif
+
+// Size of the table that maps name addresses to region IDs, must be a power of two
+#define LOOKUP_SIZE (4 * RAPL_REGION_MAX)
+
+#define REGION_NAME_SIZE 64
+
+// Totals shared by all threads, each region has its own cache lines
+struct region {
+	char name[REGION_NAME_SIZE];
+	uint64_t calls;
+	uint64_t cycles;
+	// Raw counter steps summed over the packages
+	uint64_t energy[RAPL_SHM_NUM_DOMAINS];
+} __attribute__((aligned(64)));
+
+struct region_frame {
+	int id;
+	bool have_energy;
+	uint64_t tsc;
+	uint64_t energy[RAPL_SHM_NUM_DOMAINS];
+};
+
+static struct region s_regions[RAPL_REGION_MAX];
+static int s_num_regions = 0;
+static pthread_mutex_t s_regions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Name address to region ID, keys are published with release stores
+static const char *s_lookup_keys[LOOKUP_SIZE];
+static int s_lookup_ids[LOOKUP_SIZE];
+
+static pthread_once_t s_init_once = PTHREAD_ONCE_INIT;
+static int s_initialized = 0;
+static const struct rapl_shm *s_shm = NULL;
+static const char *s_shm_name = NULL;
+// Set when the sampler stopped in the middle of publishing, the counters are not read after that
+static int s_shm_stopped = 0;
+
+// Used for converting cycles to seconds in the report
+static uint64_t s_start_tsc = 0;
+static struct timespec s_start_time;
+
+// Misuse is counted instead of reported on the hot path
+static uint64_t s_unmatched_ends = 0;
+static uint64_t s_too_deep = 0;
+static uint64_t s_too_many_regions = 0;
+static uint64_t s_calls_without_energy = 0;
+
+static __thread struct region_frame t_stack[RAPL_REGION_MAX_DEPTH];
+static __thread int t_depth = 0;
+
+static void report_at_exit() {
+	const char *path = getenv("RAPL_REGION_REPORT");
+	if (path && path[0]) {
+		FILE *fp = fopen(path, "w");
+		if (fp) {
+			rapl_region_report(fp);
+			fclose(fp);
+			return;
+		}
+		perror("fopen");
+	}
+	rapl_region_report(stderr);
+}
+
+static void region_init() {
+	s_shm_name = getenv("RAPL_SHM_NAME");
+	if (!s_shm_name || !s_shm_name[0]) {
+		s_shm_name = RAPL_SHM_DEFAULT_NAME;
+	}
+	s_shm = rapl_shm_attach(s_shm_name);
+	clock_gettime(CLOCK_MONOTONIC, &s_start_time);
+	RDTSC(s_start_tsc);
+	atexit(report_at_exit);
+	__atomic_store_n(&s_initialized, 1, __ATOMIC_RELEASE);
+}
+
+static inline void ensure_init() {
+	if (unlikely(!__atomic_load_n(&s_initialized, __ATOMIC_ACQUIRE))) {
+		pthread_once(&s_init_once, region_init);
+	}
+}
+
+// Sum the counters of each domain over the packages, returns false if there are no counters to read
+static inline bool read_energy(uint64_t *energy) {
+	struct rapl_shm_sample sample;
+	int domain, package;
+	
+	for (domain = 0; domain < RAPL_SHM_NUM_DOMAINS; domain++) {
+		energy[domain] = 0;
+	}
+	if (!s_shm || unlikely(__atomic_load_n(&s_shm_stopped, __ATOMIC_RELAXED))) {
+		return false;
+	}
+	if (unlikely(rapl_shm_read(s_shm, &sample) < 0)) {
+		__atomic_store_n(&s_shm_stopped, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	for (package = 0; package < (int)s_shm->num_packages; package++) {
+		for (domain = 0; domain < RAPL_SHM_NUM_DOMAINS; domain++) {
+			energy[domain] += sample.energy[package * RAPL_SHM_NUM_DOMAINS + domain];
+		}
+	}
+	return true;
+}
+
+// Called with the lock held, returns -1 if there is no room for a new region
+static int find_or_add_region(const char *name) {
+	int id;
+	for (id = 0; id < s_num_regions; id++) {
+		if (strncmp(s_regions[id].name, name, REGION_NAME_SIZE - 1) == 0) {
+			return id;
+		}
+	}
+	if (s_num_regions == RAPL_REGION_MAX) {
+		return -1;
+	}
+	id = s_num_regions;
+	strncpy(s_regions[id].name, name, REGION_NAME_SIZE - 1);
+	// The report reads the count without the lock
+	__atomic_store_n(&s_num_regions, id + 1, __ATOMIC_RELEASE);
+	return id;
+}
+
+static inline unsigned lookup_hash(const char *name) {
+	uintptr_t key = (uintptr_t)name;
+	return (unsigned)((key >> 3) ^ (key >> 12)) & (LOOKUP_SIZE - 1);
+}
+
+static int lookup_region_slow(const char *name) {
+	unsigned slot = lookup_hash(name);
+	int id = -1;
+	
+	pthread_mutex_lock(&s_regions_lock);
+	for (unsigned probe = 0; probe < LOOKUP_SIZE; probe++, slot = (slot + 1) & (LOOKUP_SIZE - 1)) {
+		const char *key = s_lookup_keys[slot];
+		if (key == name) {
+			// Another thread added it meanwhile
+			id = s_lookup_ids[slot];
+			break;
+		}
+		if (key == NULL) {
+			id = find_or_add_region(name);
+			if (id >= 0) {
+				s_lookup_ids[slot] = id;
+				__atomic_store_n(&s_lookup_keys[slot], name, __ATOMIC_RELEASE);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s_regions_lock);
+	return id;
+}
+
+// Lock-free unless the name has not been seen before
+static inline int lookup_region(const char *name) {
+	unsigned slot = lookup_hash(name);
+	for (unsigned probe = 0; probe < LOOKUP_SIZE; probe++, slot = (slot + 1) & (LOOKUP_SIZE - 1)) {
+		const char *key = __atomic_load_n(&s_lookup_keys[slot], __ATOMIC_ACQUIRE);
+		if (likely(key == name)) {
+			return s_lookup_ids[slot];
+		}
+		if (key == NULL) {
+			break;
+		}
+	}
+	return lookup_region_slow(name);
+}
+
+int rapl_region_register(const char *name) {
+	ensure_init();
+	pthread_mutex_lock(&s_regions_lock);
+	int id = find_or_add_region(name);
+	pthread_mutex_unlock(&s_regions_lock);
+	return id;
+}
+
+void rapl_region_begin_id(int id) {
+	ensure_init();
+	if (unlikely(t_depth >= RAPL_REGION_MAX_DEPTH || id < 0)) {
+		// Still pushed, so that the matching end pops the right frame
+		if (t_depth >= RAPL_REGION_MAX_DEPTH) {
+			__atomic_fetch_add(&s_too_deep, 1, __ATOMIC_RELAXED);
+		} else {
+			__atomic_fetch_add(&s_too_many_regions, 1, __ATOMIC_RELAXED);
+			t_stack[t_depth].id = -1;
+		}
+		t_depth++;
+		return;
+	}
+	struct region_frame *frame = &t_stack[t_depth++];
+	frame->id = id;
+	frame->have_energy = read_energy(frame->energy);
+	RDTSC(frame->tsc);
+}
+
+void rapl_region_begin(const char *name) {
+	rapl_region_begin_id(lookup_region(name));
+}
+
+void rapl_region_end(void) {
+	uint64_t tsc, energy[RAPL_SHM_NUM_DOMAINS];
+	
+	RDTSC(tsc);
+	if (unlikely(t_depth == 0)) {
+		__atomic_fetch_add(&s_unmatched_ends, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	t_depth--;
+	if (unlikely(t_depth >= RAPL_REGION_MAX_DEPTH || t_stack[t_depth].id < 0)) {
+		return;
+	}
+	const struct region_frame *frame = &t_stack[t_depth];
+	struct region *region = &s_regions[frame->id];
+	bool have_energy = read_energy(energy) && frame->have_energy;
+	
+	__atomic_fetch_add(&region->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&region->cycles, tsc - frame->tsc, __ATOMIC_RELAXED);
+	if (have_energy) {
+		for (int domain = 0; domain < RAPL_SHM_NUM_DOMAINS; domain++) {
+			__atomic_fetch_add(&region->energy[domain], energy[domain] - frame->energy[domain], __ATOMIC_RELAXED);
+		}
+	} else if (s_shm) {
+		__atomic_fetch_add(&s_calls_without_energy, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void rapl_region_report(FILE *fp) {
+	struct timespec now;
+	uint64_t now_tsc;
+	int id, domain;
+	
+	ensure_init();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	RDTSC(now_tsc);
+	double elapsed = (now.tv_sec - s_start_time.tv_sec) + (now.tv_nsec - s_start_time.tv_nsec) * 1e-9;
+	double cycles_per_second = elapsed > 0.0 ? (now_tsc - s_start_tsc) / elapsed : 0.0;
+	
+	fprintf(fp, "# rapl-region report\n");
+	fprintf(fp, "# TSC frequency: %.3f MHz\n", cycles_per_second * 1e-6);
+	if (s_shm) {
+		fprintf(fp, "# Energy source: %s (%u packages)\n", s_shm_name, s_shm->num_packages);
+	} else {
+		fprintf(fp, "# Energy source: not available, start trace-energy-v2 -M %s first\n", s_shm_name);
+	}
+	if (s_unmatched_ends || s_too_deep || s_too_many_regions) {
+		fprintf(fp, "# Warning: %lu ends without a begin, %lu regions nested too deep, %lu regions over the limit of %d\n",
+			(unsigned long)s_unmatched_ends, (unsigned long)s_too_deep, (unsigned long)s_too_many_regions, RAPL_REGION_MAX);
+	}
+	
+	if (s_shm_stopped) {
+		fprintf(fp, "# Warning: The sampler stopped while publishing, the energy of %lu calls is missing\n", (unsigned long)s_calls_without_energy);
+	}
+	
+	fprintf(fp, "# Region, calls, cycles, seconds");
+	if (s_shm) {
+		for (domain = 0; domain < RAPL_SHM_NUM_DOMAINS; domain++) {
+			if (rapl_shm_has_domain(s_shm, domain)) {
+				static const char *domain_names[RAPL_SHM_NUM_DOMAINS] = { "PKG", "PP0", "PP1", "DRAM" };
+				fprintf(fp, ", %s J", domain_names[domain]);
+			}
+		}
+		if (rapl_shm_has_domain(s_shm, RAPL_SHM_DOMAIN_PKG)) {
+			fprintf(fp, ", PKG W");
+		}
+	}
+	fprintf(fp, "\n");
+	
+	const int num_regions = __atomic_load_n(&s_num_regions, __ATOMIC_ACQUIRE);
+	for (id = 0; id < num_regions; id++) {
+		const struct region *region = &s_regions[id];
+		uint64_t calls = __atomic_load_n(&region->calls, __ATOMIC_RELAXED);
+		uint64_t cycles = __atomic_load_n(&region->cycles, __ATOMIC_RELAXED);
+		if (calls == 0) {
+			continue;
+		}
+		double seconds = cycles_per_second > 0.0 ? cycles / cycles_per_second : 0.0;
+		fprintf(fp, "%s, %lu, %lu, %.6f", region->name, (unsigned long)calls, (unsigned long)cycles, seconds);
+		if (s_shm) {
+			for (domain = 0; domain < RAPL_SHM_NUM_DOMAINS; domain++) {
+				if (rapl_shm_has_domain(s_shm, domain)) {
+					fprintf(fp, ", %.6f", __atomic_load_n(&region->energy[domain], __ATOMIC_RELAXED) * s_shm->energy_unit[domain]);
+				}
+			}
+			if (rapl_shm_has_domain(s_shm, RAPL_SHM_DOMAIN_PKG)) {
+				double joules = __atomic_load_n(&region->energy[RAPL_SHM_DOMAIN_PKG], __ATOMIC_RELAXED) * s_shm->energy_unit[RAPL_SHM_DOMAIN_PKG];
+				fprintf(fp, ", %.3f", seconds > 0.0 ? joules / seconds : 0.0);
+			}
+		}
+		fprintf(fp, "\n");
+	}
+}
@@ -0,0 +1,76 @@
+/*
+ * Energy regions: attribute energy and cycles to parts of a program
+ *
+ *	rapl_region_begin("solve");
+ *	solve();
+ *	rapl_region_end();
+ *
+ * Each region counts its calls, the TSC cycles spent in it and the energy
+ * the packages consumed meanwhile. The energy is read from the counters that
+ * trace-energy-v2 -M publishes in shared memory (see rapl-shm.h), so begin
+ * and end only read the TSC and the shared memory segment and never make a
+ * system call. Without a publisher only the calls and the cycles are counted.
+ *
+ * The totals of every region are shared by all threads and a report is
+ * written when the program exits. Regions may nest, the energy and cycles of
+ * an inner region are also included in the outer one. RAPL measures whole
+ * packages and updates about once per millisecond, so the energy of a short
+ * region is only meaningful as a total over many calls, and regions that run
+ * at the same time on different threads see the same energy.
+ *
+ * Environment variables:
+ *   RAPL_SHM_NAME		Shared memory segment to read (defaults to /rapl-energy)
+ *   RAPL_REGION_REPORT		File the report is written to (defaults to stderr)
+ *
+ * Link with librapl.a -pthread -lrt.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef RAPL_REGION_H
+#define RAPL_REGION_H
+
+#include <stdio.h>
+
+// Upper limit for the number of distinct regions
+#define RAPL_REGION_MAX		256
+
+// Upper limit for the nesting depth of the regions of one thread
+#define RAPL_REGION_MAX_DEPTH	64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Start a region. Regions are looked up by the address of the name, so the
+ * name must not change while the program runs (a string literal is best).
+ * Use rapl_region_register() for names built at runtime.
+ */
+void rapl_region_begin(const char *name);
+
+// End the innermost region of the calling thread
+void rapl_region_end(void);
+
+// Look up or create a region by its contents, returns its ID or -1 if there are too many regions
+int rapl_region_register(const char *name);
+void rapl_region_begin_id(int id);
+
+// Write the totals of all regions, this is done automatically at exit
+void rapl_region_report(FILE *fp);
+
+#ifdef __cplusplus
+}
+
+// Ends the region when it goes out of scope
+struct rapl_region_scope {
+	explicit rapl_region_scope(const char *name) {
+		rapl_region_begin(name);
+	}
+	~rapl_region_scope() {
+		rapl_region_end();
+	}
+};
+#endif
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * Energy counters published in shared memory
+ *
+ * A sampler (trace-energy-v2 -M <name>) publishes the latest accumulated
+ * 64-bit energy counters of every package and domain together with the time
+ * they were read into a POSIX shared memory segment. Any process can then
+ * read them without system calls, PAPI or access to the MSR device:
+ *
+ *	const struct rapl_shm *shm = rapl_shm_attach("/rapl-energy");
+ *	struct rapl_shm_sample sample;
+ *	rapl_shm_read(shm, &sample);
+ *	double joules = rapl_shm_joules(shm, &sample, 0, RAPL_SHM_DOMAIN_PKG);
+ *
+ * The counters are protected with a sequence lock. The sequence number is
+ * odd while the sampler is writing, and the reader retries if the sequence
+ * number was odd or changed while it was copying the counters. Readers never
+ * write to the segment, so they do not slow down the sampler or each other.
+ * A sampler that dies in the middle of publishing leaves the sequence number
+ * odd, so the reader gives up once the sampler is gone or after
+ * RAPL_SHM_MAX_RETRIES retries instead of waiting forever.
+ *
+ * Usable from C and C++. This header has no other dependencies, link with
+ * -lrt on old glibc.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef RAPL_SHM_H
+#define RAPL_SHM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define RAPL_SHM_MAGIC		0x4c504152	/* "RAPL" */
+#define RAPL_SHM_VERSION	1
+
+// Default name of the segment
+#define RAPL_SHM_DEFAULT_NAME	"/rapl-energy"
+
+// A publish takes well under a microsecond, the reader checks that the sampler is alive every so many retries
+#define RAPL_SHM_CHECK_RETRIES	1024
+#define RAPL_SHM_MAX_RETRIES	(1 << 24)
+
+/* Same domains and layout as rapl.h */
+#define RAPL_SHM_DOMAIN_PKG	0
+#define RAPL_SHM_DOMAIN_PP0	1
+#define RAPL_SHM_DOMAIN_PP1	2
+#define RAPL_SHM_DOMAIN_DRAM	3
+#define RAPL_SHM_NUM_DOMAINS	4
+#define RAPL_SHM_MAX_PACKAGES	8
+#define RAPL_SHM_MAX_VALUES	(RAPL_SHM_MAX_PACKAGES * RAPL_SHM_NUM_DOMAINS)
+
+struct rapl_shm {
+	// Written once before the magic is set
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_packages;
+	// Bit mask of the domains that are available
+	uint32_t domains;
+	// Joules per counter step for each domain
+	double energy_unit[RAPL_SHM_NUM_DOMAINS];
+	// Process ID of the sampler, 0 after it has stopped
+	int32_t publisher_pid;
+	
+	// Protected by the sequence lock, on its own cache lines
+	uint64_t seq __attribute__((aligned(64)));
+	// CLOCK_REALTIME time of the read in nanoseconds
+	int64_t timestamp_ns;
+	// Accumulated counters indexed with package * RAPL_SHM_NUM_DOMAINS + domain
+	uint64_t energy[RAPL_SHM_MAX_VALUES];
+};
+
+struct rapl_shm_sample {
+	// Number of samples published before this one
+	uint64_t seq;
+	int64_t timestamp_ns;
+	uint64_t energy[RAPL_SHM_MAX_VALUES];
+};
+
+/* Reader side */
+
+// Map the segment read-only, returns NULL if it does not exist or is not valid
+static inline const struct rapl_shm *rapl_shm_attach(const char *name) {
+	struct stat st;
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct rapl_shm)) {
+		close(fd);
+		return NULL;
+	}
+	void *addr = mmap(NULL, sizeof(struct rapl_shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return NULL;
+	}
+	const struct rapl_shm *shm = (const struct rapl_shm *)addr;
+	if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != RAPL_SHM_MAGIC || shm->version != RAPL_SHM_VERSION) {
+		munmap(addr, sizeof(struct rapl_shm));
+		return NULL;
+	}
+	return shm;
+}
+
+static inline void rapl_shm_detach(const struct rapl_shm *shm) {
+	munmap((void *)shm, sizeof(struct rapl_shm));
+}
+
+static inline void rapl_shm_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+// Whether the sampler has not stopped and its process still exists, errno is preserved
+static inline bool rapl_shm_publisher_alive(const struct rapl_shm *shm) {
+	pid_t pid = __atomic_load_n(&shm->publisher_pid, __ATOMIC_ACQUIRE);
+	int saved_errno = errno;
+	bool alive = pid != 0 && (kill(pid, 0) == 0 || errno == EPERM);
+	errno = saved_errno;
+	return alive;
+}
+
+/*
+ * Copy a consistent snapshot of the counters. Returns the number of retries
+ * that were needed because the sampler was publishing at the same time, or
+ * -1 if the sampler stopped in the middle of publishing and the counters
+ * will not become consistent again.
+ */
+static inline int rapl_shm_read(const struct rapl_shm *shm, struct rapl_shm_sample *sample) {
+	const unsigned num_values = shm->num_packages * RAPL_SHM_NUM_DOMAINS;
+	int retries = 0;
+	uint64_t seq1, seq2;
+	
+	while (true) {
+		seq1 = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq1 & 1) {
+			retries++;
+			if (retries % RAPL_SHM_CHECK_RETRIES == 0 && (retries >= RAPL_SHM_MAX_RETRIES || !rapl_shm_publisher_alive(shm))) {
+				return -1;
+			}
+			rapl_shm_cpu_relax();
+			continue;
+		}
+		sample->timestamp_ns = __atomic_load_n(&shm->timestamp_ns, __ATOMIC_RELAXED);
+		for (unsigned i = 0; i < num_values; i++) {
+			sample->energy[i] = __atomic_load_n(&shm->energy[i], __ATOMIC_RELAXED);
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq2 = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+		if (seq1 == seq2) {
+			break;
+		}
+		retries++;
+	}
+	sample->seq = seq1 / 2;
+	return retries;
+}
+
+static inline bool rapl_shm_has_domain(const struct rapl_shm *shm, int domain) {
+	return (shm->domains >> domain) & 1;
+}
+
+static inline double rapl_shm_joules(const struct rapl_shm *shm, const struct rapl_shm_sample *sample, int package, int domain) {
+	return sample->energy[package * RAPL_SHM_NUM_DOMAINS + domain] * shm->energy_unit[domain];
+}
+
+/* Publisher side */
+
+// Create or reuse the segment, returns NULL on failure
+static inline struct rapl_shm *rapl_shm_create(const char *name, uint32_t num_packages, uint32_t domains, const double *energy_unit) {
+	if (num_packages < 1 || num_packages > RAPL_SHM_MAX_PACKAGES) {
+		return NULL;
+	}
+	int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if (fd < 0) {
+		return NULL;
+	}
+	// Readers of other users must be able to map the segment regardless of the umask
+	if (fchmod(fd, 0644) < 0 || ftruncate(fd, sizeof(struct rapl_shm)) < 0) {
+		close(fd);
+		return NULL;
+	}
+	void *addr = mmap(NULL, sizeof(struct rapl_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return NULL;
+	}
+	
+	struct rapl_shm *shm = (struct rapl_shm *)addr;
+	// A segment left behind by a previous sampler is invalidated while it is filled in again
+	__atomic_store_n(&shm->magic, 0, __ATOMIC_RELEASE);
+	shm->version = RAPL_SHM_VERSION;
+	shm->num_packages = num_packages;
+	shm->domains = domains;
+	memcpy(shm->energy_unit, energy_unit, sizeof(shm->energy_unit));
+	shm->publisher_pid = getpid();
+	shm->seq = 0;
+	shm->timestamp_ns = 0;
+	memset(shm->energy, 0, sizeof(shm->energy));
+	__atomic_store_n(&shm->magic, RAPL_SHM_MAGIC, __ATOMIC_RELEASE);
+	return shm;
+}
+
+// Publish new counters, energy has num_packages * RAPL_SHM_NUM_DOMAINS values
+static inline void rapl_shm_publish(struct rapl_shm *shm, int64_t timestamp_ns, const uint64_t *energy) {
+	const unsigned num_values = shm->num_packages * RAPL_SHM_NUM_DOMAINS;
+	const uint64_t seq = shm->seq;
+	
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&shm->timestamp_ns, timestamp_ns, __ATOMIC_RELAXED);
+	for (unsigned i = 0; i < num_values; i++) {
+		__atomic_store_n(&shm->energy[i], energy[i], __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Mark the sampler as stopped and remove the name, mapped readers keep their view
+static inline void rapl_shm_destroy(struct rapl_shm *shm, const char *name) {
+	__atomic_store_n(&shm->publisher_pid, 0, __ATOMIC_RELEASE);
+	munmap(shm, sizeof(struct rapl_shm));
+	shm_unlink(name);
+}
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ * rapl-sim-preload.cc: Simulated MSR driver loaded with LD_PRELOAD
+ *
+ * Lets the tools that open /dev/cpu/N/msr themselves run on machines without
+ * RAPL or without root, for example to measure the overhead of the sampling
+ * loops on a build server:
+ *
+ *	LD_PRELOAD=./librapl-sim.so RAPL_SIM=period=0.001,jitter=0.0001 ./msr-poll-gaps
+ *
+ * Opening /dev/cpu/N/msr returns a descriptor of /dev/null for every CPU of
+ * the machine, and pread() and pwrite() on it are served from the model in
+ * rapl-sim.h. The CPUs are divided evenly between the simulated packages.
+ * /proc/cpuinfo is replaced with one that reports an Intel CPU of the model
+ * given in the options, so the model checks of the tools pass. The msr_batch
+ * device is reported missing, so the MSR batches fall back to pread().
+ *
+ * Reads with io_uring go to the kernel directly, RAPL_IO_ENGINE is cleared
+ * so librapl does not use it.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+// The fortified wrappers of open() are inline functions that cannot be redefined
+#undef _FORTIFY_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+#include "rapl-sim.h"
+
+// Highest descriptor that can be a simulated MSR file
+#define SIM_MAX_FDS	65536
+
+#define SIM_CPUINFO	"/proc/cpuinfo"
+#define SIM_MSR_BATCH	"/dev/cpu/msr_batch"
+
+static struct rapl_sim *s_sim = NULL;
+static int s_num_cpus = 1;
+static char *s_cpuinfo = NULL;
+static size_t s_cpuinfo_len = 0;
+static pthread_once_t s_init_once = PTHREAD_ONCE_INIT;
+
+// CPU + 1 of each simulated MSR file, 0 for other descriptors
+static int s_fd_cpu[SIM_MAX_FDS];
+
+static int (*real_open)(const char *, int, ...) = NULL;
+static int (*real_openat)(int, const char *, int, ...) = NULL;
+static int (*real_close)(int) = NULL;
+static ssize_t (*real_pread)(int, void *, size_t, off_t) = NULL;
+static ssize_t (*real_pwrite)(int, const void *, size_t, off_t) = NULL;
+static FILE *(*real_fopen)(const char *, const char *) = NULL;
+
+template <typename T>
+static T real(T *fn, const char *name) {
+	if (!*fn) {
+		*fn = (T)dlsym(RTLD_NEXT, name);
+	}
+	return *fn;
+}
+
+static void build_cpuinfo() {
+	int num_packages = rapl_sim_num_packages(s_sim);
+	size_t size = 0;
+	FILE *fp = open_memstream(&s_cpuinfo, &size);
+	
+	for (int cpu = 0; cpu < s_num_cpus; cpu++) {
+		fprintf(fp, "processor\t: %d\n", cpu);
+		fprintf(fp, "vendor_id\t: GenuineIntel\n");
+		fprintf(fp, "cpu family\t: 6\n");
+		fprintf(fp, "model\t\t: %d\n", rapl_sim_cpu_model(s_sim));
+		fprintf(fp, "model name\t: Simulated RAPL CPU\n");
+		fprintf(fp, "physical id\t: %d\n\n", cpu * num_packages / s_num_cpus);
+	}
+	fclose(fp);
+	s_cpuinfo_len = size;
+}
+
+static void sim_init() {
+	if ((s_sim = rapl_sim_create(NULL)) == NULL) {
+		fprintf(stderr, "librapl-sim: Invalid %s options\n", RAPL_SIM_ENV);
+		exit(EXIT_FAILURE);
+	}
+	long cpus = sysconf(_SC_NPROCESSORS_CONF);
+	s_num_cpus = cpus > 0 ? cpus : 1;
+	build_cpuinfo();
+}
+
+__attribute__((constructor))
+static void sim_constructor() {
+	const char *engine = getenv("RAPL_IO_ENGINE");
+	if (engine && strcmp(engine, "uring") == 0) {
+		fprintf(stderr, "librapl-sim: io_uring reads cannot be simulated, reading the MSRs with pread()\n");
+		unsetenv("RAPL_IO_ENGINE");
+	}
+	// Start the clock of the model with the program
+	pthread_once(&s_init_once, sim_init);
+}
+
+// The CPU of a /dev/cpu/N/msr path or -1
+static int msr_path_cpu(const char *path) {
+	int cpu = -1, len = 0;
+	if (path && sscanf(path, "/dev/cpu/%d/msr%n", &cpu, &len) == 1 && len > 0 && path[len] == '\0') {
+		return cpu;
+	}
+	return -1;
+}
+
+// Returns false if the path is not simulated, otherwise *fd is the result of the open
+static bool sim_open(const char *path, int flags, int *fd) {
+	if (path && strcmp(path, SIM_MSR_BATCH) == 0) {
+		errno = ENOENT;
+		*fd = -1;
+		return true;
+	}
+	int cpu = msr_path_cpu(path);
+	if (cpu < 0) {
+		return false;
+	}
+	pthread_once(&s_init_once, sim_init);
+	
+	*fd = -1;
+	if (cpu >= s_num_cpus) {
+		errno = ENXIO;
+		return true;
+	}
+	*fd = real(&real_open, "open")("/dev/null", flags & (O_ACCMODE | O_CLOEXEC));
+	if (*fd >= SIM_MAX_FDS) {
+		real(&real_close, "close")(*fd);
+		*fd = -1;
+		errno = EMFILE;
+	} else if (*fd >= 0) {
+		__atomic_store_n(&s_fd_cpu[*fd], cpu + 1, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+
+static int fd_cpu(int fd) {
+	if (fd < 0 || fd >= SIM_MAX_FDS) {
+		return -1;
+	}
+	return __atomic_load_n(&s_fd_cpu[fd], __ATOMIC_ACQUIRE) - 1;
+}
+
+// Reads of any multiple of 8 bytes return the register repeatedly, like the MSR driver
+static ssize_t sim_pread(int cpu, void *buf, size_t count, off_t offset) {
+	uint64_t value = 0;
+	
+	if (count == 0 || count % sizeof(value) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!rapl_sim_read_msr(s_sim, cpu * rapl_sim_num_packages(s_sim) / s_num_cpus, offset, &value)) {
+		errno = EIO;
+		return -1;
+	}
+	for (size_t i = 0; i < count; i += sizeof(value)) {
+		memcpy((char *)buf + i, &value, sizeof(value));
+	}
+	return count;
+}
+
+static ssize_t sim_pwrite(const void *buf, size_t count, off_t offset) {
+	uint64_t value = 0;
+	
+	if (count != sizeof(value)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&value, buf, sizeof(value));
+	if (!rapl_sim_write_msr(s_sim, offset, value)) {
+		errno = EIO;
+		return -1;
+	}
+	return count;
+}
+
+static mode_t open_mode(int flags, va_list ap) {
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		return va_arg(ap, int);
+	}
+	return 0;
+}
+
+extern "C" int open(const char *path, int flags, ...) {
+	va_list ap;
+	int fd = -1;
+	va_start(ap, flags);
+	mode_t mode = open_mode(flags, ap);
+	va_end(ap);
+	if (sim_open(path, flags, &fd)) {
+		return fd;
+	}
+	return real(&real_open, "open")(path, flags, mode);
+}
+
+extern "C" int open64(const char *path, int flags, ...) {
+	va_list ap;
+	int fd = -1;
+	va_start(ap, flags);
+	mode_t mode = open_mode(flags, ap);
+	va_end(ap);
+	if (sim_open(path, flags, &fd)) {
+		return fd;
+	}
+	return real(&real_open, "open")(path, flags | O_LARGEFILE, mode);
+}
+
+extern "C" int openat(int dirfd, const char *path, int flags, ...) {
+	va_list ap;
+	int fd = -1;
+	va_start(ap, flags);
+	mode_t mode = open_mode(flags, ap);
+	va_end(ap);
+	if (path[0] == '/' && sim_open(path, flags, &fd)) {
+		return fd;
+	}
+	return real(&real_openat, "openat")(dirfd, path, flags, mode);
+}
+
+extern "C" int openat64(int dirfd, const char *path, int flags, ...) {
+	va_list ap;
+	int fd = -1;
+	va_start(ap, flags);
+	mode_t mode = open_mode(flags, ap);
+	va_end(ap);
+	if (path[0] == '/' && sim_open(path, flags, &fd)) {
+		return fd;
+	}
+	return real(&real_openat, "openat")(dirfd, path, flags | O_LARGEFILE, mode);
+}
+
+// Called instead of open() by programs built with _FORTIFY_SOURCE
+extern "C" int __open_2(const char *path, int flags) {
+	return open(path, flags);
+}
+
+extern "C" int __open64_2(const char *path, int flags) {
+	return open64(path, flags);
+}
+
+extern "C" int close(int fd) {
+	if (fd_cpu(fd) >= 0) {
+		__atomic_store_n(&s_fd_cpu[fd], 0, __ATOMIC_RELEASE);
+	}
+	return real(&real_close, "close")(fd);
+}
+
+extern "C" ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+	int cpu = fd_cpu(fd);
+	if (cpu >= 0) {
+		return sim_pread(cpu, buf, count, offset);
+	}
+	return real(&real_pread, "pread")(fd, buf, count, offset);
+}
+
+extern "C" ssize_t pread64(int fd, void *buf, size_t count, off_t offset) {
+	return pread(fd, buf, count, offset);
+}
+
+extern "C" ssize_t __pread_chk(int fd, void *buf, size_t count, off_t offset, size_t buflen) {
+	if (count > buflen) {
+		abort();
+	}
+	return pread(fd, buf, count, offset);
+}
+
+extern "C" ssize_t __pread64_chk(int fd, void *buf, size_t count, off_t offset, size_t buflen) {
+	return __pread_chk(fd, buf, count, offset, buflen);
+}
+
+extern "C" ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+	if (fd_cpu(fd) >= 0) {
+		return sim_pwrite(buf, count, offset);
+	}
+	return real(&real_pwrite, "pwrite")(fd, buf, count, offset);
+}
+
+extern "C" ssize_t pwrite64(int fd, const void *buf, size_t count, off_t offset) {
+	return pwrite(fd, buf, count, offset);
+}
+
+extern "C" FILE *fopen(const char *path, const char *mode) {
+	if (path && strcmp(path, SIM_CPUINFO) == 0) {
+		pthread_once(&s_init_once, sim_init);
+		return fmemopen(s_cpuinfo, s_cpuinfo_len, "r");
+	}
+	return real(&real_fopen, "fopen")(path, mode);
+}
+
+extern "C" FILE *fopen64(const char *path, const char *mode) {
+	return fopen(path, mode);
+}
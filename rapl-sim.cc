@@ -0,0 +1,530 @@
+/*
+ * librapl: Simulated backend
+ *
+ * Serves the energy counters from the model in rapl-sim.h. The backend is
+ * never picked automatically, it is selected with "sim" or "sim:<options>".
+ *
+ * Counter k is updated at update_time(k) and then holds the energy consumed
+ * up to that time. A read finds the latest update that has happened with a
+ * search that starts from the update found by the previous read, so polling
+ * costs a couple of comparisons.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "rapl.h"
+#include "rapl-sim.h"
+#include "msr-index.h"
+
+#define SIM_DEFAULT_PERIOD	0.001
+#define SIM_DEFAULT_UNIT	16
+#define SIM_DEFAULT_MODEL	CPU_SANDYBRIDGE_EP
+
+// The counters of package p start at start + p * SIM_PACKAGE_OFFSET
+#define SIM_PACKAGE_OFFSET	0x10000000ULL
+
+// Values of the registers that do not change
+#define SIM_TJMAX		100
+#define SIM_TEMPERATURE		50
+#define SIM_CORE_RATIO		32
+// 1 V in units of 1 / 8192 V
+#define SIM_CORE_VOLTAGE	8192
+
+#ifndef MSR_IA32_PM_ENABLE
+#define MSR_IA32_PM_ENABLE	0x770
+#endif
+
+static const unsigned sim_energy_status[RAPL_NUM_DOMAINS] = {
+	MSR_PKG_ENERGY_STATUS,
+	MSR_PP0_ENERGY_STATUS,
+	MSR_PP1_ENERGY_STATUS,
+	MSR_DRAM_ENERGY_STATUS,
+};
+
+static const char *sim_domain_option[RAPL_NUM_DOMAINS] = { "pkg", "pp0", "pp1", "dram" };
+
+static const double sim_default_watts[RAPL_NUM_DOMAINS] = { 20.0, 12.0, 1.0, 3.0 };
+
+struct sim_profile {
+	bool present;
+	double low;
+	double high;
+	// Period of the square wave, 0 for a constant power
+	double period;
+};
+
+struct rapl_sim {
+	double period;
+	double jitter;
+	uint64_t seed;
+	double energy_unit;
+	unsigned unit_bits;
+	uint64_t start;
+	int num_packages;
+	int cpu_model;
+	double delay;
+	uint64_t energy_perf_bias;
+	struct sim_profile profile[RAPL_NUM_DOMAINS];
+	struct timespec start_time;
+	
+	// Recorded updates, none without a replay file
+	int num_updates;
+	// Time of each update since the start of the recording, the last one is the length of the recording
+	double *update_time;
+	// Energy consumed since the start of the recording at each update, NULL for a gaps file
+	double *update_energy;
+	int trace_packages;
+	
+	// Latest update found by a read
+	uint64_t hint;
+};
+
+// Uniform value in [-1, 1) for the jitter of update k
+static double sim_random(uint64_t seed, uint64_t k) {
+	uint64_t x = seed + k * 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	x = x ^ (x >> 31);
+	return (x >> 11) * (2.0 / (1ULL << 53)) - 1.0;
+}
+
+static double update_time(const struct rapl_sim *sim, uint64_t k) {
+	if (k == 0) {
+		return 0.0;
+	}
+	if (sim->num_updates > 0) {
+		uint64_t n = sim->num_updates;
+		return ((k - 1) / n) * sim->update_time[n - 1] + sim->update_time[(k - 1) % n];
+	}
+	return k * sim->period + sim->jitter * sim_random(sim->seed, k);
+}
+
+// Energy in joules consumed in t seconds at the power of the profile
+static double profile_energy(const struct sim_profile *profile, double t) {
+	if (profile->period <= 0.0) {
+		return profile->low * t;
+	}
+	double half = profile->period * 0.5;
+	double cycles = floor(t / profile->period);
+	double rem = t - cycles * profile->period;
+	return cycles * half * (profile->low + profile->high) + profile->low * fmin(rem, half) + profile->high * fmax(rem - half, 0.0);
+}
+
+static double update_energy(const struct rapl_sim *sim, uint64_t k, int package, int domain) {
+	if (sim->update_energy == NULL) {
+		return profile_energy(&sim->profile[domain], update_time(sim, k));
+	}
+	if (k == 0) {
+		return 0.0;
+	}
+	uint64_t n = sim->num_updates;
+	int column = (package % sim->trace_packages) * RAPL_NUM_DOMAINS + domain;
+	const double *cycle_end = sim->update_energy + (n - 1) * sim->trace_packages * RAPL_NUM_DOMAINS;
+	const double *cur = sim->update_energy + ((k - 1) % n) * sim->trace_packages * RAPL_NUM_DOMAINS;
+	return ((k - 1) / n) * cycle_end[column] + cur[column];
+}
+
+// Find the latest update at or before t, the update times never decrease
+static uint64_t find_update(struct rapl_sim *sim, double t) {
+	uint64_t lo = __atomic_load_n(&sim->hint, __ATOMIC_RELAXED);
+	uint64_t hi = 0, step = 1;
+	
+	if (update_time(sim, lo) <= t) {
+		// Gallop forward until an update after t is found
+		while (update_time(sim, lo + step) <= t) {
+			lo += step;
+			step *= 2;
+		}
+		hi = lo + step;
+	} else {
+		// Another thread read a later time
+		hi = lo;
+		lo = 0;
+	}
+	while (hi - lo > 1) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (update_time(sim, mid) <= t) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	
+	__atomic_store_n(&sim->hint, lo, __ATOMIC_RELAXED);
+	return lo;
+}
+
+static double sim_elapsed(const struct rapl_sim *sim) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - sim->start_time.tv_sec) + (now.tv_nsec - sim->start_time.tv_nsec) * 1e-9;
+}
+
+// Current time of the model after the delay of one read
+static double sim_now(const struct rapl_sim *sim) {
+	double now = sim_elapsed(sim);
+	if (sim->delay > 0.0) {
+		double end = now + sim->delay;
+		while ((now = sim_elapsed(sim)) < end);
+	}
+	return now;
+}
+
+static uint64_t sim_counter(struct rapl_sim *sim, int package, int domain, uint64_t k) {
+	uint64_t steps = (uint64_t)(update_energy(sim, k, package, domain) / sim->energy_unit);
+	return (sim->start + package * SIM_PACKAGE_OFFSET + steps) & (RAPL_MSR_COUNTER_RANGE - 1);
+}
+
+static bool sim_read_at(struct rapl_sim *sim, int package, unsigned msr, double now, uint64_t *value) {
+	int domain;
+	
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		if (msr == sim_energy_status[domain]) {
+			if (!sim->profile[domain].present) {
+				return false;
+			}
+			*value = sim_counter(sim, package, domain, find_update(sim, now));
+			return true;
+		}
+	}
+	
+	switch (msr) {
+		case MSR_RAPL_POWER_UNIT:
+			// Power in 1/8 W and time in 1/1024 s as on Sandy Bridge
+			*value = 0xa0003 | (sim->unit_bits << 8);
+			return true;
+		case MSR_PKG_POWER_INFO:
+			// Thermal design power, the highest power of the PKG profile
+			*value = (uint64_t)(fmax(sim->profile[RAPL_DOMAIN_PKG].low, sim->profile[RAPL_DOMAIN_PKG].high) * 8.0) & 0x7fff;
+			return true;
+		case MSR_IA32_PERF_STATUS:
+			*value = ((uint64_t)SIM_CORE_VOLTAGE << 32) | (SIM_CORE_RATIO << 8);
+			return true;
+		case MSR_IA32_ENERGY_PERF_BIAS:
+			*value = __atomic_load_n(&sim->energy_perf_bias, __ATOMIC_RELAXED);
+			return true;
+		case MSR_IA32_THERM_STATUS:
+		case MSR_IA32_PACKAGE_THERM_STATUS:
+			// Valid digital readout below TjMax
+			*value = (1u << 31) | ((SIM_TJMAX - SIM_TEMPERATURE) << 16);
+			return true;
+		case MSR_IA32_TEMPERATURE_TARGET:
+			*value = SIM_TJMAX << 16;
+			return true;
+		case MSR_IA32_PM_ENABLE:
+			*value = 0;
+			return true;
+	}
+	
+	return false;
+}
+
+bool rapl_sim_read_msr(struct rapl_sim *sim, int package, unsigned msr, uint64_t *value) {
+	return sim_read_at(sim, package, msr, sim_now(sim), value);
+}
+
+bool rapl_sim_write_msr(struct rapl_sim *sim, unsigned msr, uint64_t value) {
+	if (msr != MSR_IA32_ENERGY_PERF_BIAS) {
+		return false;
+	}
+	__atomic_store_n(&sim->energy_perf_bias, value & 0xf, __ATOMIC_RELAXED);
+	return true;
+}
+
+int rapl_sim_num_packages(const struct rapl_sim *sim) {
+	return sim->num_packages;
+}
+
+int rapl_sim_cpu_model(const struct rapl_sim *sim) {
+	return sim->cpu_model;
+}
+
+static bool parse_profile(const char *value, struct sim_profile *profile) {
+	char *end = NULL;
+	
+	memset(profile, 0, sizeof(*profile));
+	if (strcmp(value, "off") == 0) {
+		return true;
+	}
+	profile->present = true;
+	profile->low = profile->high = strtod(value, &end);
+	if (*end == ':') {
+		profile->high = strtod(end + 1, &end);
+		if (*end != ':') {
+			return false;
+		}
+		profile->period = strtod(end + 1, &end);
+		if (profile->period <= 0.0) {
+			return false;
+		}
+	}
+	return *end == '\0' && profile->low >= 0.0 && profile->high >= 0.0;
+}
+
+// Split a line of comma separated numbers, returns the number of columns or -1 if it is not numeric
+static int parse_columns(char *line, double *columns, int max_columns) {
+	int n = 0;
+	char *p = line, *end = NULL;
+	
+	while (n < max_columns) {
+		columns[n++] = strtod(p, &end);
+		if (end == p) {
+			return -1;
+		}
+		while (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n') end++;
+		if (*end != ',') {
+			return *end == '\0' ? n : -1;
+		}
+		p = end + 1;
+	}
+	return n;
+}
+
+static bool load_replay(struct rapl_sim *sim, const char *filename) {
+	double columns[1 + RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS + 2];
+	const int max_columns = sizeof(columns) / sizeof(columns[0]);
+	double first_time = 0.0, total = 0.0;
+	int num_columns = 0, max_updates = 0, values = 0, i;
+	char line[1024];
+	
+	FILE *fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "rapl-sim: Failed to open %s\n", filename);
+		return false;
+	}
+	
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+			continue;
+		}
+		int n = parse_columns(line, columns, max_columns);
+		if (n < 0 || (num_columns > 0 && n != num_columns)) {
+			fprintf(stderr, "rapl-sim: Unexpected line in %s: %s", filename, line);
+			fclose(fp);
+			return false;
+		}
+		if (num_columns == 0) {
+			// One gap per line or a timestamp followed by four domains per package and two attributed columns
+			if (n != 1 && n < 1 + RAPL_NUM_DOMAINS) {
+				fprintf(stderr, "rapl-sim: %s is neither a gaps file nor an energy trace\n", filename);
+				fclose(fp);
+				return false;
+			}
+			num_columns = n;
+			sim->trace_packages = n == 1 ? 0 : (n - 1) / RAPL_NUM_DOMAINS;
+			values = sim->trace_packages * RAPL_NUM_DOMAINS;
+			first_time = columns[0];
+		}
+		if (sim->num_updates == max_updates) {
+			max_updates = max_updates ? max_updates * 2 : 1024;
+			sim->update_time = (double *)realloc(sim->update_time, max_updates * sizeof(double));
+			if (values > 0) {
+				sim->update_energy = (double *)realloc(sim->update_energy, max_updates * values * sizeof(double));
+			}
+		}
+		
+		if (values == 0) {
+			total += columns[0];
+			sim->update_time[sim->num_updates] = total;
+		} else {
+			// The first sample covers an unknown interval, give it the length of the next one
+			if (sim->num_updates == 1) {
+				sim->update_time[0] = columns[0] - first_time;
+			}
+			sim->update_time[sim->num_updates] = columns[0] - first_time + (sim->num_updates > 0 ? sim->update_time[0] : 0.0);
+			double *cur = sim->update_energy + sim->num_updates * values;
+			for (i = 0; i < values; i++) {
+				cur[i] = columns[1 + i] + (sim->num_updates > 0 ? cur[i - values] : 0.0);
+			}
+		}
+		sim->num_updates++;
+	}
+	fclose(fp);
+	
+	if (sim->num_updates == 0 || sim->update_time[sim->num_updates - 1] <= 0.0) {
+		fprintf(stderr, "rapl-sim: %s does not contain any updates\n", filename);
+		return false;
+	}
+	if (values > 0) {
+		// Domains that never consumed energy were not measured
+		const double *last = sim->update_energy + (sim->num_updates - 1) * values;
+		for (int domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+			bool measured = false;
+			for (i = 0; i < sim->trace_packages; i++) {
+				measured = measured || last[i * RAPL_NUM_DOMAINS + domain] > 0.0;
+			}
+			sim->profile[domain].present = sim->profile[domain].present && measured;
+		}
+	}
+	
+	return true;
+}
+
+static bool parse_options(struct rapl_sim *sim, char *options, const char **replay) {
+	char *saveptr = NULL, *option = NULL, *end = NULL;
+	int domain;
+	
+	for (option = strtok_r(options, ",", &saveptr); option; option = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(option, '=');
+		if (!value) {
+			fprintf(stderr, "rapl-sim: Option '%s' has no value\n", option);
+			return false;
+		}
+		*value++ = '\0';
+		end = value;
+		
+		for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+			if (strcmp(option, sim_domain_option[domain]) == 0) {
+				break;
+			}
+		}
+		if (domain < RAPL_NUM_DOMAINS) {
+			if (!parse_profile(value, &sim->profile[domain])) {
+				fprintf(stderr, "rapl-sim: Invalid power profile '%s' for %s\n", value, option);
+				return false;
+			}
+			continue;
+		}
+		
+		if (strcmp(option, "period") == 0) {
+			sim->period = strtod(value, &end);
+		} else if (strcmp(option, "jitter") == 0) {
+			sim->jitter = strtod(value, &end);
+		} else if (strcmp(option, "seed") == 0) {
+			sim->seed = strtoull(value, &end, 0);
+		} else if (strcmp(option, "unit") == 0) {
+			sim->unit_bits = strtoul(value, &end, 0);
+		} else if (strcmp(option, "start") == 0) {
+			sim->start = strtoull(value, &end, 0);
+		} else if (strcmp(option, "packages") == 0) {
+			sim->num_packages = strtol(value, &end, 0);
+		} else if (strcmp(option, "model") == 0) {
+			sim->cpu_model = strtol(value, &end, 0);
+		} else if (strcmp(option, "delay") == 0) {
+			sim->delay = strtod(value, &end);
+		} else if (strcmp(option, "replay") == 0) {
+			*replay = value;
+			end = value + strlen(value);
+		} else {
+			fprintf(stderr, "rapl-sim: Unknown option '%s'\n", option);
+			return false;
+		}
+		if (*end != '\0' || end == value) {
+			fprintf(stderr, "rapl-sim: Invalid value '%s' for %s\n", value, option);
+			return false;
+		}
+	}
+	
+	if (sim->period <= 0.0 || sim->jitter < 0.0 || sim->jitter >= sim->period * 0.5) {
+		fprintf(stderr, "rapl-sim: The period must be positive and the jitter less than half of it\n");
+		return false;
+	}
+	if (sim->unit_bits > 31 || sim->num_packages < 0 || sim->num_packages > RAPL_MAX_PACKAGES || sim->delay < 0.0) {
+		fprintf(stderr, "rapl-sim: The unit must be at most 31, the number of packages 1 to %d and the delay non-negative\n", RAPL_MAX_PACKAGES);
+		return false;
+	}
+	return true;
+}
+
+struct rapl_sim *rapl_sim_create(const char *options) {
+	const char *replay = NULL;
+	int domain;
+	
+	if (options == NULL) {
+		options = getenv(RAPL_SIM_ENV);
+	}
+	
+	struct rapl_sim *sim = (struct rapl_sim *)calloc(1, sizeof(*sim));
+	sim->period = SIM_DEFAULT_PERIOD;
+	sim->seed = 1;
+	sim->unit_bits = SIM_DEFAULT_UNIT;
+	sim->cpu_model = SIM_DEFAULT_MODEL;
+	sim->energy_perf_bias = ENERGY_PERF_BIAS_NORMAL;
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		sim->profile[domain].present = true;
+		sim->profile[domain].low = sim->profile[domain].high = sim_default_watts[domain];
+	}
+	
+	char *copy = strdup(options ? options : "");
+	bool ok = parse_options(sim, copy, &replay) && (replay == NULL || load_replay(sim, replay));
+	free(copy);
+	if (!ok) {
+		rapl_sim_destroy(sim);
+		return NULL;
+	}
+	sim->energy_unit = 1.0 / (1u << sim->unit_bits);
+	// An energy trace has as many packages as were recorded unless told otherwise
+	if (sim->num_packages == 0) {
+		sim->num_packages = sim->trace_packages > 0 ? sim->trace_packages : 1;
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &sim->start_time);
+	return sim;
+}
+
+void rapl_sim_destroy(struct rapl_sim *sim) {
+	free(sim->update_time);
+	free(sim->update_energy);
+	free(sim);
+}
+
+static bool rapl_sim_read_all(struct rapl_source *source, uint64_t *values) {
+	struct rapl_sim *sim = (struct rapl_sim *)source->priv;
+	double now = sim_now(sim);
+	int package, domain;
+	
+	for (package = 0; package < source->num_packages; package++) {
+		for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+			if (source->domains & RAPL_HAVE_DOMAIN(domain)) {
+				sim_read_at(sim, package, sim_energy_status[domain], now, &values[RAPL_VALUE_INDEX(package, domain)]);
+			}
+		}
+	}
+	
+	return true;
+}
+
+static void rapl_sim_close(struct rapl_source *source) {
+	rapl_sim_destroy((struct rapl_sim *)source->priv);
+	free(source);
+}
+
+static const struct rapl_source_ops rapl_sim_ops = {
+	"sim",
+	rapl_sim_read_all,
+	rapl_sim_close,
+};
+
+struct rapl_source *rapl_open_sim(const char *options, int max_packages) {
+	struct rapl_sim *sim = rapl_sim_create(options);
+	int domain;
+	
+	if (!sim) {
+		return NULL;
+	}
+	if (!sim->profile[RAPL_DOMAIN_PKG].present) {
+		fprintf(stderr, "rapl-sim: The PKG domain cannot be turned off\n");
+		rapl_sim_destroy(sim);
+		return NULL;
+	}
+	
+	struct rapl_source *source = (struct rapl_source *)calloc(1, sizeof(*source));
+	source->ops = &rapl_sim_ops;
+	source->num_packages = sim->num_packages < max_packages ? sim->num_packages : max_packages;
+	source->priv = sim;
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		if (sim->profile[domain].present) {
+			source->domains |= RAPL_HAVE_DOMAIN(domain);
+		}
+		source->energy_unit[domain] = sim->energy_unit;
+		source->counter_range[domain] = RAPL_MSR_COUNTER_RANGE;
+	}
+	
+	return source;
+}
@@ -0,0 +1,63 @@
+/*
+ * librapl: Simulated RAPL registers
+ *
+ * A deterministic model of the energy status registers, so that the tools
+ * can be run and benchmarked on machines without RAPL. The counters only
+ * change at update times, like the real registers, and wrap around at 32 bits.
+ *
+ * The model is configured with a comma separated list of options:
+ *   period=<s>		Time between the counter updates (defaults to 0.001)
+ *   jitter=<s>		Each update is moved by up to this much, less than period / 2 (defaults to 0)
+ *   seed=<n>		Seed of the update jitter (defaults to 1)
+ *   pkg=<profile>	Power profile of a domain, also pp0, pp1 and dram
+ *   unit=<n>		Energy status unit, each step is 1 / 2^n joules (defaults to 16)
+ *   start=<n>		Initial value of the counters, to test the wrap around (defaults to 0)
+ *   packages=<n>	Number of packages (defaults to 1 or the number recorded in an energy trace)
+ *   model=<n>		CPU model reported in /proc/cpuinfo by librapl-sim.so (defaults to 45)
+ *   delay=<s>		Time spent busy waiting in every read, to mimic the cost of rdmsr (defaults to 0)
+ *   replay=<file>	Replay a gaps-msr.csv or energy-trace.csv file
+ *
+ * A power profile is either a constant power in watts, "off" for a domain
+ * that does not exist, or "low:high:period" for a square wave that spends
+ * the first half of each period at the low power. The defaults are 20 W for
+ * PKG, 12 W for PP0, 1 W for PP1 and 3 W for DRAM.
+ *
+ * A gaps-msr.csv file has one gap between updates in seconds per line. The
+ * updates happen at the recorded intervals and the energy comes from the
+ * power profiles. An energy-trace.csv file from trace-energy-v2 gives both
+ * the update times and the energy of each package and domain. The recording
+ * is repeated when it runs out.
+ *
+ * Time is measured from rapl_sim_create() with CLOCK_MONOTONIC.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef RAPL_SIM_H
+#define RAPL_SIM_H
+
+#include <stdint.h>
+
+// Environment variable holding the options when none are given
+#define RAPL_SIM_ENV	"RAPL_SIM"
+
+struct rapl_sim;
+
+// Create a model from the options, NULL reads them from RAPL_SIM. Returns NULL and prints an error on failure.
+struct rapl_sim *rapl_sim_create(const char *options);
+void rapl_sim_destroy(struct rapl_sim *sim);
+
+int rapl_sim_num_packages(const struct rapl_sim *sim);
+int rapl_sim_cpu_model(const struct rapl_sim *sim);
+
+/*
+ * Read a register of a package at the current time. Returns false for
+ * registers that are not modeled, like the MSR driver does with EIO.
+ * Safe to call from several threads.
+ */
+bool rapl_sim_read_msr(struct rapl_sim *sim, int package, unsigned msr, uint64_t *value);
+
+// Write a register, only IA32_ENERGY_PERF_BIAS is writable
+bool rapl_sim_write_msr(struct rapl_sim *sim, unsigned msr, uint64_t value);
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ * Sampling synchronized to the RAPL counter updates
+ *
+ * The energy counters update roughly every millisecond. rapl_sync_wait()
+ * learns the period and phase of the updates, sleeps until just before the
+ * next expected update and spins until the PKG counter changes, so that each
+ * sample is taken and timestamped at an update instead of at an arbitrary
+ * point between two of them. The guard time before the update adapts to late
+ * wakeups, the period estimate tracks drift and the phase is learned again if
+ * the sampler loses track of the updates.
+ *
+ * The caller passes a function that reads the counters and returns the PKG
+ * counter of the first package, the values it reads at the update are left
+ * wherever that function puts them.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef RAPL_SYNC_H
+#define RAPL_SYNC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+// Number of updates observed to learn the update period and phase
+#define RAPL_SYNC_CALIBRATION_UPDATES	16
+
+// How early the sampler wakes up before an expected update, adapted at runtime
+#define RAPL_SYNC_INITIAL_GUARD_NS	100000
+#define RAPL_SYNC_MIN_GUARD_NS	5000
+
+// RAPL updates roughly every millisecond, give up if nothing happens in 100 ms
+#define RAPL_SYNC_TIMEOUT_NS	100000000
+
+typedef uint64_t (*rapl_sync_read_fn)(void *arg);
+
+struct rapl_sync {
+	rapl_sync_read_fn read_pkg;
+	void *arg;
+	double period_ns;
+	int64_t guard_ns;
+	// CLOCK_MONOTONIC time of the last update and the PKG counter after it
+	int64_t last_update;
+	uint64_t last_pkg;
+	// Spin time before the update and time since the previous sample, set by rapl_sync_wait()
+	int64_t spin_ns;
+	int64_t gap_ns;
+	unsigned long late_wakeups;
+	unsigned long resyncs;
+};
+
+static inline int64_t rapl_sync_monotonic_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+ * Poll the PKG counter until it differs from last_pkg.
+ * Returns the time of the change or -1 on timeout.
+ */
+static inline int64_t rapl_sync_spin(struct rapl_sync *sync, int64_t timeout_ns) {
+	int64_t start = rapl_sync_monotonic_ns(), now = start;
+	do {
+		uint64_t pkg = sync->read_pkg(sync->arg);
+		now = rapl_sync_monotonic_ns();
+		if (pkg != sync->last_pkg) {
+			sync->last_pkg = pkg;
+			return now;
+		}
+	} while (now - start < timeout_ns);
+	return -1;
+}
+
+// Learn the update period by polling through a number of updates
+static inline bool rapl_sync_calibrate(struct rapl_sync *sync) {
+	int64_t first = -1, last = -1;
+	int i;
+	
+	sync->last_pkg = sync->read_pkg(sync->arg);
+	for (i = 0; i <= RAPL_SYNC_CALIBRATION_UPDATES; i++) {
+		last = rapl_sync_spin(sync, RAPL_SYNC_TIMEOUT_NS);
+		if (last < 0) {
+			return false;
+		}
+		if (i == 0) {
+			first = last;
+		}
+	}
+	sync->period_ns = (double)(last - first) / RAPL_SYNC_CALIBRATION_UPDATES;
+	sync->last_update = last;
+	return true;
+}
+
+/*
+ * Learn the updates, the counters are left at an update on return.
+ * Returns false if the counters are not updating.
+ */
+static inline bool rapl_sync_init(struct rapl_sync *sync, rapl_sync_read_fn read_pkg, void *arg) {
+	memset(sync, 0, sizeof(*sync));
+	sync->read_pkg = read_pkg;
+	sync->arg = arg;
+	sync->guard_ns = RAPL_SYNC_INITIAL_GUARD_NS;
+	return rapl_sync_calibrate(sync);
+}
+
+/*
+ * Wait for the update at which the next sample at the given frequency is due,
+ * every stride'th update when the frequency is lower than the update rate.
+ * Returns the CLOCK_MONOTONIC time of the update, 0 if the sleep was
+ * interrupted by a signal before it, or -1 if the counters stopped updating.
+ */
+static inline int64_t rapl_sync_wait(struct rapl_sync *sync, double sampling_frequency) {
+	while (true) {
+		int64_t stride = llround(1e9 / sampling_frequency / sync->period_ns);
+		if (stride < 1) stride = 1;
+		int64_t expected = sync->last_update + llround(stride * sync->period_ns);
+		int64_t wakeup_ns = expected - sync->guard_ns;
+		
+		struct timespec wakeup = { (time_t)(wakeup_ns / 1000000000LL), (long)(wakeup_ns % 1000000000LL) };
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) == EINTR) {
+			return 0;
+		}
+		int64_t woke = rapl_sync_monotonic_ns();
+		
+		int64_t update = rapl_sync_spin(sync, sync->guard_ns + 2 * llround(sync->period_ns));
+		if (update < 0) {
+			// Lost track of the updates, learn the phase again
+			sync->resyncs++;
+			if (!rapl_sync_calibrate(sync)) {
+				return -1;
+			}
+			continue;
+		}
+		
+		if (update - woke < 1000) {
+			// The counter had already changed when we woke up, start spinning earlier
+			sync->late_wakeups++;
+			sync->guard_ns += sync->guard_ns / 2;
+			if (sync->guard_ns > sync->period_ns / 2) sync->guard_ns = sync->period_ns / 2;
+		} else if (sync->guard_ns > RAPL_SYNC_MIN_GUARD_NS) {
+			// Slowly approach the update edge to reduce the time spent spinning
+			sync->guard_ns -= sync->guard_ns / 64;
+		}
+		
+		// Track drift in the update period
+		int64_t gap = update - sync->last_update;
+		int64_t num_updates = llround(gap / sync->period_ns);
+		if (num_updates >= 1) {
+			sync->period_ns += ((double)gap / num_updates - sync->period_ns) / 16;
+		}
+		
+		sync->spin_ns = update - woke;
+		sync->gap_ns = gap;
+		sync->last_update = update;
+		return update;
+	}
+}
+
+#endif
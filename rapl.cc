@@ -0,0 +1,267 @@
+/*
+ * librapl: Functions shared by all backends
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "rapl.h"
+#include "msr-index.h"
+
+/* RAPL UNIT BITMASK */
+#define ENERGY_UNIT_OFFSET	0x08
+#define ENERGY_UNIT_MASK	0x1F00
+
+static const char *rapl_domain_names[RAPL_NUM_DOMAINS] = { "PKG", "PP0", "PP1", "DRAM" };
+
+const char *rapl_domain_name(int domain) {
+	if (domain < 0 || domain >= RAPL_NUM_DOMAINS) {
+		return "unknown";
+	}
+	return rapl_domain_names[domain];
+}
+
+void rapl_close(struct rapl_source *source) {
+	if (source) {
+		source->ops->close(source);
+	}
+}
+
+void rapl_accum_init(struct rapl_accum *accum, const struct rapl_source *source) {
+	int domain;
+	memset(accum, 0, sizeof(*accum));
+	accum->num_values = source->num_packages * RAPL_NUM_DOMAINS;
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		accum->range[domain] = source->counter_range[domain];
+	}
+}
+
+void rapl_accum_init_raw(struct rapl_accum *accum, int num_values, uint64_t range) {
+	int domain;
+	memset(accum, 0, sizeof(*accum));
+	accum->num_values = num_values;
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		accum->range[domain] = range;
+	}
+}
+
+void rapl_accum_update(struct rapl_accum *accum, const uint64_t *values) {
+	int i;
+	
+	if (!accum->started) {
+		memcpy(accum->last, values, accum->num_values * sizeof(uint64_t));
+		accum->started = true;
+		return;
+	}
+	for (i = 0; i < accum->num_values; i++) {
+		uint64_t range = accum->range[i % RAPL_NUM_DOMAINS];
+		uint64_t delta = values[i] - accum->last[i];
+		// A smaller value means that the counter wrapped around since the last update
+		if (range != 0 && values[i] < accum->last[i]) {
+			delta = range - accum->last[i] + values[i];
+		}
+		accum->total[i] += delta;
+		accum->last[i] = values[i];
+	}
+}
+
+double rapl_wrap_seconds(const struct rapl_source *source, double max_power) {
+	double shortest = 0.0;
+	int domain;
+	
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		if (rapl_has_domain(source, domain) && source->counter_range[domain] != 0) {
+			double seconds = source->counter_range[domain] * source->energy_unit[domain] / max_power;
+			if (shortest == 0.0 || seconds < shortest) {
+				shortest = seconds;
+			}
+		}
+	}
+	return shortest;
+}
+
+int rapl_discover_packages(struct rapl_package *packages, int max_packages) {
+	int num_packages = 0, cpu, i;
+	int num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		char path[128];
+		int id = -1;
+		// Offline CPUs have no topology directory
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+		FILE *fp = fopen(path, "r");
+		if (!fp) {
+			continue;
+		}
+		if (fscanf(fp, "%d", &id) != 1) {
+			id = -1;
+		}
+		fclose(fp);
+		if (id < 0) {
+			continue;
+		}
+		
+		for (i = 0; i < num_packages; i++) {
+			if (packages[i].id == id) {
+				break;
+			}
+		}
+		if (i < num_packages) {
+			continue;
+		}
+		if (num_packages == max_packages) {
+			fprintf(stderr, "Warning: Only the first %d packages are supported\n", max_packages);
+			break;
+		}
+		// Keep the packages sorted by id, PAPI and powercap number them in that order
+		for (i = num_packages; i > 0 && packages[i - 1].id > id; i--) {
+			packages[i] = packages[i - 1];
+		}
+		packages[i].id = id;
+		packages[i].cpu = cpu;
+		num_packages++;
+	}
+	
+	if (num_packages == 0) {
+		packages[0].id = 0;
+		packages[0].cpu = 0;
+		num_packages = 1;
+	}
+	
+	return num_packages;
+}
+
+static int msr_open(int cpu, int flags) {
+	char msr_filename[64] = { '\0' };
+	int fd = -1;
+	
+	snprintf(msr_filename, sizeof(msr_filename), "/dev/cpu/%d/msr", cpu);
+	
+	fd = open(msr_filename, flags);
+	if (fd < 0) {
+		if (errno == ENXIO) {
+			fprintf(stderr, "rdmsr: No CPU %d\n", cpu);
+		} else if (errno == EIO) {
+			fprintf(stderr, "rdmsr: CPU %d doesn't support MSRs\n", cpu);
+		} else {
+			perror("rdmsr:open");
+			fprintf(stderr, "Trying to open %s\n", msr_filename);
+		}
+	}
+	
+	return fd;
+}
+
+int rapl_msr_open(int cpu) {
+	return msr_open(cpu, O_RDONLY);
+}
+
+int rapl_msr_open_rw(int cpu) {
+	return msr_open(cpu, O_RDWR);
+}
+
+bool rapl_msr_read(int fd, unsigned msr_offset, uint64_t *msr_out) {
+	if (pread(fd, msr_out, sizeof(*msr_out), msr_offset) != sizeof(*msr_out)) {
+		perror("rdmsr:pread");
+		fprintf(stderr, "rapl_msr_read failed while trying to read offset 0x%04x!\n", msr_offset);
+		return false;
+	}
+	
+	return true;
+}
+
+bool rapl_msr_write(int fd, unsigned msr_offset, uint64_t value) {
+	if (pwrite(fd, &value, sizeof(value), msr_offset) != sizeof(value)) {
+		perror("wrmsr:pwrite");
+		fprintf(stderr, "rapl_msr_write failed while trying to write offset 0x%04x!\n", msr_offset);
+		return false;
+	}
+	
+	return true;
+}
+
+bool rapl_msr_energy_unit(int fd, double *unit) {
+	uint64_t power_unit = 0;
+	
+	if (!rapl_msr_read(fd, MSR_RAPL_POWER_UNIT, &power_unit)) {
+		return false;
+	}
+	*unit = 1.0 / (1 << ((power_unit & ENERGY_UNIT_MASK) >> ENERGY_UNIT_OFFSET));
+	return true;
+}
+
+int rapl_detect_cpu() {
+	FILE *fff = NULL;
+	int family = -1, model = -1;
+	char buffer[BUFSIZ];
+	char vendor[BUFSIZ];
+	
+	fff = fopen("/proc/cpuinfo", "r");
+	if (fff == NULL) return -1;
+	
+	while (fgets(buffer, BUFSIZ, fff)) {
+		if (!strncmp(buffer, "vendor_id", 8)) {
+			sscanf(buffer, "%*s%*s%s", vendor);
+			
+			if (strncmp(vendor, "GenuineIntel", 12)) {
+				printf("%s not an Intel chip\n", vendor);
+				fclose(fff);
+				return -1;
+			}
+		}
+		
+		if (!strncmp(buffer, "cpu family", 10)) {
+			sscanf(buffer, "%*s%*s%*s%d", &family);
+			if (family != 6) {
+				printf("Wrong CPU family %d\n", family);
+				fclose(fff);
+				return -1;
+			}
+		}
+		
+		if (!strncmp(buffer, "model", 5)) {
+			sscanf(buffer, "%*s%*s%d", &model);
+		}
+	}
+	
+	fclose(fff);
+	
+	switch (model) {
+		case CPU_SANDYBRIDGE:
+			printf("Found Sandybridge CPU\n");
+			break;
+		case CPU_SANDYBRIDGE_EP:
+			printf("Found Sandybridge-EP CPU\n");
+			break;
+		case CPU_IVYBRIDGE:
+			printf("Found Ivybridge CPU\n");
+			break;
+		case CPU_IVYBRIDGE_EP:
+			printf("Found Ivybridge-EP CPU\n");
+			break;
+		case CPU_HASWELL:
+			printf("Found Haswell CPU\n");
+			break;
+		case CPU_HASWELL_EP:
+			printf("Found Haswell-EP CPU\n");
+			break;
+		case CPU_BROADWELL_EP:
+			printf("Found Broadwell-EP CPU\n");
+			break;
+		case CPU_SKYLAKE:
+			printf("Found Skylake CPU\n");
+			break;
+		default:
+			printf("Unsupported model %d\n", model);
+			model = -1;
+			break;
+	}
+	
+	return model;
+}
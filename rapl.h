@@ -0,0 +1,183 @@
+/*
+ * librapl: Common code for reading the RAPL energy counters
+ *
+ * An energy source hides the mechanism used to read the counters.
+ * Backends are provided for PAPI, the MSR driver and the powercap sysfs interface.
+ * The simulated backend in rapl-sim.h serves the counters from a model instead.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef RAPL_H
+#define RAPL_H
+
+#include <stdint.h>
+
+/* RAPL domains in the order used by the values array of rapl_read() */
+enum rapl_domain {
+	RAPL_DOMAIN_PKG = 0,
+	RAPL_DOMAIN_PP0,
+	RAPL_DOMAIN_PP1,
+	RAPL_DOMAIN_DRAM,
+	RAPL_NUM_DOMAINS
+};
+
+#define RAPL_HAVE_DOMAIN(d)	(1u << (d))
+
+// Upper limit for the number of packages (sockets) read by one source
+#define RAPL_MAX_PACKAGES	8
+
+struct rapl_source;
+
+struct rapl_source_ops {
+	const char *name;
+	// Read the raw counters of all domains and packages, unavailable domains are left untouched
+	bool (*read)(struct rapl_source *source, uint64_t *values);
+	void (*close)(struct rapl_source *source);
+};
+
+struct rapl_source {
+	const struct rapl_source_ops *ops;
+	// Bit mask of RAPL_HAVE_DOMAIN() values
+	unsigned domains;
+	// Size of one counter step in joules
+	double energy_unit[RAPL_NUM_DOMAINS];
+	// Number of packages read by this source
+	int num_packages;
+	// The raw counters wrap around to zero at this value, 0 for counters that do not wrap
+	uint64_t counter_range[RAPL_NUM_DOMAINS];
+	// Backend specific state
+	void *priv;
+};
+
+/*
+ * Open an energy source using the named backend ("papi", "msr", "perf", "powercap" or "sim").
+ * A NULL or "auto" backend tries each one in turn except for "sim", which is
+ * configured with "sim:<options>" or the RAPL_SIM environment variable.
+ * The cpu selects which CPU (MSR, perf) or package (powercap) to read, PAPI ignores it.
+ * Returns NULL and prints an error message on failure.
+ */
+struct rapl_source *rapl_open(const char *backend, int cpu);
+struct rapl_source *rapl_open_papi(int num_packages);
+struct rapl_source *rapl_open_msr(int cpu);
+struct rapl_source *rapl_open_perf(int cpu);
+struct rapl_source *rapl_open_powercap(int package);
+// Simulated counters of at most max_packages packages, options as in rapl-sim.h
+struct rapl_source *rapl_open_sim(const char *options, int max_packages);
+void rapl_close(struct rapl_source *source);
+
+/* Package topology */
+struct rapl_package {
+	// physical_package_id from sysfs
+	int id;
+	// First online CPU of the package, used for reading its MSRs
+	int cpu;
+};
+
+/*
+ * Find the packages of the system from /sys/devices/system/cpu, sorted by id.
+ * Returns the number of packages found. Falls back to a single package on CPU 0.
+ */
+int rapl_discover_packages(struct rapl_package *packages, int max_packages);
+
+/*
+ * Open a source that reads every package in one rapl_read() call.
+ * PAPI reads all packages with a single event set, the other backends
+ * open one source per package.
+ */
+struct rapl_source *rapl_open_all(const char *backend);
+
+// Index of a counter in the values array of rapl_read()
+#define RAPL_VALUE_INDEX(package, domain)	((package) * RAPL_NUM_DOMAINS + (domain))
+
+// Read the raw counters, values must have room for num_packages * RAPL_NUM_DOMAINS entries
+static inline bool rapl_read(struct rapl_source *source, uint64_t *values) {
+	return source->ops->read(source, values);
+}
+
+static inline bool rapl_has_domain(const struct rapl_source *source, int domain) {
+	return (source->domains & RAPL_HAVE_DOMAIN(domain)) != 0;
+}
+
+const char *rapl_domain_name(int domain);
+
+/*
+ * Accumulator extending the raw counters of a source to monotonic 64-bit counts.
+ * rapl_accum_update() must be called at least once per wrap period of the
+ * counters, see rapl_wrap_seconds().
+ */
+struct rapl_accum {
+	int num_values;
+	uint64_t range[RAPL_NUM_DOMAINS];
+	bool started;
+	uint64_t last[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS];
+	uint64_t total[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS];
+};
+
+void rapl_accum_init(struct rapl_accum *accum, const struct rapl_source *source);
+// For counters read without a source, such as the MSR tools reading the registers themselves
+// All domains use the same range
+void rapl_accum_init_raw(struct rapl_accum *accum, int num_values, uint64_t range);
+// Add the increments since the previous call, values come from rapl_read()
+void rapl_accum_update(struct rapl_accum *accum, const uint64_t *values);
+
+static inline double rapl_accum_joules(const struct rapl_accum *accum, const struct rapl_source *source, int package, int domain) {
+	return accum->total[RAPL_VALUE_INDEX(package, domain)] * source->energy_unit[domain];
+}
+
+// Shortest time in which a counter of the source can wrap at the given power, 0 if it never wraps
+double rapl_wrap_seconds(const struct rapl_source *source, double max_power);
+
+/* Helpers for accessing the MSR driver directly */
+int rapl_msr_open(int cpu);
+// Opened for writing as well, for the tools that change MSRs
+int rapl_msr_open_rw(int cpu);
+bool rapl_msr_read(int fd, unsigned msr_offset, uint64_t *msr_out);
+bool rapl_msr_write(int fd, unsigned msr_offset, uint64_t value);
+
+// The energy status registers are 32 bits wide
+#define RAPL_MSR_COUNTER_RANGE	(1ULL << 32)
+
+// Read the energy unit in joules from MSR_RAPL_POWER_UNIT, returns false on failure
+bool rapl_msr_energy_unit(int fd, double *unit);
+
+/* Helpers for the perf_event power PMU */
+struct rapl_perf_event {
+	uint32_t type;
+	uint64_t config;
+	// Joules per counter step
+	double scale;
+};
+
+// Look up a power PMU event such as "energy-pkg", returns false if the kernel does not have it
+bool rapl_perf_event(const char *name, struct rapl_perf_event *event);
+// Open a counting event read with PERF_FORMAT_GROUP, group_fd is -1 for the group leader
+int rapl_perf_open(const struct rapl_perf_event *event, int cpu, int group_fd);
+
+/*
+ * Helpers for the tools that time PAPI_read() on the RAPL component itself.
+ * They are in rapl-papi.o, link it and -lpapi to use them.
+ */
+// Initialise PAPI and find its RAPL component, returns the component id or -1 after printing an error
+int rapl_papi_component();
+/*
+ * Create and start an event set of the RAPL events whose names contain one of
+ * the patterns, such as "PACKAGE_ENERGY_CNT:". indices[i] receives the position
+ * of the last event matching patterns[i] in the values of PAPI_read(), or -1.
+ * Returns the number of events, 0 after printing an error.
+ */
+int rapl_papi_start(const char *const *patterns, int num_patterns, int *indices, int *event_set);
+
+#define CPU_SANDYBRIDGE		42
+#define CPU_SANDYBRIDGE_EP	45
+#define CPU_IVYBRIDGE		58
+#define CPU_IVYBRIDGE_EP	62
+#define CPU_HASWELL		60
+#define CPU_HASWELL_EP		63
+#define CPU_BROADWELL_EP	79
+#define CPU_SKYLAKE		94
+
+// Returns the CPU model number or -1 if the CPU does not support RAPL
+int rapl_detect_cpu();
+
+#endif
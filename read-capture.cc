@@ -0,0 +1,404 @@
+/*
+ * Capture of raw counter reads for offline analysis, see read-capture.h
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "read-capture.h"
+#include "spsc-ring.h"
+
+// How long the writer thread sleeps when there are no full chunks
+#define CAPTURE_POLL_INTERVAL_NS	1000000
+
+struct capture_chunk {
+	struct capture_chunk_header hdr;
+	unsigned char payload[CAPTURE_CHUNK_SIZE];
+};
+
+struct capture {
+	// Full chunks to the writer thread and empty chunks back
+	struct spsc_ring full_chunks;
+	struct spsc_ring free_chunks;
+	struct capture_chunk *chunks;
+	FILE *fp;
+	struct capture_header header;
+	pthread_t thread;
+	int done;
+	bool write_failed;
+	
+	// State of the producer
+	struct capture_chunk *cur;
+	uint64_t prev_tsc;
+	uint64_t prev_mono_ns;
+	uint64_t prev_value[CAPTURE_MAX_REGISTERS];
+	uint32_t dropped_pending;
+	uint64_t dropped_total;
+};
+
+struct capture_reader {
+	const unsigned char *data;
+	size_t size;
+	size_t pos;
+	struct capture_header header;
+	// State of the current chunk
+	size_t chunk_end;
+	uint32_t records_left;
+	uint64_t prev_tsc;
+	uint64_t prev_mono_ns;
+	uint64_t prev_value[CAPTURE_MAX_REGISTERS];
+	uint64_t dropped;
+};
+
+static inline uint64_t zigzag_encode(uint64_t delta) {
+	return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+}
+
+static inline uint64_t zigzag_decode(uint64_t value) {
+	return (value >> 1) ^ (0 - (value & 1));
+}
+
+static inline unsigned char *put_varint(unsigned char *p, uint64_t value) {
+	while (value >= 0x80) {
+		*p++ = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (unsigned char)value;
+	return p;
+}
+
+// Returns NULL if the varint does not end before end
+static inline const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, uint64_t *value) {
+	uint64_t result = 0;
+	unsigned shift = 0;
+	while (p < end && shift < 64) {
+		unsigned char byte = *p++;
+		result |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*value = result;
+			return p;
+		}
+		shift += 7;
+	}
+	return NULL;
+}
+
+static bool write_all(struct capture *capture, const void *data, size_t size) {
+	if (!capture->write_failed && size > 0 && fwrite(data, size, 1, capture->fp) != 1) {
+		fprintf(stderr, "capture: Failed to write the capture: %s\n", strerror(errno));
+		capture->write_failed = true;
+	}
+	return !capture->write_failed;
+}
+
+static void write_chunk(struct capture *capture, const struct capture_chunk *chunk) {
+	write_all(capture, &chunk->hdr, sizeof(chunk->hdr));
+	write_all(capture, chunk->payload, chunk->hdr.size);
+}
+
+static void *capture_writer(void *arg) {
+	struct capture *capture = (struct capture *)arg;
+	const struct timespec poll_interval = { 0, CAPTURE_POLL_INTERVAL_NS };
+	struct capture_chunk *chunk = NULL;
+	
+	while (true) {
+		// Checked before taking a chunk so that the last chunk is not lost
+		bool done = __atomic_load_n(&capture->done, __ATOMIC_ACQUIRE);
+		if (!spsc_ring_pop(&capture->full_chunks, &chunk)) {
+			if (done) {
+				break;
+			}
+			nanosleep(&poll_interval, NULL);
+			continue;
+		}
+		write_chunk(capture, chunk);
+		spsc_ring_push(&capture->free_chunks, &chunk);
+	}
+	
+	return NULL;
+}
+
+struct capture *capture_open(const char *filename, const char *tool_name, int cpu) {
+	struct capture *capture = NULL;
+	struct timespec now;
+	sigset_t all_signals, old_signals;
+	int i;
+	
+	// The rings must be aligned to cache lines
+	if (posix_memalign((void **)&capture, SPSC_CACHE_LINE, sizeof(*capture)) != 0) {
+		fprintf(stderr, "capture: Out of memory\n");
+		return NULL;
+	}
+	memset(capture, 0, sizeof(*capture));
+	
+	capture->chunks = (struct capture_chunk *)calloc(CAPTURE_NUM_CHUNKS, sizeof(struct capture_chunk));
+	if (!capture->chunks || !spsc_ring_init(&capture->full_chunks, sizeof(struct capture_chunk *), CAPTURE_NUM_CHUNKS) ||
+		!spsc_ring_init(&capture->free_chunks, sizeof(struct capture_chunk *), CAPTURE_NUM_CHUNKS)) {
+		fprintf(stderr, "capture: Out of memory\n");
+		spsc_ring_destroy(&capture->full_chunks);
+		free(capture->chunks);
+		free(capture);
+		return NULL;
+	}
+	for (i = 0; i < CAPTURE_NUM_CHUNKS; i++) {
+		struct capture_chunk *chunk = &capture->chunks[i];
+		spsc_ring_push(&capture->free_chunks, &chunk);
+	}
+	
+	capture->fp = fopen(filename, "wb");
+	if (!capture->fp) {
+		fprintf(stderr, "capture: Could not open '%s' for writing: %s\n", filename, strerror(errno));
+		spsc_ring_destroy(&capture->full_chunks);
+		spsc_ring_destroy(&capture->free_chunks);
+		free(capture->chunks);
+		free(capture);
+		return NULL;
+	}
+	
+	memcpy(capture->header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+	capture->header.version = CAPTURE_VERSION;
+	capture->header.header_size = sizeof(struct capture_header);
+	snprintf(capture->header.tool_name, sizeof(capture->header.tool_name), "%s", tool_name);
+	clock_gettime(CLOCK_REALTIME, &now);
+	capture->header.start_time = now.tv_sec * 1000000000LL + now.tv_nsec;
+	capture->header.cpu = cpu;
+	write_all(capture, &capture->header, sizeof(capture->header));
+	
+	// The writer thread must not take the signals of the poll loop
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+	int err = pthread_create(&capture->thread, NULL, capture_writer, capture);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (err != 0) {
+		fprintf(stderr, "capture: Could not create the writer thread: %s\n", strerror(err));
+		fclose(capture->fp);
+		spsc_ring_destroy(&capture->full_chunks);
+		spsc_ring_destroy(&capture->free_chunks);
+		free(capture->chunks);
+		free(capture);
+		return NULL;
+	}
+	
+	return capture;
+}
+
+int capture_add_register(struct capture *capture, const char *name, uint32_t id, uint32_t bits) {
+	struct capture_header *header = &capture->header;
+	
+	if (header->num_registers >= CAPTURE_MAX_REGISTERS) {
+		return -1;
+	}
+	struct capture_register *reg = &header->registers[header->num_registers];
+	snprintf(reg->name, sizeof(reg->name), "%s", name);
+	reg->id = id;
+	reg->bits = bits;
+	header->num_registers++;
+	// Nothing follows the header before the first read
+	fseek(capture->fp, 0, SEEK_SET);
+	write_all(capture, header, sizeof(*header));
+	return header->num_registers - 1;
+}
+
+// Hand the current chunk to the writer thread
+static void finish_chunk(struct capture *capture) {
+	spsc_ring_push(&capture->full_chunks, &capture->cur);
+	capture->cur = NULL;
+}
+
+// Take an empty chunk, returns false if the writer has not returned any
+static bool start_chunk(struct capture *capture) {
+	if (!spsc_ring_pop(&capture->free_chunks, &capture->cur)) {
+		return false;
+	}
+	capture->cur->hdr.magic = CAPTURE_CHUNK_MAGIC;
+	capture->cur->hdr.size = 0;
+	capture->cur->hdr.num_records = 0;
+	capture->cur->hdr.dropped = capture->dropped_pending;
+	capture->dropped_pending = 0;
+	memset(capture->prev_value, 0, sizeof(capture->prev_value));
+	return true;
+}
+
+void capture_append(struct capture *capture, unsigned reg, uint64_t tsc, uint64_t mono_ns, uint64_t value) {
+	struct capture_chunk *chunk = capture->cur;
+	
+	if (chunk && chunk->hdr.size > CAPTURE_CHUNK_SIZE - CAPTURE_MAX_RECORD) {
+		finish_chunk(capture);
+		chunk = NULL;
+	}
+	if (!chunk) {
+		if (!start_chunk(capture)) {
+			capture->dropped_pending++;
+			capture->dropped_total++;
+			return;
+		}
+		chunk = capture->cur;
+	}
+	if (chunk->hdr.num_records == 0) {
+		chunk->hdr.base_tsc = capture->prev_tsc = tsc;
+		chunk->hdr.base_mono_ns = capture->prev_mono_ns = mono_ns;
+	}
+	
+	unsigned char *p = chunk->payload + chunk->hdr.size;
+	*p++ = (unsigned char)reg;
+	p = put_varint(p, zigzag_encode(tsc - capture->prev_tsc));
+	p = put_varint(p, mono_ns - capture->prev_mono_ns);
+	p = put_varint(p, zigzag_encode(value - capture->prev_value[reg]));
+	chunk->hdr.size = p - chunk->payload;
+	chunk->hdr.num_records++;
+	
+	capture->prev_tsc = tsc;
+	capture->prev_mono_ns = mono_ns;
+	capture->prev_value[reg] = value;
+}
+
+uint64_t capture_close(struct capture *capture) {
+	uint64_t dropped = capture->dropped_total;
+	
+	if (capture->cur) {
+		finish_chunk(capture);
+	}
+	__atomic_store_n(&capture->done, 1, __ATOMIC_RELEASE);
+	pthread_join(capture->thread, NULL);
+	
+	// Records dropped after the last chunk go into an empty chunk
+	if (capture->dropped_pending > 0) {
+		struct capture_chunk_header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = CAPTURE_CHUNK_MAGIC;
+		hdr.dropped = capture->dropped_pending;
+		write_all(capture, &hdr, sizeof(hdr));
+	}
+	if (fclose(capture->fp) != 0 && !capture->write_failed) {
+		fprintf(stderr, "capture: Failed to write the capture: %s\n", strerror(errno));
+	}
+	if (dropped > 0) {
+		fprintf(stderr, "capture: Warning: %lu reads were dropped because the writer could not keep up\n", (unsigned long)dropped);
+	}
+	
+	spsc_ring_destroy(&capture->full_chunks);
+	spsc_ring_destroy(&capture->free_chunks);
+	free(capture->chunks);
+	free(capture);
+	return dropped;
+}
+
+struct capture_reader *capture_reader_open(const char *filename) {
+	struct stat st;
+	
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "capture: Could not open '%s': %s\n", filename, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct capture_header)) {
+		fprintf(stderr, "capture: '%s' is not a capture file\n", filename);
+		close(fd);
+		return NULL;
+	}
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "capture: Could not map '%s': %s\n", filename, strerror(errno));
+		return NULL;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	
+	struct capture_reader *reader = (struct capture_reader *)calloc(1, sizeof(*reader));
+	reader->data = (const unsigned char *)data;
+	reader->size = st.st_size;
+	memcpy(&reader->header, data, sizeof(reader->header));
+	if (memcmp(reader->header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 ||
+		reader->header.version != CAPTURE_VERSION ||
+		reader->header.header_size < sizeof(struct capture_header) || reader->header.header_size > reader->size ||
+		reader->header.num_registers > CAPTURE_MAX_REGISTERS) {
+		fprintf(stderr, "capture: '%s' is not a version %d capture file\n", filename, CAPTURE_VERSION);
+		capture_reader_close(reader);
+		return NULL;
+	}
+	reader->pos = reader->chunk_end = reader->header.header_size;
+	
+	return reader;
+}
+
+void capture_reader_close(struct capture_reader *reader) {
+	munmap((void *)reader->data, reader->size);
+	free(reader);
+}
+
+const struct capture_header *capture_reader_header(const struct capture_reader *reader) {
+	return &reader->header;
+}
+
+uint64_t capture_reader_dropped(const struct capture_reader *reader) {
+	return reader->dropped;
+}
+
+// Move to the next chunk with records, returns false at the end of the file
+static bool next_chunk(struct capture_reader *reader) {
+	struct capture_chunk_header hdr;
+	
+	while (reader->pos + sizeof(hdr) <= reader->size) {
+		memcpy(&hdr, reader->data + reader->pos, sizeof(hdr));
+		if (hdr.magic != CAPTURE_CHUNK_MAGIC || hdr.size > reader->size - reader->pos - sizeof(hdr)) {
+			fprintf(stderr, "capture: %s chunk at offset %lu\n", hdr.magic == CAPTURE_CHUNK_MAGIC ? "Truncated" : "Damaged", (unsigned long)reader->pos);
+			reader->size = reader->pos;
+			return false;
+		}
+		reader->dropped += hdr.dropped;
+		reader->pos += sizeof(hdr);
+		reader->chunk_end = reader->pos + hdr.size;
+		reader->records_left = hdr.num_records;
+		reader->prev_tsc = hdr.base_tsc;
+		reader->prev_mono_ns = hdr.base_mono_ns;
+		memset(reader->prev_value, 0, sizeof(reader->prev_value));
+		if (reader->records_left > 0) {
+			return true;
+		}
+		reader->pos = reader->chunk_end;
+	}
+	
+	return false;
+}
+
+bool capture_next(struct capture_reader *reader, struct capture_record *record) {
+	uint64_t tsc_delta = 0, mono_delta = 0, value_delta = 0;
+	
+	if (reader->records_left == 0) {
+		reader->pos = reader->chunk_end;
+		if (!next_chunk(reader)) {
+			return false;
+		}
+	}
+	
+	const unsigned char *p = reader->data + reader->pos;
+	const unsigned char *end = reader->data + reader->chunk_end;
+	unsigned reg = *p++;
+	if (reg >= CAPTURE_MAX_REGISTERS || p >= end ||
+		(p = get_varint(p, end, &tsc_delta)) == NULL ||
+		(p = get_varint(p, end, &mono_delta)) == NULL ||
+		(p = get_varint(p, end, &value_delta)) == NULL) {
+		fprintf(stderr, "capture: Damaged record at offset %lu\n", (unsigned long)reader->pos);
+		reader->records_left = 0;
+		reader->size = reader->chunk_end = reader->pos;
+		return false;
+	}
+	reader->pos = p - reader->data;
+	reader->records_left--;
+	
+	record->reg = reg;
+	record->tsc = reader->prev_tsc += zigzag_decode(tsc_delta);
+	record->mono_ns = reader->prev_mono_ns += mono_delta;
+	record->value = reader->prev_value[reg] += zigzag_decode(value_delta);
+	return true;
+}
@@ -0,0 +1,134 @@
+/*
+ * Capture of raw counter reads for offline analysis
+ *
+ * The poll loops record every read as a (register, TSC, CLOCK_MONOTONIC,
+ * value) tuple, so that a run can be analysed again with capture-replay
+ * without the hardware it was recorded on.
+ *
+ * A capture file starts with a fixed-width struct capture_header followed by
+ * chunks. Each chunk is a struct capture_chunk_header and a payload of
+ * records, and can be decoded on its own, so a capture cut short by a crash
+ * is readable up to the last complete chunk. A record is the register index
+ * as one byte followed by three LEB128 varints: the zigzag encoded TSC delta,
+ * the CLOCK_MONOTONIC delta in nanoseconds and the zigzag encoded difference
+ * to the previous value of the same register in the chunk. A read that did
+ * not change the counter takes about six bytes.
+ *
+ * The poll loop only encodes the record into the current chunk. Full chunks
+ * are handed to a writer thread through a ring and empty ones come back
+ * through another, so capture_read() never blocks or allocates. If the
+ * writer falls behind, the records of the chunk are dropped and counted in
+ * the header of the next chunk. All values are stored in host byte order.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef READ_CAPTURE_H
+#define READ_CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#define CAPTURE_MAGIC		"RAPLCAP"
+#define CAPTURE_VERSION		1
+#define CAPTURE_CHUNK_MAGIC	0x4b4e4843	/* "CHNK" */
+
+// Upper limit for the number of registers in one capture
+#define CAPTURE_MAX_REGISTERS	16
+
+// Payload bytes per chunk and the number of chunks in flight
+#define CAPTURE_CHUNK_SIZE	(256 * 1024)
+#define CAPTURE_NUM_CHUNKS	32
+
+// Longest encoded record
+#define CAPTURE_MAX_RECORD	(1 + 3 * 10)
+
+struct capture_register {
+	char name[24];
+	// MSR offset or other identifier of the counter
+	uint32_t id;
+	// The counter wraps around at 2^bits, 64 for counters that do not wrap
+	uint32_t bits;
+};
+
+struct capture_header {
+	char magic[8];
+	uint32_t version;
+	// Size of this header, the first chunk starts at this offset
+	uint32_t header_size;
+	char tool_name[32];
+	// CLOCK_REALTIME in nanoseconds when the capture was opened
+	int64_t start_time;
+	// The CPU the reads were made on, -1 if not pinned
+	int32_t cpu;
+	uint32_t num_registers;
+	struct capture_register registers[CAPTURE_MAX_REGISTERS];
+};
+
+struct capture_chunk_header {
+	uint32_t magic;
+	// Payload bytes following this header
+	uint32_t size;
+	uint32_t num_records;
+	// Records lost before this chunk because the writer could not keep up
+	uint32_t dropped;
+	// Timestamps the deltas of the first record are relative to
+	uint64_t base_tsc;
+	uint64_t base_mono_ns;
+};
+
+struct capture_record {
+	unsigned reg;
+	uint64_t tsc;
+	uint64_t mono_ns;
+	uint64_t value;
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t capture_rdtsc() {
+	unsigned lo, hi;
+	__asm__ volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)lo) | ((uint64_t)hi << 32);
+}
+#else
+static inline uint64_t capture_rdtsc() {
+	return 0;
+}
+#endif
+
+/* Writing */
+
+struct capture;
+
+// Create the file and start the writer thread, returns NULL and prints an error on failure
+struct capture *capture_open(const char *filename, const char *tool_name, int cpu);
+// Declare a register before the first read, returns its index or -1 if there are too many
+int capture_add_register(struct capture *capture, const char *name, uint32_t id, uint32_t bits);
+// Append a record with the given timestamps
+void capture_append(struct capture *capture, unsigned reg, uint64_t tsc, uint64_t mono_ns, uint64_t value);
+// Write the remaining records and close the file, returns the number of records dropped
+uint64_t capture_close(struct capture *capture);
+
+// Record a read that just returned value
+static inline void capture_read(struct capture *capture, unsigned reg, uint64_t value) {
+	struct timespec now;
+	uint64_t tsc = capture_rdtsc();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	capture_append(capture, reg, tsc, now.tv_sec * 1000000000ULL + now.tv_nsec, value);
+}
+
+/* Reading */
+
+struct capture_reader;
+
+// Map a capture file for reading, returns NULL and prints an error on failure
+struct capture_reader *capture_reader_open(const char *filename);
+void capture_reader_close(struct capture_reader *reader);
+const struct capture_header *capture_reader_header(const struct capture_reader *reader);
+// Decode the next record, returns false at the end of the capture or at a damaged chunk
+bool capture_next(struct capture_reader *reader, struct capture_record *record);
+// Records dropped by the writer in the chunks decoded so far
+uint64_t capture_reader_dropped(const struct capture_reader *reader);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * shm-poll-latency.cc
+ * Benchmark the latency of reading the energy counters that trace-energy-v2 -M
+ * publishes in shared memory and compare it with PAPI_read().
+ *
+ * Start the publisher first, for example: ./trace-energy-v2 -M /rapl-energy
+ *
+ * Usage: ./shm-poll-latency [ -n <iterations> ] [ -c <core> ] [ -b <backend> ] [ -H <histogram file> ] [ shm name ]
+ * The comparison is made through the librapl backend given with -b, which defaults to papi.
+ * Each read is timed with the TSC, see tsc-latency.h, so the percentiles show
+ * how often a reader has to retry while the publisher is writing.
+ *   -H	Write the latency histograms in nanoseconds as CSV
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rapl.h"
+#include "rapl-shm.h"
+#include "util.h"
+#include "tsc-latency.h"
+
+static void report_latency(const char *name, const struct tsc_latency *lat, FILE *histogram_fp) {
+	tsc_latency_print(stdout, name, lat);
+	if (histogram_fp) {
+		tsc_latency_dump(histogram_fp, name, lat);
+	}
+}
+
+static bool do_shm(const char *name, int num_iterations, FILE *histogram_fp) {
+	struct rapl_shm_sample sample;
+	unsigned long retries = 0, updates = 0;
+	uint64_t prev_seq = 0;
+	int i = 0;
+	
+	const struct rapl_shm *shm = rapl_shm_attach(name);
+	if (!shm) {
+		fprintf(stderr, "Could not attach to %s, is trace-energy-v2 -M %s running?\n", name, name);
+		return false;
+	}
+	if (shm->publisher_pid == 0) {
+		fprintf(stderr, "Warning: The publisher of %s has stopped, the counters are not updated\n", name);
+	}
+	if (rapl_shm_read(shm, &sample) < 0) {
+		fprintf(stderr, "The publisher of %s stopped while publishing, the counters are not consistent\n", name);
+		rapl_shm_detach(shm);
+		return false;
+	}
+	prev_seq = sample.seq;
+	
+	static struct tsc_latency lat;
+	tsc_latency_init(&lat);
+	for (i = 0; i < num_iterations; i++) {
+		uint64_t begin = tsc_latency_begin();
+		int read_retries = rapl_shm_read(shm, &sample);
+		tsc_latency_add(&lat, begin, tsc_latency_end());
+		if (read_retries < 0) {
+			fprintf(stderr, "The publisher of %s stopped while publishing after %d reads\n", name, i);
+			break;
+		}
+		retries += read_retries;
+		if (sample.seq != prev_seq) {
+			updates++;
+			prev_seq = sample.seq;
+		}
+	}
+	
+	printf("Average shared memory read latency for %u packages: %f nanoseconds\n", shm->num_packages, tsc_latency_mean_ns(&lat));
+	report_latency("Shared memory read", &lat, histogram_fp);
+	tsc_latency_print_overhead(stdout, &lat);
+	printf("Observed %lu updates, %lu retries while the publisher was writing\n", updates, retries);
+	if (rapl_shm_has_domain(shm, RAPL_SHM_DOMAIN_PKG)) {
+		printf("Package 0 energy: %f J\n", rapl_shm_joules(shm, &sample, 0, RAPL_SHM_DOMAIN_PKG));
+	}
+	
+	rapl_shm_detach(shm);
+	return true;
+}
+
+static bool do_backend(const char *backend, int core, int num_iterations, FILE *histogram_fp) {
+	uint64_t values[RAPL_NUM_DOMAINS] = { 0 };
+	int i = 0;
+	
+	struct rapl_source *source = rapl_open(backend, core);
+	if (!source) {
+		printf("%s: not available\n", backend);
+		return false;
+	}
+	
+	static struct tsc_latency lat;
+	tsc_latency_init(&lat);
+	for (i = 0; i < num_iterations; i++) {
+		uint64_t begin = tsc_latency_begin();
+		rapl_read(source, values);
+		tsc_latency_add(&lat, begin, tsc_latency_end());
+	}
+	
+	if (strcmp(backend, "papi") == 0) {
+		printf("Average PAPI_read() latency: %f nanoseconds\n", tsc_latency_mean_ns(&lat));
+		report_latency("PAPI_read()", &lat, histogram_fp);
+	} else {
+		printf("%s: Average read latency: %f nanoseconds\n", backend, tsc_latency_mean_ns(&lat));
+		report_latency(backend, &lat, histogram_fp);
+	}
+	
+	rapl_close(source);
+	return true;
+}
+
+int main(int argc, char **argv) {
+	int core = 0, num_iterations = 1000000;
+	const char *backend = "papi";
+	const char *histogram_file = NULL;
+	FILE *histogram_fp = NULL;
+	int c = 0;
+	
+	while ((c = getopt(argc, argv, "n:c:b:H:")) != -1) {
+		switch (c) {
+			case 'n':
+				num_iterations = atoi(optarg);
+				break;
+			case 'c':
+				core = atoi(optarg);
+				break;
+			case 'b':
+				backend = optarg;
+				break;
+			case 'H':
+				histogram_file = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [ -n <iterations> ] [ -c <core> ] [ -b <backend> ] [ -H <histogram file> ] [ shm name ]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (num_iterations <= 0) {
+		fprintf(stderr, "Error: The number of iterations must be greater than zero\n");
+		return EXIT_FAILURE;
+	}
+	const char *name = optind < argc ? argv[optind] : RAPL_SHM_DEFAULT_NAME;
+	
+	if (histogram_file) {
+		histogram_fp = fopen(histogram_file, "w");
+		if (!histogram_fp) {
+			fprintf(stderr, "Failed to open %s!\n", histogram_file);
+			return EXIT_FAILURE;
+		}
+	}
+	
+	do_affinity(core);
+	bool ok = do_shm(name, num_iterations, histogram_fp);
+	do_backend(backend, core, num_iterations, histogram_fp);
+	if (histogram_fp) {
+		fclose(histogram_fp);
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,98 @@
+/*
+ * Lock-free single-producer single-consumer ring buffer
+ *
+ * Hands fixed-size elements from one thread to another, for example from a
+ * real-time sampler to a writer thread. The capacity is a power of two and
+ * the slots are allocated once in spsc_ring_init(), so spsc_ring_push()
+ * never blocks or allocates: it returns false when the ring is full.
+ *
+ * The producer and the consumer indices live on separate cache lines, and
+ * each side keeps a cached copy of the other index so that the shared cache
+ * line is only read when the ring looks full or empty. The struct must be
+ * allocated with 64-byte alignment, static storage is the easiest way.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SPSC_CACHE_LINE 64
+
+struct spsc_ring {
+	// Written by the producer only
+	uint64_t head __attribute__((aligned(SPSC_CACHE_LINE)));
+	uint64_t cached_tail;
+	// Written by the consumer only
+	uint64_t tail __attribute__((aligned(SPSC_CACHE_LINE)));
+	uint64_t cached_head;
+	// Read-only after spsc_ring_init()
+	size_t elem_size __attribute__((aligned(SPSC_CACHE_LINE)));
+	uint64_t capacity;
+	uint64_t mask;
+	unsigned char *slots;
+};
+
+// Capacity must be a power of two, returns false on failure
+static inline bool spsc_ring_init(struct spsc_ring *ring, size_t elem_size, uint64_t capacity) {
+	void *slots = NULL;
+	if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+		return false;
+	}
+	if (posix_memalign(&slots, SPSC_CACHE_LINE, elem_size * capacity) != 0) {
+		return false;
+	}
+	ring->head = 0;
+	ring->cached_tail = 0;
+	ring->tail = 0;
+	ring->cached_head = 0;
+	ring->elem_size = elem_size;
+	ring->capacity = capacity;
+	ring->mask = capacity - 1;
+	ring->slots = (unsigned char *)slots;
+	return true;
+}
+
+static inline void spsc_ring_destroy(struct spsc_ring *ring) {
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+// Producer side, returns false if the ring is full
+static inline bool spsc_ring_push(struct spsc_ring *ring, const void *elem) {
+	const uint64_t head = ring->head;
+	if (head - ring->cached_tail == ring->capacity) {
+		ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (head - ring->cached_tail == ring->capacity) {
+			return false;
+		}
+	}
+	memcpy(ring->slots + (head & ring->mask) * ring->elem_size, elem, ring->elem_size);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Consumer side, returns false if the ring is empty
+static inline bool spsc_ring_pop(struct spsc_ring *ring, void *elem) {
+	const uint64_t tail = ring->tail;
+	if (tail == ring->cached_head) {
+		ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (tail == ring->cached_head) {
+			return false;
+		}
+	}
+	memcpy(elem, ring->slots + (tail & ring->mask) * ring->elem_size, ring->elem_size);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Number of elements in the ring, approximate while both threads are running
+static inline uint64_t spsc_ring_count(struct spsc_ring *ring) {
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ * One-pass streaming statistics
+ *
+ * struct stream_stats keeps the count, mean, min, max and the second to
+ * fourth central moments of a series with Welford's update, extended to the
+ * higher moments as described by Terriberry. Nothing is stored per value,
+ * so the poll loops can run for hours in constant memory.
+ *
+ * struct stream_hist is a log-linear histogram of non-negative integers in
+ * the style of HdrHistogram. Values below 2^STREAM_HIST_SUB_BITS have a
+ * bucket each, above that every power of two is split into
+ * 2^STREAM_HIST_SUB_BITS buckets, so a percentile is off by at most 1/64 of
+ * its value and the whole 64-bit range fits in 30 kB.
+ *
+ * Both can be merged, for example to combine the results of several threads.
+ * Usable from C and C++, link C programs with -lm.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef STREAM_STATS_H
+#define STREAM_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+struct stream_stats {
+	uint64_t count;
+	double mean;
+	// Sums of the second, third and fourth powers of the differences from the mean
+	double m2;
+	double m3;
+	double m4;
+	double min;
+	double max;
+};
+
+static inline void stream_stats_init(struct stream_stats *stats) {
+	memset(stats, 0, sizeof(*stats));
+}
+
+static inline void stream_stats_add(struct stream_stats *stats, double x) {
+	double n1 = (double)stats->count;
+	double n = n1 + 1.0;
+	double delta = x - stats->mean;
+	double delta_n = delta / n;
+	double delta_n2 = delta_n * delta_n;
+	double term1 = delta * delta_n * n1;
+	
+	stats->mean += delta_n;
+	stats->m4 += term1 * delta_n2 * (n * n - 3.0 * n + 3.0) + 6.0 * delta_n2 * stats->m2 - 4.0 * delta_n * stats->m3;
+	stats->m3 += term1 * delta_n * (n - 2.0) - 3.0 * delta_n * stats->m2;
+	stats->m2 += term1;
+	if (stats->count == 0 || x < stats->min) stats->min = x;
+	if (stats->count == 0 || x > stats->max) stats->max = x;
+	stats->count++;
+}
+
+// Add the values of b to a
+static inline void stream_stats_merge(struct stream_stats *a, const struct stream_stats *b) {
+	if (b->count == 0) {
+		return;
+	}
+	if (a->count == 0) {
+		*a = *b;
+		return;
+	}
+	double na = (double)a->count, nb = (double)b->count, n = na + nb;
+	double delta = b->mean - a->mean;
+	double delta2 = delta * delta;
+	
+	double m2 = a->m2 + b->m2 + delta2 * na * nb / n;
+	double m3 = a->m3 + b->m3 + delta2 * delta * na * nb * (na - nb) / (n * n) +
+		3.0 * delta * (na * b->m2 - nb * a->m2) / n;
+	double m4 = a->m4 + b->m4 + delta2 * delta2 * na * nb * (na * na - na * nb + nb * nb) / (n * n * n) +
+		6.0 * delta2 * (na * na * b->m2 + nb * nb * a->m2) / (n * n) + 4.0 * delta * (na * b->m3 - nb * a->m3) / n;
+	a->mean += delta * nb / n;
+	a->m2 = m2;
+	a->m3 = m3;
+	a->m4 = m4;
+	if (b->min < a->min) a->min = b->min;
+	if (b->max > a->max) a->max = b->max;
+	a->count += b->count;
+}
+
+// Population standard deviation
+static inline double stream_stats_stddev(const struct stream_stats *stats) {
+	return stats->count > 0 ? sqrt(stats->m2 / stats->count) : 0.0;
+}
+
+static inline double stream_stats_skewness(const struct stream_stats *stats) {
+	return stats->m2 > 0.0 ? sqrt((double)stats->count) * stats->m3 / pow(stats->m2, 1.5) : 0.0;
+}
+
+// Excess kurtosis, 0 for a normal distribution
+static inline double stream_stats_kurtosis(const struct stream_stats *stats) {
+	return stats->m2 > 0.0 ? stats->count * stats->m4 / (stats->m2 * stats->m2) - 3.0 : 0.0;
+}
+
+#define STREAM_HIST_SUB_BITS	6
+#define STREAM_HIST_SUB_COUNT	(1u << STREAM_HIST_SUB_BITS)
+#define STREAM_HIST_BUCKETS	((64 - STREAM_HIST_SUB_BITS + 1) * STREAM_HIST_SUB_COUNT)
+
+struct stream_hist {
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	uint64_t counts[STREAM_HIST_BUCKETS];
+};
+
+static inline void stream_hist_init(struct stream_hist *hist) {
+	memset(hist, 0, sizeof(*hist));
+}
+
+static inline unsigned stream_hist_bucket(uint64_t value) {
+	if (value < STREAM_HIST_SUB_COUNT) {
+		return (unsigned)value;
+	}
+	unsigned shift = 63 - __builtin_clzll(value) - STREAM_HIST_SUB_BITS;
+	return ((shift + 1) << STREAM_HIST_SUB_BITS) + (unsigned)(value >> shift) - STREAM_HIST_SUB_COUNT;
+}
+
+// Smallest value of a bucket, *width receives the number of values in it
+static inline uint64_t stream_hist_bucket_start(unsigned bucket, uint64_t *width) {
+	if (bucket < STREAM_HIST_SUB_COUNT) {
+		*width = 1;
+		return bucket;
+	}
+	unsigned shift = (bucket >> STREAM_HIST_SUB_BITS) - 1;
+	*width = 1ULL << shift;
+	return (uint64_t)(STREAM_HIST_SUB_COUNT + (bucket & (STREAM_HIST_SUB_COUNT - 1))) << shift;
+}
+
+static inline void stream_hist_add(struct stream_hist *hist, uint64_t value) {
+	hist->counts[stream_hist_bucket(value)]++;
+	if (hist->total == 0 || value < hist->min) hist->min = value;
+	if (value > hist->max) hist->max = value;
+	hist->total++;
+}
+
+static inline void stream_hist_merge(struct stream_hist *a, const struct stream_hist *b) {
+	unsigned i;
+	if (b->total == 0) {
+		return;
+	}
+	for (i = 0; i < STREAM_HIST_BUCKETS; i++) {
+		a->counts[i] += b->counts[i];
+	}
+	if (a->total == 0 || b->min < a->min) a->min = b->min;
+	if (b->max > a->max) a->max = b->max;
+	a->total += b->total;
+}
+
+// Value below which the given percentage of the values fall, the middle of its bucket
+static inline uint64_t stream_hist_percentile(const struct stream_hist *hist, double percentile) {
+	double exact_rank = percentile / 100.0 * hist->total;
+	uint64_t rank = (uint64_t)exact_rank, seen = 0, width = 0;
+	unsigned i;
+	
+	if (hist->total == 0) {
+		return 0;
+	}
+	// Round up, but not because of a rounding error in the percentage
+	if (exact_rank - rank > 1e-6) rank++;
+	if (rank < 1) rank = 1;
+	if (rank >= hist->total) return hist->max;
+	for (i = 0; i < STREAM_HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= rank) {
+			uint64_t value = stream_hist_bucket_start(i, &width) + (width - 1) / 2;
+			if (value < hist->min) value = hist->min;
+			if (value > hist->max) value = hist->max;
+			return value;
+		}
+	}
+	return hist->max;
+}
+
+// Print the usual percentiles on one line, the values are multiplied by scale
+static inline void stream_hist_print_percentiles(FILE *fp, const char *label, const struct stream_hist *hist, double scale) {
+	fprintf(fp, "%s: p50 %f, p90 %f, p99 %f, p99.9 %f, max %f\n", label,
+		stream_hist_percentile(hist, 50.0) * scale, stream_hist_percentile(hist, 90.0) * scale,
+		stream_hist_percentile(hist, 99.0) * scale, stream_hist_percentile(hist, 99.9) * scale, hist->max * scale);
+}
+
+// Print the non-empty buckets as "name, start, end, count" lines, the values are multiplied by scale
+static inline void stream_hist_dump(FILE *fp, const char *name, const struct stream_hist *hist, double scale) {
+	uint64_t width = 0;
+	unsigned i;
+	for (i = 0; i < STREAM_HIST_BUCKETS; i++) {
+		if (hist->counts[i] > 0) {
+			uint64_t start = stream_hist_bucket_start(i, &width);
+			fprintf(fp, "%s, %f, %f, %llu\n", name, start * scale, (start + width) * scale, (unsigned long long)hist->counts[i]);
+		}
+	}
+}
+
+/*
+ * Gaps between counter updates, the common analysis of the gap tools.
+ * The gaps are given in seconds and the histogram is kept in nanoseconds.
+ */
+struct gap_stats {
+	struct stream_stats stats;
+	struct stream_hist hist;
+};
+
+static inline void gap_stats_init(struct gap_stats *gaps) {
+	stream_stats_init(&gaps->stats);
+	stream_hist_init(&gaps->hist);
+}
+
+static inline void gap_stats_add(struct gap_stats *gaps, double gap) {
+	stream_stats_add(&gaps->stats, gap);
+	stream_hist_add(&gaps->hist, gap > 0.0 ? (uint64_t)(gap * 1e9 + 0.5) : 0);
+}
+
+static inline void gap_stats_print(FILE *fp, const struct gap_stats *gaps) {
+	fprintf(fp, "Biggest gap was %f millisecond.\n", gaps->stats.max * 1000.0);
+	fprintf(fp, "Average gap of %f milliseconds.\n", gaps->stats.mean * 1000.0);
+	fprintf(fp, "Standard deviation of the gaps is %f microseconds.\n", stream_stats_stddev(&gaps->stats) * 1000000.0);
+	fprintf(fp, "Skewness of the gaps is %f and excess kurtosis %f.\n", stream_stats_skewness(&gaps->stats), stream_stats_kurtosis(&gaps->stats));
+	stream_hist_print_percentiles(fp, "Gap percentiles in milliseconds", &gaps->hist, 1e-6);
+}
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * test-cpu-tracker.cc
+ * Test the /proc/<pid>/stat parsing and the process tree CPU time of cpu-tracker.h.
+ *
+ * The parser is given stat lines where every field has a different value, so
+ * that reading a neighbouring field shows up in the sum. The command names
+ * contain spaces and parentheses. The real /proc/self/stat is compared with
+ * times(), which reports the same four fields, after this process and a child
+ * it has waited for have used some CPU time. Finally a tree of two busy
+ * processes is tracked while they run.
+ *
+ * Usage: ./test-cpu-tracker
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/times.h>
+#include <sys/wait.h>
+
+#include "cpu-tracker.h"
+
+static unsigned long errors = 0;
+
+static int64_t cputime_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Use CPU time in this process
+static void burn(int64_t ns) {
+	int64_t start = cputime_ns();
+	volatile uint64_t x = 0;
+	while (cputime_ns() - start < ns) {
+		x++;
+	}
+}
+
+static void check_line(const char *test, const char *line, bool valid, uint64_t expected) {
+	uint64_t ticks = 0;
+	bool parsed = cpu_tracker_parse_stat(line, &ticks);
+	if (parsed != valid || (valid && ticks != expected)) {
+		fprintf(stderr, "%s: parsed %s with %llu ticks, expected %s with %llu ticks\n", test,
+			parsed ? "true" : "false", (unsigned long long)ticks, valid ? "true" : "false", (unsigned long long)expected);
+		errors++;
+	}
+}
+
+/* Fields 14 to 17 are utime, stime, cutime and cstime, their neighbours must not be included */
+static void test_parse_lines() {
+	const char *test = "stat lines";
+	unsigned long errors_before = errors;
+	
+	// minflt 10, cminflt 11, majflt 12, cmajflt 13, utime 100, stime 2000, cutime 30000, cstime 400000, priority 20
+	check_line(test, "1234 (sleep) S 1 1234 1234 0 -1 4194304 10 11 12 13 100 2000 30000 400000 20 0 1 0 5 8192 100\n", true, 432100);
+	check_line(test, "1234 (my prog) R 1 1234 1234 0 -1 4194304 10 11 12 13 100 2000 30000 400000 20 0 1 0 5 8192 100\n", true, 432100);
+	check_line(test, "1234 (a) b (c)) R 1 1234 1234 0 -1 4194304 10 11 12 13 100 2000 30000 400000 20 0 1 0 5 8192 100\n", true, 432100);
+	check_line(test, "1234 ()) ) S 1 1234 1234 0 -1 4194304 10 11 12 13 1 2 3 4 20 0 1 0 5 8192 100\n", true, 10);
+	// Cut short before cstime and without a command name
+	check_line(test, "1234 (sleep) S 1 1234 1234 0 -1 4194304 10 11 12 13 100 2000 30000", false, 0);
+	check_line(test, "1234 sleep S 1 1234 1234 0 -1 4194304 10 11 12 13 100 2000 30000 400000 20", false, 0);
+	printf("%s: %s\n", test, errors == errors_before ? "passed" : "FAILED");
+}
+
+/* times() gives the same fields for the calling process */
+static void test_parse_self() {
+	const char *test = "/proc/self/stat";
+	unsigned long errors_before = errors;
+	char buf[1024];
+	struct tms before, after;
+	uint64_t ticks = 0;
+	
+	// Some time in each of the four fields
+	pid_t child = fork();
+	if (child == 0) {
+		burn(50000000);
+		_exit(EXIT_SUCCESS);
+	}
+	waitpid(child, NULL, 0);
+	burn(50000000);
+	
+	FILE *fp = fopen("/proc/self/stat", "r");
+	if (!fp) {
+		perror("fopen /proc/self/stat");
+		errors++;
+		return;
+	}
+	times(&before);
+	bool parsed = fgets(buf, sizeof(buf), fp) && cpu_tracker_parse_stat(buf, &ticks);
+	times(&after);
+	fclose(fp);
+	
+	uint64_t low = before.tms_utime + before.tms_stime + before.tms_cutime + before.tms_cstime;
+	uint64_t high = after.tms_utime + after.tms_stime + after.tms_cutime + after.tms_cstime;
+	if (!parsed || ticks < low || ticks > high || after.tms_cutime + after.tms_cstime == 0) {
+		fprintf(stderr, "%s: %llu ticks, times() gives %llu to %llu\n", test,
+			(unsigned long long)ticks, (unsigned long long)low, (unsigned long long)high);
+		errors++;
+	}
+	printf("%s: %s\n", test, errors == errors_before ? "passed" : "FAILED");
+}
+
+/* A root that waits for a busy child and then uses as much time itself */
+static void test_tree() {
+	const char *test = "process tree";
+	const int64_t busy_ns = 200000000;
+	unsigned long errors_before = errors;
+	uint64_t tracked_ns = 0;
+	int status = 0;
+	
+	// /proc/<pid>/stat truncates to clock ticks, a tick may be lost for each process and field
+	const uint64_t min_ns = 2 * busy_ns - 4 * (uint64_t)(1e9 / sysconf(_SC_CLK_TCK));
+	cpu_tracker_prepare_trees();
+	pid_t root = fork();
+	if (root == 0) {
+		cpu_tracker_enter_tree();
+		pid_t child = fork();
+		if (child == 0) {
+			burn(busy_ns);
+			_exit(EXIT_SUCCESS);
+		}
+		waitpid(child, NULL, 0);
+		burn(busy_ns);
+		// Stay alive until the tracker has read the tree
+		pause();
+		_exit(EXIT_SUCCESS);
+	}
+	struct cpu_tracker *tracker = cpu_tracker_open_tree(root);
+	if (!tracker) {
+		errors++;
+		printf("%s: FAILED\n", test);
+		return;
+	}
+	// Wait until both have used their time
+	for (int i = 0; i < 100 && tracked_ns < min_ns; i++) {
+		usleep(20000);
+		cpu_tracker_read(tracker, &tracked_ns, NULL);
+	}
+	cpu_tracker_kill(tracker, SIGKILL);
+	waitpid(root, &status, 0);
+	cpu_tracker_close(tracker);
+	
+	// The time spent around the busy loops makes it a little more
+	if (tracked_ns < min_ns || tracked_ns > 3 * busy_ns) {
+		fprintf(stderr, "%s: %f s tracked, expected %f s\n", test, tracked_ns * 1e-9, 2 * busy_ns * 1e-9);
+		errors++;
+	}
+	printf("%s: %s\n", test, errors == errors_before ? "passed" : "FAILED");
+}
+
+int main() {
+	test_parse_lines();
+	test_parse_self();
+	test_tree();
+	
+	printf("%s (%lu errors)\n", errors == 0 ? "All tests passed" : "Some tests FAILED", errors);
+	return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
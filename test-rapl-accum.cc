@@ -0,0 +1,254 @@
+/*
+ * test-rapl-accum.cc
+ * Test the 64-bit accumulator of librapl against the counter ranges of the backends.
+ *
+ * The 32-bit MSR registers wrap at 2^32, the powercap energy_uj files wrap
+ * after max_energy_range_uj and perf counters do not wrap at all. The
+ * accumulator is fed with hand-made counter values for each case and with a
+ * multi-package layout where the domains have different ranges. Finally the
+ * simulated backend is started just below 2^32 so that it wraps while read.
+ *
+ * Usage: ./test-rapl-accum
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "rapl.h"
+
+// max_energy_range_uj of a typical Intel package domain
+#define POWERCAP_MAX_ENERGY_RANGE_UJ	262143328850ULL
+
+static unsigned long errors = 0;
+
+static void check_total(const char *test, const struct rapl_accum *accum, int index, uint64_t expected) {
+	if (accum->total[index] != expected) {
+		fprintf(stderr, "%s: counter %d is %llu, expected %llu\n", test, index,
+			(unsigned long long)accum->total[index], (unsigned long long)expected);
+		errors++;
+	}
+}
+
+// A source with the given number of packages and ranges, only the fields used by rapl_accum
+static void fake_source(struct rapl_source *source, int num_packages, const uint64_t *range) {
+	int domain;
+	memset(source, 0, sizeof(*source));
+	source->num_packages = num_packages;
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		source->domains |= RAPL_HAVE_DOMAIN(domain);
+		source->energy_unit[domain] = 1e-6;
+		source->counter_range[domain] = range[domain];
+	}
+}
+
+/* MSR registers wrap from 2^32 - 1 to 0 */
+static void test_msr_wrap() {
+	const char *test = "32-bit wrap";
+	struct rapl_accum accum;
+	uint64_t values[RAPL_NUM_DOMAINS] = { 0 };
+	
+	rapl_accum_init_raw(&accum, RAPL_NUM_DOMAINS, RAPL_MSR_COUNTER_RANGE);
+	values[RAPL_DOMAIN_PKG] = 0xffffff00;
+	values[RAPL_DOMAIN_PP0] = 0xffffffff;
+	values[RAPL_DOMAIN_DRAM] = 100;
+	rapl_accum_update(&accum, values);
+	// The first update only sets the starting point
+	check_total(test, &accum, RAPL_DOMAIN_PKG, 0);
+	
+	values[RAPL_DOMAIN_PKG] = 0x100;
+	values[RAPL_DOMAIN_PP0] = 0;
+	values[RAPL_DOMAIN_DRAM] = 200;
+	rapl_accum_update(&accum, values);
+	check_total(test, &accum, RAPL_DOMAIN_PKG, 0x200);
+	check_total(test, &accum, RAPL_DOMAIN_PP0, 1);
+	check_total(test, &accum, RAPL_DOMAIN_PP1, 0);
+	check_total(test, &accum, RAPL_DOMAIN_DRAM, 100);
+	
+	// Several wraps in a row keep adding up
+	for (int i = 0; i < 3; i++) {
+		values[RAPL_DOMAIN_PKG] = 0xffffff00;
+		rapl_accum_update(&accum, values);
+		values[RAPL_DOMAIN_PKG] = 0x100;
+		rapl_accum_update(&accum, values);
+	}
+	check_total(test, &accum, RAPL_DOMAIN_PKG, 0x200 + 3 * 0x100000000ULL);
+	printf("%s: %s\n", test, errors == 0 ? "passed" : "FAILED");
+}
+
+/* powercap counters wrap from max_energy_range_uj to 0, so the range is one more than the maximum */
+static void test_powercap_wrap() {
+	const char *test = "max_energy_range_uj wrap";
+	const uint64_t range[RAPL_NUM_DOMAINS] = { POWERCAP_MAX_ENERGY_RANGE_UJ + 1, POWERCAP_MAX_ENERGY_RANGE_UJ + 1, 0, 65712999613ULL + 1 };
+	unsigned long errors_before = errors;
+	struct rapl_source source;
+	struct rapl_accum accum;
+	uint64_t values[RAPL_NUM_DOMAINS] = { 0 };
+	
+	fake_source(&source, 1, range);
+	rapl_accum_init(&accum, &source);
+	values[RAPL_DOMAIN_PKG] = POWERCAP_MAX_ENERGY_RANGE_UJ - 10;
+	values[RAPL_DOMAIN_PP0] = POWERCAP_MAX_ENERGY_RANGE_UJ;
+	values[RAPL_DOMAIN_DRAM] = 65712999613ULL - 1;
+	rapl_accum_update(&accum, values);
+	
+	values[RAPL_DOMAIN_PKG] = 5;
+	values[RAPL_DOMAIN_PP0] = 0;
+	values[RAPL_DOMAIN_DRAM] = 1;
+	rapl_accum_update(&accum, values);
+	// 10 steps up to the maximum, one to zero and 5 more
+	check_total(test, &accum, RAPL_DOMAIN_PKG, 16);
+	check_total(test, &accum, RAPL_DOMAIN_PP0, 1);
+	check_total(test, &accum, RAPL_DOMAIN_DRAM, 3);
+	
+	// Reaching the maximum exactly is not a wrap
+	values[RAPL_DOMAIN_PKG] = POWERCAP_MAX_ENERGY_RANGE_UJ;
+	rapl_accum_update(&accum, values);
+	check_total(test, &accum, RAPL_DOMAIN_PKG, 16 + POWERCAP_MAX_ENERGY_RANGE_UJ - 5);
+	
+	double joules = rapl_accum_joules(&accum, &source, 0, RAPL_DOMAIN_PKG);
+	if (fabs(joules - (16 + POWERCAP_MAX_ENERGY_RANGE_UJ - 5) * 1e-6) > 1e-6) {
+		fprintf(stderr, "%s: %f joules, expected %f\n", test, joules, (16 + POWERCAP_MAX_ENERGY_RANGE_UJ - 5) * 1e-6);
+		errors++;
+	}
+	printf("%s: %s\n", test, errors == errors_before ? "passed" : "FAILED");
+}
+
+/* perf counters are 64 bits wide and have no range, nothing is treated as a wrap */
+static void test_no_wrap() {
+	const char *test = "range 0";
+	const uint64_t range[RAPL_NUM_DOMAINS] = { 0, 0, 0, 0 };
+	unsigned long errors_before = errors;
+	struct rapl_source source;
+	struct rapl_accum accum;
+	uint64_t values[RAPL_NUM_DOMAINS] = { 0 };
+	
+	fake_source(&source, 1, range);
+	rapl_accum_init(&accum, &source);
+	values[RAPL_DOMAIN_PKG] = 0xfffffff0;
+	values[RAPL_DOMAIN_PP0] = 1000;
+	rapl_accum_update(&accum, values);
+	
+	// Passing 2^32 is a plain increment
+	values[RAPL_DOMAIN_PKG] = 0x100000010ULL;
+	values[RAPL_DOMAIN_PP0] = 1000;
+	rapl_accum_update(&accum, values);
+	check_total(test, &accum, RAPL_DOMAIN_PKG, 0x20);
+	check_total(test, &accum, RAPL_DOMAIN_PP0, 0);
+	
+	// A counter that does not change adds nothing
+	rapl_accum_update(&accum, values);
+	check_total(test, &accum, RAPL_DOMAIN_PKG, 0x20);
+	printf("%s: %s\n", test, errors == errors_before ? "passed" : "FAILED");
+}
+
+/* Each package has RAPL_NUM_DOMAINS values and each domain keeps its own range */
+static void test_multi_package() {
+	const char *test = "multi-package layout";
+	const int num_packages = 3;
+	const uint64_t range[RAPL_NUM_DOMAINS] = { POWERCAP_MAX_ENERGY_RANGE_UJ + 1, RAPL_MSR_COUNTER_RANGE, 0, 1000 };
+	unsigned long errors_before = errors;
+	struct rapl_source source;
+	struct rapl_accum accum;
+	uint64_t values[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS] = { 0 };
+	int package, domain;
+	
+	fake_source(&source, num_packages, range);
+	rapl_accum_init(&accum, &source);
+	if (accum.num_values != num_packages * RAPL_NUM_DOMAINS) {
+		fprintf(stderr, "%s: %d values, expected %d\n", test, accum.num_values, num_packages * RAPL_NUM_DOMAINS);
+		errors++;
+	}
+	
+	// Every counter starts 5 steps below its wrap, 2^64 - 5 for the domain without a range
+	for (package = 0; package < num_packages; package++) {
+		for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+			values[RAPL_VALUE_INDEX(package, domain)] = range[domain] - 5;
+		}
+	}
+	// Counters past the used packages must not be touched
+	values[RAPL_VALUE_INDEX(num_packages, RAPL_DOMAIN_PKG)] = 12345;
+	rapl_accum_update(&accum, values);
+	
+	// Package p advances by 10 * (p + 1) steps in every domain
+	for (package = 0; package < num_packages; package++) {
+		for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+			values[RAPL_VALUE_INDEX(package, domain)] = range[domain] - 5 + 10 * (package + 1);
+		}
+	}
+	values[RAPL_VALUE_INDEX(num_packages, RAPL_DOMAIN_PKG)] = 0;
+	rapl_accum_update(&accum, values);
+	
+	for (package = 0; package < num_packages; package++) {
+		for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+			int i = RAPL_VALUE_INDEX(package, domain);
+			check_total(test, &accum, i, 10 * (package + 1));
+			double joules = rapl_accum_joules(&accum, &source, package, domain);
+			if (fabs(joules - 10 * (package + 1) * 1e-6) > 1e-12) {
+				fprintf(stderr, "%s: package %d %s has %g joules, expected %g\n", test, package, rapl_domain_name(domain), joules, 10 * (package + 1) * 1e-6);
+				errors++;
+			}
+		}
+	}
+	check_total(test, &accum, RAPL_VALUE_INDEX(num_packages, RAPL_DOMAIN_PKG), 0);
+	printf("%s: %s\n", test, errors == errors_before ? "passed" : "FAILED");
+}
+
+/* The simulated registers start 1 J below 2^32 steps at 20 W and wrap within 100 ms */
+static void test_sim_wrap() {
+	const char *test = "simulated wrap";
+	const struct timespec poll_interval = { 0, 1000000 };
+	unsigned long errors_before = errors;
+	uint64_t values[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS] = { 0 };
+	struct rapl_accum accum;
+	bool wrapped = false;
+	int i;
+	
+	struct rapl_source *source = rapl_open_all("sim:unit=16,start=4294901760,packages=2");
+	if (!source) {
+		errors++;
+		printf("%s: FAILED\n", test);
+		return;
+	}
+	rapl_accum_init(&accum, source);
+	rapl_read(source, values);
+	rapl_accum_update(&accum, values);
+	for (i = 0; i < 100; i++) {
+		nanosleep(&poll_interval, NULL);
+		uint64_t last = accum.last[RAPL_DOMAIN_PKG];
+		rapl_read(source, values);
+		rapl_accum_update(&accum, values);
+		if (values[RAPL_DOMAIN_PKG] < last) {
+			wrapped = true;
+		}
+	}
+	if (!wrapped) {
+		fprintf(stderr, "%s: the PKG counter did not wrap\n", test);
+		errors++;
+	}
+	// The same power on both packages, and the energy keeps growing through the wrap
+	double pkg0 = rapl_accum_joules(&accum, source, 0, RAPL_DOMAIN_PKG);
+	double pkg1 = rapl_accum_joules(&accum, source, 1, RAPL_DOMAIN_PKG);
+	if (pkg0 < 1.0 || pkg0 > 1000.0 || fabs(pkg0 - pkg1) > 0.1) {
+		fprintf(stderr, "%s: PKG energy of %f J and %f J after the wrap\n", test, pkg0, pkg1);
+		errors++;
+	}
+	rapl_close(source);
+	printf("%s: %s\n", test, errors == errors_before ? "passed" : "FAILED");
+}
+
+int main() {
+	test_msr_wrap();
+	test_powercap_wrap();
+	test_no_wrap();
+	test_multi_package();
+	test_sim_wrap();
+	
+	printf("%s (%lu errors)\n", errors == 0 ? "All tests passed" : "Some tests FAILED", errors);
+	return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
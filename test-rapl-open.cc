@@ -0,0 +1,87 @@
+/*
+ * test-rapl-open.cc
+ * Smoke test of the backend selection of librapl.
+ *
+ * Every backend name that the tools accept is opened with rapl_open() and
+ * rapl_open_all(), linked with rapl-papi.o like the tools, so that "auto"
+ * and "papi" go through the PAPI backend first. A backend that is not
+ * available on this machine must fail cleanly, one that opens must be
+ * readable. The simulated backend is always available. The whole test runs
+ * under a watchdog, so a selection that never returns is a failure.
+ *
+ * Usage: ./test-rapl-open
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "rapl.h"
+
+// Opening a backend takes well under a second, the simulated one included
+#define WATCHDOG_SECONDS	10
+
+static unsigned long errors = 0;
+
+static void handle_watchdog(int sig) {
+	(void)sig;
+	const char msg[] = "Backend selection did not return: FAILED\n";
+	if (write(STDOUT_FILENO, msg, sizeof(msg) - 1) < 0) {
+		// Exiting anyway
+	}
+	_exit(EXIT_FAILURE);
+}
+
+// Returns whether the source opened
+static bool check_source(const char *name, struct rapl_source *source) {
+	uint64_t values[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS] = { 0 };
+	
+	if (!source) {
+		printf("%s: not available\n", name);
+		return false;
+	}
+	if (source->num_packages < 1 || source->num_packages > RAPL_MAX_PACKAGES || !rapl_read(source, values)) {
+		fprintf(stderr, "%s: opened with %d packages but could not be read\n", name, source->num_packages);
+		errors++;
+	} else {
+		printf("%s: opened with %d packages, PKG counter %llu\n", name, source->num_packages,
+			(unsigned long long)values[RAPL_VALUE_INDEX(0, RAPL_DOMAIN_PKG)]);
+	}
+	rapl_close(source);
+	return true;
+}
+
+int main() {
+	const char *backends[] = { "auto", "papi", "msr", "perf", "powercap", "sim" };
+	char name[64];
+	unsigned i;
+	
+	signal(SIGALRM, handle_watchdog);
+	alarm(WATCHDOG_SECONDS);
+	
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		snprintf(name, sizeof(name), "rapl_open(\"%s\")", backends[i]);
+		bool opened = check_source(name, rapl_open(backends[i], 0));
+		snprintf(name, sizeof(name), "rapl_open_all(\"%s\")", backends[i]);
+		bool opened_all = check_source(name, rapl_open_all(backends[i]));
+		if (strcmp(backends[i], "sim") == 0 && (!opened || !opened_all)) {
+			fprintf(stderr, "The simulated backend must always open\n");
+			errors++;
+		}
+	}
+	
+	// An unknown name is an error, not a fallback
+	if (rapl_open("no-such-backend", 0) != NULL) {
+		fprintf(stderr, "An unknown backend opened\n");
+		errors++;
+	}
+	alarm(0);
+	
+	printf("%s (%lu errors)\n", errors == 0 ? "All tests passed" : "Some tests FAILED", errors);
+	return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
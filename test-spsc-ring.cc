@@ -0,0 +1,239 @@
+/*
+ * test-spsc-ring.cc
+ * Stress test and microbenchmark for the lock-free SPSC ring in spsc-ring.h.
+ *
+ * The stress test pushes a sequence of samples from one thread and checks
+ * on the other thread that every sample arrives once, in order and intact.
+ * The benchmark times every push with the TSC, once with the consumer
+ * running and once with the producer alone emptying the ring whenever it
+ * fills up. A push that finds the ring full is retried until the sample is
+ * stored, the latencies are of the stored samples and the early returns from
+ * a full ring are reported separately. It also checks that pushing does not
+ * allocate any memory.
+ *
+ * Usage: ./test-spsc-ring [ -n <samples> ] [ -r <ring capacity> ]
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "spsc-ring.h"
+#include "tsc-latency.h"
+#include "util.h"
+
+// Roughly the size of a trace-energy-v2 sample
+struct test_sample {
+	uint64_t seq;
+	uint64_t payload[33];
+};
+
+static struct spsc_ring ring;
+static uint64_t num_samples = 10000000;
+static uint64_t ring_capacity = 1024;
+
+static int64_t monotonic_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void fill_sample(struct test_sample *sample, uint64_t seq) {
+	sample->seq = seq;
+	for (unsigned i = 0; i < sizeof(sample->payload) / sizeof(sample->payload[0]); i++) {
+		sample->payload[i] = seq * 33 + i;
+	}
+}
+
+// Bytes currently allocated with malloc()
+static size_t allocated_bytes() {
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 info = mallinfo2();
+#else
+	struct mallinfo info = mallinfo();
+#endif
+	return info.uordblks + info.hblkhd;
+}
+
+/* Stress test */
+
+static void *stress_producer(void *arg) {
+	uint64_t *full = (uint64_t *)arg;
+	struct test_sample sample;
+	uint64_t seq;
+	
+	for (seq = 0; seq < num_samples; seq++) {
+		fill_sample(&sample, seq);
+		while (!spsc_ring_push(&ring, &sample)) {
+			(*full)++;
+			// Lets the consumer run on machines with few CPUs
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+static bool stress_test() {
+	pthread_t producer;
+	struct test_sample sample, expected;
+	uint64_t full = 0, errors = 0, seq = 0;
+	
+	int64_t start = monotonic_ns();
+	pthread_create(&producer, NULL, stress_producer, &full);
+	while (seq < num_samples) {
+		if (!spsc_ring_pop(&ring, &sample)) {
+			sched_yield();
+			continue;
+		}
+		fill_sample(&expected, seq);
+		if (unlikely(memcmp(&sample, &expected, sizeof(sample)) != 0)) {
+			if (errors < 10) {
+				fprintf(stderr, "Sample %lu is corrupted or out of order (got sequence number %lu)\n", (unsigned long)seq, (unsigned long)sample.seq);
+			}
+			errors++;
+		}
+		seq++;
+	}
+	pthread_join(producer, NULL);
+	int64_t end = monotonic_ns();
+	
+	if (spsc_ring_pop(&ring, &sample)) {
+		fprintf(stderr, "The ring has samples left after the last one\n");
+		errors++;
+	}
+	printf("Stress test: %lu samples in %f seconds, %f million samples per second, the producer found the ring full %lu times\n", (unsigned long)num_samples, (end - start) * 1e-9, num_samples / ((end - start) * 1e-3), (unsigned long)full);
+	printf("Stress test: %s (%lu errors)\n", errors == 0 ? "passed" : "FAILED", (unsigned long)errors);
+	return errors == 0;
+}
+
+/* Microbenchmark */
+
+static volatile int consumer_stop = 0;
+
+static void *bench_consumer(void *arg) {
+	struct test_sample sample;
+	(void)arg;
+	while (!consumer_stop) {
+		spsc_ring_pop(&ring, &sample);
+	}
+	while (spsc_ring_pop(&ring, &sample)) {
+	}
+	return NULL;
+}
+
+struct push_timing {
+	// Pushes that stored the sample
+	struct tsc_latency stored;
+	// Pushes that returned early because the ring was full
+	struct tsc_latency full;
+	long allocated;
+};
+
+// Push count samples and time each attempt. A push that finds the ring full
+// is retried after yielding to the consumer, or after emptying the ring on
+// this thread when there is no consumer, until the sample is stored.
+static void time_pushes(uint64_t count, bool drain, struct push_timing *timing) {
+	struct test_sample sample;
+	uint64_t i;
+	
+	tsc_latency_init(&timing->stored);
+	tsc_latency_init(&timing->full);
+	fill_sample(&sample, 0);
+	size_t before = allocated_bytes();
+	for (i = 0; i < count; i++) {
+		for (;;) {
+			uint64_t begin = tsc_latency_begin();
+			bool ok = spsc_ring_push(&ring, &sample);
+			uint64_t end = tsc_latency_end();
+			if (ok) {
+				tsc_latency_add(&timing->stored, begin, end);
+				break;
+			}
+			tsc_latency_add(&timing->full, begin, end);
+			if (drain) {
+				struct test_sample discard;
+				while (spsc_ring_pop(&ring, &discard)) {
+				}
+			} else {
+				sched_yield();
+			}
+		}
+	}
+	timing->allocated = (long)(allocated_bytes() - before);
+	if (drain) {
+		while (spsc_ring_pop(&ring, &sample)) {
+		}
+	}
+}
+
+static void print_timing(const char *name, const struct push_timing *timing) {
+	char label[128];
+	
+	printf("Benchmark: %s: %lu pushes stored, average %f nanoseconds, max %f nanoseconds, %ld bytes allocated\n", name,
+		(unsigned long)timing->stored.stats.count, tsc_latency_mean_ns(&timing->stored),
+		timing->stored.stats.max / timing->stored.cycles_per_ns, timing->allocated);
+	snprintf(label, sizeof(label), "Benchmark: %s", name);
+	tsc_latency_print(stdout, label, &timing->stored);
+	if (timing->full.stats.count > 0) {
+		printf("Benchmark: %s: the ring was full %lu times, those pushes took %f nanoseconds on average, max %f nanoseconds\n", name,
+			(unsigned long)timing->full.stats.count, tsc_latency_mean_ns(&timing->full),
+			timing->full.stats.max / timing->full.cycles_per_ns);
+	}
+}
+
+static void benchmark() {
+	pthread_t consumer;
+	struct push_timing timing;
+	const uint64_t count = num_samples < 1000000 ? num_samples : 1000000;
+	
+	consumer_stop = 0;
+	pthread_create(&consumer, NULL, bench_consumer, NULL);
+	time_pushes(count, false, &timing);
+	consumer_stop = 1;
+	pthread_join(consumer, NULL);
+	tsc_latency_print_overhead(stdout, &timing.stored);
+	print_timing("push with a running consumer", &timing);
+	
+	// The producer alone, the ring is emptied whenever it fills up
+	time_pushes(count, true, &timing);
+	print_timing("push without a consumer", &timing);
+}
+
+int main(int argc, char **argv) {
+	int c = 0;
+	
+	while ((c = getopt(argc, argv, "n:r:")) != -1) {
+		switch (c) {
+			case 'n':
+				num_samples = strtoull(optarg, NULL, 10);
+				break;
+			case 'r':
+				ring_capacity = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [ -n <samples> ] [ -r <ring capacity> ]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (num_samples == 0) {
+		fprintf(stderr, "Error: The number of samples must be greater than zero\n");
+		return EXIT_FAILURE;
+	}
+	if (!spsc_ring_init(&ring, sizeof(struct test_sample), ring_capacity)) {
+		fprintf(stderr, "Error: The ring capacity must be a power of two\n");
+		return EXIT_FAILURE;
+	}
+	
+	bool passed = stress_test();
+	benchmark();
+	
+	spsc_ring_destroy(&ring);
+	return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,362 @@
+/*
+ * trace-convert.cc: Convert a binary energy trace to CSV or print summary statistics.
+ *
+ * The trace is mapped into memory with mmap() and read in place. Traces with
+ * energy attribution (-a or -g) get the same attributed PKG and PP0 columns as
+ * the text traces, computed from the CPU time columns.
+ *
+ * Usage: ./trace-convert [ -s ] [ -o <output file> ] <trace file>
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+#include "trace-format.h"
+#include "cpu-tracker.h"
+
+// Columns used for splitting the energy by CPU time
+struct attribution {
+	std::vector<uint32_t> pkg_columns;
+	std::vector<uint32_t> pp0_columns;
+	int tracked_column;
+	int system_column;
+	struct cpu_split split;
+};
+
+static uint64_t get_u64(const unsigned char *p) {
+	uint64_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+// Difference between two samples of an energy column, 32-bit registers wrap around
+static uint64_t energy_delta(const struct trace_column *column, const unsigned char *prev, const unsigned char *cur) {
+	if (column->type == TRACE_COL_ENERGY32) {
+		return (uint32_t)(get_u32(cur) - get_u32(prev));
+	}
+	return get_u64(cur) - get_u64(prev);
+}
+
+static int16_t get_i16(const unsigned char *p) {
+	int16_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+// The energy columns of a domain are named after it, with a ":<package>" suffix on multi-package systems
+static bool is_domain_column(const struct trace_column *column, const char *domain) {
+	size_t len = strlen(domain);
+	return column->type == TRACE_COL_ENERGY && strncmp(column->name, domain, len) == 0 &&
+		(column->name[len] == '\0' || column->name[len] == ':');
+}
+
+// Returns false if the columns needed for attribution are missing
+static bool find_attribution(const struct trace_header *hdr, struct attribution *attr) {
+	attr->tracked_column = -1;
+	attr->system_column = -1;
+	memset(&attr->split, 0, sizeof(attr->split));
+	for (uint32_t col = 0; col < hdr->num_columns; col++) {
+		const struct trace_column *column = &hdr->columns[col];
+		if (is_domain_column(column, "PKG")) {
+			attr->pkg_columns.push_back(col);
+		} else if (is_domain_column(column, "PP0")) {
+			attr->pp0_columns.push_back(col);
+		} else if (column->type == TRACE_COL_CPUTIME && strcmp(column->name, "CPU:tracked") == 0) {
+			attr->tracked_column = col;
+		} else if (column->type == TRACE_COL_CPUTIME && strcmp(column->name, "CPU:system") == 0) {
+			attr->system_column = col;
+		}
+	}
+	return attr->tracked_column >= 0 && attr->system_column >= 0 && !attr->pkg_columns.empty();
+}
+
+// PKG and PP0 energy of all packages between two samples that belongs to the traced tasks
+static void attribute_sample(struct attribution *attr, const struct trace_header *hdr, const unsigned char *prev, const unsigned char *cur, const std::vector<size_t> &offsets, double *joules) {
+	size_t i;
+	
+	joules[0] = 0.0;
+	joules[1] = 0.0;
+	for (i = 0; i < attr->pkg_columns.size(); i++) {
+		uint32_t col = attr->pkg_columns[i];
+		joules[0] += energy_delta(&hdr->columns[col], prev + offsets[col], cur + offsets[col]) * hdr->columns[col].scale;
+	}
+	for (i = 0; i < attr->pp0_columns.size(); i++) {
+		uint32_t col = attr->pp0_columns[i];
+		joules[1] += energy_delta(&hdr->columns[col], prev + offsets[col], cur + offsets[col]) * hdr->columns[col].scale;
+	}
+	uint64_t tracked_delta = get_u64(cur + offsets[attr->tracked_column]) - get_u64(prev + offsets[attr->tracked_column]);
+	uint64_t system_delta = get_u64(cur + offsets[attr->system_column]) - get_u64(prev + offsets[attr->system_column]);
+	cpu_split_energy(&attr->split, tracked_delta, system_delta, joules, 2);
+}
+
+static void print_metadata(FILE *fp, const struct trace_header *hdr) {
+	char formatted_time[256] = { '\0' };
+	time_t start_time = hdr->start_time;
+	struct tm *tmp = localtime(&start_time);
+	if (tmp == NULL || strftime(formatted_time, sizeof(formatted_time), "%a, %d %b %Y %H:%M:%S %z", tmp) == 0) {
+		formatted_time[0] = '\0';
+	}
+	
+	fprintf(fp, "# %s version %s output\n", hdr->tool_name, hdr->tool_version);
+	fprintf(fp, "# Capture started: %s\n", formatted_time);
+	fprintf(fp, "# System name: %s\n", hdr->sysname);
+	fprintf(fp, "# Hostname: %s\n", hdr->hostname);
+	fprintf(fp, "# System release: %s\n", hdr->release);
+	fprintf(fp, "# System version: %s\n", hdr->sys_version);
+	fprintf(fp, "# Architecture: %s\n", hdr->machine);
+	fprintf(fp, "# CPU model: %s\n", hdr->cpu_model);
+	fprintf(fp, "# CPUs available: %d\n", hdr->cpus_available);
+	fprintf(fp, "# CPUs online: %d\n", hdr->cpus_online);
+	fprintf(fp, "# Total memory: %ld kB\n", (long)hdr->mem_total_kb);
+	fprintf(fp, "# Working directory: %s\n", hdr->working_directory);
+	fprintf(fp, "# Command line: %s\n", hdr->command_line);
+	if (hdr->attributed_to[0] != '\0') {
+		fprintf(fp, "# Attributed to: %s\n", hdr->attributed_to);
+		fprintf(fp, "# Last two columns: PKG and PP0 energy of all packages attributed by CPU time\n");
+	}
+	if (hdr->num_packages > 1) {
+		fprintf(fp, "# Packages: %d\n", hdr->num_packages);
+	}
+	// Only the temperature tracers print the list, even when it is empty
+	bool has_temp = false;
+	for (uint32_t col = 0; col < hdr->num_columns; col++) {
+		if (hdr->columns[col].type == TRACE_COL_TEMP) {
+			has_temp = true;
+		}
+	}
+	if (has_temp) {
+		fprintf(fp, "# Temperature CPUs:");
+		for (int32_t i = 0; i < hdr->num_temp_cpus; i++) {
+			fprintf(fp, " %d", hdr->temp_cpus[i]);
+		}
+		fprintf(fp, "\n");
+	}
+}
+
+static void print_csv(FILE *fp, const struct trace_header *hdr, const unsigned char *records, size_t num_records, const std::vector<size_t> &offsets, struct attribution *attr) {
+	size_t i, col;
+	
+	print_metadata(fp, hdr);
+	for (i = 1; i < num_records; i++) {
+		const unsigned char *prev = records + (i - 1) * hdr->record_size;
+		const unsigned char *cur = records + i * hdr->record_size;
+		fprintf(fp, "%.6f", get_u64(cur) * 1e-9);
+		for (col = 0; col < hdr->num_columns; col++) {
+			const struct trace_column *column = &hdr->columns[col];
+			if (column->type == TRACE_COL_TEMP) {
+				fprintf(fp, ", %d", get_i16(cur + offsets[col]));
+			} else if (column->type == TRACE_COL_CPUTIME && attr) {
+				// Replaced by the attributed energy below
+				continue;
+			} else {
+				uint64_t delta = energy_delta(column, prev + offsets[col], cur + offsets[col]);
+				fprintf(fp, ", %.6f", delta * column->scale);
+			}
+		}
+		if (attr) {
+			double joules[2];
+			attribute_sample(attr, hdr, prev, cur, offsets, joules);
+			fprintf(fp, ", %.6f, %.6f", joules[0], joules[1]);
+		}
+		fprintf(fp, "\n");
+	}
+}
+
+static void print_summary(FILE *fp, const struct trace_header *hdr, const unsigned char *records, size_t num_records, const std::vector<size_t> &offsets, struct attribution *attr) {
+	size_t i, col;
+	
+	fprintf(fp, "Tool: %s version %s\n", hdr->tool_name, hdr->tool_version);
+	fprintf(fp, "Command line: %s\n", hdr->command_line);
+	if (hdr->num_packages > 1) {
+		fprintf(fp, "Packages: %d\n", hdr->num_packages);
+	}
+	fprintf(fp, "Samples: %zu\n", num_records);
+	if (num_records < 2) {
+		return;
+	}
+	
+	const unsigned char *first = records;
+	const unsigned char *last = records + (num_records - 1) * hdr->record_size;
+	double duration = (get_u64(last) - get_u64(first)) * 1e-9;
+	fprintf(fp, "Duration: %f seconds\n", duration);
+	fprintf(fp, "Average sampling rate: %f Hz\n", (num_records - 1) / duration);
+	
+	for (col = 0; col < hdr->num_columns; col++) {
+		const struct trace_column *column = &hdr->columns[col];
+		if (column->type != TRACE_COL_TEMP) {
+			double total = 0.0;
+			for (i = 1; i < num_records; i++) {
+				uint64_t delta = energy_delta(column, records + (i - 1) * hdr->record_size + offsets[col], records + i * hdr->record_size + offsets[col]);
+				total += delta * column->scale;
+			}
+			if (column->type == TRACE_COL_CPUTIME) {
+				fprintf(fp, "%s CPU time: %f s\n", column->name, total);
+			} else {
+				fprintf(fp, "%s energy consumed: %f J\n", column->name, total);
+				fprintf(fp, "%s average power: %f W\n", column->name, total / duration);
+			}
+		} else {
+			int min_temp = get_i16(first + offsets[col]), max_temp = min_temp;
+			double sum_temp = 0.0;
+			for (i = 0; i < num_records; i++) {
+				int temp = get_i16(records + i * hdr->record_size + offsets[col]);
+				if (temp < min_temp) min_temp = temp;
+				if (temp > max_temp) max_temp = temp;
+				sum_temp += temp;
+			}
+			fprintf(fp, "%s temperature: min %d, average %.2f, max %d degrees C\n", column->name, min_temp, sum_temp / num_records, max_temp);
+		}
+	}
+	
+	if (attr) {
+		double attributed[2] = { 0.0, 0.0 };
+		for (i = 1; i < num_records; i++) {
+			double joules[2];
+			attribute_sample(attr, hdr, records + (i - 1) * hdr->record_size, records + i * hdr->record_size, offsets, joules);
+			attributed[0] += joules[0];
+			attributed[1] += joules[1];
+		}
+		fprintf(fp, "PKG energy attributed to %s: %f J\n", hdr->attributed_to, attributed[0]);
+		fprintf(fp, "PP0 energy attributed to %s: %f J\n", hdr->attributed_to, attributed[1]);
+	}
+}
+
+static void print_usage(const char *argv0) {
+	fprintf(stderr, "Usage: %s [ -s ] [ -o <output file> ] <trace file>\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Convert a binary trace written with -B to CSV.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -s                  Print summary statistics instead of CSV\n");
+	fprintf(stderr, "  -o <output file>    Write the output to a file instead of stdout\n");
+}
+
+int main(int argc, char **argv) {
+	bool summary = false;
+	const char *output_file = NULL;
+	int c = 0;
+	
+	while ((c = getopt(argc, argv, "so:h")) != -1) {
+		switch (c) {
+			case 's':
+				summary = true;
+				break;
+			case 'o':
+				output_file = optarg;
+				break;
+			default:
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	
+	const char *trace_file = argv[optind];
+	int fd = open(trace_file, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		fprintf(stderr, "Error: Could not open '%s'!\n", trace_file);
+		return EXIT_FAILURE;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	size_t file_size = st.st_size;
+	if (file_size < sizeof(struct trace_header)) {
+		fprintf(stderr, "Error: '%s' is too small to be a trace file\n", trace_file);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	void *map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+	// The records are read sequentially
+	madvise(map, file_size, MADV_SEQUENTIAL);
+	
+	const struct trace_header *hdr = (const struct trace_header *)map;
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+		fprintf(stderr, "Error: '%s' is not a binary trace file\n", trace_file);
+		return EXIT_FAILURE;
+	}
+	if (hdr->version != TRACE_VERSION || hdr->header_size != sizeof(struct trace_header) || hdr->num_columns > TRACE_MAX_COLUMNS) {
+		fprintf(stderr, "Error: Unsupported trace format version %u\n", hdr->version);
+		return EXIT_FAILURE;
+	}
+	if (hdr->num_temp_cpus < 0 || hdr->num_temp_cpus > TRACE_MAX_COLUMNS || memchr(hdr->attributed_to, '\0', sizeof(hdr->attributed_to)) == NULL) {
+		fprintf(stderr, "Error: Corrupted trace header in '%s'\n", trace_file);
+		return EXIT_FAILURE;
+	}
+	
+	// Work out where each column lives inside a record
+	std::vector<size_t> offsets(hdr->num_columns);
+	size_t offset = sizeof(uint64_t);
+	for (uint32_t col = 0; col < hdr->num_columns; col++) {
+		offsets[col] = offset;
+		offset += trace_column_size(hdr->columns[col].type);
+	}
+	if (offset != hdr->record_size) {
+		fprintf(stderr, "Error: Corrupted trace header in '%s'\n", trace_file);
+		return EXIT_FAILURE;
+	}
+	
+	struct attribution attribution;
+	struct attribution *attr = NULL;
+	if (hdr->attributed_to[0] != '\0') {
+		if (!find_attribution(hdr, &attribution)) {
+			fprintf(stderr, "Error: '%s' is attributed to %s but lacks the PKG or CPU time columns\n", trace_file, hdr->attributed_to);
+			return EXIT_FAILURE;
+		}
+		attr = &attribution;
+	}
+	
+	// A partially written last record is ignored
+	const unsigned char *records = (const unsigned char *)map + hdr->header_size;
+	size_t num_records = (file_size - hdr->header_size) / hdr->record_size;
+	
+	FILE *fp = stdout;
+	if (output_file) {
+		fp = fopen(output_file, "w");
+		if (!fp) {
+			fprintf(stderr, "Error: Could not open '%s' for writing!\n", output_file);
+			return EXIT_FAILURE;
+		}
+	}
+	
+	if (summary) {
+		print_summary(fp, hdr, records, num_records, offsets, attr);
+	} else {
+		print_csv(fp, hdr, records, num_records, offsets, attr);
+	}
+	
+	if (fp != stdout) {
+		fclose(fp);
+	}
+	munmap(map, file_size);
+	return 0;
+}
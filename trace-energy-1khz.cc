@@ -1,7 +1,13 @@
 /*
  * trace-energy.cc: Runs a command and produces an energy trace of its execution.
  *
- * This version polls the RAPL counters every 0.8 ms.
+ * This version polls the RAPL counters every 0.8 ms. With -u it takes one
+ * sample at every RAPL update instead, see rapl-sync.h.
+ *
+ * The counters are read through librapl. The backend can be selected with the
+ * RAPL_BACKEND environment variable (papi, msr, perf, powercap or sim).
+ *
+ * Usage: ./trace-energy-1khz [ -u ] <program> [parameters]
  *
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
@@ -19,32 +25,30 @@
 
 #include <vector>
 
-#include <papi.h>
-
 #include "util.h"
+#include "rapl.h"
+#include "rapl-sync.h"
 
 static pid_t child_pid = -1;
 static int exit_code = EXIT_SUCCESS;
 static int sigalrm_received = 0;
 
-static int s_event_set = 0;
-static int s_num_events = 0;
-static long long *s_rapl_values = NULL;
+static struct rapl_source *s_rapl = NULL;
+static struct rapl_accum s_rapl_accum;
+static uint64_t s_rapl_values[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS];
 
-#define READ_ENERGY(a) PAPI_read(s_event_set, a)
+// RAPL update synchronized sampling can be enabled using the -u command line switch
+static bool sync_to_updates = false;
+static struct rapl_sync s_sync;
 
-static int idx_pkg_energy = -1;
-static int idx_pp0_energy = -1;
-static int idx_pp1_energy = -1;
-static int idx_dram_energy = -1;
-
-static const double scaleFactor = 1e-9;
+// Same rate as the 0.8 ms timer, so every update is sampled
+#define SYNC_SAMPLING_FREQUENCY 1250.0
 
 struct energy_numbers {
-	long long pkg;
-	long long pp0;
-	long long pp1;
-	long long dram;
+	double pkg;
+	double pp0;
+	double pp1;
+	double dram;
 };
 
 static std::vector<energy_numbers> v_energy_numbers;
@@ -94,140 +98,91 @@ static void reset_timer() {
 	setitimer(timer_which, &timer_value, NULL);
 }
 
-/*
- * Based on Filip Nybäck's energy profiling module in IgProf
- */
 static bool init_rapl() {
-	if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
-		fprintf(stderr, "PAPI library initialisation failed.\n");
-		return false;
-	}
-	
-	// Find the RAPL component of PAPI.
-	int num_components = PAPI_num_components();
-	int component_id;
-	const PAPI_component_info_t *component_info = 0;
-	for (component_id = 0; component_id < num_components; ++component_id)
-	{
-		component_info = PAPI_get_component_info(component_id);
-		if (component_info && strstr(component_info->name, "rapl")) {
-			break;
-		}
-	}
-	if (component_id == num_components) {
-		fprintf(stderr, "No RAPL component found in PAPI library.\n");
-		return false;
-	}
-	
-	if (component_info->disabled) {
-		fprintf(stderr, "RAPL component of PAPI disabled: %s.\n",
-			component_info->disabled_reason);
-		return false;
-	}
-	
-	// Create an event set.
-	s_event_set = PAPI_NULL;
-	if (PAPI_create_eventset(&s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not create PAPI event set.\n");
-		return false;
-	}
-	
-	int code = PAPI_NATIVE_MASK;
-	for (int retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_FIRST, component_id); retval == PAPI_OK; retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_EVENTS, component_id)) {
-		char event_name[PAPI_MAX_STR_LEN];
-		if (PAPI_event_code_to_name(code, event_name) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event name.\n");
-			return false;
-		}
-		
-		PAPI_event_info_t event_info;
-		if (PAPI_get_event_info(code, &event_info) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event info.\n");
-			return false;
-		}
-		if (event_info.data_type != PAPI_DATATYPE_UINT64) {
-			continue;
-		}
-		
-		if (strstr(event_name, "PACKAGE_ENERGY:")) {
-			idx_pkg_energy = s_num_events;
-		} else if (strstr(event_name, "PP0_ENERGY:")) {
-			idx_pp0_energy = s_num_events;
-		} else if (strstr(event_name, "PP1_ENERGY:")) {
-			idx_pp1_energy = s_num_events;
-		} else if (strstr(event_name, "DRAM_ENERGY:")) {
-			idx_dram_energy = s_num_events;
-		} else {
-			continue; // Skip other counters
-		}
-		
-		//printf("Adding %s to event set.\n", event_name);
-		if (PAPI_add_event(s_event_set, code) != PAPI_OK)
-			break;
-		++s_num_events;
-	}
-	if (s_num_events == 0) {
-		fprintf(stderr, "Could not find any RAPL events.\n");
-		return false;
-	}
-	
-	// Allocate memory for reading the counters
-	s_rapl_values = (long long *)calloc(s_num_events, sizeof(long long));
-	
-	// Activate the event set.
-	if (PAPI_start(s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not activate the event set.\n");
+	s_rapl = rapl_open(getenv("RAPL_BACKEND"), 0);
+	if (!s_rapl) {
 		return false;
 	}
+	rapl_accum_init(&s_rapl_accum, s_rapl);
 	
 	return true;
 }
 
-static void handle_sigalrm() {
-	long long pkg_energy = 0, pp0_energy = 0, pp1_energy = 0, dram_energy = 0;
+// Store the counters in s_rapl_values as a new sample
+static void store_sample() {
+	rapl_accum_update(&s_rapl_accum, s_rapl_values);
 	
-	READ_ENERGY(s_rapl_values);
-	
-	if (idx_pkg_energy != -1) {
-		pkg_energy = s_rapl_values[idx_pkg_energy];
-	}
-	if (idx_pp0_energy != -1) {
-		pp0_energy = s_rapl_values[idx_pp0_energy];
-	}
-	if (idx_pp1_energy != -1) {
-		pp1_energy = s_rapl_values[idx_pp1_energy];
-	}
-	if (idx_dram_energy != -1) {
-		dram_energy = s_rapl_values[idx_dram_energy];
-	}
+	double pkg_energy = rapl_accum_joules(&s_rapl_accum, s_rapl, 0, RAPL_DOMAIN_PKG);
+	double pp0_energy = rapl_accum_joules(&s_rapl_accum, s_rapl, 0, RAPL_DOMAIN_PP0);
+	double pp1_energy = rapl_accum_joules(&s_rapl_accum, s_rapl, 0, RAPL_DOMAIN_PP1);
+	double dram_energy = rapl_accum_joules(&s_rapl_accum, s_rapl, 0, RAPL_DOMAIN_DRAM);
 	
 	int n = v_energy_numbers.size();
 	//if (n == 0 || pkg_energy != v_energy_numbers[n - 1].pkg) {
 	// Use DRAM energy as the trigger
 	// Seems to produce the best results
-	if (n == 0 || dram_energy != v_energy_numbers[n - 1].dram) {
+	// Synchronized samples are always taken right after a PKG update
+	if (n == 0 || sync_to_updates || dram_energy != v_energy_numbers[n - 1].dram) {
 		struct energy_numbers numbers = { pkg_energy, pp0_energy, pp1_energy, dram_energy };
 		v_energy_numbers.push_back(numbers);
 	}
 }
 
+static void handle_sigalrm() {
+	if (rapl_read(s_rapl, s_rapl_values)) {
+		store_sample();
+	}
+}
+
+// Reads the counters for rapl_sync_wait(), they are stored by store_sample()
+static uint64_t sync_read_pkg(void *arg) {
+	(void)arg;
+	rapl_read(s_rapl, s_rapl_values);
+	return s_rapl_values[RAPL_DOMAIN_PKG];
+}
+
+// Take a sample at each RAPL update until the child exits, returns false if the counters are not updating
+static bool sample_updates() {
+	if (!rapl_sync_init(&s_sync, sync_read_pkg, NULL)) {
+		fprintf(stderr, "trace-energy: Warning: The energy counters are not updating, cannot synchronize to them\n");
+		return false;
+	}
+	store_sample();
+	
+	// SIGCHLD interrupts the wait
+	while (child_pid > 0) {
+		int64_t update = rapl_sync_wait(&s_sync, SYNC_SAMPLING_FREQUENCY);
+		if (update < 0) {
+			fprintf(stderr, "trace-energy: Warning: The energy counters stopped updating, falling back to the timer\n");
+			return false;
+		} else if (update > 0) {
+			store_sample();
+		}
+	}
+	printf("trace-energy: Estimated RAPL update period: %.3f us, late wakeups: %lu, resynchronizations: %lu\n",
+		s_sync.period_ns * 1e-3, s_sync.late_wakeups, s_sync.resyncs);
+	return true;
+}
+
 static void wait_for_child() {
 	struct timespec sleep_time = { 1, 0 };
 	int i;
 	
-	setup_timer();
-
-	while (child_pid > 0) {
-		/* Sleep for one second */
-		nanosleep(&sleep_time, NULL);
-		if (sigalrm_received) {
-			handle_sigalrm();
-			sigalrm_received = 0;
+	if (!sync_to_updates || !sample_updates()) {
+		setup_timer();
+		
+		while (child_pid > 0) {
+			/* Sleep for one second */
+			nanosleep(&sleep_time, NULL);
+			if (sigalrm_received) {
+				handle_sigalrm();
+				sigalrm_received = 0;
+			}
 		}
+		
+		reset_timer();
 	}
 	
-	reset_timer();
-	
 	FILE *fp = fopen("energy-trace.csv", "w");
 	if (!fp) {
 		fprintf(stderr, "Error: Could not open energy-trace.csv for writing!\n");
@@ -236,10 +191,10 @@ static void wait_for_child() {
 	
 	const int n = v_energy_numbers.size();
 	for (i = 1; i < n; i++) {
-		double pkg_energy = (v_energy_numbers[i].pkg - v_energy_numbers[i - 1].pkg) * scaleFactor;
-		double pp0_energy = (v_energy_numbers[i].pp0 - v_energy_numbers[i - 1].pp0) * scaleFactor;
-		double pp1_energy = (v_energy_numbers[i].pp1 - v_energy_numbers[i - 1].pp1) * scaleFactor;
-		double dram_energy = (v_energy_numbers[i].dram - v_energy_numbers[i - 1].dram) * scaleFactor;
+		double pkg_energy = v_energy_numbers[i].pkg - v_energy_numbers[i - 1].pkg;
+		double pp0_energy = v_energy_numbers[i].pp0 - v_energy_numbers[i - 1].pp0;
+		double pp1_energy = v_energy_numbers[i].pp1 - v_energy_numbers[i - 1].pp1;
+		double dram_energy = v_energy_numbers[i].dram - v_energy_numbers[i - 1].dram;
 		fprintf(fp, "%f, %f, %f, %f\n", pkg_energy, pp0_energy, pp1_energy, dram_energy);
 	}
 	
@@ -261,14 +216,22 @@ static void do_fork_and_exec(int argc, char **argv) {
 			wait_for_child();
 		}
 	} else {
-		printf("Usage: %s <program> [parameters]\n", argv[0]);
+		printf("Usage: trace-energy-1khz [ -u ] <program> [parameters]\n");
 	}
 }
 
 int main(int argc, char **argv) {
+	int args_consumed = 0;
+	if (argc > 1 && strcmp(argv[1], "-u") == 0) {
+		sync_to_updates = true;
+		args_consumed++;
+	}
+	
 	v_energy_numbers.reserve(1000);
 	do_signals();
-	init_rapl();
-	do_fork_and_exec(argc, argv);
+	if (!init_rapl()) {
+		return EXIT_FAILURE;
+	}
+	do_fork_and_exec(argc - args_consumed, argv + args_consumed);
 	return exit_code;
 }
@@ -3,12 +3,18 @@
  *
  * This tool is based on trace-energy-v2.
  * It uses the MSR driver directly.
+ * Energy and package temperature are recorded for every package (socket).
+ * Any number of cores can be traced (-C), the cores are read in parallel (-j).
+ * The 32-bit energy registers are extended to 64-bit counts so that wraparounds are handled.
+ * The energy and package temperature registers of all packages are read as one MSR batch.
+ * Set RAPL_IO_ENGINE=uring to submit the MSR reads of each sample through io_uring.
+ * With -u the samples are taken at the RAPL updates, see rapl-sync.h.
  *
- * Compilation: g++ -Wall -Wextra -O2 -g -o trace-energy-and-temp-msr trace-energy-and-temp-msr.cc util.cc -lpapi -lrt
+ * Compilation: g++ -Wall -Wextra -O2 -g -o trace-energy-and-temp-msr trace-energy-and-temp-msr.cc util.cc trace-format.cc msr-temp.cc librapl.a -lrt -pthread
  *
  * Dependencies: PAPI (Performance Application Programming Interface)
  *
- * Usage: ./trace-energy-and-temp-msr [ -F <frequency> ] [ -o <output file> ] [ -c <child CPU affinity core> ] <program> [parameters]
+ * Usage: ./trace-energy-and-temp-msr [ -F <frequency> ] [ -o <output file> ] [ -c <child CPU affinity core> ] [ -C <CPU list> ] [ -j <threads> ] [ -B ] [ -u ] <program> [parameters]
  *
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
@@ -34,22 +40,30 @@
 #include <string>
 #include <sstream>
 
+#include "rapl.h"
+#include "msr-batch.h"
+#include "msr-temp.h"
+#include "trace-format.h"
+#include "rapl-sync.h"
 #include "util.h"
 
-#define MSR_IA32_THERM_STATUS		0x0000019c
-#define MSR_IA32_TEMPERATURE_TARGET	0x000001a2
-#define MSR_IA32_PACKAGE_THERM_STATUS		0x000001b1
-
 #define MSR_PKG_ENERGY_STATUS		0x611
 #define MSR_PP0_ENERGY_STATUS		0x639
 #define MSR_PP1_ENERGY_STATUS		0x641
 #define MSR_DRAM_ENERGY_STATUS		0x619
 
+static const unsigned msr_energy_status[RAPL_NUM_DOMAINS] = {
+	MSR_PKG_ENERGY_STATUS,
+	MSR_PP0_ENERGY_STATUS,
+	MSR_PP1_ENERGY_STATUS,
+	MSR_DRAM_ENERGY_STATUS,
+};
+
 // Name of this program
 const char *trace_temp_name = "trace-energy-and-temp-msr";
 
 // Version string
-const char *trace_temp_version = "2.2";
+const char *trace_temp_version = "2.4";
 
 // Frequency can be changed using the -F command line switch
 // Defaults to 200 Hz
@@ -77,30 +91,53 @@ static const char *argv0 = NULL;
 // Default value for critical temperate is 100 degrees C
 static short tjmax = 100;
 
-// File descriptor fore core 0 MSR file
-// Right now this is hard-coded to support up to 4 cores
-static int core0_fd = -1;
-static int core1_fd = -1;
-static int core2_fd = -1;
-static int core3_fd = -1;
+// CPUs whose temperature is traced, set using the -C command line switch
+// Defaults to all online CPUs
+static int temp_cpus[MSR_TEMP_MAX_CPUS];
+static int num_temp_cpus = 0;
+
+// Number of threads reading the core temperatures, set using the -j command line switch
+// Defaults to one thread per 16 CPUs
+static int num_reader_threads = 0;
+
+static struct core_temp_reader *core_temps = NULL;
+
+// Packages found in sysfs and the MSR files of their first CPUs
+static struct rapl_package packages[RAPL_MAX_PACKAGES];
+static int num_packages = 0;
+static int package_fds[RAPL_MAX_PACKAGES];
+
+// The package registers read on every sample and their indices in the batch
+static struct msr_batch *package_batch = NULL;
+static int energy_index[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS];
+static int pkg_temp_index[RAPL_MAX_PACKAGES];
 
-// Hardcoded energy unit size for Haswell
+// Energy unit size, read from MSR_RAPL_POWER_UNIT at startup
+// Defaults to the energy unit size of Haswell
 static double energyUnits = 0.00006103515625; // 0.5^14
 
-struct temp_numbers {
-	struct timespec timestamp;
-	uint32_t pkg_energy;
-	uint32_t pp0_energy;
-	uint32_t pp1_energy;
-	uint32_t dram_energy;
-	short pkg_temp;
-	short core0_temp;
-	short core1_temp;
-	short core2_temp;
-	short core3_temp;
+// Extends the energy registers to 64-bit counts
+static struct rapl_accum energy_accum;
+
+// The samples are stored as a structure of arrays, each sample adds one row to every array
+struct temp_samples {
+	std::vector<struct timespec> timestamp;
+	// num_packages * RAPL_NUM_DOMAINS accumulated energy counters
+	std::vector<uint64_t> energy;
+	// num_packages package temperatures
+	std::vector<short> pkg_temp;
+	// num_temp_cpus core temperatures
+	std::vector<short> core_temp;
 };
 
-static std::vector<temp_numbers> v_temp_numbers;
+static struct temp_samples samples;
+
+// Binary output can be enabled using the -B command line switch
+static bool binary_output = false;
+
+// RAPL update synchronized sampling can be enabled using the -u command line switch
+static bool sync_to_updates = false;
+static struct rapl_sync s_sync;
 
 static void sigchld_handler(int sig) {
 	(void)sig;
@@ -160,74 +197,76 @@ static void reset_timer() {
 	}
 }
 
-static int open_msr(int core) {
-	char msr_filename[1024] = { '\0' };
-	int fd = -1;
-	
-	snprintf(msr_filename, sizeof(msr_filename), "/dev/cpu/%d/msr", core);
+static bool init_temp() {
+	int tjmax_new = -1;
 	
-	fd = open(msr_filename, O_RDONLY);
-	if (fd < 0) {
-		perror("open");
-		fprintf(stderr, "open_msr failed while trying to open %s!\n", msr_filename);
-		return fd;
+	num_packages = rapl_discover_packages(packages, RAPL_MAX_PACKAGES);
+	for (int i = 0; i < num_packages; i++) {
+		if ((package_fds[i] = rapl_msr_open(packages[i].cpu)) < 0) {
+			return false;
+		}
 	}
-	
-	return fd;
-}
-
-static bool read_msr(int fd, unsigned msr_offset, uint64_t *msr_out) {
-	if (pread(fd, msr_out, sizeof(*msr_out), msr_offset) != sizeof(*msr_out)) {
-		perror("pread");
-		fprintf(stderr, "read_msr failed while trying to read offset 0x%04x!\n", msr_offset);
-		return false;
+	if (num_packages > 1) {
+		printf("%s: Tracing %d packages\n", trace_temp_name, num_packages);
 	}
-	
-	return true;
-}
-
-static bool init_temp() {
-	uint64_t msr_temp_target = 0;
-	
-	if ((core0_fd = open_msr(0)) < 0) {
-		return false;
+	if (!rapl_msr_energy_unit(package_fds[0], &energyUnits)) {
+		fprintf(stderr, "Failed to read MSR_RAPL_POWER_UNIT!\n");
+		fprintf(stderr, "Using the default energy unit of %g J.\n", energyUnits);
 	}
+	rapl_accum_init_raw(&energy_accum, num_packages * RAPL_NUM_DOMAINS, RAPL_MSR_COUNTER_RANGE);
 	
-	core1_fd = open_msr(1);
-	core2_fd = open_msr(2);
-	core3_fd = open_msr(3);
+	package_batch = msr_batch_create(MSR_BATCH_AUTO);
+	for (int i = 0; i < num_packages; i++) {
+		for (int domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+			if ((energy_index[RAPL_VALUE_INDEX(i, domain)] = msr_batch_add(package_batch, packages[i].cpu, msr_energy_status[domain])) < 0) {
+				return false;
+			}
+		}
+		if ((pkg_temp_index[i] = msr_batch_add(package_batch, packages[i].cpu, MSR_IA32_PACKAGE_THERM_STATUS)) < 0) {
+			return false;
+		}
+	}
 	
-	if (read_msr(core0_fd, MSR_IA32_TEMPERATURE_TARGET, &msr_temp_target)) {
-		unsigned tjmax_new = (msr_temp_target >> 16) & 0xff;
-		printf("%s: TjMax is %u degrees C\n", trace_temp_name, tjmax_new);
+	if ((tjmax_new = read_tjmax(package_fds[0])) >= 0) {
+		printf("%s: TjMax is %d degrees C\n", trace_temp_name, tjmax_new);
 		tjmax = tjmax_new;
 	} else {
 		fprintf(stderr, "Failed to read MSR_IA32_TEMPERATURE_TARGET!\n");
 		fprintf(stderr, "Using the default value of %d for tjmax.", (int)tjmax);
 	}
 	
+	if (num_temp_cpus == 0) {
+		num_temp_cpus = online_cpu_list(temp_cpus, MSR_TEMP_MAX_CPUS);
+	}
+	if (num_reader_threads == 0) {
+		num_reader_threads = core_temp_default_threads(num_temp_cpus);
+	}
+	core_temps = core_temp_open(temp_cpus, num_temp_cpus, num_reader_threads, tjmax);
+	if (!core_temps) {
+		return false;
+	}
+	printf("%s: Tracing the temperature of %d CPUs using %d threads\n", trace_temp_name, num_temp_cpus, num_reader_threads < num_temp_cpus ? num_reader_threads : num_temp_cpus);
+	
 	return true;
 }
 
-static short read_temp(int fd, unsigned msr_offset) {
-	uint64_t msr_therm_status = 0;
-	
-	if (read_msr(fd, msr_offset, &msr_therm_status)) {
-		return tjmax - ((msr_therm_status >> 16) & 0x7f);
+// The read functions take the result of a read from package_batch
+static short read_temp(int index, unsigned msr_offset) {
+	if (msr_batch_ok(package_batch, index)) {
+		return therm_status_to_temp(msr_batch_value(package_batch, index), tjmax);
 	} else {
 		fprintf(stderr, "%s: Failed to read MSR offset 0x%04x\n", __func__, msr_offset);
 		return -1;
 	}
 }
 
-static uint32_t read_energy(int fd, unsigned msr_offset) {
-	uint64_t energy;
-	
-	if (read_msr(fd, msr_offset, &energy)) {
-		return energy;
+// Leaves the previous value in place on failure so that it does not look like a wraparound
+static void read_energy(int index, unsigned msr_offset, uint64_t *value) {
+	if (msr_batch_ok(package_batch, index)) {
+		// The energy counters are 32 bits wide
+		*value = msr_batch_value(package_batch, index) & 0xffffffff;
 	} else {
 		fprintf(stderr, "%s: Failed to read MSR offset 0x%04x\n", __func__, msr_offset);
-		return -1;
 	}
 }
 
@@ -252,36 +291,43 @@ static void handle_sigchld() {
 	}
 }
 
-static void handle_sigalrm() {
-	short pkg_temp = 0, core0_temp = 0, core1_temp = 0, core2_temp = 0, core3_temp = 0;
-	uint32_t pkg_energy = 0, pp0_energy = 0, pp1_energy = 0, dram_energy = 0;
+// Take a sample, update_time is the time of the RAPL update in synchronized mode and NULL otherwise
+static void take_sample(const struct timespec *update_time) {
 	struct timespec now = { 0, 0 };
-//	int idx_prev_sample = v_temp_numbers.size() - 1;
+	const size_t n = samples.timestamp.size();
 	bool is_duplicate = true; // Ignore duplicates in case we are supersampling
 	
-	pkg_energy = read_energy(core0_fd, MSR_PKG_ENERGY_STATUS);
-	pp0_energy = read_energy(core0_fd, MSR_PP0_ENERGY_STATUS);
-	pp1_energy = read_energy(core0_fd, MSR_PP1_ENERGY_STATUS);
-	dram_energy = read_energy(core0_fd, MSR_DRAM_ENERGY_STATUS);
-	pkg_temp = read_temp(core0_fd, MSR_IA32_PACKAGE_THERM_STATUS);
-	core0_temp = read_temp(core0_fd, MSR_IA32_THERM_STATUS);
-	core1_temp = read_temp(core1_fd, MSR_IA32_THERM_STATUS);
-	core2_temp = read_temp(core2_fd, MSR_IA32_THERM_STATUS);
-	core3_temp = read_temp(core3_fd, MSR_IA32_THERM_STATUS);
-	clock_gettime(gettime_clockid, &now);
+	// The temperatures are read straight into the next row of their arrays
+	samples.energy.resize((n + 1) * num_packages * RAPL_NUM_DOMAINS);
+	samples.pkg_temp.resize((n + 1) * num_packages);
+	samples.core_temp.resize((n + 1) * num_temp_cpus);
+	uint64_t energy[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS];
+	memcpy(energy, energy_accum.last, sizeof(energy));
+	short *pkg_temp = &samples.pkg_temp[n * num_packages];
+	short *core_temp = &samples.core_temp[n * num_temp_cpus];
+	
+	msr_batch_read(package_batch);
+	for (int i = 0; i < num_packages; i++) {
+		for (int domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+			read_energy(energy_index[RAPL_VALUE_INDEX(i, domain)], msr_energy_status[domain], &energy[RAPL_VALUE_INDEX(i, domain)]);
+		}
+		pkg_temp[i] = read_temp(pkg_temp_index[i], MSR_IA32_PACKAGE_THERM_STATUS);
+	}
+	core_temp_read(core_temps, core_temp);
+	if (update_time) {
+		now = *update_time;
+	} else {
+		clock_gettime(gettime_clockid, &now);
+	}
+	rapl_accum_update(&energy_accum, energy);
+	memcpy(&samples.energy[n * num_packages * RAPL_NUM_DOMAINS], energy_accum.total, num_packages * RAPL_NUM_DOMAINS * sizeof(uint64_t));
 	
 	/* Disabled because the energy data becomes spiky */
 #if 0
-	if (likely(idx_prev_sample >= 0)) {
-		if (unlikely(pkg_temp != v_temp_numbers[idx_prev_sample].pkg_temp)) {
+	if (likely(n > 0)) {
+		if (unlikely(memcmp(pkg_temp, pkg_temp - num_packages, num_packages * sizeof(short)) != 0)) {
 			is_duplicate = false;
-		} else if (unlikely(core0_temp != v_temp_numbers[idx_prev_sample].core0_temp)) {
-			is_duplicate = false;
-		} else if (unlikely(core1_temp != v_temp_numbers[idx_prev_sample].core1_temp)) {
-			is_duplicate = false;
-		} else if (unlikely(core2_temp != v_temp_numbers[idx_prev_sample].core2_temp)) {
-			is_duplicate = false;
-		} else if (unlikely(core3_temp != v_temp_numbers[idx_prev_sample].core3_temp)) {
+		} else if (unlikely(memcmp(core_temp, core_temp - num_temp_cpus, num_temp_cpus * sizeof(short)) != 0)) {
 			is_duplicate = false;
 		}
 	} else {
@@ -292,31 +338,144 @@ static void handle_sigalrm() {
 #endif
 	
 	if (likely(!is_duplicate)) {
-		struct temp_numbers numbers = { now, pkg_energy, pp0_energy, pp1_energy, dram_energy, pkg_temp, core0_temp, core1_temp, core2_temp, core3_temp };
-		v_temp_numbers.push_back(numbers);
+		samples.timestamp.push_back(now);
+	} else {
+		samples.energy.resize(n * num_packages * RAPL_NUM_DOMAINS);
+		samples.pkg_temp.resize(n * num_packages);
+		samples.core_temp.resize(n * num_temp_cpus);
 	}
 }
 
-static void wait_for_child() {
-	FILE *fp = NULL;
-	struct timespec sleep_time = { 1, 0 };
-	int i;
-	
-	setup_timer();
+static void handle_sigalrm() {
+	take_sample(NULL);
+}
 
+// Reads the PKG counter of the first package for rapl_sync_wait()
+static uint64_t sync_read_pkg(void *arg) {
+	uint64_t value = 0;
+	(void)arg;
+	rapl_msr_read(package_fds[0], MSR_PKG_ENERGY_STATUS, &value);
+	return value & 0xffffffff;
+}
+
+// Take a sample at each RAPL update until the child exits, returns false if the counters are not updating
+static bool sample_updates() {
+	struct timespec now;
+	
+	if (!rapl_sync_init(&s_sync, sync_read_pkg, NULL)) {
+		fprintf(stderr, "%s: Warning: The energy counters are not updating, cannot synchronize to them\n", trace_temp_name);
+		return false;
+	}
+	clock_gettime(gettime_clockid, &now);
+	take_sample(&now);
+	
 	while (likely(child_pid > 0)) {
-		/* Sleep until interrupted by signal */
-		nanosleep(&sleep_time, NULL);
+		// Interrupted by SIGCHLD
+		int64_t update = rapl_sync_wait(&s_sync, sampling_frequency);
+		if (likely(update > 0)) {
+			clock_gettime(gettime_clockid, &now);
+			take_sample(&now);
+		} else if (unlikely(update < 0)) {
+			fprintf(stderr, "%s: Warning: The energy counters stopped updating, falling back to the timer\n", trace_temp_name);
+			return false;
+		}
 		if (unlikely(__sync_bool_compare_and_swap(&sigchld_received, 1, 0))) {
 			handle_sigchld();
 		}
-		if (likely(__sync_bool_compare_and_swap(&sigalrm_received, 1, 0))) {
-			sigalrm_received = 0;
-			handle_sigalrm();
+	}
+	printf("%s: Estimated RAPL update period: %.3f us, late wakeups: %lu, resynchronizations: %lu\n", trace_temp_name,
+		s_sync.period_ns * 1e-3, s_sync.late_wakeups, s_sync.resyncs);
+	return true;
+}
+
+static void drop_last_sample() {
+	const size_t n = samples.timestamp.size();
+	if (n > 0) {
+		samples.timestamp.pop_back();
+		samples.energy.resize((n - 1) * num_packages * RAPL_NUM_DOMAINS);
+		samples.pkg_temp.resize((n - 1) * num_packages);
+		samples.core_temp.resize((n - 1) * num_temp_cpus);
+	}
+}
+
+// Binary traces store the raw samples, use trace-convert to read them
+static void write_binary_trace(FILE *fp) {
+	static struct trace_header hdr;
+	std::vector<unsigned char> record(sizeof(uint64_t) + num_packages * (RAPL_NUM_DOMAINS * sizeof(uint64_t) + sizeof(int16_t)) + num_temp_cpus * sizeof(int16_t));
+	char name[32];
+	int i, package, domain, cpu;
+	
+	trace_init_header(&hdr, trace_temp_name, trace_temp_version, start_time, cmdline.c_str());
+	hdr.num_packages = num_packages;
+	for (package = 0; package < num_packages; package++) {
+		// Single package traces keep the plain column names
+		const char *suffix = "";
+		char package_suffix[16];
+		if (num_packages > 1) {
+			snprintf(package_suffix, sizeof(package_suffix), ":%d", package);
+			suffix = package_suffix;
+		}
+		for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+			snprintf(name, sizeof(name), "%s%s", rapl_domain_name(domain), suffix);
+			trace_add_column(&hdr, name, TRACE_COL_ENERGY, energyUnits);
 		}
+		snprintf(name, sizeof(name), "PKG_TEMP%s", suffix);
+		trace_add_column(&hdr, name, TRACE_COL_TEMP, 1.0);
 	}
+	for (cpu = 0; cpu < num_temp_cpus; cpu++) {
+		snprintf(name, sizeof(name), "CORE%d_TEMP", temp_cpus[cpu]);
+		if (trace_add_column(&hdr, name, TRACE_COL_TEMP, 1.0) < 0) {
+			return;
+		}
+		hdr.temp_cpus[hdr.num_temp_cpus++] = temp_cpus[cpu];
+	}
+	if (!trace_write_header(fp, &hdr)) {
+		return;
+	}
+	
+	const int n = samples.timestamp.size();
+	for (i = 0; i < n; i++) {
+		const uint64_t *energy = &samples.energy[i * num_packages * RAPL_NUM_DOMAINS];
+		size_t offset = trace_put_timestamp(&record[0], &samples.timestamp[i]);
+		for (package = 0; package < num_packages; package++) {
+			for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+				offset = trace_put_u64(&record[0], offset, energy[RAPL_VALUE_INDEX(package, domain)]);
+			}
+			offset = trace_put_i16(&record[0], offset, samples.pkg_temp[i * num_packages + package]);
+		}
+		for (cpu = 0; cpu < num_temp_cpus; cpu++) {
+			offset = trace_put_i16(&record[0], offset, samples.core_temp[i * num_temp_cpus + cpu]);
+		}
+		fwrite(&record[0], offset, 1, fp);
+	}
+}
+
+static void wait_for_child() {
+	FILE *fp = NULL;
+	struct timespec sleep_time = { 1, 0 };
+	int i;
 	
-	reset_timer();
+	if (!sync_to_updates || !sample_updates()) {
+		setup_timer();
+		
+		while (likely(child_pid > 0)) {
+			/* Sleep until interrupted by signal */
+			nanosleep(&sleep_time, NULL);
+			if (unlikely(__sync_bool_compare_and_swap(&sigchld_received, 1, 0))) {
+				handle_sigchld();
+			}
+			if (likely(__sync_bool_compare_and_swap(&sigalrm_received, 1, 0))) {
+				sigalrm_received = 0;
+				handle_sigalrm();
+			}
+		}
+		
+		reset_timer();
+	}
+	core_temp_close(core_temps);
+	core_temps = NULL;
+	msr_batch_destroy(package_batch);
+	package_batch = NULL;
 	
 	fp = fopen(output_file.c_str(), "w");
 	if (!fp) {
@@ -324,6 +483,12 @@ static void wait_for_child() {
 		exit(-1);
 	}
 	
+	if (binary_output) {
+		write_binary_trace(fp);
+		fclose(fp);
+		return;
+	}
+	
 	fprintf(fp, "# %s version %s output\n", trace_temp_name, trace_temp_version);
 	// Print formatted time
 	{
@@ -400,21 +565,37 @@ static void wait_for_child() {
 		fprintf(fp, "# Working directory: %s\n", wd);
 	}
 	fprintf(fp, "# Command line: %s\n", cmdline.c_str());
+	// Each package has its own PKG, PP0, PP1, DRAM and package temperature columns
+	if (num_packages > 1) {
+		fprintf(fp, "# Packages: %d\n", num_packages);
+	}
+	// The core temperature columns follow the package columns in this order
+	fprintf(fp, "# Temperature CPUs:");
+	for (i = 0; i < num_temp_cpus; i++) {
+		fprintf(fp, " %d", temp_cpus[i]);
+	}
+	fprintf(fp, "\n");
 	
-	const int n = v_temp_numbers.size();
+	const int n = samples.timestamp.size();
 	for (i = 1; i < n; i++) {
-		double timestamp = v_temp_numbers[i].timestamp.tv_sec + v_temp_numbers[i].timestamp.tv_nsec * 1e-9;
-		// Calculate energy deltas
-		double pkg_energy = (v_temp_numbers[i].pkg_energy - v_temp_numbers[i - 1].pkg_energy) * energyUnits;
-		double pp0_energy = (v_temp_numbers[i].pp0_energy - v_temp_numbers[i - 1].pp0_energy) * energyUnits;
-		double pp1_energy = (v_temp_numbers[i].pp1_energy - v_temp_numbers[i - 1].pp1_energy) * energyUnits;
-		double dram_energy = (v_temp_numbers[i].dram_energy - v_temp_numbers[i - 1].dram_energy) * energyUnits;
-		int pkg_temp = v_temp_numbers[i].pkg_temp;
-		int core0_temp = v_temp_numbers[i].core0_temp;
-		int core1_temp = v_temp_numbers[i].core1_temp;
-		int core2_temp = v_temp_numbers[i].core2_temp;
-		int core3_temp = v_temp_numbers[i].core3_temp;
-		fprintf(fp, "%.6f, %.6f, %.6f, %.6f, %.6f, %d, %d, %d, %d, %d\n", timestamp, pkg_energy, pp0_energy, pp1_energy, dram_energy, pkg_temp, core0_temp, core1_temp, core2_temp, core3_temp);
+		double timestamp = samples.timestamp[i].tv_sec + samples.timestamp[i].tv_nsec * 1e-9;
+		const uint64_t *energy = &samples.energy[i * num_packages * RAPL_NUM_DOMAINS];
+		const uint64_t *prev_energy = energy - num_packages * RAPL_NUM_DOMAINS;
+		const short *core_temp = &samples.core_temp[i * num_temp_cpus];
+		fprintf(fp, "%.6f", timestamp);
+		for (int package = 0; package < num_packages; package++) {
+			// Calculate energy deltas
+			for (int domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+				int idx = RAPL_VALUE_INDEX(package, domain);
+				uint64_t delta = energy[idx] - prev_energy[idx];
+				fprintf(fp, ", %.6f", delta * energyUnits);
+			}
+			fprintf(fp, ", %d", samples.pkg_temp[i * num_packages + package]);
+		}
+		for (int cpu = 0; cpu < num_temp_cpus; cpu++) {
+			fprintf(fp, ", %d", core_temp[cpu]);
+		}
+		fprintf(fp, "\n");
 	}
 	
 	fclose(fp);
@@ -427,11 +608,11 @@ static void do_warmup() {
 	nanosleep(&sleep_time_warm, NULL);
 	sigalrm_received = 0;
 	handle_sigalrm();
-	v_temp_numbers.pop_back();
+	drop_last_sample();
 }
 
 static void print_usage() {
-	fprintf(stderr, "Usage: %s [ -F <frequency> ] [ -o <output file> ] [ -c <child CPU affinity core> ] <program> [parameters]\n", argv0);
+	fprintf(stderr, "Usage: %s [ -F <frequency> ] [ -o <output file> ] [ -c <child CPU affinity core> ] [ -C <CPU list> ] [ -j <threads> ] [ -B ] [ -u ] <program> [parameters]\n", argv0);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Execute the given program as a child process and record a trace of CPU power consumption while it is running.\n");
 	fprintf(stderr, "\n");
@@ -439,6 +620,10 @@ static void print_usage() {
 	fprintf(stderr, "  -F <frequency>                  Record power consumption at a given frequency (in Hz, defaults to %.0f)\n", sampling_frequency);
 	fprintf(stderr, "  -o <output file>                Write the output to a specific file (defaults to %s)\n", output_file.c_str());
 	fprintf(stderr, "  -c <child CPU affinity core>    Set the affinity for the child process to a specific core\n");
+	fprintf(stderr, "  -C <CPU list>                   Trace the temperature of these CPUs, e.g. 0-3,8 (defaults to all online CPUs)\n");
+	fprintf(stderr, "  -j <threads>                    Read the core temperatures using this many threads (defaults to one per 16 CPUs)\n");
+	fprintf(stderr, "  -B                              Write a binary trace, use trace-convert to read it\n");
+	fprintf(stderr, "  -u                              Take the samples at RAPL updates, timestamped at the update\n");
 	fprintf(stderr, "  -h, --help                      Display this usage information\n");
 }
 
@@ -510,6 +695,40 @@ static int process_command_line(int argc, char **argv) {
 				fprintf(stderr, "Error: Not enough arguments to -c\n");
 				consumed += 1;
 			}
+		} else if (strcmp(argv[i], "-C") == 0) {
+			if (argc > i + 1) {
+				num_temp_cpus = parse_cpu_list(argv[i + 1], temp_cpus, MSR_TEMP_MAX_CPUS);
+				if (num_temp_cpus <= 0) {
+					fprintf(stderr, "Error: Invalid CPU list '%s'\n", argv[i + 1]);
+					exit_code = EXIT_FAILURE;
+					break;
+				}
+				i++;
+				consumed += 2;
+			} else {
+				fprintf(stderr, "Error: Not enough arguments to -C\n");
+				consumed += 1;
+			}
+		} else if (strcmp(argv[i], "-j") == 0) {
+			if (argc > i + 1) {
+				int threads = atoi(argv[i + 1]);
+				if (threads > 0) {
+					num_reader_threads = threads;
+				} else {
+					fprintf(stderr, "Error: The number of threads must be greater than zero\n");
+				}
+				i++;
+				consumed += 2;
+			} else {
+				fprintf(stderr, "Error: Not enough arguments to -j\n");
+				consumed += 1;
+			}
+		} else if (strcmp(argv[i], "-B") == 0) {
+			binary_output = true;
+			consumed += 1;
+		} else if (strcmp(argv[i], "-u") == 0) {
+			sync_to_updates = true;
+			consumed += 1;
 		} else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
 			print_usage();
 			exit_code = EXIT_FAILURE;
@@ -555,17 +774,20 @@ static void do_fork_and_exec(int argc, char **argv) {
 
 int main(int argc, char **argv) {
 	argv0 = argv[0];
-	// Set our affinity to core 0 because PAPI reads the MSRs from core 0
+	// Set our affinity to core 0, the MSRs of the other packages are read through their own CPUs
 	do_affinity(0);
 	int args_consumed = process_command_line(argc, argv);
 	if (exit_code != EXIT_SUCCESS) {
 		return exit_code;
 	}
-	v_temp_numbers.reserve(1000);
 	do_signals();
 	if (!init_temp()) {
 		return EXIT_FAILURE;
 	}
+	samples.timestamp.reserve(1000);
+	samples.energy.reserve(1000 * num_packages * RAPL_NUM_DOMAINS);
+	samples.pkg_temp.reserve(1000 * num_packages);
+	samples.core_temp.reserve(1000 * num_temp_cpus);
 	do_warmup();
 	start_time = time(NULL);
 	do_fork_and_exec(argc - args_consumed, argv + args_consumed);
@@ -4,12 +4,24 @@
  * This is an improved version that records timestamps.
  * Added support for changing the frequency using the -F command line switch.
  * Version 2.2: Pass SIGINT (Ctrl-C on terminal) to the child process
+ * Version 2.3: Streaming mode (-s) writes the trace while the child is running
+ *              Binary output (-B), use trace-convert to turn it into CSV
+ *              Sampler thread mode (-t) with absolute deadlines on CLOCK_MONOTONIC
+ *              RAPL update synchronized sampling (-u)
+ *              All packages are traced on multi-socket systems, one group of columns per package
+ *              counters that wrap around (MSR, powercap) are extended to 64 bits
+ * Version 2.4: Live power stream and rolling averages served over a UNIX socket (-S),
+ *              without a program the samples are served until SIGINT or SIGTERM
+ *              Latest counters published in shared memory (-M), read them with rapl-shm.h
+ * Version 2.5: PKG and PP0 energy attributed to the traced process tree (-a) or a cgroup (-g)
+ *              in proportion to CPU time
+ *              Orphaned descendants are reaped by the tracer, -T traces until the whole tree has exited
  *
- * Compilation: g++ -Wall -Wextra -O2 -g -o trace-energy-v2 trace-energy-v2.cc util.cc -lpapi -lrt
+ * Compilation: g++ -Wall -Wextra -O2 -g -o trace-energy-v2 trace-energy-v2.cc util.cc trace-format.cc power-server.cc cpu-tracker.cc librapl.a -lpapi -lrt -pthread
  *
  * Dependencies: PAPI (Performance Application Programming Interface)
  *
- * Usage: ./trace-energy-v2 [ -F <frequency> ] [ -o <output file> ] [ -c <child CPU affinity core> ] <program> [parameters]
+ * Usage: ./trace-energy-v2 [ -F <frequency> ] [ -o <output file> ] [ -c <child CPU affinity core> ] [ -b <backend> ] [ -s ] [ -B ] [ -t [ -w <spin microseconds> ] ] [ -u ] [ -S <socket> ] [ -M <shm name> ] [ -a [ -R <rescan milliseconds> ] | -g <cgroup> ] [ -T ] <program> [parameters]
  *
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
@@ -27,20 +39,27 @@
 #include <string.h>
 #include <math.h>
 #include <sys/utsname.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <vector>
 #include <string>
 #include <sstream>
 
-#include <papi.h>
-
+#include "rapl.h"
+#include "trace-format.h"
+#include "power-server.h"
+#include "rapl-shm.h"
+#include "spsc-ring.h"
+#include "rapl-sync.h"
+#include "cpu-tracker.h"
 #include "util.h"
 
 // Name of this program
 const char *trace_energy_name = "trace-energy-v2";
 
 // Version string
-const char *trace_energy_version = "2.2";
+const char *trace_energy_version = "2.5";
 
 // Frequency can be changed using the -F command line switch
 // Defaults to 200 Hz
@@ -63,31 +82,115 @@ static pid_t child_pid = -1;
 static int exit_code = EXIT_SUCCESS;
 static int sigchld_received = 0;
 static int sigalrm_received = 0;
+static int stop_received = 0;
 static const char *argv0 = NULL;
 
-static int s_event_set = 0;
-static int s_num_events = 0;
-static long long *s_rapl_values = NULL;
-
-#define READ_ENERGY(a) PAPI_read(s_event_set, a)
-
-static int idx_pkg_energy = -1;
-static int idx_pp0_energy = -1;
-static int idx_pp1_energy = -1;
-static int idx_dram_energy = -1;
+// RAPL backend can be changed using the -b command line switch
+static const char *rapl_backend = "papi";
 
-static const double scaleFactor = 1e-9;
+static struct rapl_source *s_rapl = NULL;
+static uint64_t s_rapl_values[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS];
+static struct rapl_accum s_rapl_accum;
 
 struct energy_numbers {
 	struct timespec timestamp;
-	long long pkg;
-	long long pp0;
-	long long pp1;
-	long long dram;
+	// Accumulated counters indexed with RAPL_VALUE_INDEX(package, domain)
+	uint64_t energy[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS];
+	// CPU time of the tracked tasks and of the whole system in nanoseconds, with -a or -g
+	uint64_t cpu_ns[2];
 };
 
 static std::vector<energy_numbers> v_energy_numbers;
 
+// Previous sample, used for detecting duplicates
+static struct energy_numbers prev_numbers;
+static bool have_prev_numbers = false;
+
+// Streaming mode can be enabled using the -s command line switch
+// Samples are then handed over to a writer thread through a lock-free ring
+// instead of being stored until the child exits.
+static bool streaming = false;
+
+// The live power stream can be served over a UNIX socket using the -S switch
+static const char *serve_path = NULL;
+static struct power_server *stream_server = NULL;
+
+// The latest counters can be published in shared memory using the -M switch
+static const char *shm_name = NULL;
+static struct rapl_shm *s_shm = NULL;
+
+// Energy attribution to the traced process tree (-a) or to a cgroup (-g)
+static bool attribute_tree = false;
+static const char *attribute_cgroup = NULL;
+static struct cpu_tracker *s_cpu_tracker = NULL;
+
+// Tracing continues until all descendants of the program have exited, set using -T
+static bool follow_tree = false;
+static bool descendants_left = false;
+
+// Totals over all packages, updated by whoever writes the trace
+static struct cpu_split s_cpu_split;
+static double attributed_joules[RAPL_NUM_DOMAINS];
+static double total_joules[RAPL_NUM_DOMAINS];
+static uint64_t attributed_cpu_ns = 0;
+static uint64_t total_cpu_ns = 0;
+
+static_assert(RAPL_SHM_MAX_VALUES == RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS, "rapl-shm.h does not match rapl.h");
+
+// Without a program to run, the samples are served or published until SIGINT or SIGTERM
+static bool daemon_mode = false;
+
+// Samples go through the ring to the writer thread when streaming or serving
+static bool use_writer_thread = false;
+
+// Number of samples the ring can hold, must be a power of two
+#define STREAM_RING_SIZE 8192
+
+// The writer polls the ring this often when it is empty
+#define STREAM_POLL_INTERVAL_NS 10000000
+#define STREAM_POLL_INTERVAL_MS (STREAM_POLL_INTERVAL_NS / 1000000)
+
+static struct spsc_ring stream_ring;
+// Only touched by the sampling path
+static unsigned long stream_dropped = 0;
+static int stream_done = 0;
+static pthread_t stream_thread;
+static FILE *stream_fp = NULL;
+
+// Binary output can be enabled using the -B command line switch
+static bool binary_output = false;
+static struct trace_header trace_hdr;
+
+// Sampler thread mode can be enabled using the -t command line switch
+// A dedicated thread pinned to core 0 sleeps until absolute deadlines on
+// CLOCK_MONOTONIC instead of waiting for SIGALRM from a CLOCK_REALTIME timer.
+static bool sampler_thread_mode = false;
+
+// The sampler busy-waits this long before each deadline, set using -w
+static long sampler_spin_ns = 0;
+
+static pthread_t sampler_thread;
+static volatile int sampler_stop = 0;
+
+// Achieved sampling period and wakeup latency statistics, both in nanoseconds
+struct period_stats {
+	unsigned long count;
+	double mean;
+	double m2;
+	double min;
+	double max;
+};
+
+static struct period_stats sampler_period_stats;
+static struct period_stats sampler_latency_stats;
+static unsigned long sampler_missed_deadlines = 0;
+
+// RAPL update synchronized sampling can be enabled using the -u command line switch
+// The sampler learns when the energy counters update and wakes up just before each update.
+static bool sync_to_updates = false;
+
+static struct rapl_sync s_sync;
+
 static void sigchld_handler(int sig) {
 	(void)sig;
 	sigchld_received = 1;
@@ -101,6 +204,8 @@ static void sigalrm_handler(int sig) {
 static void sigint_handler(int sig) {
 	if (child_pid > 0) {
 		kill(child_pid, sig);
+	} else if (daemon_mode) {
+		stop_received = 1;
 	} else {
 		exit(-1);
 	}
@@ -146,184 +251,139 @@ static void reset_timer() {
 	}
 }
 
-/*
- * Based on Filip Nybäck's energy profiling module in IgProf
- */
 static bool init_rapl() {
-	if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
-		fprintf(stderr, "PAPI library initialisation failed.\n");
+	s_rapl = rapl_open_all(rapl_backend);
+	if (!s_rapl) {
 		return false;
 	}
-	
-	// Find the RAPL component of PAPI.
-	int num_components = PAPI_num_components();
-	int component_id;
-	const PAPI_component_info_t *component_info = 0;
-	for (component_id = 0; component_id < num_components; ++component_id)
-	{
-		component_info = PAPI_get_component_info(component_id);
-		if (component_info && strstr(component_info->name, "rapl")) {
-			break;
-		}
-	}
-	if (component_id == num_components) {
-		fprintf(stderr, "No RAPL component found in PAPI library.\n");
-		return false;
+	if (s_rapl->num_packages > 1) {
+		printf("%s: Tracing %d packages\n", trace_energy_name, s_rapl->num_packages);
 	}
-	
-	if (component_info->disabled) {
-		fprintf(stderr, "RAPL component of PAPI disabled: %s.\n",
-			component_info->disabled_reason);
-		return false;
+	rapl_accum_init(&s_rapl_accum, s_rapl);
+	return true;
+}
+
+static bool init_shm() {
+	uint32_t domains = 0;
+	for (int domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		if (rapl_has_domain(s_rapl, domain)) {
+			domains |= 1 << domain;
+		}
 	}
-	
-	// Create an event set.
-	s_event_set = PAPI_NULL;
-	if (PAPI_create_eventset(&s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not create PAPI event set.\n");
+	s_shm = rapl_shm_create(shm_name, s_rapl->num_packages, domains, s_rapl->energy_unit);
+	if (!s_shm) {
+		fprintf(stderr, "Error: Could not create the shared memory segment '%s': %s\n", shm_name, strerror(errno));
 		return false;
 	}
-	
-	int code = PAPI_NATIVE_MASK;
-	for (int retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_FIRST, component_id); retval == PAPI_OK; retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_EVENTS, component_id)) {
-		char event_name[PAPI_MAX_STR_LEN];
-		if (PAPI_event_code_to_name(code, event_name) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event name.\n");
-			return false;
-		}
-		
-		PAPI_event_info_t event_info;
-		if (PAPI_get_event_info(code, &event_info) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event info.\n");
-			return false;
+	printf("%s: Publishing the energy counters in %s\n", trace_energy_name, shm_name);
+	return true;
+}
+
+static void handle_sigchld() {
+	int status = 0;
+	struct rusage usage;
+	pid_t pid;
+	// Orphaned descendants are reparented to us with -a and -T, they are reaped here too
+	while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+		if (s_cpu_tracker && attribute_tree) {
+			cpu_tracker_add_reaped(s_cpu_tracker, &usage);
 		}
-		if (event_info.data_type != PAPI_DATATYPE_UINT64) {
+		if (pid != child_pid) {
 			continue;
 		}
-		
-		if (strstr(event_name, "PACKAGE_ENERGY:")) {
-			idx_pkg_energy = s_num_events;
-		} else if (strstr(event_name, "PP0_ENERGY:")) {
-			idx_pp0_energy = s_num_events;
-		} else if (strstr(event_name, "PP1_ENERGY:")) {
-			idx_pp1_energy = s_num_events;
-		} else if (strstr(event_name, "DRAM_ENERGY:")) {
-			idx_dram_energy = s_num_events;
-		} else {
-			continue; // Skip other counters
+		if (WIFEXITED(status)) {
+			int child_exit_code = WEXITSTATUS(status);
+			printf("%s: Child exited normally with exit code %d\n", trace_energy_name, child_exit_code);
+			exit_code = child_exit_code;
+			child_pid = -1;
+		}
+		else if (WIFSIGNALED(status)) {
+			printf("%s: Child was terminated by a signal\n", trace_energy_name);
+			exit_code = EXIT_FAILURE;
+			child_pid = -1;
 		}
-		
-		//printf("Adding %s to event set.\n", event_name);
-		if (PAPI_add_event(s_event_set, code) != PAPI_OK)
-			break;
-		++s_num_events;
-	}
-	if (s_num_events == 0) {
-		fprintf(stderr, "Could not find any RAPL events.\n");
-		return false;
 	}
-	
-	// Allocate memory for reading the counters
-	s_rapl_values = (long long *)calloc(s_num_events, sizeof(long long));
-	
-	// Activate the event set.
-	if (PAPI_start(s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not activate the event set.\n");
-		return false;
+	if (follow_tree) {
+		bool was_left = descendants_left;
+		// No children left means that the whole tree has exited
+		descendants_left = !(pid < 0 && errno == ECHILD);
+		if (child_pid < 0 && was_left && !descendants_left) {
+			printf("%s: All descendants have exited\n", trace_energy_name);
+		}
 	}
-	
-	return true;
 }
 
-static void handle_sigchld() {
-	int status = 0;
-	if (child_pid > 0) {
-		while (waitpid(child_pid, &status, WNOHANG) > 0) {
-			if (WIFEXITED(status)) {
-				int child_exit_code = WEXITSTATUS(status);
-				printf("%s: Child exited normally with exit code %d\n", trace_energy_name, child_exit_code);
-				exit_code = child_exit_code;
-				child_pid = -1;
-				break;
-			}
-			else if (WIFSIGNALED(status)) {
-				printf("%s: Child was terminated by a signal\n", trace_energy_name);
-				exit_code = EXIT_FAILURE;
-				child_pid = -1;
-				break;
-			}
-		}
+/*
+ * Called from the sampling path. Never blocks on the writer:
+ * if the ring is full the sample is dropped and counted.
+ */
+static void stream_push(const struct energy_numbers *numbers) {
+	if (unlikely(!spsc_ring_push(&stream_ring, numbers))) {
+		stream_dropped++;
 	}
 }
 
-static void handle_sigalrm() {
-	long long pkg_energy = 0, pp0_energy = 0, pp1_energy = 0, dram_energy = 0;
-	struct timespec now = { 0, 0 };
-	int idx_prev_sample = v_energy_numbers.size() - 1;
+// Store the counters in s_rapl_values as a sample taken at the given time
+static void store_sample(const struct timespec *now) {
+	const uint64_t *energy = s_rapl_accum.total;
 	bool is_duplicate = false; // Ignore duplicates in case we are supersampling
 	
-	READ_ENERGY(s_rapl_values);
-	clock_gettime(gettime_clockid, &now);
+	// Duplicates are accumulated too, so that no wraparound is missed
+	rapl_accum_update(&s_rapl_accum, s_rapl_values);
 	
-	if (likely(idx_pkg_energy != -1)) {
-		pkg_energy = s_rapl_values[idx_pkg_energy];
+	// The packages update at the same time, so only the first one is checked
+	if (likely(rapl_has_domain(s_rapl, RAPL_DOMAIN_PKG))) {
 		// PKG energy should always grow between samples
-		if (likely(idx_prev_sample >= 0)) {
-			if (unlikely(pkg_energy == v_energy_numbers[idx_prev_sample].pkg)) {
+		if (likely(have_prev_numbers)) {
+			if (unlikely(energy[RAPL_DOMAIN_PKG] == prev_numbers.energy[RAPL_DOMAIN_PKG])) {
 				is_duplicate = true;
 			}
 		}
 	}
-	if (likely(idx_pp0_energy != -1)) {
-		pp0_energy = s_rapl_values[idx_pp0_energy];
-	}
-	if (likely(idx_pp1_energy != -1)) {
-		pp1_energy = s_rapl_values[idx_pp1_energy];
-	}
-	if (likely(idx_dram_energy != -1)) {
-		dram_energy = s_rapl_values[idx_dram_energy];
+	if (likely(rapl_has_domain(s_rapl, RAPL_DOMAIN_DRAM))) {
 		// DRAM energy should always grow between samples
 		// Sometimes PKG energy updates before DRAM does, so check both
-		if (likely(idx_prev_sample >= 0)) {
-			if (unlikely(dram_energy == v_energy_numbers[idx_prev_sample].dram)) {
+		// unless the samples are already synchronized to PKG updates
+		if (likely(have_prev_numbers && !sync_to_updates)) {
+			if (unlikely(energy[RAPL_DOMAIN_DRAM] == prev_numbers.energy[RAPL_DOMAIN_DRAM])) {
 				is_duplicate = true;
 			}
 		}
 	}
 	
 	if (likely(!is_duplicate)) {
-		struct energy_numbers numbers = { now, pkg_energy, pp0_energy, pp1_energy, dram_energy };
-		v_energy_numbers.push_back(numbers);
+		struct energy_numbers numbers;
+		numbers.timestamp = *now;
+		memcpy(numbers.energy, energy, s_rapl->num_packages * RAPL_NUM_DOMAINS * sizeof(uint64_t));
+		// Only read when the energy has changed, the CPU time is split per RAPL update
+		if (s_cpu_tracker) {
+			cpu_tracker_read(s_cpu_tracker, &numbers.cpu_ns[0], &numbers.cpu_ns[1]);
+		} else {
+			numbers.cpu_ns[0] = numbers.cpu_ns[1] = 0;
+		}
+		if (s_shm) {
+			// The sequence lock never waits for the readers
+			rapl_shm_publish(s_shm, now->tv_sec * 1000000000LL + now->tv_nsec, energy);
+		}
+		if (use_writer_thread) {
+			stream_push(&numbers);
+		} else if (!daemon_mode) {
+			v_energy_numbers.push_back(numbers);
+		}
+		prev_numbers = numbers;
+		have_prev_numbers = true;
 	}
 }
 
-static void wait_for_child() {
-	FILE *fp = NULL;
-	struct timespec sleep_time = { 1, 0 };
-	int i;
+static void handle_sigalrm() {
+	struct timespec now = { 0, 0 };
 	
-	setup_timer();
+	rapl_read(s_rapl, s_rapl_values);
+	clock_gettime(gettime_clockid, &now);
+	store_sample(&now);
+}
 
-	while (likely(child_pid > 0)) {
-		/* Sleep until interrupted by signal */
-		nanosleep(&sleep_time, NULL);
-		if (unlikely(__sync_bool_compare_and_swap(&sigchld_received, 1, 0))) {
-			handle_sigchld();
-		}
-		if (likely(__sync_bool_compare_and_swap(&sigalrm_received, 1, 0))) {
-			sigalrm_received = 0;
-			handle_sigalrm();
-		}
-	}
-	
-	reset_timer();
-	
-	fp = fopen(output_file.c_str(), "w");
-	if (!fp) {
-		fprintf(stderr, "Error: Could not open '%s' for writing!\n", output_file.c_str());
-		exit(-1);
-	}
-	
+static void write_header(FILE *fp) {
 	fprintf(fp, "# %s version %s output\n", trace_energy_name, trace_energy_version);
 	// Print formatted time
 	{
@@ -400,18 +460,470 @@ static void wait_for_child() {
 		fprintf(fp, "# Working directory: %s\n", wd);
 	}
 	fprintf(fp, "# Command line: %s\n", cmdline.c_str());
+	if (s_cpu_tracker) {
+		fprintf(fp, "# Attributed to: %s\n", attribute_cgroup ? attribute_cgroup : "traced process tree");
+		fprintf(fp, "# Last two columns: PKG and PP0 energy of all packages attributed by CPU time\n");
+	}
+	// Each package has its own PKG, PP0, PP1 and DRAM columns
+	if (s_rapl->num_packages > 1) {
+		fprintf(fp, "# Packages: %d\n", s_rapl->num_packages);
+	}
+}
+
+static void write_binary_header(FILE *fp) {
+	trace_init_header(&trace_hdr, trace_energy_name, trace_energy_version, start_time, cmdline.c_str());
+	trace_hdr.num_packages = s_rapl->num_packages;
+	for (int package = 0; package < s_rapl->num_packages; package++) {
+		for (int domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+			char name[20];
+			if (s_rapl->num_packages > 1) {
+				snprintf(name, sizeof(name), "%s:%d", rapl_domain_name(domain), package);
+			} else {
+				snprintf(name, sizeof(name), "%s", rapl_domain_name(domain));
+			}
+			trace_add_column(&trace_hdr, name, TRACE_COL_ENERGY, s_rapl->energy_unit[domain]);
+		}
+	}
+	if (s_cpu_tracker) {
+		// trace-convert splits the energy by these in the same way as the text trace
+		snprintf(trace_hdr.attributed_to, sizeof(trace_hdr.attributed_to), "%s", attribute_cgroup ? attribute_cgroup : "traced process tree");
+		trace_add_column(&trace_hdr, "CPU:tracked", TRACE_COL_CPUTIME, 1e-9);
+		trace_add_column(&trace_hdr, "CPU:system", TRACE_COL_CPUTIME, 1e-9);
+	}
+	trace_write_header(fp, &trace_hdr);
+}
+
+static void write_output_header(FILE *fp) {
+	if (binary_output) {
+		write_binary_header(fp);
+	} else {
+		write_header(fp);
+	}
+}
+
+// Binary traces store every sample as raw counters, deltas are computed by the reader
+static void write_binary_sample(FILE *fp, const struct energy_numbers *numbers) {
+	unsigned char record[(3 + RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS) * sizeof(uint64_t)];
+	size_t offset = trace_put_timestamp(record, &numbers->timestamp);
+	for (int i = 0; i < s_rapl->num_packages * RAPL_NUM_DOMAINS; i++) {
+		offset = trace_put_u64(record, offset, numbers->energy[i]);
+	}
+	if (s_cpu_tracker) {
+		offset = trace_put_u64(record, offset, numbers->cpu_ns[0]);
+		offset = trace_put_u64(record, offset, numbers->cpu_ns[1]);
+	}
+	fwrite(record, offset, 1, fp);
+}
+
+// Split the PKG and PP0 energy between two samples by CPU time, joules has RAPL_NUM_DOMAINS values
+static void attribute_sample(const struct energy_numbers *prev, const struct energy_numbers *cur, double *joules) {
+	const uint64_t tracked_delta = cur->cpu_ns[0] - prev->cpu_ns[0];
+	const uint64_t system_delta = cur->cpu_ns[1] - prev->cpu_ns[1];
+	int domain;
+	
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		joules[domain] = 0.0;
+		for (int package = 0; package < s_rapl->num_packages; package++) {
+			int i = RAPL_VALUE_INDEX(package, domain);
+			joules[domain] += (cur->energy[i] - prev->energy[i]) * s_rapl->energy_unit[domain];
+		}
+		total_joules[domain] += joules[domain];
+	}
+	cpu_split_energy(&s_cpu_split, tracked_delta, system_delta, joules, RAPL_NUM_DOMAINS);
+	for (domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+		attributed_joules[domain] += joules[domain];
+	}
+	attributed_cpu_ns += tracked_delta;
+	total_cpu_ns += system_delta;
+}
+
+static void print_attribution_summary() {
+	const double pkg_share = total_joules[RAPL_DOMAIN_PKG] > 0.0 ? attributed_joules[RAPL_DOMAIN_PKG] / total_joules[RAPL_DOMAIN_PKG] : 0.0;
+	printf("%s: Attributed %.3f J of %.3f J PKG energy (%.1f%%) and %.3f J of %.3f J PP0 energy to %s\n", trace_energy_name,
+		attributed_joules[RAPL_DOMAIN_PKG], total_joules[RAPL_DOMAIN_PKG], pkg_share * 100.0,
+		attributed_joules[RAPL_DOMAIN_PP0], total_joules[RAPL_DOMAIN_PP0],
+		attribute_cgroup ? attribute_cgroup : "the traced processes");
+	printf("%s: CPU time: %.3f s tracked, %.3f s for the whole system\n", trace_energy_name, attributed_cpu_ns * 1e-9, total_cpu_ns * 1e-9);
+}
+
+static void print_sample(FILE *fp, const struct energy_numbers *prev, const struct energy_numbers *cur) {
+	double timestamp = cur->timestamp.tv_sec + cur->timestamp.tv_nsec * 1e-9;
+	fprintf(fp, "%.6f", timestamp);
+	for (int package = 0; package < s_rapl->num_packages; package++) {
+		for (int domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+			int i = RAPL_VALUE_INDEX(package, domain);
+			fprintf(fp, ", %.6f", (cur->energy[i] - prev->energy[i]) * s_rapl->energy_unit[domain]);
+		}
+	}
+	if (s_cpu_tracker) {
+		double joules[RAPL_NUM_DOMAINS];
+		attribute_sample(prev, cur, joules);
+		fprintf(fp, ", %.6f, %.6f", joules[RAPL_DOMAIN_PKG], joules[RAPL_DOMAIN_PP0]);
+	}
+	fprintf(fp, "\n");
+}
+
+// Hand a sample to the subscribers of the live power stream
+static void serve_sample(const struct energy_numbers *numbers) {
+	double joules[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS];
+	for (int package = 0; package < s_rapl->num_packages; package++) {
+		for (int domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+			int i = RAPL_VALUE_INDEX(package, domain);
+			joules[i] = numbers->energy[i] * s_rapl->energy_unit[domain];
+		}
+	}
+	power_server_add_sample(stream_server, &numbers->timestamp, joules);
+}
+
+static void *stream_writer(void *arg) {
+	// Samples are written in batches, the file is flushed after each batch
+	static struct energy_numbers batch[STREAM_RING_SIZE / 8];
+	const struct timespec poll_interval = { 0, STREAM_POLL_INTERVAL_NS };
+	struct energy_numbers prev;
+	bool have_prev = false;
+	(void)arg;
+	
+	while (true) {
+		// Checked before draining the ring so that the last samples are not lost
+		bool done = __atomic_load_n(&stream_done, __ATOMIC_ACQUIRE);
+		unsigned n = 0;
+		while (n < sizeof(batch) / sizeof(batch[0]) && spsc_ring_pop(&stream_ring, &batch[n])) {
+			n++;
+		}
+		if (n == 0) {
+			if (done) {
+				break;
+			}
+			// The server waits for subscribers while there is nothing to send
+			if (stream_server) {
+				power_server_poll(stream_server, STREAM_POLL_INTERVAL_MS);
+			} else {
+				nanosleep(&poll_interval, NULL);
+			}
+			continue;
+		}
+		
+		for (unsigned i = 0; i < n; i++) {
+			if (!stream_fp) {
+				// Only serving, the trace is written when the child exits
+				if (!daemon_mode) {
+					v_energy_numbers.push_back(batch[i]);
+				}
+			} else if (binary_output) {
+				write_binary_sample(stream_fp, &batch[i]);
+				if (s_cpu_tracker && have_prev) {
+					double joules[RAPL_NUM_DOMAINS];
+					attribute_sample(&prev, &batch[i], joules);
+				}
+			} else if (have_prev) {
+				print_sample(stream_fp, &prev, &batch[i]);
+			}
+			if (stream_server) {
+				serve_sample(&batch[i]);
+			}
+			prev = batch[i];
+			have_prev = true;
+		}
+		// Flush after every batch so that the trace survives the tracer being killed
+		if (stream_fp) {
+			fflush(stream_fp);
+		}
+		if (stream_server) {
+			power_server_poll(stream_server, 0);
+		}
+	}
+	
+	return NULL;
+}
+
+static void close_stream_outputs() {
+	if (stream_server) {
+		power_server_destroy(stream_server);
+		stream_server = NULL;
+	}
+	if (stream_fp) {
+		fclose(stream_fp);
+		stream_fp = NULL;
+	}
+}
+
+static bool start_streaming() {
+	sigset_t all_signals, old_signals;
+	
+	if (streaming) {
+		stream_fp = fopen(output_file.c_str(), "w");
+		if (!stream_fp) {
+			fprintf(stderr, "Error: Could not open '%s' for writing!\n", output_file.c_str());
+			return false;
+		}
+		write_output_header(stream_fp);
+		fflush(stream_fp);
+	}
+	if (serve_path) {
+		char names[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS][20];
+		const char *name_ptrs[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS];
+		for (int package = 0; package < s_rapl->num_packages; package++) {
+			for (int domain = 0; domain < RAPL_NUM_DOMAINS; domain++) {
+				int i = RAPL_VALUE_INDEX(package, domain);
+				if (s_rapl->num_packages > 1) {
+					snprintf(names[i], sizeof(names[i]), "%s:%d", rapl_domain_name(domain), package);
+				} else {
+					snprintf(names[i], sizeof(names[i]), "%s", rapl_domain_name(domain));
+				}
+				name_ptrs[i] = names[i];
+			}
+		}
+		stream_server = power_server_create(serve_path, s_rapl->num_packages * RAPL_NUM_DOMAINS, name_ptrs);
+		if (!stream_server) {
+			close_stream_outputs();
+			return false;
+		}
+		printf("%s: Serving the power stream on %s\n", trace_energy_name, serve_path);
+	}
+	if (!spsc_ring_init(&stream_ring, sizeof(struct energy_numbers), STREAM_RING_SIZE)) {
+		fprintf(stderr, "Error: Could not allocate the sample ring!\n");
+		close_stream_outputs();
+		return false;
+	}
+	
+	// The writer thread must not steal SIGALRM or SIGCHLD from the main thread
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+	int err = pthread_create(&stream_thread, NULL, stream_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (err != 0) {
+		fprintf(stderr, "Error: Could not create the writer thread: %s\n", strerror(err));
+		spsc_ring_destroy(&stream_ring);
+		close_stream_outputs();
+		return false;
+	}
+	return true;
+}
+
+static void stop_streaming() {
+	__atomic_store_n(&stream_done, 1, __ATOMIC_RELEASE);
+	pthread_join(stream_thread, NULL);
+	spsc_ring_destroy(&stream_ring);
+	
+	if (stream_dropped > 0) {
+		fprintf(stderr, "%s: Warning: %lu samples were dropped because the writer could not keep up\n", trace_energy_name, stream_dropped);
+	}
+	close_stream_outputs();
+}
+
+static void period_stats_add(struct period_stats *stats, double x) {
+	if (stats->count == 0 || x < stats->min) stats->min = x;
+	if (stats->count == 0 || x > stats->max) stats->max = x;
+	stats->count++;
+	double delta = x - stats->mean;
+	stats->mean += delta / stats->count;
+	stats->m2 += delta * (x - stats->mean);
+}
+
+static int64_t timespec_to_ns(const struct timespec *ts) {
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static struct timespec ns_to_timespec(int64_t ns) {
+	struct timespec ts = { (time_t)(ns / 1000000000LL), (long)(ns % 1000000000LL) };
+	return ts;
+}
+
+static int64_t monotonic_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_to_ns(&now);
+}
+
+// Reads the counters for rapl_sync_wait(), they are stored by store_sample()
+static uint64_t sync_read_pkg(void *arg) {
+	(void)arg;
+	rapl_read(s_rapl, s_rapl_values);
+	return s_rapl_values[RAPL_DOMAIN_PKG];
+}
+
+static void sampler_sync_loop() {
+	struct timespec now_realtime;
+	
+	if (!rapl_sync_init(&s_sync, sync_read_pkg, NULL)) {
+		fprintf(stderr, "%s: Warning: The energy counters are not updating, cannot synchronize to them\n", trace_energy_name);
+		return;
+	}
+	clock_gettime(gettime_clockid, &now_realtime);
+	store_sample(&now_realtime);
+	
+	while (likely(!sampler_stop)) {
+		int64_t update = rapl_sync_wait(&s_sync, sampling_frequency);
+		if (unlikely(update < 0)) {
+			return;
+		} else if (unlikely(update == 0)) {
+			continue;
+		}
+		clock_gettime(gettime_clockid, &now_realtime);
+		store_sample(&now_realtime);
+		
+		period_stats_add(&sampler_latency_stats, s_sync.spin_ns);
+		period_stats_add(&sampler_period_stats, s_sync.gap_ns);
+	}
+}
+
+static void *sampler_main(void *arg) {
+	const int64_t period_ns = llround(1e9 / sampling_frequency);
+	int64_t deadline = monotonic_ns();
+	int64_t prev_wakeup = -1;
+	(void)arg;
+	
+	// Read the MSRs from core 0 like the main thread does
+	do_affinity(0);
+	
+	if (sync_to_updates) {
+		sampler_sync_loop();
+		return NULL;
+	}
+	
+	while (likely(!sampler_stop)) {
+		deadline += period_ns;
+		
+		// Sleep until shortly before the deadline, then spin the rest of the way
+		struct timespec wakeup = ns_to_timespec(deadline - sampler_spin_ns);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) == EINTR) {
+		}
+		int64_t now = monotonic_ns();
+		while (sampler_spin_ns > 0 && now < deadline) {
+			now = monotonic_ns();
+		}
+		
+		handle_sigalrm();
+		
+		period_stats_add(&sampler_latency_stats, now - deadline);
+		if (likely(prev_wakeup >= 0)) {
+			period_stats_add(&sampler_period_stats, now - prev_wakeup);
+		}
+		prev_wakeup = now;
+		
+		// Skip deadlines that have already passed instead of sampling in a burst
+		now = monotonic_ns();
+		while (unlikely(deadline + period_ns <= now)) {
+			deadline += period_ns;
+			sampler_missed_deadlines++;
+		}
+	}
+	
+	return NULL;
+}
+
+static bool start_sampler() {
+	sigset_t all_signals, old_signals;
+	
+	// The sampler thread must not steal SIGCHLD or SIGINT from the main thread
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+	int err = pthread_create(&sampler_thread, NULL, sampler_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (err != 0) {
+		fprintf(stderr, "Error: Could not create the sampler thread: %s\n", strerror(err));
+		return false;
+	}
+	return true;
+}
+
+static void print_period_stats(const char *what, const struct period_stats *stats) {
+	double stddev = stats->count > 1 ? sqrt(stats->m2 / stats->count) : 0.0;
+	printf("%s: %s: mean %.3f us, stddev %.3f us, min %.3f us, max %.3f us\n", trace_energy_name, what,
+		stats->mean * 1e-3, stddev * 1e-3, stats->min * 1e-3, stats->max * 1e-3);
+}
+
+static void stop_sampler() {
+	sampler_stop = 1;
+	pthread_join(sampler_thread, NULL);
+	
+	printf("%s: Requested sampling period: %.3f us\n", trace_energy_name, 1e6 / sampling_frequency);
+	if (sync_to_updates) {
+		printf("%s: Estimated RAPL update period: %.3f us\n", trace_energy_name, s_sync.period_ns * 1e-3);
+		if (sampler_period_stats.count > 0) {
+			print_period_stats("Achieved sampling period", &sampler_period_stats);
+			print_period_stats("Spin time before update", &sampler_latency_stats);
+		}
+		printf("%s: Late wakeups: %lu, resynchronizations: %lu\n", trace_energy_name, s_sync.late_wakeups, s_sync.resyncs);
+		return;
+	}
+	if (sampler_period_stats.count > 0) {
+		print_period_stats("Achieved sampling period", &sampler_period_stats);
+		print_period_stats("Wakeup latency", &sampler_latency_stats);
+	}
+	printf("%s: Missed deadlines: %lu\n", trace_energy_name, sampler_missed_deadlines);
+}
+
+static void wait_for_child() {
+	FILE *fp = NULL;
+	struct timespec sleep_time = { 1, 0 };
+	int i;
+	
+	if (sampler_thread_mode) {
+		if (!start_sampler()) {
+			// Fall back to the timer signal
+			sampler_thread_mode = false;
+		}
+	}
+	if (!sampler_thread_mode) {
+		setup_timer();
+	}
+
+	while (likely(child_pid > 0 || descendants_left || (daemon_mode && !stop_received))) {
+		/* Sleep until interrupted by signal */
+		nanosleep(&sleep_time, NULL);
+		if (unlikely(__sync_bool_compare_and_swap(&sigchld_received, 1, 0))) {
+			handle_sigchld();
+		}
+		if (likely(__sync_bool_compare_and_swap(&sigalrm_received, 1, 0))) {
+			sigalrm_received = 0;
+			handle_sigalrm();
+		}
+	}
+	
+	if (sampler_thread_mode) {
+		stop_sampler();
+	} else {
+		reset_timer();
+	}
+	
+	if (use_writer_thread) {
+		stop_streaming();
+	}
+	if (streaming || daemon_mode) {
+		if (s_cpu_tracker) {
+			print_attribution_summary();
+		}
+		return;
+	}
+	
+	fp = fopen(output_file.c_str(), "w");
+	if (!fp) {
+		fprintf(stderr, "Error: Could not open '%s' for writing!\n", output_file.c_str());
+		exit(-1);
+	}
+	
+	write_output_header(fp);
 	
 	const int n = v_energy_numbers.size();
-	for (i = 1; i < n; i++) {
-		double timestamp = v_energy_numbers[i].timestamp.tv_sec + v_energy_numbers[i].timestamp.tv_nsec * 1e-9;
-		double pkg_energy = (v_energy_numbers[i].pkg - v_energy_numbers[i - 1].pkg) * scaleFactor;
-		double pp0_energy = (v_energy_numbers[i].pp0 - v_energy_numbers[i - 1].pp0) * scaleFactor;
-		double pp1_energy = (v_energy_numbers[i].pp1 - v_energy_numbers[i - 1].pp1) * scaleFactor;
-		double dram_energy = (v_energy_numbers[i].dram - v_energy_numbers[i - 1].dram) * scaleFactor;
-		fprintf(fp, "%.6f, %.6f, %.6f, %.6f, %.6f\n", timestamp, pkg_energy, pp0_energy, pp1_energy, dram_energy);
+	if (binary_output) {
+		for (i = 0; i < n; i++) {
+			write_binary_sample(fp, &v_energy_numbers[i]);
+			if (s_cpu_tracker && i > 0) {
+				double joules[RAPL_NUM_DOMAINS];
+				attribute_sample(&v_energy_numbers[i - 1], &v_energy_numbers[i], joules);
+			}
+		}
+	} else {
+		for (i = 1; i < n; i++) {
+			print_sample(fp, &v_energy_numbers[i - 1], &v_energy_numbers[i]);
+		}
 	}
 	
 	fclose(fp);
+	if (s_cpu_tracker) {
+		print_attribution_summary();
+	}
 }
 
 static void do_warmup() {
@@ -420,12 +932,17 @@ static void do_warmup() {
 	sigalrm_handler(0);
 	nanosleep(&sleep_time_warm, NULL);
 	sigalrm_received = 0;
+	// The warmup sample goes to the vector and is thrown away, the stream has not started yet
+	bool was_using_writer = use_writer_thread;
+	use_writer_thread = false;
 	handle_sigalrm();
-	v_energy_numbers.pop_back();
+	use_writer_thread = was_using_writer;
+	v_energy_numbers.clear();
+	have_prev_numbers = false;
 }
 
 static void print_usage() {
-	fprintf(stderr, "Usage: %s [ -F <frequency> ] [ -o <output file> ] [ -c <child CPU affinity core> ] <program> [parameters]\n", argv0);
+	fprintf(stderr, "Usage: %s [ -F <frequency> ] [ -o <output file> ] [ -c <child CPU affinity core> ] [ -b <backend> ] [ -s ] [ -B ] [ -t [ -w <spin microseconds> ] ] [ -u ] [ -S <socket> ] [ -M <shm name> ] [ -a [ -R <rescan milliseconds> ] | -g <cgroup> ] [ -T ] [ <program> [parameters] ]\n", argv0);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Execute the given program as a child process and record a trace of CPU power consumption while it is running.\n");
 	fprintf(stderr, "\n");
@@ -433,6 +950,24 @@ static void print_usage() {
 	fprintf(stderr, "  -F <frequency>                  Record power consumption at a given frequency (in Hz, defaults to %.0f)\n", sampling_frequency);
 	fprintf(stderr, "  -o <output file>                Write the output to a specific file (defaults to %s)\n", output_file.c_str());
 	fprintf(stderr, "  -c <child CPU affinity core>    Set the affinity for the child process to a specific core\n");
+	fprintf(stderr, "  -b <backend>                    Read RAPL through papi, msr, perf, powercap, sim[:<options>] or auto (defaults to %s)\n", rapl_backend);
+	fprintf(stderr, "  -s                              Stream the trace to the output file while the program is running\n");
+	fprintf(stderr, "  -B                              Write a binary trace, use trace-convert to read it\n");
+	fprintf(stderr, "  -t                              Sample from a dedicated thread using absolute deadlines instead of SIGALRM\n");
+	fprintf(stderr, "  -w <spin microseconds>          With -t, busy-wait this long before each deadline (defaults to 0)\n");
+	fprintf(stderr, "  -u                              Take one sample per RAPL update, timestamped at the update (implies -t)\n");
+	fprintf(stderr, "  -S <socket>                     Serve the samples and rolling averages on a UNIX socket while tracing,\n");
+	fprintf(stderr, "                                  without a program serve until interrupted (see power-stream.h)\n");
+	fprintf(stderr, "  -M <shm name>                   Publish the latest counters in shared memory (see rapl-shm.h),\n");
+	fprintf(stderr, "                                  without a program publish until interrupted\n");
+	fprintf(stderr, "  -a                              Attribute PKG and PP0 energy to the program and its descendants by CPU time\n");
+	fprintf(stderr, "  -R <rescan milliseconds>        With -a, how often the process tree is scanned for new processes (defaults to %.0f)\n", CPU_TRACKER_RESCAN_NS / 1e6);
+	fprintf(stderr, "                                  The tree is only scanned if the proc connector needs CAP_NET_ADMIN (before Linux 6.6)\n");
+	fprintf(stderr, "                                  and no cgroup v2 directory is writable (for example under systemd-run --user --scope).\n");
+	fprintf(stderr, "                                  Each scan reads one /proc file per thread of the tree, and processes that live\n");
+	fprintf(stderr, "                                  shorter than the interval are only counted when their parent reaps them.\n");
+	fprintf(stderr, "  -g <cgroup>                     Attribute PKG and PP0 energy to a cgroup directory by CPU time\n");
+	fprintf(stderr, "  -T                              Keep tracing until all descendants of the program have exited\n");
 	fprintf(stderr, "  -h, --help                      Display this usage information\n");
 }
 
@@ -504,6 +1039,89 @@ static int process_command_line(int argc, char **argv) {
 				fprintf(stderr, "Error: Not enough arguments to -c\n");
 				consumed += 1;
 			}
+		} else if (strcmp(argv[i], "-b") == 0) {
+			if (argc > i + 1) {
+				rapl_backend = argv[i + 1];
+				i++;
+				consumed += 2;
+			} else {
+				fprintf(stderr, "Error: Not enough arguments to -b\n");
+				consumed += 1;
+			}
+		} else if (strcmp(argv[i], "-s") == 0) {
+			streaming = true;
+			consumed += 1;
+		} else if (strcmp(argv[i], "-S") == 0) {
+			if (argc > i + 1) {
+				serve_path = argv[i + 1];
+				i++;
+				consumed += 2;
+			} else {
+				fprintf(stderr, "Error: Not enough arguments to -S\n");
+				consumed += 1;
+			}
+		} else if (strcmp(argv[i], "-M") == 0) {
+			if (argc > i + 1) {
+				shm_name = argv[i + 1];
+				i++;
+				consumed += 2;
+			} else {
+				fprintf(stderr, "Error: Not enough arguments to -M\n");
+				consumed += 1;
+			}
+		} else if (strcmp(argv[i], "-a") == 0) {
+			attribute_tree = true;
+			consumed += 1;
+		} else if (strcmp(argv[i], "-T") == 0) {
+			follow_tree = true;
+			consumed += 1;
+		} else if (strcmp(argv[i], "-R") == 0) {
+			if (argc > i + 1) {
+				double rescan_ms = atof(argv[i + 1]);
+				if (rescan_ms > 0) {
+					cpu_tracker_set_rescan_interval(llround(rescan_ms * 1e6));
+				} else {
+					fprintf(stderr, "Error: Rescan interval must be greater than zero\n");
+				}
+				i++;
+				consumed += 2;
+			} else {
+				fprintf(stderr, "Error: Not enough arguments to -R\n");
+				consumed += 1;
+			}
+		} else if (strcmp(argv[i], "-g") == 0) {
+			if (argc > i + 1) {
+				attribute_cgroup = argv[i + 1];
+				i++;
+				consumed += 2;
+			} else {
+				fprintf(stderr, "Error: Not enough arguments to -g\n");
+				consumed += 1;
+			}
+		} else if (strcmp(argv[i], "-B") == 0) {
+			binary_output = true;
+			consumed += 1;
+		} else if (strcmp(argv[i], "-t") == 0) {
+			sampler_thread_mode = true;
+			consumed += 1;
+		} else if (strcmp(argv[i], "-u") == 0) {
+			sampler_thread_mode = true;
+			sync_to_updates = true;
+			consumed += 1;
+		} else if (strcmp(argv[i], "-w") == 0) {
+			if (argc > i + 1) {
+				double spin_us = atof(argv[i + 1]);
+				if (spin_us >= 0) {
+					sampler_spin_ns = llround(spin_us * 1000.0);
+				} else {
+					fprintf(stderr, "Error: Spin time must not be negative\n");
+				}
+				i++;
+				consumed += 2;
+			} else {
+				fprintf(stderr, "Error: Not enough arguments to -w\n");
+				consumed += 1;
+			}
 		} else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
 			print_usage();
 			exit_code = EXIT_FAILURE;
@@ -521,8 +1139,18 @@ static int process_command_line(int argc, char **argv) {
 
 static void do_fork_and_exec(int argc, char **argv) {
 	if (argc > 1) {
+		if (attribute_tree || follow_tree) {
+			cpu_tracker_become_subreaper();
+		}
+		if (attribute_tree && !cpu_tracker_prepare_trees()) {
+			printf("%s: Scanning /proc for the processes of the tree, see -R\n", trace_energy_name);
+		}
+		descendants_left = follow_tree;
 		child_pid = fork();
 		if (child_pid == 0) {
+			if (attribute_tree) {
+				cpu_tracker_enter_tree();
+			}
 			if (child_cpu_affinity_core == -1) {
 				do_affinity_all();
 			} else {
@@ -538,8 +1166,13 @@ static void do_fork_and_exec(int argc, char **argv) {
 			if (setpriority(PRIO_PROCESS, 0, -5) < 0) {
 				perror("setpriority");
 			}
+			if (attribute_tree) {
+				s_cpu_tracker = cpu_tracker_open_tree(child_pid);
+			}
 			wait_for_child();
 		}
+	} else if (daemon_mode) {
+		wait_for_child();
 	} else {
 		fprintf(stderr, "Error: Not enough parameters!\n");
 		print_usage();
@@ -549,17 +1182,50 @@ static void do_fork_and_exec(int argc, char **argv) {
 
 int main(int argc, char **argv) {
 	argv0 = argv[0];
-	// Set our affinity to core 0 because PAPI reads the MSRs from core 0
+	// Set our affinity to core 0, the MSRs of the other packages are read through their own CPUs
 	do_affinity(0);
 	int args_consumed = process_command_line(argc, argv);
 	if (exit_code != EXIT_SUCCESS) {
 		return exit_code;
 	}
 	v_energy_numbers.reserve(1000);
+	daemon_mode = (serve_path || shm_name) && argc - args_consumed <= 1;
+	use_writer_thread = streaming || serve_path;
+	if ((attribute_tree || attribute_cgroup) && daemon_mode) {
+		fprintf(stderr, "Error: Energy attribution needs a program to trace\n");
+		return EXIT_FAILURE;
+	}
+	if (attribute_tree && attribute_cgroup) {
+		fprintf(stderr, "Error: -a and -g cannot be used together\n");
+		return EXIT_FAILURE;
+	}
+	if (attribute_cgroup) {
+		s_cpu_tracker = cpu_tracker_open_cgroup(attribute_cgroup);
+		if (!s_cpu_tracker) {
+			return EXIT_FAILURE;
+		}
+	}
 	do_signals();
-	init_rapl();
+	if (!init_rapl()) {
+		return EXIT_FAILURE;
+	}
+	if (shm_name && !init_shm()) {
+		return EXIT_FAILURE;
+	}
 	do_warmup();
 	start_time = time(NULL);
+	if (use_writer_thread && !start_streaming()) {
+		if (s_shm) {
+			rapl_shm_destroy(s_shm, shm_name);
+		}
+		return EXIT_FAILURE;
+	}
 	do_fork_and_exec(argc - args_consumed, argv + args_consumed);
+	if (s_cpu_tracker) {
+		cpu_tracker_close(s_cpu_tracker);
+	}
+	if (s_shm) {
+		rapl_shm_destroy(s_shm, shm_name);
+	}
 	return exit_code;
 }
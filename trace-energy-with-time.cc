@@ -3,6 +3,9 @@
  *
  * This is an improved version that records timestamps.
  *
+ * The counters are read through librapl. The backend can be selected with the
+ * RAPL_BACKEND environment variable (papi, msr, perf, powercap or sim).
+ *
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
 
@@ -21,34 +24,24 @@
 
 #include <vector>
 
-#include <papi.h>
-
 #include "util.h"
+#include "rapl.h"
 
 static pid_t child_pid = -1;
 static int exit_code = EXIT_SUCCESS;
 static int sigchld_received = 0;
 static int sigalrm_received = 0;
 
-static int s_event_set = 0;
-static int s_num_events = 0;
-static long long *s_rapl_values = NULL;
-
-#define READ_ENERGY(a) PAPI_read(s_event_set, a)
-
-static int idx_pkg_energy = -1;
-static int idx_pp0_energy = -1;
-static int idx_pp1_energy = -1;
-static int idx_dram_energy = -1;
-
-static const double scaleFactor = 1e-9;
+static struct rapl_source *s_rapl = NULL;
+static struct rapl_accum s_rapl_accum;
+static uint64_t s_rapl_values[RAPL_MAX_PACKAGES * RAPL_NUM_DOMAINS];
 
 struct energy_numbers {
 	struct timespec timestamp;
-	long long pkg;
-	long long pp0;
-	long long pp1;
-	long long dram;
+	double pkg;
+	double pp0;
+	double pp1;
+	double dram;
 };
 
 static std::vector<energy_numbers> v_energy_numbers;
@@ -101,102 +94,23 @@ static void reset_timer() {
 	}
 }
 
-/*
- * Based on Filip Nybäck's energy profiling module in IgProf
- */
 static bool init_rapl() {
-	if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
-		fprintf(stderr, "PAPI library initialisation failed.\n");
-		return false;
-	}
-	
-	// Find the RAPL component of PAPI.
-	int num_components = PAPI_num_components();
-	int component_id;
-	const PAPI_component_info_t *component_info = 0;
-	for (component_id = 0; component_id < num_components; ++component_id)
-	{
-		component_info = PAPI_get_component_info(component_id);
-		if (component_info && strstr(component_info->name, "rapl")) {
-			break;
-		}
-	}
-	if (component_id == num_components) {
-		fprintf(stderr, "No RAPL component found in PAPI library.\n");
-		return false;
-	}
-	
-	if (component_info->disabled) {
-		fprintf(stderr, "RAPL component of PAPI disabled: %s.\n",
-			component_info->disabled_reason);
-		return false;
-	}
-	
-	// Create an event set.
-	s_event_set = PAPI_NULL;
-	if (PAPI_create_eventset(&s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not create PAPI event set.\n");
-		return false;
-	}
-	
-	int code = PAPI_NATIVE_MASK;
-	for (int retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_FIRST, component_id); retval == PAPI_OK; retval = PAPI_enum_cmp_event(&code, PAPI_ENUM_EVENTS, component_id)) {
-		char event_name[PAPI_MAX_STR_LEN];
-		if (PAPI_event_code_to_name(code, event_name) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event name.\n");
-			return false;
-		}
-		
-		PAPI_event_info_t event_info;
-		if (PAPI_get_event_info(code, &event_info) != PAPI_OK) {
-			fprintf(stderr, "Could not get PAPI event info.\n");
-			return false;
-		}
-		if (event_info.data_type != PAPI_DATATYPE_UINT64) {
-			continue;
-		}
-		
-		if (strstr(event_name, "PACKAGE_ENERGY:")) {
-			idx_pkg_energy = s_num_events;
-		} else if (strstr(event_name, "PP0_ENERGY:")) {
-			idx_pp0_energy = s_num_events;
-		} else if (strstr(event_name, "PP1_ENERGY:")) {
-			idx_pp1_energy = s_num_events;
-		} else if (strstr(event_name, "DRAM_ENERGY:")) {
-			idx_dram_energy = s_num_events;
-		} else {
-			continue; // Skip other counters
-		}
-		
-		//printf("Adding %s to event set.\n", event_name);
-		if (PAPI_add_event(s_event_set, code) != PAPI_OK)
-			break;
-		++s_num_events;
-	}
-	if (s_num_events == 0) {
-		fprintf(stderr, "Could not find any RAPL events.\n");
-		return false;
-	}
-	
-	// Allocate memory for reading the counters
-	s_rapl_values = (long long *)calloc(s_num_events, sizeof(long long));
-	
-	// Activate the event set.
-	if (PAPI_start(s_event_set) != PAPI_OK) {
-		fprintf(stderr, "Could not activate the event set.\n");
+	s_rapl = rapl_open(getenv("RAPL_BACKEND"), 0);
+	if (!s_rapl) {
 		return false;
 	}
+	rapl_accum_init(&s_rapl_accum, s_rapl);
 	
 	return true;
 }
 
 #if 0
 static void calibrate_rapl() {
-	long long old_rapl_value = 0;
+	uint64_t old_rapl_value = 0;
 	int updates = 0, num_updates = 1000;
 	struct timespec time_start, time_end;
 	
-	if (idx_pkg_energy == -1) {
+	if (!rapl_has_domain(s_rapl, RAPL_DOMAIN_PKG)) {
 		fprintf(stderr, "trace-energy: No RAPL socket energy found, cannot calibrate!\n");
 		return;
 	}
@@ -205,14 +119,14 @@ static void calibrate_rapl() {
 	clock_gettime(CLOCK_REALTIME, &time_start);
 	clock_gettime(CLOCK_REALTIME, &time_end);
 	
-	READ_ENERGY(s_rapl_values);
-	old_rapl_value = s_rapl_values[idx_pkg_energy];
+	rapl_read(s_rapl, s_rapl_values);
+	old_rapl_value = s_rapl_values[RAPL_DOMAIN_PKG];
 	
 	// Wait for a RAPL update
 	while (true) {
-		READ_ENERGY(s_rapl_values);
-		if (unlikely(old_rapl_value != s_rapl_values[idx_pkg_energy])) {
-			old_rapl_value = s_rapl_values[idx_pkg_energy];
+		rapl_read(s_rapl, s_rapl_values);
+		if (unlikely(old_rapl_value != s_rapl_values[RAPL_DOMAIN_PKG])) {
+			old_rapl_value = s_rapl_values[RAPL_DOMAIN_PKG];
 			break;
 		}
 	}
@@ -220,9 +134,9 @@ static void calibrate_rapl() {
 	clock_gettime(CLOCK_REALTIME, &time_start);
 	
 	while (likely(updates < num_updates)) {
-		READ_ENERGY(s_rapl_values);
-		if (unlikely(old_rapl_value != s_rapl_values[idx_pkg_energy])) {
-			old_rapl_value = s_rapl_values[idx_pkg_energy];
+		rapl_read(s_rapl, s_rapl_values);
+		if (unlikely(old_rapl_value != s_rapl_values[RAPL_DOMAIN_PKG])) {
+			old_rapl_value = s_rapl_values[RAPL_DOMAIN_PKG];
 			updates++;
 		}
 	}
@@ -257,24 +171,17 @@ static void handle_sigchld() {
 }
 
 static void handle_sigalrm() {
-	long long pkg_energy = 0, pp0_energy = 0, pp1_energy = 0, dram_energy = 0;
 	struct timespec now;
 	
-	READ_ENERGY(s_rapl_values);
+	if (rapl_read(s_rapl, s_rapl_values)) {
+		rapl_accum_update(&s_rapl_accum, s_rapl_values);
+	}
 	clock_gettime(CLOCK_REALTIME, &now);
 	
-	if (likely(idx_pkg_energy != -1)) {
-		pkg_energy = s_rapl_values[idx_pkg_energy];
-	}
-	if (likely(idx_pp0_energy != -1)) {
-		pp0_energy = s_rapl_values[idx_pp0_energy];
-	}
-	if (likely(idx_pp1_energy != -1)) {
-		pp1_energy = s_rapl_values[idx_pp1_energy];
-	}
-	if (likely(idx_dram_energy != -1)) {
-		dram_energy = s_rapl_values[idx_dram_energy];
-	}
+	double pkg_energy = rapl_accum_joules(&s_rapl_accum, s_rapl, 0, RAPL_DOMAIN_PKG);
+	double pp0_energy = rapl_accum_joules(&s_rapl_accum, s_rapl, 0, RAPL_DOMAIN_PP0);
+	double pp1_energy = rapl_accum_joules(&s_rapl_accum, s_rapl, 0, RAPL_DOMAIN_PP1);
+	double dram_energy = rapl_accum_joules(&s_rapl_accum, s_rapl, 0, RAPL_DOMAIN_DRAM);
 	
 	struct energy_numbers numbers = { now, pkg_energy, pp0_energy, pp1_energy, dram_energy };
 	v_energy_numbers.push_back(numbers);
@@ -309,10 +216,10 @@ static void wait_for_child() {
 	const int n = v_energy_numbers.size();
 	for (i = 1; i < n; i++) {
 		double timestamp = v_energy_numbers[i].timestamp.tv_sec + v_energy_numbers[i].timestamp.tv_nsec * 1e-9;
-		double pkg_energy = (v_energy_numbers[i].pkg - v_energy_numbers[i - 1].pkg) * scaleFactor;
-		double pp0_energy = (v_energy_numbers[i].pp0 - v_energy_numbers[i - 1].pp0) * scaleFactor;
-		double pp1_energy = (v_energy_numbers[i].pp1 - v_energy_numbers[i - 1].pp1) * scaleFactor;
-		double dram_energy = (v_energy_numbers[i].dram - v_energy_numbers[i - 1].dram) * scaleFactor;
+		double pkg_energy = v_energy_numbers[i].pkg - v_energy_numbers[i - 1].pkg;
+		double pp0_energy = v_energy_numbers[i].pp0 - v_energy_numbers[i - 1].pp0;
+		double pp1_energy = v_energy_numbers[i].pp1 - v_energy_numbers[i - 1].pp1;
+		double dram_energy = v_energy_numbers[i].dram - v_energy_numbers[i - 1].dram;
 		fprintf(fp, "%.6f, %.6f, %.6f, %.6f, %.6f\n", timestamp, pkg_energy, pp0_energy, pp1_energy, dram_energy);
 	}
 	
@@ -356,7 +263,9 @@ int main(int argc, char **argv) {
 	do_affinity(0);
 	v_energy_numbers.reserve(1000);
 	do_signals();
-	init_rapl();
+	if (!init_rapl()) {
+		return EXIT_FAILURE;
+	}
 	// Calibration is disabled because it causes more problems than it solves
 	//calibrate_rapl();
 	do_warmup();
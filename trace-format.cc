@@ -0,0 +1,109 @@
+/*
+ * Binary trace format shared by the trace-energy* tools
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+#include "trace-format.h"
+
+// Copy a string into a fixed-width field, always leaving it terminated
+static void copy_field(char *dest, size_t size, const char *src) {
+	size_t i;
+	for (i = 0; i + 1 < size && src[i]; i++) {
+		dest[i] = src[i];
+	}
+	dest[i] = '\0';
+}
+
+void trace_init_header(struct trace_header *hdr, const char *tool_name, const char *tool_version, time_t start_time, const char *cmdline) {
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	hdr->version = TRACE_VERSION;
+	hdr->header_size = sizeof(*hdr);
+	hdr->record_size = sizeof(uint64_t);
+	hdr->num_packages = 1;
+	copy_field(hdr->tool_name, sizeof(hdr->tool_name), tool_name);
+	copy_field(hdr->tool_version, sizeof(hdr->tool_version), tool_version);
+	hdr->start_time = start_time;
+	copy_field(hdr->command_line, sizeof(hdr->command_line), cmdline);
+	
+	// uname information
+	{
+		struct utsname info;
+		memset(&info, 0, sizeof(info));
+		uname(&info);
+		copy_field(hdr->sysname, sizeof(hdr->sysname), info.sysname);
+		copy_field(hdr->hostname, sizeof(hdr->hostname), info.nodename);
+		copy_field(hdr->release, sizeof(hdr->release), info.release);
+		copy_field(hdr->sys_version, sizeof(hdr->sys_version), info.version);
+		copy_field(hdr->machine, sizeof(hdr->machine), info.machine);
+	}
+	// Get the CPU information from /proc/cpuinfo
+	{
+		FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+		if (cpuinfo) {
+			char line[1024];
+			while (fgets(line, sizeof(line), cpuinfo)) {
+				// Find the first line containing "model name"
+				if (memcmp(line, "model name", strlen("model name")) == 0) {
+					char *colon = strchr(line, ':');
+					if (colon && colon[1]) {
+						char *model = colon + 2;
+						char *newline = strchr(model, '\n');
+						if (newline) *newline = '\0';
+						copy_field(hdr->cpu_model, sizeof(hdr->cpu_model), model);
+						break;
+					}
+				}
+			}
+			fclose(cpuinfo);
+		} else {
+			fprintf(stderr, "Warning: Failed to open /proc/cpuinfo\n");
+		}
+	}
+	hdr->cpus_available = sysconf(_SC_NPROCESSORS_CONF);
+	hdr->cpus_online = sysconf(_SC_NPROCESSORS_ONLN);
+	// Get total memory from /proc/meminfo
+	{
+		long mem_total = 0;
+		FILE *meminfo = fopen("/proc/meminfo", "r");
+		if (meminfo) {
+			if (fscanf(meminfo, "MemTotal: %ld", &mem_total) == 1) {
+				hdr->mem_total_kb = mem_total;
+			}
+			fclose(meminfo);
+		} else {
+			fprintf(stderr, "Warning: Failed to open /proc/meminfo\n");
+		}
+	}
+	if (!getcwd(hdr->working_directory, sizeof(hdr->working_directory))) {
+		hdr->working_directory[0] = '\0';
+	}
+}
+
+int trace_add_column(struct trace_header *hdr, const char *name, uint32_t type, double scale) {
+	if (hdr->num_columns >= TRACE_MAX_COLUMNS) {
+		fprintf(stderr, "Error: Too many columns in the trace (maximum is %d)\n", TRACE_MAX_COLUMNS);
+		return -1;
+	}
+	struct trace_column *col = &hdr->columns[hdr->num_columns];
+	copy_field(col->name, sizeof(col->name), name);
+	col->type = type;
+	col->scale = scale;
+	hdr->record_size += trace_column_size(type);
+	return hdr->num_columns++;
+}
+
+bool trace_write_header(FILE *fp, const struct trace_header *hdr) {
+	if (fwrite(hdr, sizeof(*hdr), 1, fp) != 1) {
+		perror("fwrite");
+		return false;
+	}
+	return true;
+}
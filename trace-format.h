@@ -0,0 +1,118 @@
+/*
+ * Binary trace format shared by the trace-energy* tools
+ *
+ * A trace file starts with a fixed-width struct trace_header that holds the
+ * same metadata the text traces print as "# ..." comments, followed by the
+ * column descriptors. The rest of the file is packed records, each record
+ * is a 64-bit CLOCK_REALTIME timestamp in nanoseconds followed by the raw
+ * column values in column order. All values are stored in host byte order.
+ *
+ * Version 2 added the number of packages, the temperature CPUs and the target
+ * of energy attribution to the header.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_MAGIC		"RAPLTRC"
+#define TRACE_VERSION		2
+
+// Upper limit for the number of columns in one trace
+#define TRACE_MAX_COLUMNS	512
+
+/* Column types */
+#define TRACE_COL_ENERGY	1	/* uint64_t raw energy counter, printed as a delta in joules */
+#define TRACE_COL_TEMP		2	/* int16_t temperature in degrees C */
+#define TRACE_COL_ENERGY32	3	/* uint32_t raw energy register that wraps around, printed as a delta in joules */
+#define TRACE_COL_CPUTIME	4	/* uint64_t CPU time counter, printed as a delta in seconds */
+
+struct trace_column {
+	char name[20];
+	uint32_t type;
+	// Joules per counter step for energy columns, seconds per step for CPU time
+	double scale;
+};
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	// Size of this header, records start at this offset
+	uint32_t header_size;
+	// Size of one record in bytes
+	uint32_t record_size;
+	uint32_t num_columns;
+	char tool_name[32];
+	char tool_version[16];
+	int64_t start_time;
+	char sysname[64];
+	char hostname[64];
+	char release[64];
+	char sys_version[128];
+	char machine[32];
+	char cpu_model[128];
+	int32_t cpus_available;
+	int32_t cpus_online;
+	int64_t mem_total_kb;
+	char working_directory[256];
+	char command_line[1024];
+	// Each package has its own group of energy columns
+	int32_t num_packages;
+	// CPUs of the core temperature columns in column order
+	int32_t num_temp_cpus;
+	int32_t temp_cpus[TRACE_MAX_COLUMNS];
+	// What the PKG and PP0 energy is attributed to by the CPU time columns, empty if not attributed
+	char attributed_to[256];
+	struct trace_column columns[TRACE_MAX_COLUMNS];
+};
+
+/*
+ * Fill in the header with information about the system.
+ * The columns are added afterwards with trace_add_column().
+ */
+void trace_init_header(struct trace_header *hdr, const char *tool_name, const char *tool_version, time_t start_time, const char *cmdline);
+
+// Returns the column index or -1 if there are too many columns
+int trace_add_column(struct trace_header *hdr, const char *name, uint32_t type, double scale);
+
+bool trace_write_header(FILE *fp, const struct trace_header *hdr);
+
+// Returns the size of a single column value
+static inline size_t trace_column_size(uint32_t type) {
+	switch (type) {
+		case TRACE_COL_TEMP:
+			return sizeof(int16_t);
+		case TRACE_COL_ENERGY32:
+			return sizeof(uint32_t);
+		default:
+			return sizeof(uint64_t);
+	}
+}
+
+/* Helpers for packing a record, they return the offset of the next value */
+static inline size_t trace_put_u64(unsigned char *record, size_t offset, uint64_t value) {
+	memcpy(record + offset, &value, sizeof(value));
+	return offset + sizeof(value);
+}
+
+static inline size_t trace_put_u32(unsigned char *record, size_t offset, uint32_t value) {
+	memcpy(record + offset, &value, sizeof(value));
+	return offset + sizeof(value);
+}
+
+static inline size_t trace_put_i16(unsigned char *record, size_t offset, int16_t value) {
+	memcpy(record + offset, &value, sizeof(value));
+	return offset + sizeof(value);
+}
+
+static inline size_t trace_put_timestamp(unsigned char *record, const struct timespec *ts) {
+	return trace_put_u64(record, 0, ts->tv_sec * 1000000000ULL + ts->tv_nsec);
+}
+
+#endif
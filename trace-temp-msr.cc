@@ -6,12 +6,14 @@
  * This is an improved version that records timestamps.
  * Added support for changing the frequency using the -F command line switch.
  * Version 2.2: Pass SIGINT (Ctrl-C on terminal) to the child process
+ * Version 2.3: Trace any number of cores (-C), the cores are read in parallel (-j)
+ * Set RAPL_IO_ENGINE=uring to submit the MSR reads of each sample through io_uring.
  *
- * Compilation: g++ -Wall -Wextra -O2 -g -o trace-temp-msr trace-temp-msr.cc util.cc -lpapi -lrt
+ * Compilation: g++ -Wall -Wextra -O2 -g -o trace-temp-msr trace-temp-msr.cc util.cc trace-format.cc msr-temp.cc librapl.a -lrt -pthread
  *
  * Dependencies: PAPI (Performance Application Programming Interface)
  *
- * Usage: ./trace-temp-msr [ -F <frequency> ] [ -o <output file> ] [ -c <child CPU affinity core> ] <program> [parameters]
+ * Usage: ./trace-temp-msr [ -F <frequency> ] [ -o <output file> ] [ -c <child CPU affinity core> ] [ -C <CPU list> ] [ -j <threads> ] [ -B ] <program> [parameters]
  *
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
@@ -37,17 +39,16 @@
 #include <string>
 #include <sstream>
 
+#include "rapl.h"
+#include "msr-temp.h"
+#include "trace-format.h"
 #include "util.h"
 
-#define MSR_IA32_THERM_STATUS		0x0000019c
-#define MSR_IA32_TEMPERATURE_TARGET	0x000001a2
-#define MSR_IA32_PACKAGE_THERM_STATUS		0x000001b1
-
 // Name of this program
 const char *trace_temp_name = "trace-temp-msr";
 
 // Version string
-const char *trace_temp_version = "2.2";
+const char *trace_temp_version = "2.3";
 
 // Frequency can be changed using the -F command line switch
 // Defaults to 200 Hz
@@ -75,23 +76,32 @@ static const char *argv0 = NULL;
 // Default value for critical temperate is 100 degrees C
 static short tjmax = 100;
 
-// File descriptor fore core 0 MSR file
-// Right now this is hard-coded to support up to 4 cores
+// File descriptor for core 0 MSR file, used for the package temperature
 static int core0_fd = -1;
-static int core1_fd = -1;
-static int core2_fd = -1;
-static int core3_fd = -1;
-
-struct temp_numbers {
-	struct timespec timestamp;
-	short pkg_temp;
-	short core0_temp;
-	short core1_temp;
-	short core2_temp;
-	short core3_temp;
+
+// CPUs whose temperature is traced, set using the -C command line switch
+// Defaults to all online CPUs
+static int temp_cpus[MSR_TEMP_MAX_CPUS];
+static int num_temp_cpus = 0;
+
+// Number of threads reading the core temperatures, set using the -j command line switch
+// Defaults to one thread per 16 CPUs
+static int num_reader_threads = 0;
+
+static struct core_temp_reader *core_temps = NULL;
+
+// The samples are stored as a structure of arrays
+// The core temperatures of sample i start at core_temp[i * num_temp_cpus]
+struct temp_samples {
+	std::vector<struct timespec> timestamp;
+	std::vector<short> pkg_temp;
+	std::vector<short> core_temp;
 };
 
-static std::vector<temp_numbers> v_temp_numbers;
+static struct temp_samples samples;
+
+// Binary output can be enabled using the -B command line switch
+static bool binary_output = false;
 
 static void sigchld_handler(int sig) {
 	(void)sig;
@@ -151,60 +161,41 @@ static void reset_timer() {
 	}
 }
 
-static int open_msr(int core) {
-	char msr_filename[1024] = { '\0' };
-	int fd = -1;
-	
-	snprintf(msr_filename, sizeof(msr_filename), "/dev/cpu/%d/msr", core);
-	
-	fd = open(msr_filename, O_RDONLY);
-	if (fd < 0) {
-		perror("open");
-		fprintf(stderr, "open_msr failed while trying to open %s!\n", msr_filename);
-		return fd;
-	}
-	
-	return fd;
-}
-
-static bool read_msr(int fd, unsigned msr_offset, uint64_t *msr_out) {
-	if (pread(fd, msr_out, sizeof(*msr_out), msr_offset) != sizeof(*msr_out)) {
-		perror("pread");
-		fprintf(stderr, "read_msr failed while trying to read offset 0x%04x!\n", msr_offset);
-		return false;
-	}
-	
-	return true;
-}
-
 static bool init_temp() {
-	uint64_t msr_temp_target = 0;
+	int tjmax_new = -1;
 	
-	if ((core0_fd = open_msr(0)) < 0) {
+	if ((core0_fd = rapl_msr_open(0)) < 0) {
 		return false;
 	}
 	
-	core1_fd = open_msr(1);
-	core2_fd = open_msr(2);
-	core3_fd = open_msr(3);
-	
-	if (read_msr(core0_fd, MSR_IA32_TEMPERATURE_TARGET, &msr_temp_target)) {
-		unsigned tjmax_new = (msr_temp_target >> 16) & 0xff;
-		printf("%s: TjMax is %u degrees C\n", trace_temp_name, tjmax_new);
+	if ((tjmax_new = read_tjmax(core0_fd)) >= 0) {
+		printf("%s: TjMax is %d degrees C\n", trace_temp_name, tjmax_new);
 		tjmax = tjmax_new;
 	} else {
 		fprintf(stderr, "Failed to read MSR_IA32_TEMPERATURE_TARGET!\n");
 		fprintf(stderr, "Using the default value of %d for tjmax.", (int)tjmax);
 	}
 	
+	if (num_temp_cpus == 0) {
+		num_temp_cpus = online_cpu_list(temp_cpus, MSR_TEMP_MAX_CPUS);
+	}
+	if (num_reader_threads == 0) {
+		num_reader_threads = core_temp_default_threads(num_temp_cpus);
+	}
+	core_temps = core_temp_open(temp_cpus, num_temp_cpus, num_reader_threads, tjmax);
+	if (!core_temps) {
+		return false;
+	}
+	printf("%s: Tracing the temperature of %d CPUs using %d threads\n", trace_temp_name, num_temp_cpus, num_reader_threads < num_temp_cpus ? num_reader_threads : num_temp_cpus);
+	
 	return true;
 }
 
 static short read_temp(int fd, unsigned msr_offset) {
 	uint64_t msr_therm_status = 0;
 	
-	if (read_msr(fd, msr_offset, &msr_therm_status)) {
-		return tjmax - ((msr_therm_status >> 16) & 0x7f);
+	if (rapl_msr_read(fd, msr_offset, &msr_therm_status)) {
+		return therm_status_to_temp(msr_therm_status, tjmax);
 	} else {
 		fprintf(stderr, "Failed to read MSR offset 0x%04x\n", msr_offset);
 		fprintf(stderr, "read_temp failed!\n");
@@ -234,28 +225,22 @@ static void handle_sigchld() {
 }
 
 static void handle_sigalrm() {
-	short pkg_temp = 0, core0_temp = 0, core1_temp = 0, core2_temp = 0, core3_temp = 0;
+	short pkg_temp = 0;
 	struct timespec now = { 0, 0 };
-	int idx_prev_sample = v_temp_numbers.size() - 1;
+	const size_t n = samples.timestamp.size();
 	bool is_duplicate = true; // Ignore duplicates in case we are supersampling
 	
+	// The core temperatures are read straight into the next row
+	samples.core_temp.resize((n + 1) * num_temp_cpus);
+	short *core_temp = &samples.core_temp[n * num_temp_cpus];
 	pkg_temp = read_temp(core0_fd, MSR_IA32_PACKAGE_THERM_STATUS);
-	core0_temp = read_temp(core0_fd, MSR_IA32_THERM_STATUS);
-	core1_temp = read_temp(core1_fd, MSR_IA32_THERM_STATUS);
-	core2_temp = read_temp(core2_fd, MSR_IA32_THERM_STATUS);
-	core3_temp = read_temp(core3_fd, MSR_IA32_THERM_STATUS);
+	core_temp_read(core_temps, core_temp);
 	clock_gettime(gettime_clockid, &now);
 	
-	if (likely(idx_prev_sample >= 0)) {
-		if (unlikely(pkg_temp != v_temp_numbers[idx_prev_sample].pkg_temp)) {
+	if (likely(n > 0)) {
+		if (unlikely(pkg_temp != samples.pkg_temp[n - 1])) {
 			is_duplicate = false;
-		} else if (unlikely(core0_temp != v_temp_numbers[idx_prev_sample].core0_temp)) {
-			is_duplicate = false;
-		} else if (unlikely(core1_temp != v_temp_numbers[idx_prev_sample].core1_temp)) {
-			is_duplicate = false;
-		} else if (unlikely(core2_temp != v_temp_numbers[idx_prev_sample].core2_temp)) {
-			is_duplicate = false;
-		} else if (unlikely(core3_temp != v_temp_numbers[idx_prev_sample].core3_temp)) {
+		} else if (unlikely(memcmp(core_temp, core_temp - num_temp_cpus, num_temp_cpus * sizeof(short)) != 0)) {
 			is_duplicate = false;
 		}
 	} else {
@@ -263,8 +248,50 @@ static void handle_sigalrm() {
 	}
 	
 	if (likely(!is_duplicate)) {
-		struct temp_numbers numbers = { now, pkg_temp, core0_temp, core1_temp, core2_temp, core3_temp };
-		v_temp_numbers.push_back(numbers);
+		samples.timestamp.push_back(now);
+		samples.pkg_temp.push_back(pkg_temp);
+	} else {
+		samples.core_temp.resize(n * num_temp_cpus);
+	}
+}
+
+static void drop_last_sample() {
+	const size_t n = samples.timestamp.size();
+	if (n > 0) {
+		samples.timestamp.pop_back();
+		samples.pkg_temp.pop_back();
+		samples.core_temp.resize((n - 1) * num_temp_cpus);
+	}
+}
+
+// Binary traces store the raw samples, use trace-convert to read them
+static void write_binary_trace(FILE *fp) {
+	static struct trace_header hdr;
+	std::vector<unsigned char> record(sizeof(uint64_t) + (1 + num_temp_cpus) * sizeof(int16_t));
+	char name[20];
+	int i, cpu;
+	
+	trace_init_header(&hdr, trace_temp_name, trace_temp_version, start_time, cmdline.c_str());
+	trace_add_column(&hdr, "PKG_TEMP", TRACE_COL_TEMP, 1.0);
+	for (cpu = 0; cpu < num_temp_cpus; cpu++) {
+		snprintf(name, sizeof(name), "CORE%d_TEMP", temp_cpus[cpu]);
+		if (trace_add_column(&hdr, name, TRACE_COL_TEMP, 1.0) < 0) {
+			return;
+		}
+		hdr.temp_cpus[hdr.num_temp_cpus++] = temp_cpus[cpu];
+	}
+	if (!trace_write_header(fp, &hdr)) {
+		return;
+	}
+	
+	const int n = samples.timestamp.size();
+	for (i = 0; i < n; i++) {
+		size_t offset = trace_put_timestamp(&record[0], &samples.timestamp[i]);
+		offset = trace_put_i16(&record[0], offset, samples.pkg_temp[i]);
+		for (cpu = 0; cpu < num_temp_cpus; cpu++) {
+			offset = trace_put_i16(&record[0], offset, samples.core_temp[i * num_temp_cpus + cpu]);
+		}
+		fwrite(&record[0], offset, 1, fp);
 	}
 }
 
@@ -288,6 +315,8 @@ static void wait_for_child() {
 	}
 	
 	reset_timer();
+	core_temp_close(core_temps);
+	core_temps = NULL;
 	
 	fp = fopen(output_file.c_str(), "w");
 	if (!fp) {
@@ -295,6 +324,12 @@ static void wait_for_child() {
 		exit(-1);
 	}
 	
+	if (binary_output) {
+		write_binary_trace(fp);
+		fclose(fp);
+		return;
+	}
+	
 	fprintf(fp, "# %s version %s output\n", trace_temp_name, trace_temp_version);
 	// Print formatted time
 	{
@@ -371,16 +406,22 @@ static void wait_for_child() {
 		fprintf(fp, "# Working directory: %s\n", wd);
 	}
 	fprintf(fp, "# Command line: %s\n", cmdline.c_str());
+	// The core temperature columns follow the package temperature in this order
+	fprintf(fp, "# Temperature CPUs:");
+	for (i = 0; i < num_temp_cpus; i++) {
+		fprintf(fp, " %d", temp_cpus[i]);
+	}
+	fprintf(fp, "\n");
 	
-	const int n = v_temp_numbers.size();
+	const int n = samples.timestamp.size();
 	for (i = 1; i < n; i++) {
-		double timestamp = v_temp_numbers[i].timestamp.tv_sec + v_temp_numbers[i].timestamp.tv_nsec * 1e-9;
-		int pkg_temp = v_temp_numbers[i].pkg_temp;
-		int core0_temp = v_temp_numbers[i].core0_temp;
-		int core1_temp = v_temp_numbers[i].core1_temp;
-		int core2_temp = v_temp_numbers[i].core2_temp;
-		int core3_temp = v_temp_numbers[i].core3_temp;
-		fprintf(fp, "%.6f, %d, %d, %d, %d, %d\n", timestamp, pkg_temp, core0_temp, core1_temp, core2_temp, core3_temp);
+		double timestamp = samples.timestamp[i].tv_sec + samples.timestamp[i].tv_nsec * 1e-9;
+		const short *core_temp = &samples.core_temp[i * num_temp_cpus];
+		fprintf(fp, "%.6f, %d", timestamp, samples.pkg_temp[i]);
+		for (int cpu = 0; cpu < num_temp_cpus; cpu++) {
+			fprintf(fp, ", %d", core_temp[cpu]);
+		}
+		fprintf(fp, "\n");
 	}
 	
 	fclose(fp);
@@ -393,11 +434,11 @@ static void do_warmup() {
 	nanosleep(&sleep_time_warm, NULL);
 	sigalrm_received = 0;
 	handle_sigalrm();
-	v_temp_numbers.pop_back();
+	drop_last_sample();
 }
 
 static void print_usage() {
-	fprintf(stderr, "Usage: %s [ -F <frequency> ] [ -o <output file> ] [ -c <child CPU affinity core> ] <program> [parameters]\n", argv0);
+	fprintf(stderr, "Usage: %s [ -F <frequency> ] [ -o <output file> ] [ -c <child CPU affinity core> ] [ -C <CPU list> ] [ -j <threads> ] [ -B ] <program> [parameters]\n", argv0);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Execute the given program as a child process and record a trace of CPU power consumption while it is running.\n");
 	fprintf(stderr, "\n");
@@ -405,6 +446,9 @@ static void print_usage() {
 	fprintf(stderr, "  -F <frequency>                  Record power consumption at a given frequency (in Hz, defaults to %.0f)\n", sampling_frequency);
 	fprintf(stderr, "  -o <output file>                Write the output to a specific file (defaults to %s)\n", output_file.c_str());
 	fprintf(stderr, "  -c <child CPU affinity core>    Set the affinity for the child process to a specific core\n");
+	fprintf(stderr, "  -C <CPU list>                   Trace the temperature of these CPUs, e.g. 0-3,8 (defaults to all online CPUs)\n");
+	fprintf(stderr, "  -j <threads>                    Read the core temperatures using this many threads (defaults to one per 16 CPUs)\n");
+	fprintf(stderr, "  -B                              Write a binary trace, use trace-convert to read it\n");
 	fprintf(stderr, "  -h, --help                      Display this usage information\n");
 }
 
@@ -476,6 +520,37 @@ static int process_command_line(int argc, char **argv) {
 				fprintf(stderr, "Error: Not enough arguments to -c\n");
 				consumed += 1;
 			}
+		} else if (strcmp(argv[i], "-C") == 0) {
+			if (argc > i + 1) {
+				num_temp_cpus = parse_cpu_list(argv[i + 1], temp_cpus, MSR_TEMP_MAX_CPUS);
+				if (num_temp_cpus <= 0) {
+					fprintf(stderr, "Error: Invalid CPU list '%s'\n", argv[i + 1]);
+					exit_code = EXIT_FAILURE;
+					break;
+				}
+				i++;
+				consumed += 2;
+			} else {
+				fprintf(stderr, "Error: Not enough arguments to -C\n");
+				consumed += 1;
+			}
+		} else if (strcmp(argv[i], "-j") == 0) {
+			if (argc > i + 1) {
+				int threads = atoi(argv[i + 1]);
+				if (threads > 0) {
+					num_reader_threads = threads;
+				} else {
+					fprintf(stderr, "Error: The number of threads must be greater than zero\n");
+				}
+				i++;
+				consumed += 2;
+			} else {
+				fprintf(stderr, "Error: Not enough arguments to -j\n");
+				consumed += 1;
+			}
+		} else if (strcmp(argv[i], "-B") == 0) {
+			binary_output = true;
+			consumed += 1;
 		} else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
 			print_usage();
 			exit_code = EXIT_FAILURE;
@@ -527,11 +602,13 @@ int main(int argc, char **argv) {
 	if (exit_code != EXIT_SUCCESS) {
 		return exit_code;
 	}
-	v_temp_numbers.reserve(1000);
 	do_signals();
 	if (!init_temp()) {
 		return EXIT_FAILURE;
 	}
+	samples.timestamp.reserve(1000);
+	samples.pkg_temp.reserve(1000);
+	samples.core_temp.reserve(1000 * num_temp_cpus);
 	do_warmup();
 	start_time = time(NULL);
 	do_fork_and_exec(argc - args_consumed, argv + args_consumed);
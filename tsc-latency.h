@@ -0,0 +1,136 @@
+/*
+ * Per-call latency measurement with the TSC
+ *
+ * Each call is timed on its own between tsc_latency_begin() and
+ * tsc_latency_end() and folded into a log-linear histogram from
+ * stream-stats.h, so the tail of the distribution is visible and the memory
+ * use does not depend on the number of calls. The reads of the TSC are
+ * ordered with LFENCE and RDTSCP so that the timed call cannot move out of
+ * the measured interval.
+ *
+ * tsc_latency_init() measures the cost of an empty begin/end pair and that
+ * is subtracted from every sample. The smallest observed cost is used so
+ * that calls are never made to look faster than they are. The TSC frequency
+ * is calibrated against CLOCK_MONOTONIC once per process. On other
+ * architectures CLOCK_MONOTONIC is used directly.
+ *
+ * Usable from C and C++, link C programs with -lm.
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef TSC_LATENCY_H
+#define TSC_LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "stream-stats.h"
+
+// Number of empty measurements used to find the overhead
+#define TSC_LATENCY_OVERHEAD_SAMPLES	100000
+
+struct tsc_latency {
+	// Latencies in TSC cycles with the overhead subtracted
+	struct stream_stats stats;
+	struct stream_hist hist;
+	uint64_t overhead;
+	double cycles_per_ns;
+};
+
+static inline uint64_t tsc_latency_monotonic_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t tsc_latency_begin(void) {
+	unsigned lo, hi;
+	__asm__ volatile("lfence\n\trdtsc" : "=a" (lo), "=d" (hi) : : "memory");
+	return ((uint64_t)lo) | ((uint64_t)hi << 32);
+}
+
+static inline uint64_t tsc_latency_end(void) {
+	unsigned lo, hi, aux;
+	__asm__ volatile("rdtscp\n\tlfence" : "=a" (lo), "=d" (hi), "=c" (aux) : : "memory");
+	return ((uint64_t)lo) | ((uint64_t)hi << 32);
+}
+
+// TSC cycles per nanosecond, measured over 20 milliseconds on the first call
+static inline double tsc_latency_calibrate(void) {
+	static double cycles_per_ns = 0.0;
+	if (cycles_per_ns == 0.0) {
+		uint64_t ns_begin = tsc_latency_monotonic_ns(), ns_end = 0;
+		uint64_t tsc_begin = tsc_latency_begin(), tsc_end = 0;
+		do {
+			ns_end = tsc_latency_monotonic_ns();
+			tsc_end = tsc_latency_end();
+		} while (ns_end - ns_begin < 20000000ULL);
+		cycles_per_ns = (double)(tsc_end - tsc_begin) / (ns_end - ns_begin);
+	}
+	return cycles_per_ns;
+}
+#else
+static inline uint64_t tsc_latency_begin(void) {
+	return tsc_latency_monotonic_ns();
+}
+
+static inline uint64_t tsc_latency_end(void) {
+	return tsc_latency_monotonic_ns();
+}
+
+static inline double tsc_latency_calibrate(void) {
+	return 1.0;
+}
+#endif
+
+static inline void tsc_latency_init(struct tsc_latency *lat) {
+	uint64_t overhead = ~0ULL;
+	int i;
+	
+	stream_stats_init(&lat->stats);
+	stream_hist_init(&lat->hist);
+	lat->cycles_per_ns = tsc_latency_calibrate();
+	for (i = 0; i < TSC_LATENCY_OVERHEAD_SAMPLES; i++) {
+		uint64_t begin = tsc_latency_begin();
+		uint64_t end = tsc_latency_end();
+		if (end - begin < overhead) {
+			overhead = end - begin;
+		}
+	}
+	lat->overhead = overhead;
+}
+
+// Add a call that was timed from begin to end
+static inline void tsc_latency_add(struct tsc_latency *lat, uint64_t begin, uint64_t end) {
+	uint64_t cycles = end - begin;
+	cycles = cycles > lat->overhead ? cycles - lat->overhead : 0;
+	stream_stats_add(&lat->stats, (double)cycles);
+	stream_hist_add(&lat->hist, cycles);
+}
+
+static inline double tsc_latency_mean_ns(const struct tsc_latency *lat) {
+	return lat->stats.mean / lat->cycles_per_ns;
+}
+
+// Print the percentiles of the latency of the named operation in nanoseconds
+static inline void tsc_latency_print(FILE *fp, const char *name, const struct tsc_latency *lat) {
+	char label[256];
+	snprintf(label, sizeof(label), "%s latency percentiles in nanoseconds", name);
+	stream_hist_print_percentiles(fp, label, &lat->hist, 1.0 / lat->cycles_per_ns);
+}
+
+// Print the measurement overhead that is subtracted from the samples
+static inline void tsc_latency_print_overhead(FILE *fp, const struct tsc_latency *lat) {
+	fprintf(fp, "Measurement overhead of %f nanoseconds (%llu TSC cycles at %f GHz) subtracted from every call\n",
+		lat->overhead / lat->cycles_per_ns, (unsigned long long)lat->overhead, lat->cycles_per_ns);
+}
+
+// Write the histogram as "name, start, end, count" lines with the bucket bounds in nanoseconds
+static inline void tsc_latency_dump(FILE *fp, const char *name, const struct tsc_latency *lat) {
+	stream_hist_dump(fp, name, &lat->hist, 1.0 / lat->cycles_per_ns);
+}
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * Batched positional reads with io_uring
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring-read.h"
+
+struct uring_reader {
+	int fd;
+	unsigned entries;
+	// Submission queue
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	// Completion queue, shares the mapping of the submission queue on newer kernels
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+struct uring_reader *uring_reader_create(unsigned entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	
+	int fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0) {
+		perror("io_uring_setup");
+		return NULL;
+	}
+	
+	struct uring_reader *ring = (struct uring_reader *)calloc(1, sizeof(*ring));
+	ring->fd = fd;
+	ring->entries = params.sq_entries;
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		free(ring);
+		return NULL;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			perror("mmap");
+			munmap(ring->sq_ring, ring->sq_ring_size);
+			close(fd);
+			free(ring);
+			return NULL;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		perror("mmap");
+		if (ring->cq_ring != ring->sq_ring) {
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		}
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(fd);
+		free(ring);
+		return NULL;
+	}
+	
+	char *sq = (char *)ring->sq_ring;
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	char *cq = (char *)ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	
+	return ring;
+}
+
+void uring_reader_destroy(struct uring_reader *ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+// Collect the finished reads, returns the number of completions
+static int reap_completions(struct uring_reader *ring, int first, int *results) {
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	int count = 0;
+	
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		results[first + cqe->user_data] = cqe->res;
+		head++;
+		count++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+bool uring_read_batch(struct uring_reader *ring, const struct uring_read *reads, int num_reads, int *results) {
+	int first, i;
+	
+	// Larger batches are split into chunks that fit in the submission queue
+	for (first = 0; first < num_reads; first += ring->entries) {
+		int count = num_reads - first < (int)ring->entries ? num_reads - first : (int)ring->entries;
+		unsigned tail = *ring->sq_tail;
+		for (i = 0; i < count; i++) {
+			const struct uring_read *req = &reads[first + i];
+			unsigned index = tail & *ring->sq_mask;
+			struct io_uring_sqe *sqe = &ring->sqes[index];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = req->fd;
+			sqe->addr = (uintptr_t)req->buf;
+			sqe->len = req->len;
+			sqe->off = req->offset;
+			sqe->user_data = i;
+			ring->sq_array[index] = index;
+			tail++;
+		}
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+		
+		int to_submit = count, completed = 0;
+		while (completed < count) {
+			int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+			if (ret < 0) {
+				// Interrupted by a signal, for example the sampling timer
+				if (errno == EINTR) {
+					continue;
+				}
+				perror("io_uring_enter");
+				return false;
+			}
+			to_submit -= to_submit > 0 ? ret : 0;
+			completed += reap_completions(ring, first, results);
+		}
+	}
+	
+	return true;
+}
+
+bool uring_requested(void) {
+	const char *engine = getenv("RAPL_IO_ENGINE");
+	return engine && strcmp(engine, "uring") == 0;
+}
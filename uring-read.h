@@ -0,0 +1,44 @@
+/*
+ * Batched positional reads with io_uring
+ *
+ * Submits many pread()-style reads with a single io_uring_enter() call and
+ * waits for all of them to complete. Reads from files that cannot be read
+ * without blocking, such as /dev/cpu/N/msr, are handed to the io-wq worker
+ * threads of the kernel and run in parallel. Uses the raw system calls, so
+ * liburing is not needed.
+ *
+ * The engine is optional, the MSR batches and the powercap backend use it
+ * when the RAPL_IO_ENGINE environment variable is set to "uring".
+ *
+ * Author: Mikael Hirki <mikael.hirki@aalto.fi>
+ */
+
+#ifndef URING_READ_H
+#define URING_READ_H
+
+#include <stdint.h>
+
+struct uring_read {
+	int fd;
+	void *buf;
+	unsigned len;
+	uint64_t offset;
+};
+
+struct uring_reader;
+
+// Returns NULL if the kernel does not support io_uring
+struct uring_reader *uring_reader_create(unsigned entries);
+void uring_reader_destroy(struct uring_reader *ring);
+
+/*
+ * Perform the reads and wait for all of them. results[i] receives the number
+ * of bytes read or a negative errno value. Returns false if the reads could
+ * not be submitted.
+ */
+bool uring_read_batch(struct uring_reader *ring, const struct uring_read *reads, int num_reads, int *results);
+
+// True if RAPL_IO_ENGINE asks for io_uring
+bool uring_requested(void);
+
+#endif
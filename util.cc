@@ -8,8 +8,6 @@
 #include <stdio.h>
 #include <unistd.h>
 
-#include <papi.h>
-
 #include "util.h"
 
 int do_affinity(int core) {
@@ -2,8 +2,23 @@
  * watcher.cc: Runs a command and monitors it.
  *
  * The child program is terminated if it doesn't spend enough user and system time.
+ * The time of all of its descendants is included, and they are terminated together.
+ * The watcher is a subreaper, so descendants that are orphaned stay in the tree.
+ * When the child exits, its remaining descendants are supervised the same way
+ * until the whole tree has exited.
+ *
+ * Several copies of the command can be supervised at once using -n. Everything
+ * is driven by a single epoll loop: a pidfd for each child reports its exit,
+ * a timerfd triggers the progress checks and a signalfd receives SIGCHLD for
+ * reaping orphans, as well as SIGINT and SIGTERM, which are passed on to the
+ * children. Idle children cost nothing between the checks:
+ *
+ *	./watcher -n 1000 -t 0 sleep 10
  *
  * Exit code will be EXIT_FAILURE if the child gets terminated by a signal.
+ * With several children it is EXIT_FAILURE if any of them fails.
+ *
+ * Usage: ./watcher [ -n <copies> ] [ -i <check interval> ] [ -t <threshold> ] [ -r <rescan interval> ] <program> [parameters]
  *
  * Author: Mikael Hirki <mikael.hirki@aalto.fi>
  */
@@ -17,140 +32,434 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <math.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
 
-static pid_t child_pid = -1;
-static int exit_code = EXIT_SUCCESS;
+#include "cpu-tracker.h"
 
-static void sigchld_handler(int sig) {
-	(void)sig;
-	int status = 0;
-	if (child_pid > 0) {
-		int rval = waitpid(child_pid, &status, WNOHANG);
-		if (rval < 0) {
-			perror("waitpid");
-		} else if (rval > 0) {
-			if (WIFEXITED(status)) {
-				int child_exit_code = WEXITSTATUS(status);
-				printf("Watcher: Child exited normally with exit code %d\n", child_exit_code);
-				exit_code = child_exit_code;
-				child_pid = -1;
-			}
-			else if (WIFSIGNALED(status)) {
-				printf("Watcher: Child was terminated by a signal\n");
-				exit_code = EXIT_FAILURE;
-				child_pid = -1;
-			}
-		}
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+// epoll data of the timer and the signals, the children use their index
+#define EVENT_TIMER	-1
+#define EVENT_SIGNAL	-2
+
+#define MAX_EVENTS	64
+
+struct child {
+	pid_t pid;
+	// -1 on kernels without pidfd_open(), SIGCHLD still reports the exit
+	int pidfd;
+	struct cpu_tracker *tracker;
+	double prev_user_and_sys;
+	bool signaled;
+	// The child itself has been reaped
+	bool exited;
+	// The whole tree has exited
+	bool done;
+};
+
+struct watcher {
+	struct child *children;
+	int num_children;
+	int num_running;
+	int epoll_fd;
+	int timer_fd;
+	int signal_fd;
+	// Signal mask restored in the children
+	sigset_t old_mask;
+	double check_interval;
+	// Minimum user and system time per check interval
+	double signal_threshold;
+	int exit_code;
+};
+
+static bool epoll_add(struct watcher *w, int fd, int data) {
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	ev.data.fd = data;
+	if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
 	}
+	return true;
 }
 
-static void do_signals() {
-	signal(SIGCHLD, &sigchld_handler);
+// The signals are only received through the signalfd
+static bool setup_signals(struct watcher *w) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &mask, &w->old_mask) < 0) {
+		perror("sigprocmask");
+		return false;
+	}
+	w->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (w->signal_fd < 0) {
+		perror("signalfd");
+		return false;
+	}
+	return epoll_add(w, w->signal_fd, EVENT_SIGNAL);
 }
 
-static bool read_child_stats(double *double_utime, double *double_stime) {
-	char filename[256];
-	snprintf(filename, sizeof(filename), "/proc/%d/stat", (int)child_pid);
-	/* Open the stat file for the child process */
-	FILE *fp = fopen(filename, "r");
-	if (!fp) {
-		*double_utime = 0;
-		*double_stime = 0;
+static bool setup_timer(struct watcher *w) {
+	struct itimerspec timer_value;
+	timer_value.it_interval.tv_sec = (time_t)w->check_interval;
+	timer_value.it_interval.tv_nsec = (long)((w->check_interval - timer_value.it_interval.tv_sec) * 1e9);
+	timer_value.it_value = timer_value.it_interval;
+	w->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (w->timer_fd < 0) {
+		perror("timerfd_create");
 		return false;
 	}
-	
-	long clk_ticks = sysconf(_SC_CLK_TCK);
-	double tick_period = 1.0 / clk_ticks;
-	
-	int pid;
-	char comm[1025];
-	char state;
-	int ppid, pgrp, session, tty_nr, tpgid;
-	unsigned flags;
-	unsigned long minflt, cminflt, majflt, cmajflt, utime, stime;
-	/* Parse up to 'stime' */
-	fscanf(fp, "%d %1024s %c %d %d %d %d %d %u %lu %lu %lu %lu %lu %lu",
-	       &pid, comm, &state, &ppid, &pgrp, &session, &tty_nr, &tpgid, &flags,
-	       &minflt, &cminflt, &majflt, &cmajflt, &utime, &stime);
-	fclose(fp);
-	
-	*double_utime = utime * tick_period;
-	*double_stime = stime * tick_period;
-	
+	if (timerfd_settime(w->timer_fd, 0, &timer_value, NULL) < 0) {
+		perror("timerfd_settime");
+		return false;
+	}
+	return epoll_add(w, w->timer_fd, EVENT_TIMER);
+}
+
+// Every child needs a pidfd and the tree needs one file per process
+static void raise_fd_limit() {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+static void signal_child(struct child *c, int sig) {
+	if (c->tracker) {
+		cpu_tracker_kill(c->tracker, sig);
+	} else if (kill(c->pid, sig) < 0) {
+		perror("kill");
+	}
+}
+
+static bool start_child(struct watcher *w, struct child *c, int index, char **argv) {
+	c->pid = fork();
+	if (c->pid == 0) {
+		cpu_tracker_enter_tree();
+		sigprocmask(SIG_SETMASK, &w->old_mask, NULL);
+		execvp(argv[0], argv);
+		perror("execlp");
+		exit(-1);
+	} else if (c->pid < 0) {
+		perror("fork");
+		return false;
+	}
+	c->tracker = cpu_tracker_open_tree(c->pid);
+	c->pidfd = syscall(SYS_pidfd_open, c->pid, 0);
+	if (c->pidfd >= 0 && !epoll_add(w, c->pidfd, index)) {
+		// Do not leave a child running that is not supervised
+		close(c->pidfd);
+		c->pidfd = -1;
+		signal_child(c, SIGKILL);
+		waitpid(c->pid, NULL, 0);
+		if (c->tracker) {
+			cpu_tracker_close(c->tracker);
+			c->tracker = NULL;
+		}
+		return false;
+	}
+	c->prev_user_and_sys = -1.0;
+	c->signaled = false;
+	c->exited = false;
+	c->done = false;
+	w->num_running++;
 	return true;
 }
 
-static void monitor_child() {
-	int rval = 0;
-	double prev_user_and_sys = -1.0;
-	const double signal_threshold = 0.1;
-	bool child_signaled = false;
-	struct timespec sleep_time = { 1, 0 };
-	struct timespec sleep_remaining = { 0, 0 };
-
-	while (child_pid > 0) {
-		double user_time = 0;
-		double sys_time = 0;
-		read_child_stats(&user_time, &sys_time);
-		// For debugging
-		//printf("user = %f, sys = %f\n", user_time, sys_time);
-		double user_and_sys = user_time + sys_time;
-		if (user_and_sys - prev_user_and_sys < signal_threshold) {
-			if (!child_signaled) {
-				fprintf(stderr, "Watcher: Sending SIGTERM\n");
-				rval = kill(child_pid, SIGTERM);
-				if (rval < 0) {
-					perror("kill");
-				}
-				child_signaled = true;
-			} else {
-				fprintf(stderr, "Watcher: Sending SIGKILL\n");
-				kill(child_pid, SIGKILL);
-				if (rval < 0) {
-					perror("kill");
-				}
+static void print_child(FILE *fp, const struct watcher *w, const struct child *c) {
+	if (w->num_children > 1) {
+		fprintf(fp, "Watcher: Child %d (pid %d)", (int)(c - w->children), (int)c->pid);
+	} else {
+		fprintf(fp, "Watcher: Child");
+	}
+}
+
+// Live processes of the tree after its child has exited
+static int tree_processes_left(struct child *c) {
+	uint64_t tree_ns = 0;
+	if (!c->tracker) {
+		return 0;
+	}
+	// Drops the processes that have been reaped
+	cpu_tracker_read(c->tracker, &tree_ns, NULL);
+	return cpu_tracker_num_processes(c->tracker);
+}
+
+static void tree_done(struct watcher *w, struct child *c) {
+	if (c->tracker) {
+		cpu_tracker_close(c->tracker);
+		c->tracker = NULL;
+	}
+	c->done = true;
+	w->num_running--;
+}
+
+static void child_exited(struct watcher *w, struct child *c, int status) {
+	if (WIFEXITED(status)) {
+		int child_exit_code = WEXITSTATUS(status);
+		print_child(stdout, w, c);
+		printf(" exited normally with exit code %d\n", child_exit_code);
+		if (w->num_children == 1) {
+			w->exit_code = child_exit_code;
+		} else if (child_exit_code != EXIT_SUCCESS) {
+			w->exit_code = EXIT_FAILURE;
+		}
+	} else if (WIFSIGNALED(status)) {
+		print_child(stdout, w, c);
+		printf(" was terminated by a signal\n");
+		w->exit_code = EXIT_FAILURE;
+	} else {
+		// Stopped or continued
+		return;
+	}
+	if (c->pidfd >= 0) {
+		epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->pidfd, NULL);
+		close(c->pidfd);
+		c->pidfd = -1;
+	}
+	c->exited = true;
+	int left = tree_processes_left(c);
+	if (left > 0) {
+		print_child(stdout, w, c);
+		printf(" left %d processes running, supervising them until they exit\n", left);
+	} else {
+		tree_done(w, c);
+	}
+}
+
+static struct child *find_child(struct watcher *w, pid_t pid) {
+	for (int i = 0; i < w->num_children; i++) {
+		if (w->children[i].pid == pid && !w->children[i].exited) {
+			return &w->children[i];
+		}
+	}
+	return NULL;
+}
+
+// Reap the children and the orphaned descendants, the time of an orphan goes to its tree
+static void reap_children(struct watcher *w) {
+	struct rusage usage;
+	int status = 0;
+	pid_t pid;
+	
+	while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+		struct child *c = find_child(w, pid);
+		if (c) {
+			child_exited(w, c, status);
+			continue;
+		}
+		for (int i = 0; i < w->num_children; i++) {
+			struct child *tree = &w->children[i];
+			if (!tree->done && tree->tracker && cpu_tracker_contains(tree->tracker, pid)) {
+				cpu_tracker_add_reaped(tree->tracker, &usage);
+				break;
 			}
 		}
-		prev_user_and_sys = user_and_sys;
-		
-		/* Sleep for one second */
-		rval = nanosleep(&sleep_time, &sleep_remaining);
-		if (rval < 0) {
-			if (errno == EINTR) {
-				/* Retry sleeping in case of interrupts */
-				do {
-					/* Exit immediately if child has terminated */
-					if (child_pid < 0) return;
-					rval = nanosleep(&sleep_remaining, &sleep_remaining);
-				} while (rval < 0 && errno == EINTR);
+	}
+	if (pid < 0 && errno != ECHILD) {
+		perror("wait4");
+	}
+	// The last process of a tree whose child has exited is an orphan reaped here
+	for (int i = 0; i < w->num_children; i++) {
+		struct child *c = &w->children[i];
+		if (c->exited && !c->done && tree_processes_left(c) == 0) {
+			print_child(stdout, w, c);
+			printf(": All descendants have exited\n");
+			if (c->signaled) {
+				w->exit_code = EXIT_FAILURE;
 			}
-			/* Handle other nanosleep errors */
-			if (rval < 0 && errno != EINTR) {
-				perror("nanosleep");
+			tree_done(w, c);
+		}
+	}
+}
+
+static void handle_signals(struct watcher *w) {
+	struct signalfd_siginfo info;
+	
+	while (read(w->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo == SIGCHLD) {
+			reap_children(w);
+			continue;
+		}
+		fprintf(stderr, "Watcher: Passing signal %d to the children\n", (int)info.ssi_signo);
+		for (int i = 0; i < w->num_children; i++) {
+			if (!w->children[i].done) {
+				signal_child(&w->children[i], info.ssi_signo);
 			}
 		}
 	}
 }
 
-static void do_fork_and_exec(int argc, char **argv) {
-	if (argc > 1) {
-		child_pid = fork();
-		if (child_pid == 0) {
-			execvp(argv[1], &argv[1]);
-			perror("execlp");
-			exit(-1);
-		} else if (child_pid < 0) {
-			perror("fork");
+static void check_child(struct watcher *w, struct child *c) {
+	uint64_t tree_ns = 0;
+	
+	if (!c->tracker) {
+		return;
+	}
+	cpu_tracker_read(c->tracker, &tree_ns, NULL);
+	// For debugging
+	//printf("user + sys = %f, processes = %d\n", tree_ns * 1e-9, cpu_tracker_num_processes(c->tracker));
+	double user_and_sys = tree_ns * 1e-9;
+	if (user_and_sys - c->prev_user_and_sys < w->signal_threshold) {
+		print_child(stderr, w, c);
+		if (!c->signaled) {
+			fprintf(stderr, ": Sending SIGTERM to %d processes\n", cpu_tracker_num_processes(c->tracker));
+			signal_child(c, SIGTERM);
+			c->signaled = true;
 		} else {
-			monitor_child();
+			fprintf(stderr, ": Sending SIGKILL to %d processes\n", cpu_tracker_num_processes(c->tracker));
+			signal_child(c, SIGKILL);
 		}
-	} else {
-		printf("Usage: %s <program> [parameters]\n", argv[0]);
 	}
+	c->prev_user_and_sys = user_and_sys;
+}
+
+static void handle_timer(struct watcher *w) {
+	uint64_t expirations = 0;
+	
+	if (read(w->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+		return;
+	}
+	for (int i = 0; i < w->num_children; i++) {
+		if (!w->children[i].done) {
+			check_child(w, &w->children[i]);
+		}
+	}
+}
+
+static void event_loop(struct watcher *w) {
+	struct epoll_event events[MAX_EVENTS];
+	
+	while (w->num_running > 0) {
+		int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno != EINTR) {
+				perror("epoll_wait");
+				return;
+			}
+			continue;
+		}
+		for (int i = 0; i < n; i++) {
+			switch (events[i].data.fd) {
+				case EVENT_SIGNAL:
+					handle_signals(w);
+					break;
+				case EVENT_TIMER:
+					handle_timer(w);
+					break;
+				default:
+					// A pidfd becomes readable when the child exits
+					reap_children(w);
+					break;
+			}
+		}
+	}
+}
+
+static void print_usage(const char *argv0) {
+	fprintf(stderr, "Usage: %s [ -n <copies> ] [ -i <check interval> ] [ -t <threshold> ] [ -r <rescan interval> ] <program> [parameters]\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Run a program and terminate it if it stops using CPU time.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -n <copies>            Run and supervise several copies of the program (defaults to 1)\n");
+	fprintf(stderr, "  -i <check interval>    Seconds between the progress checks (defaults to 1)\n");
+	fprintf(stderr, "  -t <threshold>         Seconds of CPU time a process tree must use per check, 0 disables (defaults to 0.1)\n");
+	fprintf(stderr, "  -r <rescan interval>   Seconds between the scans of /proc for new processes in the trees (defaults to %g)\n", CPU_TRACKER_RESCAN_NS * 1e-9);
+	fprintf(stderr, "                         The trees are only scanned if the proc connector needs CAP_NET_ADMIN (before Linux 6.6)\n");
+	fprintf(stderr, "                         and no cgroup v2 directory is writable (for example under systemd-run --user --scope).\n");
+	fprintf(stderr, "                         Each scan reads one /proc file per thread of every tree, and processes that live\n");
+	fprintf(stderr, "                         shorter than the interval are only counted when their parent reaps them.\n");
 }
 
 int main(int argc, char **argv) {
-	do_signals();
-	do_fork_and_exec(argc, argv);
-	return exit_code;
+	struct watcher w;
+	double rescan_interval = CPU_TRACKER_RESCAN_NS * 1e-9;
+	int c = 0, i = 0;
+	
+	w.num_children = 1;
+	w.num_running = 0;
+	w.check_interval = 1.0;
+	w.signal_threshold = 0.1;
+	w.exit_code = EXIT_SUCCESS;
+	
+	// Options end at the program name
+	while ((c = getopt(argc, argv, "+n:i:t:r:h")) != -1) {
+		switch (c) {
+			case 'n':
+				w.num_children = atoi(optarg);
+				break;
+			case 'i':
+				w.check_interval = atof(optarg);
+				break;
+			case 't':
+				w.signal_threshold = atof(optarg);
+				break;
+			case 'r':
+				rescan_interval = atof(optarg);
+				break;
+			default:
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc) {
+		print_usage(argv[0]);
+		return EXIT_SUCCESS;
+	}
+	if (w.num_children <= 0 || w.check_interval <= 0.0 || rescan_interval <= 0.0) {
+		fprintf(stderr, "Error: The number of copies and the intervals must be greater than zero\n");
+		return EXIT_FAILURE;
+	}
+	cpu_tracker_set_rescan_interval(llround(rescan_interval * 1e9));
+	// A threshold of zero never triggers
+	if (w.signal_threshold <= 0.0) {
+		w.signal_threshold = -INFINITY;
+	}
+	
+	raise_fd_limit();
+	w.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (w.epoll_fd < 0) {
+		perror("epoll_create1");
+		return EXIT_FAILURE;
+	}
+	if (!setup_signals(&w) || !setup_timer(&w)) {
+		return EXIT_FAILURE;
+	}
+	cpu_tracker_become_subreaper();
+	if (!cpu_tracker_prepare_trees()) {
+		printf("Watcher: Scanning /proc for the processes of the trees, see -r\n");
+	}
+	
+	w.children = (struct child *)calloc(w.num_children, sizeof(struct child));
+	for (i = 0; i < w.num_children; i++) {
+		if (!start_child(&w, &w.children[i], i, &argv[optind])) {
+			w.children[i].exited = true;
+			w.children[i].done = true;
+			w.exit_code = EXIT_FAILURE;
+		}
+	}
+	
+	event_loop(&w);
+	
+	if (w.num_children > 1) {
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		printf("Watcher: Supervised %d children using %.3f s of user and %.3f s of system time\n", w.num_children,
+			usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6, usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6);
+	}
+	free(w.children);
+	return w.exit_code;
 }